@@ -31,6 +31,7 @@
 #include <glib.h>
 #include "utils.h"
 #include "runner.h"
+#include "zygote.h"
 
 #ifndef __GNUC__
 #define __attribute__(x)
@@ -205,6 +206,36 @@ handle_kill(DBusConnection *con, DBusMessage *msg)
 	dbus_message_unref(reply);
 }
 
+static void
+handle_kill_udis(DBusConnection *con, DBusMessage *msg)
+{
+	DBusError error;
+	DBusMessage *reply = NULL;
+	char **udis;
+	int num_udis;
+
+	dbus_error_init (&error);
+	if (!dbus_message_get_args(msg, &error,
+				   DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &udis, &num_udis,
+				   DBUS_TYPE_INVALID)) {
+		reply = dbus_message_new_error (msg, "org.freedesktop.HalRunner.Malformed", 
+						"Malformed KillUdis message");
+		g_assert(reply);
+		dbus_connection_send (con, reply, NULL);
+		dbus_message_unref(reply);
+		return;
+	}
+	run_kill_udis(udis);
+	dbus_free_string_array(udis);
+
+	/* always successfull; hald usually doesn't wait for this */
+	if (!dbus_message_get_no_reply(msg)) {
+		reply = dbus_message_new_method_return(msg);
+		dbus_connection_send(con, reply, NULL);
+		dbus_message_unref(reply);
+	}
+}
+
 static DBusHandlerResult
 filter(DBusConnection *con, DBusMessage *msg, void *user_data)
 {
@@ -222,6 +253,9 @@ filter(DBusConnection *con, DBusMessage *msg, void *user_data)
 	} else if (dbus_message_is_method_call(msg, "org.freedesktop.HalRunner", "Kill")) {
 		handle_kill(con, msg);
 		return DBUS_HANDLER_RESULT_HANDLED;
+	} else if (dbus_message_is_method_call(msg, "org.freedesktop.HalRunner", "KillUdis")) {
+		handle_kill_udis(con, msg);
+		return DBUS_HANDLER_RESULT_HANDLED;
 	} else if (dbus_message_is_method_call(msg, "org.freedesktop.HalRunner", "Shutdown")) {
 		run_kill_all ();
 		exit (0);
@@ -244,6 +278,7 @@ main(int argc, char **argv)
 	DBusError error;
 	GMainLoop *loop;
 	char *dbus_address;
+	char *prefork;
 
 	run_init();
 	dbus_error_init(&error);
@@ -252,6 +287,10 @@ main(int argc, char **argv)
 
 	fprintf(stderr, "Runner started - allowed paths are '%s'\n", getenv("PATH"));
 
+	/* Fork the workers before we have any other descriptors open */
+	prefork = getenv("HALD_RUNNER_PREFORK");
+	zygote_init(prefork != NULL ? (guint) atoi(prefork) : ZYGOTE_DEFAULT_WORKERS);
+
 	c = dbus_connection_open(dbus_address, &error);
 	if (c == NULL)
 		goto error;
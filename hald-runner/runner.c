@@ -38,6 +38,7 @@
 #include <glib.h>
 #include "utils.h"
 #include "runner.h"
+#include "zygote.h"
 
 /* Successful run of the program */
 #define HALD_RUN_SUCCESS 0x0 
@@ -48,8 +49,12 @@
 /* Killed on purpose, e.g. hal_util_kill_device_helpers */   
 #define HALD_RUN_KILLED 0x4
 
+/* udi -> GQueue of run_data */
 GHashTable *udi_hash = NULL;
-GList *singletons = NULL;
+GQueue *singletons = NULL;
+
+/* program basename -> full path, to save walking $PATH for every helper */
+static GHashTable *program_paths = NULL;
 
 typedef struct {
 	run_request *r;
@@ -61,6 +66,7 @@ typedef struct {
 	guint timeout;
 	gboolean sent_kill;
 	gboolean emit_pid_exited;
+	GList *link;	/* our node in singletons or the udi's queue */
 } run_data;
 
 static void
@@ -129,20 +135,42 @@ send_reply(DBusConnection *con, DBusMessage *msg, guint32 exit_type, gint32 retu
 	dbus_message_unref(reply);
 }
 
+static void
+add_run_data(run_data *rd)
+{
+	GQueue *queue;
+
+	if (rd->r->is_singleton) {
+		queue = singletons;
+	} else {
+		queue = (GQueue *)g_hash_table_lookup(udi_hash, rd->r->udi);
+		if (queue == NULL) {
+			queue = g_queue_new();
+			g_hash_table_insert(udi_hash, g_strdup(rd->r->udi), queue);
+		}
+	}
+	g_queue_push_head(queue, rd);
+	rd->link = g_queue_peek_head_link(queue);
+}
+
 static void
 remove_run_data(run_data *rd)
 {
-	GList *list;
+	GQueue *queue;
+
+	/* already dropped by a kill */
+	if (rd->link == NULL)
+		return;
 
 	if (rd->r->is_singleton) {
-		singletons = g_list_remove(singletons, rd);
+		g_queue_delete_link(singletons, rd->link);
 	} else {
-		/* Remove to the hashtable */
-		list = (GList *)g_hash_table_lookup(udi_hash, rd->r->udi);
-		list = g_list_remove(list, rd);
-		/* The hash table will take care to not leak the dupped string */
-		g_hash_table_insert(udi_hash, g_strdup(rd->r->udi), list);
+		queue = (GQueue *)g_hash_table_lookup(udi_hash, rd->r->udi);
+		g_queue_delete_link(queue, rd->link);
+		if (g_queue_is_empty(queue))
+			g_hash_table_remove(udi_hash, rd->r->udi);
 	}
+	rd->link = NULL;
 }
 
 static void
@@ -224,8 +252,17 @@ find_program(char **argv)
 
 	program = g_path_get_basename(argv[0]);
 
-	/* first search $PATH to make e.g. run-hald.sh work */
-	path = g_find_program_in_path (program);
+	path = g_hash_table_lookup(program_paths, program);
+	if (path != NULL && access(path, X_OK) == 0) {
+		path = g_strdup(path);
+	} else {
+		/* first search $PATH to make e.g. run-hald.sh work */
+		path = g_find_program_in_path (program);
+		if (path != NULL)
+			g_hash_table_insert(program_paths, g_strdup(program), g_strdup(path));
+		else
+			g_hash_table_remove(program_paths, program);
+	}
 	g_free(program);
 	if (path == NULL)
 		return FALSE;
@@ -250,7 +287,6 @@ run_request_run (run_request *r, DBusConnection *con, DBusMessage *msg, GPid *ou
 	run_data *rd = NULL;
 	gboolean program_exists = FALSE;
 	char *program_dir = NULL;
-	GList *list;
 
 	printf("Run started %s (%u) (%d) \n!", r->argv[0], r->timeout,
 		r->error_on_stderr);
@@ -268,11 +304,14 @@ run_request_run (run_request *r, DBusConnection *con, DBusMessage *msg, GPid *ou
 
 	printf("  full path is '%s', program_dir is '%s'\n", r->argv[0], program_dir);
 
+	/* Prefer a pre-forked worker, see zygote.c */
 	if (!program_exists ||
-		!g_spawn_async_with_pipes(program_dir, r->argv, r->environment,
+		(!zygote_spawn(program_dir, r->argv, r->environment,
+		               &pid, stdin_p, stderr_p) &&
+		 !g_spawn_async_with_pipes(program_dir, r->argv, r->environment,
 		                          G_SPAWN_DO_NOT_REAP_CHILD,
 		                          NULL, NULL, &pid,
-		                          stdin_p, NULL, stderr_p, &error)) {
+		                          stdin_p, NULL, stderr_p, &error))) {
 		g_free (program_dir);
 		del_run_request(r);
 		if (con && msg)
@@ -308,16 +347,7 @@ run_request_run (run_request *r, DBusConnection *con, DBusMessage *msg, GPid *ou
 	else
 		rd->timeout = 0;
 
-	if (r->is_singleton) {
-		singletons = g_list_prepend(singletons, rd);
-	} else {
-		/* Add to the hashtable */
-		list = (GList *)g_hash_table_lookup(udi_hash, r->udi);
-		list = g_list_prepend(list, rd);
-
-		/* The hash table will take care to not leak the dupped string */
-		g_hash_table_insert(udi_hash, g_strdup(r->udi), list);
-	}
+	add_run_data(rd);
 
 	/* send back PID if requested.. and only emit StartedProcessExited in this case */
 	if (out_pid != NULL) {
@@ -342,31 +372,45 @@ kill_rd(gpointer data, gpointer user_data)
 
 	/* So the exit watch will know it's killed  in case it runs */
 	rd->sent_kill = TRUE;
+	/* the queue it was on goes away with this kill */
+	rd->link = NULL;
 
 	if (rd->msg != NULL)
 		send_reply(rd->con, rd->msg, HALD_RUN_KILLED, 0, NULL);
 }
 
 static void
-do_kill_udi(gchar *udi)
+free_queue(gpointer data)
 {
-	GList *list;
-	list = (GList *)g_hash_table_lookup(udi_hash, udi);
-	g_list_foreach(list, kill_rd, NULL);
-	g_list_free(list);
+	g_queue_free((GQueue *)data);
 }
 
 /* Kill all running request for a udi */
 void 
 run_kill_udi(gchar *udi)
 {
-	do_kill_udi(udi);
+	GQueue *queue;
+
+	queue = (GQueue *)g_hash_table_lookup(udi_hash, udi);
+	if (queue == NULL)
+		return;
+	g_queue_foreach(queue, kill_rd, NULL);
 	g_hash_table_remove(udi_hash, udi);
 }
 
+/* Kill all running requests for each of the udis */
+void
+run_kill_udis(gchar **udis)
+{
+	int i;
+
+	for (i = 0; udis[i] != NULL; i++)
+		run_kill_udi(udis[i]);
+}
+
 static gboolean 
 hash_kill_udi(gpointer key, gpointer value, gpointer user_data) {
-	do_kill_udi(key);
+	g_queue_foreach((GQueue *)value, kill_rd, NULL);
 	return TRUE;
 }
 
@@ -375,11 +419,15 @@ void
 run_kill_all()
 {
 	g_hash_table_foreach_remove(udi_hash, hash_kill_udi, NULL);
-	g_list_foreach(singletons, kill_rd, NULL);
+	g_queue_foreach(singletons, kill_rd, NULL);
+	while (g_queue_pop_head(singletons) != NULL)
+		;
 }
 
 void
 run_init()
 {
-	udi_hash = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	udi_hash = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free_queue);
+	singletons = g_queue_new();
+	program_paths = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
 }
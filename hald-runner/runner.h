@@ -49,6 +49,9 @@ gboolean run_request_run(run_request *r, DBusConnection *con, DBusMessage *msg,
 /* Kill all running request for a udi */
 void run_kill_udi(gchar *udi);
 
+/* Kill all running requests for each udi in the NULL-terminated array */
+void run_kill_udis(gchar **udis);
+
 /* Kill all running request*/
 void run_kill_all(void);
 
@@ -0,0 +1,426 @@
+/***************************************************************************
+ * CVSID: $Id$
+ *
+ * zygote.c - Pool of pre-forked processes to start helpers from
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ **************************************************************************/
+
+/*
+ * Forking is the expensive part of starting a helper, and during coldplug
+ * the runner starts thousands of them back to back. So we fork a few
+ * workers ahead of time, while the main loop is idle. A worker closes
+ * everything but its own descriptors and blocks reading a request from a
+ * socket; when a helper should be started, the runner writes the working
+ * directory, argv and environment to an idle worker, which sets up its
+ * stdin/stderr and execs. The worker's pid is then the helper's pid, and
+ * it is a child of the runner, so it is watched and reaped as usual.
+ *
+ * Exec failures are reported back through a close-on-exec pipe, the same
+ * trick g_spawn uses.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <signal.h>
+
+#include <glib.h>
+#include "zygote.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* Connect the helper's stdin to a pipe instead of /dev/null */
+#define ZYGOTE_FLAG_STDIN	(1 << 0)
+/* Connect the helper's stderr to a pipe instead of inheriting ours */
+#define ZYGOTE_FLAG_STDERR	(1 << 1)
+
+typedef struct {
+	guint32 flags;
+	guint32 argc;
+	guint32 envc;
+	guint32 len;		/* of the strings that follow */
+} zygote_header;
+
+typedef struct {
+	GPid pid;
+	int command_fd;		/* our end of the request socket */
+	int stdin_fd;		/* write end of the worker's stdin pipe */
+	int stderr_fd;		/* read end of the worker's stderr pipe */
+	int report_fd;		/* read end of the exec report pipe */
+	guint watch;
+} worker;
+
+static GSList *idle_workers = NULL;
+static guint num_idle_workers = 0;
+static guint max_workers = 0;
+static guint refill_source = 0;
+
+static gboolean
+read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return FALSE;
+		p += n;
+		len -= n;
+	}
+	return TRUE;
+}
+
+static gboolean
+send_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return FALSE;
+		p += n;
+		len -= n;
+	}
+	return TRUE;
+}
+
+static void
+close_fds_except(int fd1, int fd2, int fd3, int fd4)
+{
+	long open_max;
+	int fd;
+
+	open_max = sysconf(_SC_OPEN_MAX);
+	if (open_max < 0)
+		open_max = 1024;
+
+	for (fd = 3; fd < open_max; fd++) {
+		if (fd != fd1 && fd != fd2 && fd != fd3 && fd != fd4)
+			close(fd);
+	}
+}
+
+static void
+set_cloexec(int fd)
+{
+	fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+}
+
+/* Unpack count NUL-terminated strings from *p into a NULL-terminated array */
+static char **
+unpack_strings(char **p, char *end, guint32 count)
+{
+	char **result;
+	guint32 i;
+
+	result = malloc(sizeof(char *) * (count + 1));
+	if (result == NULL)
+		return NULL;
+
+	for (i = 0; i < count; i++) {
+		if (*p >= end)
+			return NULL;
+		result[i] = *p;
+		*p += strlen(*p) + 1;
+	}
+	result[count] = NULL;
+	return result;
+}
+
+/* Runs in the forked worker; never returns */
+static void
+worker_main(int command_fd, int stdin_fd, int stderr_fd, int report_fd)
+{
+	zygote_header header;
+	char *buf;
+	char *p;
+	char *dir;
+	char **argv;
+	char **envp;
+	int null_fd;
+	int err;
+
+	close_fds_except(command_fd, stdin_fd, stderr_fd, report_fd);
+
+	/* EOF here means the runner went away or shrunk the pool */
+	if (!read_all(command_fd, &header, sizeof(header)))
+		_exit(0);
+
+	buf = malloc(header.len + 1);
+	if (buf == NULL || !read_all(command_fd, buf, header.len))
+		_exit(127);
+	buf[header.len] = '\0';
+	close(command_fd);
+
+	p = buf;
+	dir = p;
+	p += strlen(p) + 1;
+	argv = unpack_strings(&p, buf + header.len + 1, header.argc);
+	envp = unpack_strings(&p, buf + header.len + 1, header.envc);
+	if (argv == NULL || envp == NULL || argv[0] == NULL) {
+		err = EINVAL;
+		goto fail;
+	}
+
+	if (header.flags & ZYGOTE_FLAG_STDIN) {
+		dup2(stdin_fd, 0);
+	} else {
+		null_fd = open("/dev/null", O_RDONLY);
+		if (null_fd >= 0) {
+			dup2(null_fd, 0);
+			close(null_fd);
+		}
+	}
+	if (header.flags & ZYGOTE_FLAG_STDERR)
+		dup2(stderr_fd, 2);
+	close(stdin_fd);
+	close(stderr_fd);
+
+	if (dir[0] != '\0' && chdir(dir) != 0) {
+		err = errno;
+		goto fail;
+	}
+
+	execve(argv[0], argv, envp);
+	err = errno;
+
+fail:
+	/* if this fails the runner sees EOF and the exit status */
+	if (write(report_fd, &err, sizeof(err)) != sizeof(err))
+		_exit(127);
+	_exit(127);
+}
+
+static void
+del_worker(worker *w)
+{
+	if (w->command_fd >= 0)
+		close(w->command_fd);
+	if (w->stdin_fd >= 0)
+		close(w->stdin_fd);
+	if (w->stderr_fd >= 0)
+		close(w->stderr_fd);
+	if (w->report_fd >= 0)
+		close(w->report_fd);
+	g_free(w);
+}
+
+static void
+idle_worker_exited(GPid pid, gint status, gpointer data)
+{
+	worker *w = (worker *)data;
+
+	printf("Idle worker %d exited\n", pid);
+	idle_workers = g_slist_remove(idle_workers, w);
+	num_idle_workers--;
+	g_spawn_close_pid(pid);
+	w->watch = 0;
+	del_worker(w);
+}
+
+static gboolean
+fork_worker(void)
+{
+	int command_fds[2] = { -1, -1 };
+	int stdin_fds[2] = { -1, -1 };
+	int stderr_fds[2] = { -1, -1 };
+	int report_fds[2] = { -1, -1 };
+	worker *w;
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, command_fds) < 0 ||
+	    pipe(stdin_fds) < 0 || pipe(stderr_fds) < 0 || pipe(report_fds) < 0)
+		goto error;
+
+	/* our ends must not leak into helpers we start later */
+	set_cloexec(command_fds[0]);
+	set_cloexec(stdin_fds[1]);
+	set_cloexec(stderr_fds[0]);
+	set_cloexec(report_fds[0]);
+	/* the worker's end is closed by a successful exec */
+	set_cloexec(report_fds[1]);
+
+	pid = fork();
+	if (pid < 0)
+		goto error;
+
+	if (pid == 0)
+		worker_main(command_fds[1], stdin_fds[0], stderr_fds[1], report_fds[1]);
+
+	close(command_fds[1]);
+	close(stdin_fds[0]);
+	close(stderr_fds[1]);
+	close(report_fds[1]);
+
+	w = g_new0(worker, 1);
+	w->pid = pid;
+	w->command_fd = command_fds[0];
+	w->stdin_fd = stdin_fds[1];
+	w->stderr_fd = stderr_fds[0];
+	w->report_fd = report_fds[0];
+	w->watch = g_child_watch_add(pid, idle_worker_exited, w);
+
+	idle_workers = g_slist_prepend(idle_workers, w);
+	num_idle_workers++;
+	return TRUE;
+
+error:
+	printf("Cannot fork worker: %s\n", strerror(errno));
+	if (command_fds[0] >= 0) {
+		close(command_fds[0]);
+		close(command_fds[1]);
+	}
+	if (stdin_fds[0] >= 0) {
+		close(stdin_fds[0]);
+		close(stdin_fds[1]);
+	}
+	if (stderr_fds[0] >= 0) {
+		close(stderr_fds[0]);
+		close(stderr_fds[1]);
+	}
+	if (report_fds[0] >= 0) {
+		close(report_fds[0]);
+		close(report_fds[1]);
+	}
+	return FALSE;
+}
+
+static gboolean
+refill(gpointer data)
+{
+	/* one fork per iteration so we don't hold up requests */
+	if (num_idle_workers < max_workers && fork_worker())
+		return num_idle_workers < max_workers;
+
+	refill_source = 0;
+	return FALSE;
+}
+
+static void
+schedule_refill(void)
+{
+	if (refill_source == 0 && num_idle_workers < max_workers)
+		refill_source = g_idle_add(refill, NULL);
+}
+
+static void
+append_string(GByteArray *buf, const char *s)
+{
+	g_byte_array_append(buf, (const guint8 *) s, strlen(s) + 1);
+}
+
+gboolean
+zygote_spawn(const gchar *working_directory, gchar **argv, gchar **envp,
+	     GPid *child_pid, gint *standard_input, gint *standard_error)
+{
+	zygote_header header;
+	GByteArray *buf;
+	worker *w;
+	gboolean sent;
+	ssize_t n;
+	int err;
+	int i;
+
+	if (idle_workers == NULL) {
+		schedule_refill();
+		return FALSE;
+	}
+
+	w = (worker *)idle_workers->data;
+	idle_workers = g_slist_delete_link(idle_workers, idle_workers);
+	num_idle_workers--;
+	g_source_remove(w->watch);
+	w->watch = 0;
+	schedule_refill();
+
+	memset(&header, 0, sizeof(header));
+	if (standard_input != NULL)
+		header.flags |= ZYGOTE_FLAG_STDIN;
+	if (standard_error != NULL)
+		header.flags |= ZYGOTE_FLAG_STDERR;
+
+	buf = g_byte_array_new();
+	append_string(buf, working_directory != NULL ? working_directory : "");
+	for (i = 0; argv[i] != NULL; i++)
+		append_string(buf, argv[i]);
+	header.argc = i;
+	for (i = 0; envp != NULL && envp[i] != NULL; i++)
+		append_string(buf, envp[i]);
+	header.envc = i;
+	header.len = buf->len;
+
+	sent = send_all(w->command_fd, &header, sizeof(header)) &&
+	       send_all(w->command_fd, buf->data, buf->len);
+	g_byte_array_free(buf, TRUE);
+	if (!sent) {
+		/* the worker died under us */
+		kill(w->pid, SIGKILL);
+		goto failed;
+	}
+
+	/* EOF means the exec went through */
+	do {
+		n = read(w->report_fd, &err, sizeof(err));
+	} while (n < 0 && errno == EINTR);
+	if (n > 0) {
+		printf("Worker %d cannot exec %s: %s\n", w->pid, argv[0], strerror(err));
+		goto failed;
+	}
+
+	*child_pid = w->pid;
+	if (standard_input != NULL) {
+		*standard_input = w->stdin_fd;
+		w->stdin_fd = -1;
+	}
+	if (standard_error != NULL) {
+		*standard_error = w->stderr_fd;
+		w->stderr_fd = -1;
+	}
+	del_worker(w);
+	return TRUE;
+
+failed:
+	while (waitpid(w->pid, NULL, 0) < 0 && errno == EINTR)
+		;
+	del_worker(w);
+	return FALSE;
+}
+
+void
+zygote_init(guint num_workers)
+{
+	max_workers = num_workers;
+	while (num_idle_workers < max_workers && fork_worker())
+		;
+}
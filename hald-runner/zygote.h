@@ -0,0 +1,41 @@
+/***************************************************************************
+ * CVSID: $Id$
+ *
+ * zygote.h - Pool of pre-forked processes to start helpers from
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ **************************************************************************/
+#ifndef ZYGOTE_H
+#define ZYGOTE_H
+
+#include <glib.h>
+
+/* Number of warm workers kept if HALD_RUNNER_PREFORK is not set */
+#define ZYGOTE_DEFAULT_WORKERS 4
+
+/* Fork num_workers workers up front; 0 disables the pool */
+void zygote_init(guint num_workers);
+
+/* Exec argv in a pre-forked worker. Like g_spawn_async_with_pipes() with
+ * G_SPAWN_DO_NOT_REAP_CHILD, except that argv[0] must be a full path.
+ * Returns FALSE if no worker was available or the exec failed, in which
+ * case the caller should fall back to spawning the program itself. */
+gboolean zygote_spawn(const gchar *working_directory, gchar **argv, gchar **envp,
+		      GPid *child_pid, gint *standard_input, gint *standard_error);
+
+#endif /*  ZYGOTE_H */
@@ -37,13 +37,18 @@
 #include <stdlib.h>
 #include <dirent.h>
 #include <errno.h>
+#include <sys/time.h>
 #include <expat.h>
 #include <glib.h>
 #include <config.h>
 
 #include "logger.h"
 #include "rule.h"
+#include "rule_match.h"
 #include "mmap_cache.h"
+#include "device_store.h"
+#include "hald.h"
+#include "hald_runner.h"
 
 void 	*rules_ptr = NULL;
 
@@ -66,6 +71,447 @@ static void test_cache(u_int32_t offset, size_t size)
     }
 }
 
+static void check_blocks(const struct cache_index *index, u_int32_t list, u_int32_t num)
+{
+    const u_int32_t	*b = (const u_int32_t *) RULES_PTR(list);
+    u_int32_t		i;
+
+    for (i = 0; i < num; i++) {
+	if (b[i] >= index->num_blocks || (i > 0 && b[i] <= b[i - 1]))
+	    DIE(("Bad block list at %08x", list));
+    }
+}
+
+static void test_index(u_int32_t offset, u_int32_t rules_start, u_int32_t rules_end)
+{
+    const struct cache_index	*index = (const struct cache_index *) RULES_PTR(offset);
+    const struct cache_index_key	*keys = (const struct cache_index_key *) RULES_PTR(index->keys);
+    const u_int32_t		*blocks = (const u_int32_t *) RULES_PTR(index->blocks);
+    u_int32_t			i, j;
+
+    HAL_INFO(("index=%08x, num_blocks=%d, num_unindexed=%d, num_keys=%d",
+	offset, index->num_blocks, index->num_unindexed, index->num_keys));
+
+    if (index->num_blocks > 0 && blocks[0] != rules_start)
+	DIE(("First block does not start the section"));
+    if (blocks[index->num_blocks] != rules_end)
+	DIE(("Last block does not end the section"));
+    for (i = 1; i <= index->num_blocks; i++)
+	if (blocks[i] <= blocks[i - 1])
+	    DIE(("Blocks out of order"));
+
+    check_blocks(index, index->unindexed, index->num_unindexed);
+    for (i = 0; i < index->num_keys; i++) {
+	const struct cache_index_value *values = (const struct cache_index_value *) RULES_PTR(keys[i].values);
+
+	if (i > 0 && strcmp(RULES_PTR(keys[i - 1].key), RULES_PTR(keys[i].key)) >= 0)
+	    DIE(("Index keys out of order"));
+	HAL_INFO(("  key='%s', num_any=%d, num_values=%d",
+	    (char *) RULES_PTR(keys[i].key), keys[i].num_any, keys[i].num_values));
+
+	check_blocks(index, keys[i].any, keys[i].num_any);
+	for (j = 0; j < keys[i].num_values; j++) {
+	    if (j > 0 && strcmp(RULES_PTR(values[j - 1].value), RULES_PTR(values[j].value)) >= 0)
+		DIE(("Index values out of order"));
+	    check_blocks(index, values[j].blocks, values[j].num_blocks);
+	}
+    }
+}
+
+/* Run every match rule of a section through the matcher hald uses,
+ * rule_match_device(), on devices built so the right answer is known:
+ * one with the property set to the rule's value, one with a different
+ * value and one without it. The answer is worked out from the rule's
+ * value the way hald did before the cache carried decoded operands.
+ * With benchmark set, time rule_match_device() on those devices next
+ * to that old way of parsing the value on every match.
+ *
+ * Each device sits alone in its own store, which hald_get_gdl() returns
+ * while the device is matched, so that key paths resolve to it.
+ */
+struct match_sample {
+    HalDeviceStore	*gdl;
+    HalDevice		*d;
+};
+
+static HalDeviceStore	*test_gdl;
+static HalDeviceStore	*test_tdl;
+
+HalDeviceStore *hald_get_gdl(void)
+{
+    return test_gdl;
+}
+
+HalDeviceStore *hald_get_tdl(void)
+{
+    return test_tdl;
+}
+
+/* device.c tells the runner about devices going away */
+void runner_device_finalized(HalDevice *device)
+{
+}
+
+/* the property type a match rule looks at */
+static int match_property_type(const struct rule *r)
+{
+    const char	*value = (const char *) RULES_PTR(r->value_offset);
+    char	*end;
+
+    switch (r->type_match) {
+    case MATCH_INT:
+    case MATCH_INT_OUTOF:
+	return HAL_PROPERTY_TYPE_INT32;
+    case MATCH_UINT64:
+	return HAL_PROPERTY_TYPE_UINT64;
+    case MATCH_BOOL:
+	return HAL_PROPERTY_TYPE_BOOLEAN;
+    case MATCH_DOUBLE:
+	return HAL_PROPERTY_TYPE_DOUBLE;
+    case MATCH_COMPARE_LT:
+    case MATCH_COMPARE_LE:
+    case MATCH_COMPARE_GT:
+    case MATCH_COMPARE_GE:
+    case MATCH_COMPARE_NE:
+	strtoll(value, &end, 0);
+	return (*value != '\0' && *end == '\0') ? HAL_PROPERTY_TYPE_INT32 : HAL_PROPERTY_TYPE_STRING;
+    default:
+	return HAL_PROPERTY_TYPE_STRING;
+    }
+}
+
+/* Set the property a rule looks at to its value (other == FALSE) or to
+ * something else */
+static void match_set_property(HalDevice *d, const struct rule *r, const char *prop, gboolean other)
+{
+    const char	*value = (const char *) RULES_PTR(r->value_offset);
+    gchar	**tokens;
+    gchar	*s;
+    long	i;
+
+    switch (match_property_type(r)) {
+    case HAL_PROPERTY_TYPE_INT32:
+	i = strtol(value, NULL, 0);
+	if (other) {
+	    /* a number none of the int_outof values is */
+	    tokens = g_strsplit(value, ";", 0);
+	    for (i = 1; ; i++) {
+		guint n;
+
+		for (n = 0; tokens[n] != NULL && strtol(tokens[n], NULL, 0) != i; n++)
+		    ;
+		if (tokens[n] == NULL)
+		    break;
+	    }
+	    g_strfreev(tokens);
+	}
+	hal_device_property_set_int(d, prop, (int) i);
+	break;
+    case HAL_PROPERTY_TYPE_UINT64:
+	hal_device_property_set_uint64(d, prop, (dbus_uint64_t) strtol(value, NULL, 0) + (other ? 1 : 0));
+	break;
+    case HAL_PROPERTY_TYPE_BOOLEAN:
+	hal_device_property_set_bool(d, prop, (strcmp(value, "true") == 0) != other);
+	break;
+    case HAL_PROPERTY_TYPE_DOUBLE:
+	hal_device_property_set_double(d, prop, atof(value) + (other ? 1.0 : 0.0));
+	break;
+    default:
+	switch (r->type_match) {
+	case MATCH_EMPTY:
+	    s = g_strdup(other ? "not empty" : "");
+	    break;
+	case MATCH_ISASCII:
+	    s = g_strdup(other ? "caf\xc3\xa9" : "cafe");
+	    break;
+	case MATCH_IS_ABS_PATH:
+	    s = g_strdup(other ? "relative/path" : "/absolute/path");
+	    break;
+	case MATCH_COMPARE_LT:
+	case MATCH_COMPARE_LE:
+	case MATCH_COMPARE_GT:
+	case MATCH_COMPARE_GE:
+	case MATCH_COMPARE_NE:
+	    /* sorts after the value */
+	    s = other ? g_strconcat(value, "~", NULL) : g_strdup(value);
+	    break;
+	default:
+	    if (other) {
+		s = g_strdup("no such value");
+	    } else {
+		tokens = g_strsplit(value, ";", 2);
+		s = g_strdup(tokens[0] != NULL ? tokens[0] : "");
+		g_strfreev(tokens);
+	    }
+	    break;
+	}
+	hal_device_property_set_string(d, prop, s);
+	g_free(s);
+	break;
+    }
+}
+
+/* whether a rule should match d, parsing its value as hald used to */
+static gboolean match_expected(const struct rule *r, HalDevice *d, const char *prop)
+{
+    const char	*value = (const char *) RULES_PTR(r->value_offset);
+    gboolean	result = FALSE;
+    gboolean	want = strcmp(value, "false") != 0;
+    const char	*s = NULL;
+    gchar	**tokens;
+    gchar	*lower_value;
+    gchar	*lower_s;
+    gint64	cmp;
+    int		i;
+
+    if (!hal_device_has_property(d, prop))
+	return (r->type_match == MATCH_EXISTS && !want) || r->type_match == MATCH_CONTAINS_NOT;
+    if (hal_device_property_get_type(d, prop) == HAL_PROPERTY_TYPE_STRING)
+	s = hal_device_property_get_string(d, prop);
+
+    switch (r->type_match) {
+    case MATCH_STRING:
+	return strcmp(s, value) == 0;
+    case MATCH_INT:
+	return hal_device_property_get_int(d, prop) == (int) strtol(value, NULL, 0);
+    case MATCH_UINT64:
+	return hal_device_property_get_uint64(d, prop) == (dbus_uint64_t) strtol(value, NULL, 0);
+    case MATCH_BOOL:
+	if (strcmp(value, "false") == 0)
+	    return hal_device_property_get_bool(d, prop) == FALSE;
+	else if (strcmp(value, "true") == 0)
+	    return hal_device_property_get_bool(d, prop) == TRUE;
+	return FALSE;
+    case MATCH_DOUBLE:
+	return hal_device_property_get_double(d, prop) == atof(value);
+    case MATCH_EXISTS:
+	return want;
+    case MATCH_EMPTY:
+	return (s[0] == '\0') == want;
+    case MATCH_ISASCII:
+	for (i = 0; s[i] != '\0' && (unsigned char) s[i] <= 0x7f; i++)
+	    ;
+	return (s[i] == '\0') == want;
+    case MATCH_IS_ABS_PATH:
+	return g_path_is_absolute(s) == want;
+    case MATCH_CONTAINS:
+	return strstr(s, value) != NULL;
+    case MATCH_CONTAINS_NOT:
+	return strstr(s, value) == NULL;
+    case MATCH_PREFIX:
+	return g_str_has_prefix(s, value);
+    case MATCH_SUFFIX:
+	return g_str_has_suffix(s, value);
+    case MATCH_CONTAINS_NCASE:
+    case MATCH_PREFIX_NCASE:
+    case MATCH_SUFFIX_NCASE:
+	lower_value = g_utf8_strdown(value, -1);
+	lower_s = g_utf8_strdown(s, -1);
+	if (r->type_match == MATCH_CONTAINS_NCASE)
+	    result = strstr(lower_s, lower_value) != NULL;
+	else if (r->type_match == MATCH_PREFIX_NCASE)
+	    result = g_str_has_prefix(lower_s, lower_value);
+	else
+	    result = g_str_has_suffix(lower_s, lower_value);
+	g_free(lower_value);
+	g_free(lower_s);
+	return result;
+    case MATCH_CONTAINS_OUTOF:
+    case MATCH_PREFIX_OUTOF:
+    case MATCH_STRING_OUTOF:
+    case MATCH_INT_OUTOF:
+	tokens = g_strsplit(value, ";", 0);
+	for (i = 0; tokens[i] != NULL && !result; i++) {
+	    if (r->type_match == MATCH_CONTAINS_OUTOF)
+		result = strstr(s, tokens[i]) != NULL;
+	    else if (r->type_match == MATCH_PREFIX_OUTOF)
+		result = g_str_has_prefix(s, tokens[i]);
+	    else if (r->type_match == MATCH_STRING_OUTOF)
+		result = strcmp(s, tokens[i]) == 0;
+	    else
+		result = hal_device_property_get_int(d, prop) == strtol(tokens[i], NULL, 0);
+	}
+	g_strfreev(tokens);
+	return result;
+    case MATCH_COMPARE_LT:
+    case MATCH_COMPARE_LE:
+    case MATCH_COMPARE_GT:
+    case MATCH_COMPARE_GE:
+    case MATCH_COMPARE_NE:
+	if (s != NULL)
+	    cmp = strcmp(s, value);
+	else
+	    cmp = (gint64) hal_device_property_get_int(d, prop) - strtoll(value, NULL, 0);
+	if (r->type_match == MATCH_COMPARE_LT)
+	    return cmp < 0;
+	else if (r->type_match == MATCH_COMPARE_LE)
+	    return cmp <= 0;
+	else if (r->type_match == MATCH_COMPARE_GT)
+	    return cmp > 0;
+	else if (r->type_match == MATCH_COMPARE_GE)
+	    return cmp >= 0;
+	return cmp != 0;
+    default:
+	return FALSE;
+    }
+}
+
+/* Make the three devices for a match rule; FALSE if its key path can't
+ * be made to lead back to a single device */
+static gboolean match_make_samples(const struct rule *r, const struct rule_match *rm,
+				   guint num, struct match_sample *sample)
+{
+    const struct rule_hop	*hops = (const struct rule_hop *) RULES_PTR(rm->hops);
+    const char			*prop = (const char *) RULES_PTR(rm->prop);
+    const char			*udi = NULL;
+    gchar			*own_udi;
+    u_int32_t			h;
+    guint			j;
+
+    for (h = 0; h < rm->num_hops; h++) {
+	const char *name = (const char *) RULES_PTR(hops[h].name);
+
+	if (hops[h].indirect) {
+	    if (strcmp(name, prop) == 0)
+		return FALSE;
+	} else {
+	    if (udi != NULL && strcmp(udi, name) != 0)
+		return FALSE;
+	    if (!g_str_has_prefix(name, "/org/freedesktop/Hal/devices/"))
+		return FALSE;
+	    udi = name;
+	}
+    }
+
+    own_udi = g_strdup_printf("/org/freedesktop/Hal/devices/cache_test_%u", num);
+    for (j = 0; j < 3; j++) {
+	HalDevice *d = hal_device_new();
+
+	hal_device_set_udi(d, udi != NULL ? udi : own_udi);
+	for (h = 0; h < rm->num_hops; h++) {
+	    if (hops[h].indirect)
+		hal_device_property_set_string(d, RULES_PTR(hops[h].name), hal_device_get_udi(d));
+	}
+	if (j < 2)
+	    match_set_property(d, r, prop, j == 1);
+
+	sample[j].gdl = hal_device_store_new();
+	hal_device_store_add(sample[j].gdl, d);
+	sample[j].d = d;
+    }
+    g_free(own_udi);
+
+    return TRUE;
+}
+
+/* usec per device to run every rule over the samples, either through
+ * rule_match_device() or by parsing the value as match_expected() does */
+static double time_matches(GPtrArray *rules, GPtrArray *samples, gboolean parse)
+{
+    struct timeval	start, end;
+    guint		iterations = 1000;
+    guint		n, i, j;
+
+    gettimeofday(&start, NULL);
+    for (n = 0; n < iterations; n++) {
+	for (i = 0; i < rules->len; i++) {
+	    struct rule		*r = g_ptr_array_index(rules, i);
+	    struct match_sample	*sample = g_ptr_array_index(samples, i);
+	    const struct rule_match *rm = (const struct rule_match *) RULES_PTR(r->match_offset);
+
+	    for (j = 0; j < 3; j++) {
+		test_gdl = sample[j].gdl;
+		if (parse)
+		    match_expected(r, sample[j].d, RULES_PTR(rm->prop));
+		else
+		    rule_match_device(r, sample[j].d);
+	    }
+	}
+    }
+    gettimeofday(&end, NULL);
+
+    return ((end.tv_sec - start.tv_sec) * 1e6 + (end.tv_usec - start.tv_usec)) / (iterations * 3);
+}
+
+static void test_matches(u_int32_t offset, size_t size, gboolean benchmark)
+{
+    GPtrArray	*rules;
+    GPtrArray	*samples;
+    u_int32_t	m;
+    guint	i, j;
+    guint	num_skipped = 0;
+
+    test_tdl = hal_device_store_new();
+
+    rules = g_ptr_array_new();
+    samples = g_ptr_array_new();
+    for (m = offset; m < offset + size; m += ((struct rule *) RULES_PTR(m))->rule_size) {
+	struct rule		*r = (struct rule *) RULES_PTR(m);
+	const struct rule_match	*rm;
+	struct match_sample	*sample;
+	gchar			**tokens;
+
+	if (r->rtype != RULE_MATCH)
+	    continue;
+	if (r->match_offset == 0 || r->match_offset % __alignof__(struct rule_match) != 0)
+	    DIE(("Match rule %08x has no operands", m));
+	rm = (const struct rule_match *) RULES_PTR(r->match_offset);
+
+	/* the key path must be the one in the key */
+	tokens = g_strsplit(r->key, ":", 64);
+	if (g_strv_length(tokens) != rm->num_hops + 1 ||
+	    strcmp(tokens[rm->num_hops], RULES_PTR(rm->prop)) != 0)
+	    DIE(("Bad key path for match rule %08x", m));
+	g_strfreev(tokens);
+
+	/* siblings would need a device tree */
+	sample = g_new0(struct match_sample, 3);
+	if (r->type_match == MATCH_SIBLING_CONTAINS || r->type_match == MATCH_UNKNOWN ||
+	    !match_make_samples(r, rm, rules->len, sample)) {
+	    num_skipped++;
+	    g_free(sample);
+	    continue;
+	}
+
+	g_ptr_array_add(rules, r);
+	g_ptr_array_add(samples, sample);
+    }
+
+    /* the decoded operands have to give the same answers */
+    for (i = 0; i < rules->len; i++) {
+	struct rule		*r = g_ptr_array_index(rules, i);
+	struct match_sample	*sample = g_ptr_array_index(samples, i);
+	const struct rule_match	*rm = (const struct rule_match *) RULES_PTR(r->match_offset);
+
+	for (j = 0; j < 3; j++) {
+	    test_gdl = sample[j].gdl;
+	    if (rule_match_device(r, sample[j].d) != match_expected(r, sample[j].d, RULES_PTR(rm->prop)))
+		DIE(("Match rule '%s' on '%s' decoded wrong for device %u",
+		    r->key, (char *) RULES_PTR(r->value_offset), j));
+	}
+    }
+    HAL_INFO(("%d match rules checked, %d skipped", rules->len, num_skipped));
+
+    if (benchmark && rules->len > 0) {
+	double	decoded = time_matches(rules, samples, FALSE);
+	double	parsed = time_matches(rules, samples, TRUE);
+
+	printf("%d match rules: %.2f usec per device decoded, %.2f usec parsing values (%.1fx)\n",
+	    rules->len, decoded, parsed, parsed / decoded);
+    }
+
+    for (i = 0; i < samples->len; i++) {
+	struct match_sample *sample = g_ptr_array_index(samples, i);
+
+	for (j = 0; j < 3; j++)
+	    g_object_unref(sample[j].gdl);
+	g_free(sample);
+    }
+    g_ptr_array_free(samples, TRUE);
+    g_ptr_array_free(rules, TRUE);
+    g_object_unref(test_tdl);
+}
+
 int 
 di_rules_init (void)
 {
@@ -89,6 +535,9 @@ di_rules_init (void)
 		DIE (("Couldn't mmap file '%s', errno=%d: %s", cachename, errno, strerror (errno)));
 
 	header = (struct cache_header*) rules_ptr;
+	if (header->version != RULES_CACHE_VERSION)
+		DIE (("Cache file '%s' has an unknown format", cachename));
+
 	HAL_INFO(("preprobe: offset=%08lx, size=%d", header->fdi_rules_preprobe,
 		header->fdi_rules_information - header->fdi_rules_preprobe));
 	HAL_INFO(("information: offset=%08lx, size=%d", header->fdi_rules_information,
@@ -105,6 +554,11 @@ di_rules_init (void)
 int main(int argc, char * argv[])
 {
     struct cache_header	*header;
+    gboolean		benchmark;
+
+    benchmark = argc > 1 && strcmp(argv[1], "--benchmark") == 0;
+
+    g_type_init();
 
     di_rules_init();
     header = (struct cache_header*) RULES_PTR(0);
@@ -112,5 +566,12 @@ int main(int argc, char * argv[])
     test_cache(header->fdi_rules_preprobe, header->fdi_rules_information - header->fdi_rules_preprobe);
     test_cache(header->fdi_rules_information, header->fdi_rules_policy - header->fdi_rules_information);
     test_cache(header->fdi_rules_policy, header->all_rules_size - header->fdi_rules_policy);
+
+    test_index(header->fdi_index_preprobe, header->fdi_rules_preprobe, header->fdi_rules_information);
+    test_index(header->fdi_index_information, header->fdi_rules_information, header->fdi_rules_policy);
+    test_index(header->fdi_index_policy, header->fdi_rules_policy, header->all_rules_size);
+
+    /* all sections at once, as every device goes through all of them */
+    test_matches(header->fdi_rules_preprobe, header->all_rules_size - header->fdi_rules_preprobe, benchmark);
     return 0;
 }
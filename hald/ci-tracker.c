@@ -34,6 +34,7 @@
 #include <stdarg.h>
 #include <stdint.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include <dbus/dbus.h>
 #include <glib.h>
@@ -135,8 +136,18 @@ error:
 }
 
 
+/* How long we trust what we found out about a process, in seconds */
+#define CI_TRACKER_PROCESS_CACHE_TIMEOUT 60
+/* Expired entries are pruned when the process cache grows beyond this */
+#define CI_TRACKER_PROCESS_CACHE_SIZE 128
+
 struct CITracker_s {
         GHashTable *connection_name_to_caller_info;
+        GHashTable *connection_name_to_lookup;  /* lookups in progress */
+#ifdef HAVE_CONKIT
+        GHashTable *pid_to_process_info;        /* second-level cache, see CIProcessInfo */
+        GHashTable *session_objpath_to_session_info;
+#endif
         DBusConnection *dbus_connection;
 };
 
@@ -145,6 +156,8 @@ struct CICallerInfo_s {
 	unsigned long  uid;           /* uid of caller */
 #ifdef HAVE_CONKIT
 	pid_t  pid;                   /* process ID of caller */
+	guint64 start_time;           /* when it started, 0 if unknown */
+	gboolean session_known;       /* session_objpath came from the process cache */
 	gboolean in_active_session;   /* caller is in an active session */
         gboolean is_local;            /* session is on a local seat */
 	char *session_objpath;        /* obj path of ConsoleKit session */
@@ -153,6 +166,52 @@ struct CICallerInfo_s {
 	char *system_bus_unique_name; /* unique name of caller on the system bus */
 };
 
+#ifdef HAVE_CONKIT
+/* What we know about a process independent of its connection; a client
+ * that reconnects gets a new unique name but stays in the same session.
+ * The start time tells a reused pid apart. The SELinux context is not
+ * kept as it may change when the process exec()s. */
+typedef struct {
+	unsigned long uid;
+	guint64 start_time;
+	char *session_objpath;        /* NULL if not in any session */
+	time_t timestamp;
+} CIProcessInfo;
+
+typedef struct {
+	gboolean is_active;
+	gboolean is_local;
+} CISessionInfo;
+#endif
+
+/* The round trips needed to fill in a CICallerInfo, in order */
+typedef enum {
+	CI_STEP_UID,
+#ifdef HAVE_CONKIT
+	CI_STEP_PID,
+	CI_STEP_SELINUX_CONTEXT,
+	CI_STEP_SESSION,
+	CI_STEP_IS_ACTIVE,
+	CI_STEP_IS_LOCAL,
+#endif
+	CI_STEP_DONE,
+	CI_STEP_FAILED
+} CIStep;
+
+typedef struct {
+	CITrackerInfoCB cb;
+	void *user_data;
+} CILookupCallback;
+
+/* An asynchronous lookup in progress */
+typedef struct {
+	CITracker *cit;
+	CICallerInfo *ci;
+	CIStep step;
+	gboolean cancelled;           /* the connection went away meanwhile */
+	GSList *callbacks;            /* CILookupCallback's, most recent first */
+} CILookup;
+
 static CICallerInfo *
 caller_info_new (void)
 {
@@ -172,6 +231,115 @@ caller_info_free (CICallerInfo *ci)
 	g_free (ci);
 }
 
+#ifdef HAVE_CONKIT
+static void
+process_info_free (CIProcessInfo *pi)
+{
+	g_free (pi->session_objpath);
+	g_free (pi);
+}
+
+/* Start time of a process in clock ticks since boot, field 22 of
+ * /proc/<pid>/stat; 0 if we can't tell */
+static guint64
+process_get_start_time (pid_t pid)
+{
+	char path[64];
+	char *contents;
+	char *p;
+	guint64 start_time;
+	int field;
+
+	start_time = 0;
+
+	snprintf (path, sizeof (path), "/proc/%d/stat", (int) pid);
+	if (!g_file_get_contents (path, &contents, NULL, NULL))
+		return 0;
+
+	/* the command name may contain spaces; fields resume after its ')' */
+	p = strrchr (contents, ')');
+	if (p == NULL)
+		goto out;
+
+	for (field = 2; field < 22; field++) {
+		p = strchr (p + 1, ' ');
+		if (p == NULL)
+			goto out;
+	}
+	start_time = g_ascii_strtoull (p + 1, NULL, 10);
+
+out:
+	g_free (contents);
+	return start_time;
+}
+
+static gboolean
+process_info_is_expired (gpointer key, gpointer value, gpointer user_data)
+{
+	CIProcessInfo *pi = (CIProcessInfo *) value;
+	time_t now = *((time_t *) user_data);
+
+	return now - pi->timestamp > CI_TRACKER_PROCESS_CACHE_TIMEOUT || now < pi->timestamp;
+}
+
+static void
+process_info_store (CITracker *cit, CICallerInfo *ci)
+{
+	CIProcessInfo *pi;
+	CISessionInfo *si;
+	time_t now;
+
+	if (ci->start_time == 0)
+		return;
+
+	now = time (NULL);
+	if (g_hash_table_size (cit->pid_to_process_info) >= CI_TRACKER_PROCESS_CACHE_SIZE)
+		g_hash_table_foreach_remove (cit->pid_to_process_info, process_info_is_expired, &now);
+
+	pi = g_new0 (CIProcessInfo, 1);
+	pi->uid = ci->uid;
+	pi->start_time = ci->start_time;
+	pi->session_objpath = g_strdup (ci->session_objpath);
+	pi->timestamp = now;
+	g_hash_table_insert (cit->pid_to_process_info, GINT_TO_POINTER (ci->pid), pi);
+
+	if (ci->session_objpath != NULL) {
+		si = g_hash_table_lookup (cit->session_objpath_to_session_info, ci->session_objpath);
+		if (si == NULL) {
+			si = g_new0 (CISessionInfo, 1);
+			g_hash_table_insert (cit->session_objpath_to_session_info,
+					     g_strdup (ci->session_objpath), si);
+		}
+		si->is_active = ci->in_active_session;
+		si->is_local = ci->is_local;
+	}
+}
+
+/* fill in what we know about the caller's process; returns FALSE if nothing */
+static gboolean
+process_info_lookup (CITracker *cit, CICallerInfo *ci)
+{
+	CIProcessInfo *pi;
+	time_t now;
+
+	if (ci->start_time == 0)
+		return FALSE;
+
+	/* pids get reused */
+	pi = g_hash_table_lookup (cit->pid_to_process_info, GINT_TO_POINTER (ci->pid));
+	if (pi == NULL || pi->uid != ci->uid || pi->start_time != ci->start_time)
+		return FALSE;
+
+	now = time (NULL);
+	if (process_info_is_expired (NULL, pi, &now))
+		return FALSE;
+
+	ci->session_objpath = g_strdup (pi->session_objpath);
+	ci->session_known = TRUE;
+	return TRUE;
+}
+#endif /* HAVE_CONKIT */
+
 
 CITracker *
 ci_tracker_new (void)
@@ -196,6 +364,17 @@ ci_tracker_init (CITracker *cit)
                                                                      g_str_equal,
                                                                      NULL, /* a pointer to a CICallerInfo object */
                                                                      (GFreeFunc) caller_info_free);
+	cit->connection_name_to_lookup = g_hash_table_new (g_str_hash, g_str_equal);
+#ifdef HAVE_CONKIT
+	cit->pid_to_process_info = g_hash_table_new_full (g_direct_hash,
+                                                          g_direct_equal,
+                                                          NULL,
+                                                          (GFreeFunc) process_info_free);
+	cit->session_objpath_to_session_info = g_hash_table_new_full (g_str_hash,
+                                                                      g_str_equal,
+                                                                      g_free,
+                                                                      g_free);
+#endif
 }
 
 void 
@@ -209,6 +388,7 @@ ci_tracker_name_owner_changed (CITracker *cit,
 
 	if (strlen (old_service_name) > 0) {
 		CICallerInfo *caller_info;
+		CILookup *lookup;
 
 		/* evict CICallerInfo from cache */
 		caller_info = (CICallerInfo *) g_hash_table_lookup (cit->connection_name_to_caller_info, 
@@ -217,6 +397,14 @@ ci_tracker_name_owner_changed (CITracker *cit,
 			g_hash_table_remove (cit->connection_name_to_caller_info, old_service_name);
 			HAL_INFO (("Removing CICallerInfo object for %s", old_service_name));
 		}
+
+		/* and make sure a lookup in progress doesn't put it back */
+		lookup = (CILookup *) g_hash_table_lookup (cit->connection_name_to_lookup,
+                                                           old_service_name);
+		if (lookup != NULL) {
+			g_hash_table_remove (cit->connection_name_to_lookup, old_service_name);
+			lookup->cancelled = TRUE;
+		}
 	}
 }
 
@@ -252,6 +440,12 @@ ci_tracker_clear_active (gpointer key, gpointer value, gpointer user_data)
 void 
 ci_tracker_active_changed (CITracker *cit, const char *session_objpath, gboolean is_active)
 {
+	CISessionInfo *si;
+
+	si = g_hash_table_lookup (cit->session_objpath_to_session_info, session_objpath);
+	if (si != NULL)
+		si->is_active = is_active;
+
 	if (is_active) {
 		g_hash_table_foreach (cit->connection_name_to_caller_info, 
 				      ci_tracker_set_active, (gpointer) session_objpath);
@@ -260,22 +454,402 @@ ci_tracker_active_changed (CITracker *cit, const char *session_objpath, gboolean
 				      ci_tracker_clear_active, (gpointer) session_objpath);
 	}
 }
+
+static gboolean
+session_info_remove_all (gpointer key, gpointer value, gpointer user_data)
+{
+	return TRUE;
+}
+
+static gboolean
+process_info_in_session (gpointer key, gpointer value, gpointer user_data)
+{
+	CIProcessInfo *pi = (CIProcessInfo *) value;
+	const char *session_objpath = (const char *) user_data;
+
+	return pi->session_objpath != NULL &&
+		(session_objpath == NULL || strcmp (pi->session_objpath, session_objpath) == 0);
+}
+
+/* Forget what we cached about a session ConsoleKit removed, or about
+ * all sessions if session_objpath is NULL */
+void
+ci_tracker_session_removed (CITracker *cit, const char *session_objpath)
+{
+	if (session_objpath != NULL)
+		g_hash_table_remove (cit->session_objpath_to_session_info, session_objpath);
+	else
+		g_hash_table_foreach_remove (cit->session_objpath_to_session_info, session_info_remove_all, NULL);
+
+	g_hash_table_foreach_remove (cit->pid_to_process_info, process_info_in_session, (gpointer) session_objpath);
+}
 #endif /* HAVE_CONKIT */
 
-CICallerInfo *
-ci_tracker_get_info (CITracker *cit, const char *system_bus_unique_name)
+/* Create the request for @step, skipping steps we already know the
+ * answer to. Returns NULL when the lookup is done. */
+static DBusMessage *
+ci_step_request (CITracker *cit, CICallerInfo *ci, CIStep *step)
 {
-	CICallerInfo *ci;
-	DBusError error;
-#ifdef HAVE_CONKIT
 	DBusMessage *message;
-	DBusMessage *reply;
 	DBusMessageIter iter;
+#ifdef HAVE_CONKIT
+	CISessionInfo *si;
+#endif
+
+	message = NULL;
+
+	switch (*step) {
+	case CI_STEP_UID:
+		message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+							DBUS_PATH_DBUS,
+							DBUS_INTERFACE_DBUS,
+							"GetConnectionUnixUser");
+		dbus_message_iter_init_append (message, &iter);
+		dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &ci->system_bus_unique_name);
+		break;
+
+#ifdef HAVE_CONKIT
+	case CI_STEP_PID:
+		message = dbus_message_new_method_call ("org.freedesktop.DBus", 
+							"/org/freedesktop/DBus/Bus",
+							"org.freedesktop.DBus",
+							"GetConnectionUnixProcessID");
+		dbus_message_iter_init_append (message, &iter);
+		dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &ci->system_bus_unique_name);
+		break;
+
+	case CI_STEP_SELINUX_CONTEXT:
+		message = dbus_message_new_method_call ("org.freedesktop.DBus", 
+							"/org/freedesktop/DBus/Bus",
+							"org.freedesktop.DBus",
+							"GetConnectionSELinuxSecurityContext");
+		dbus_message_iter_init_append (message, &iter);
+		dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &ci->system_bus_unique_name);
+		break;
+
+	case CI_STEP_SESSION:
+		message = dbus_message_new_method_call ("org.freedesktop.ConsoleKit", 
+							"/org/freedesktop/ConsoleKit/Manager",
+							"org.freedesktop.ConsoleKit.Manager",
+							"GetSessionForUnixProcess");
+		dbus_message_iter_init_append (message, &iter);
+		dbus_message_iter_append_basic (&iter, DBUS_TYPE_UINT32, &ci->pid);
+		break;
+
+	case CI_STEP_IS_ACTIVE:
+		/* the caller is not a member of any session */
+		if (ci->session_objpath == NULL) {
+			*step = CI_STEP_DONE;
+			break;
+		}
+
+		/* other processes in the same session already told us; we
+		 * track changes to this through ActiveChanged */
+		si = g_hash_table_lookup (cit->session_objpath_to_session_info, ci->session_objpath);
+		if (si != NULL) {
+			ci->in_active_session = si->is_active;
+			ci->is_local = si->is_local;
+			*step = CI_STEP_DONE;
+			break;
+		}
+
+		message = dbus_message_new_method_call ("org.freedesktop.ConsoleKit", 
+							ci->session_objpath,
+							"org.freedesktop.ConsoleKit.Session",
+							"IsActive");
+		break;
+
+	case CI_STEP_IS_LOCAL:
+		message = dbus_message_new_method_call ("org.freedesktop.ConsoleKit", 
+							ci->session_objpath,
+							"org.freedesktop.ConsoleKit.Session",
+							"IsLocal");
+		break;
+#endif /* HAVE_CONKIT */
+
+	default:
+		break;
+	}
+
+	return message;
+}
+
+/* Take the answer to @step from @reply, or handle @error if the call
+ * failed. Returns the next step. */
+static CIStep
+ci_step_handle_reply (CITracker *cit, CICallerInfo *ci, CIStep step, DBusMessage *reply, DBusError *error)
+{
+	DBusMessageIter iter;
+#ifdef HAVE_CONKIT
 	DBusMessageIter sub_iter;
 	char *dbus_session_name;
         char *str;
         int num_elems;
+#endif
+
+	switch (step) {
+	case CI_STEP_UID:
+		if (reply == NULL || dbus_error_is_set (error)) {
+			HAL_WARNING (("Could not get uid for connection: %s %s", error->name, error->message));
+			return CI_STEP_FAILED;
+		}
+		dbus_message_iter_init (reply, &iter);
+		if (dbus_message_iter_get_arg_type (&iter) != DBUS_TYPE_UINT32) {
+			HAL_WARNING (("Could not get uid for connection: malformed reply"));
+			return CI_STEP_FAILED;
+		}
+		{
+			dbus_uint32_t uid;
+
+			dbus_message_iter_get_basic (&iter, &uid);
+			ci->uid = uid;
+		}
+#ifdef HAVE_CONKIT
+		return CI_STEP_PID;
+#else
+		return CI_STEP_DONE;
+#endif
+
+#ifdef HAVE_CONKIT
+	case CI_STEP_PID:
+		if (reply == NULL || dbus_error_is_set (error)) {
+			HAL_WARNING (("Error doing GetConnectionUnixProcessID on Bus: %s: %s", error->name, error->message));
+			return CI_STEP_FAILED;
+		}
+		dbus_message_iter_init (reply, &iter);
+		dbus_message_iter_get_basic (&iter, &ci->pid);
+		ci->start_time = process_get_start_time (ci->pid);
+
+		/* seen this process before? */
+		process_info_lookup (cit, ci);
+		return CI_STEP_SELINUX_CONTEXT;
+
+	case CI_STEP_SELINUX_CONTEXT:
+		/* SELinux might not be enabled */
+		if (dbus_error_is_set (error) && 
+		    strcmp (error->name, "org.freedesktop.DBus.Error.SELinuxSecurityContextUnknown") == 0) {
+			return ci->session_known ? CI_STEP_IS_ACTIVE : CI_STEP_SESSION;
+		} else if (reply == NULL || dbus_error_is_set (error)) {
+			g_warning ("Error doing GetConnectionSELinuxSecurityContext on Bus: %s: %s", error->name, error->message);
+			return CI_STEP_FAILED;
+		}
+                /* TODO: verify signature */
+                dbus_message_iter_init (reply, &iter);
+                dbus_message_iter_recurse (&iter, &sub_iter);
+                dbus_message_iter_get_fixed_array (&sub_iter, (void *) &str, &num_elems);
+                if (str != NULL && num_elems > 0)
+                        ci->selinux_context = g_strndup (str, num_elems);
+		return ci->session_known ? CI_STEP_IS_ACTIVE : CI_STEP_SESSION;
+
+	case CI_STEP_SESSION:
+		if (reply == NULL || dbus_error_is_set (error)) {
+			HAL_WARNING (("Error doing GetSessionForUnixProcess on ConsoleKit: %s: %s", error->name, error->message));
+			/* OK, this is not a catastrophe; just means the caller is not a member of any session.. */
+			return CI_STEP_DONE;
+		}
+		dbus_message_iter_init (reply, &iter);
+		dbus_message_iter_get_basic (&iter, &dbus_session_name);
+		ci->session_objpath = g_strdup (dbus_session_name);
+		return CI_STEP_IS_ACTIVE;
+
+	case CI_STEP_IS_ACTIVE:
+		if (reply == NULL || dbus_error_is_set (error)) {
+			HAL_WARNING (("Error doing IsActive on ConsoleKit: %s: %s", error->name, error->message));
+			return CI_STEP_FAILED;
+		}
+		dbus_message_iter_init (reply, &iter);
+		dbus_message_iter_get_basic (&iter, &ci->in_active_session);
+		return CI_STEP_IS_LOCAL;
+
+	case CI_STEP_IS_LOCAL:
+		if (reply == NULL || dbus_error_is_set (error)) {
+			HAL_WARNING (("Error doing IsLocal on ConsoleKit: %s: %s", error->name, error->message));
+			return CI_STEP_FAILED;
+		}
+		dbus_message_iter_init (reply, &iter);
+		dbus_message_iter_get_basic (&iter, &ci->is_local);
+		return CI_STEP_DONE;
 #endif /* HAVE_CONKIT */
+
+	default:
+		return CI_STEP_FAILED;
+	}
+}
+
+/* put a complete CICallerInfo into the caches */
+static void
+ci_tracker_store (CITracker *cit, CICallerInfo *ci)
+{
+#ifdef HAVE_CONKIT
+	process_info_store (cit, ci);
+#endif
+	g_hash_table_insert (cit->connection_name_to_caller_info,
+			     ci->system_bus_unique_name,
+			     ci);
+}
+
+static void ci_lookup_advance (CILookup *lookup, CIStep step);
+
+static void
+ci_lookup_reply (DBusPendingCall *pending_call, void *user_data)
+{
+	CILookup *lookup = (CILookup *) user_data;
+	DBusMessage *reply;
+	DBusError error;
+	CIStep next;
+
+	dbus_error_init (&error);
+	reply = dbus_pending_call_steal_reply (pending_call);
+	if (reply != NULL && dbus_message_get_type (reply) == DBUS_MESSAGE_TYPE_ERROR)
+		dbus_set_error_from_message (&error, reply);
+
+	next = ci_step_handle_reply (lookup->cit, lookup->ci, lookup->step, reply, &error);
+
+	if (dbus_error_is_set (&error))
+		dbus_error_free (&error);
+	if (reply != NULL)
+		dbus_message_unref (reply);
+	dbus_pending_call_unref (pending_call);
+
+	ci_lookup_advance (lookup, next);
+}
+
+/* send the request for @step, or finish the lookup */
+static void
+ci_lookup_advance (CILookup *lookup, CIStep step)
+{
+	CITracker *cit = lookup->cit;
+	DBusMessage *message;
+	DBusPendingCall *pending_call;
+	CICallerInfo *ci;
+	GSList *l;
+
+	message = NULL;
+	if (step != CI_STEP_FAILED && step != CI_STEP_DONE)
+		message = ci_step_request (cit, lookup->ci, &step);
+
+	if (message != NULL) {
+		lookup->step = step;
+		pending_call = NULL;
+		if (cit->dbus_connection != NULL)
+			dbus_connection_send_with_reply (cit->dbus_connection, message, &pending_call, -1);
+		dbus_message_unref (message);
+
+		if (pending_call != NULL) {
+			dbus_pending_call_set_notify (pending_call, ci_lookup_reply, lookup, NULL);
+			return;
+		}
+
+		HAL_WARNING (("Could not ask the system bus about %s", lookup->ci->system_bus_unique_name));
+		step = CI_STEP_FAILED;
+	}
+
+	/* done; hand out the result */
+	ci = lookup->ci;
+	if (!lookup->cancelled)
+		g_hash_table_remove (cit->connection_name_to_lookup, ci->system_bus_unique_name);
+
+	if (step == CI_STEP_DONE && !lookup->cancelled) {
+		CICallerInfo *cached;
+
+		/* someone may have done a blocking lookup meanwhile */
+		cached = g_hash_table_lookup (cit->connection_name_to_caller_info, ci->system_bus_unique_name);
+		if (cached != NULL) {
+			caller_info_free (ci);
+			ci = cached;
+		} else {
+			ci_tracker_store (cit, ci);
+		}
+	} else {
+		caller_info_free (ci);
+		ci = NULL;
+	}
+
+	lookup->callbacks = g_slist_reverse (lookup->callbacks);
+	for (l = lookup->callbacks; l != NULL; l = l->next) {
+		CILookupCallback *callback = l->data;
+
+		callback->cb (cit, ci, callback->user_data);
+		g_free (callback);
+	}
+	g_slist_free (lookup->callbacks);
+	g_free (lookup);
+}
+
+/**
+ * ci_tracker_resolve_info:
+ * @cit:                       the tracker
+ * @system_bus_unique_name:    the caller
+ * @cb:                        called when the lookup finishes
+ * @user_data:                 passed to @cb
+ *
+ * Look up a caller without blocking. Callers that are already known
+ * return FALSE right away; use ci_tracker_get_info() for them. Otherwise
+ * the round trips to the bus and ConsoleKit are done asynchronously and
+ * @cb is invoked once they finish, with the CICallerInfo or NULL on
+ * failure. Concurrent requests for the same caller share one lookup and
+ * their callbacks run in the order they were requested.
+ *
+ * Returns: TRUE if @cb will be called
+ */
+gboolean
+ci_tracker_resolve_info (CITracker *cit, const char *system_bus_unique_name,
+                         CITrackerInfoCB cb, void *user_data)
+{
+	CILookup *lookup;
+	CILookupCallback *callback;
+
+	if (system_bus_unique_name == NULL || !validate_bus_name (system_bus_unique_name))
+		return FALSE;
+
+	if (g_hash_table_lookup (cit->connection_name_to_caller_info, system_bus_unique_name) != NULL)
+		return FALSE;
+
+	callback = g_new0 (CILookupCallback, 1);
+	callback->cb = cb;
+	callback->user_data = user_data;
+
+	lookup = g_hash_table_lookup (cit->connection_name_to_lookup, system_bus_unique_name);
+	if (lookup != NULL) {
+		lookup->callbacks = g_slist_prepend (lookup->callbacks, callback);
+		return TRUE;
+	}
+
+	lookup = g_new0 (CILookup, 1);
+	lookup->cit = cit;
+	lookup->ci = caller_info_new ();
+	lookup->ci->system_bus_unique_name = g_strdup (system_bus_unique_name);
+	lookup->callbacks = g_slist_prepend (NULL, callback);
+	g_hash_table_insert (cit->connection_name_to_lookup, lookup->ci->system_bus_unique_name, lookup);
+
+	ci_lookup_advance (lookup, CI_STEP_UID);
+	return TRUE;
+}
+
+/**
+ * ci_tracker_is_resolving:
+ * @cit:                       the tracker
+ * @system_bus_unique_name:    the caller
+ *
+ * Returns: TRUE if ci_tracker_resolve_info() is still looking up the caller
+ */
+gboolean
+ci_tracker_is_resolving (CITracker *cit, const char *system_bus_unique_name)
+{
+	if (system_bus_unique_name == NULL)
+		return FALSE;
+
+	return g_hash_table_lookup (cit->connection_name_to_lookup, system_bus_unique_name) != NULL;
+}
+
+CICallerInfo *
+ci_tracker_get_info (CITracker *cit, const char *system_bus_unique_name)
+{
+	CICallerInfo *ci;
+	DBusError error;
+	DBusMessage *message;
+	DBusMessage *reply;
+	CIStep step;
 	
 	ci = NULL;
 	
@@ -299,137 +873,22 @@ ci_tracker_get_info (CITracker *cit, const char *system_bus_unique_name)
 	ci = caller_info_new ();
 	ci->system_bus_unique_name = g_strdup (system_bus_unique_name);
 
-	dbus_error_init (&error);
-	ci->uid = dbus_bus_get_unix_user (cit->dbus_connection, system_bus_unique_name, &error);
-	if (ci->uid == ((unsigned long) -1) || dbus_error_is_set (&error)) {
-		HAL_WARNING (("Could not get uid for connection: %s %s", error.name, error.message));
-		dbus_error_free (&error);
-		goto error;
-	}
-
-#ifdef HAVE_CONKIT
-	message = dbus_message_new_method_call ("org.freedesktop.DBus", 
-						"/org/freedesktop/DBus/Bus",
-						"org.freedesktop.DBus",
-						"GetConnectionUnixProcessID");
-	dbus_message_iter_init_append (message, &iter);
-	dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &system_bus_unique_name);
-	dbus_error_init (&error);
-	reply = dbus_connection_send_with_reply_and_block (cit->dbus_connection, message, -1, &error);
-	if (reply == NULL || dbus_error_is_set (&error)) {
-		HAL_WARNING (("Error doing GetConnectionUnixProcessID on Bus: %s: %s", error.name, error.message));
+	/* same steps as ci_tracker_resolve_info(), but blocking */
+	step = CI_STEP_UID;
+	while ((message = ci_step_request (cit, ci, &step)) != NULL) {
+		dbus_error_init (&error);
+		reply = dbus_connection_send_with_reply_and_block (cit->dbus_connection, message, -1, &error);
+		step = ci_step_handle_reply (cit, ci, step, reply, &error);
 		dbus_message_unref (message);
 		if (reply != NULL)
 			dbus_message_unref (reply);
-		dbus_error_free (&error);
-		goto error;
+		if (dbus_error_is_set (&error))
+			dbus_error_free (&error);
+		if (step == CI_STEP_FAILED)
+			goto error;
 	}
-	dbus_message_iter_init (reply, &iter);
-	dbus_message_iter_get_basic (&iter, &ci->pid);
-	dbus_message_unref (message);
-	dbus_message_unref (reply);
-
-	message = dbus_message_new_method_call ("org.freedesktop.DBus", 
-						"/org/freedesktop/DBus/Bus",
-						"org.freedesktop.DBus",
-						"GetConnectionSELinuxSecurityContext");
-	dbus_message_iter_init_append (message, &iter);
-	dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &system_bus_unique_name);
-	reply = dbus_connection_send_with_reply_and_block (cit->dbus_connection, message, -1, &error);
-        /* SELinux might not be enabled */
-        if (dbus_error_is_set (&error) && 
-            strcmp (error.name, "org.freedesktop.DBus.Error.SELinuxSecurityContextUnknown") == 0) {
-                dbus_message_unref (message);
-		if (reply != NULL)
-			dbus_message_unref (reply);
-                dbus_error_init (&error);
-        } else if (reply == NULL || dbus_error_is_set (&error)) {
-                g_warning ("Error doing GetConnectionSELinuxSecurityContext on Bus: %s: %s", error.name, error.message);
-                dbus_message_unref (message);
-                if (reply != NULL)
-                        dbus_message_unref (reply);
-		dbus_error_free (&error);
-                goto error;
-        } else {
-                /* TODO: verify signature */
-                dbus_message_iter_init (reply, &iter);
-                dbus_message_iter_recurse (&iter, &sub_iter);
-                dbus_message_iter_get_fixed_array (&sub_iter, (void *) &str, &num_elems);
-                if (str != NULL && num_elems > 0)
-                        ci->selinux_context = g_strndup (str, num_elems);
-                dbus_message_unref (message);
-                dbus_message_unref (reply);
-        }
-
-
-	message = dbus_message_new_method_call ("org.freedesktop.ConsoleKit", 
-						"/org/freedesktop/ConsoleKit/Manager",
-						"org.freedesktop.ConsoleKit.Manager",
-						"GetSessionForUnixProcess");
-	dbus_message_iter_init_append (message, &iter);
-	dbus_message_iter_append_basic (&iter, DBUS_TYPE_UINT32, &ci->pid);
-	dbus_error_init (&error);
-	reply = dbus_connection_send_with_reply_and_block (cit->dbus_connection, message, -1, &error);
-	if (reply == NULL || dbus_error_is_set (&error)) {
-		HAL_WARNING (("Error doing GetSessionForUnixProcess on ConsoleKit: %s: %s", error.name, error.message));
-		dbus_message_unref (message);
-		if (reply != NULL)
-			dbus_message_unref (reply);
-		/* OK, this is not a catastrophe; just means the caller is not a member of any session.. */
-		dbus_error_free (&error);
-		goto store_caller_info;
-	}
-	dbus_message_iter_init (reply, &iter);
-	dbus_message_iter_get_basic (&iter, &dbus_session_name);
-	ci->session_objpath = g_strdup (dbus_session_name);
-	dbus_message_unref (message);
-	dbus_message_unref (reply);
-
-	message = dbus_message_new_method_call ("org.freedesktop.ConsoleKit", 
-						ci->session_objpath,
-						"org.freedesktop.ConsoleKit.Session",
-						"IsActive");
-	dbus_error_init (&error);
-	reply = dbus_connection_send_with_reply_and_block (cit->dbus_connection, message, -1, &error);
-	if (reply == NULL || dbus_error_is_set (&error)) {
-		HAL_WARNING (("Error doing IsActive on ConsoleKit: %s: %s", error.name, error.message));
-		dbus_message_unref (message);
-		if (reply != NULL)
-			dbus_message_unref (reply);
-		dbus_error_free (&error);
-		goto error;
-	}
-	dbus_message_iter_init (reply, &iter);
-	dbus_message_iter_get_basic (&iter, &ci->in_active_session);
-	dbus_message_unref (message);
-	dbus_message_unref (reply);
-
 
-	message = dbus_message_new_method_call ("org.freedesktop.ConsoleKit", 
-						ci->session_objpath,
-						"org.freedesktop.ConsoleKit.Session",
-						"IsLocal");
-	dbus_error_init (&error);
-	reply = dbus_connection_send_with_reply_and_block (cit->dbus_connection, message, -1, &error);
-	if (reply == NULL || dbus_error_is_set (&error)) {
-		HAL_WARNING (("Error doing IsLocal on ConsoleKit: %s: %s", error.name, error.message));
-		dbus_message_unref (message);
-		if (reply != NULL)
-			dbus_message_unref (reply);
-		dbus_error_free (&error);
-		goto error;
-	}
-	dbus_message_iter_init (reply, &iter);
-	dbus_message_iter_get_basic (&iter, &ci->is_local);
-	dbus_message_unref (message);
-	dbus_message_unref (reply);
-	
-store_caller_info:
-#endif /* HAVE_CONKIT */
-
-	g_hash_table_insert (cit->connection_name_to_caller_info,
-			     ci->system_bus_unique_name,
-			     ci);
+	ci_tracker_store (cit, ci);
 
 got_caller_info:
 	/*HAL_INFO (("system_bus_unique_name = %s", ci->system_bus_unique_name));
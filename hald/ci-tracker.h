@@ -41,6 +41,8 @@ typedef struct CITracker_s CITracker;
 struct CICallerInfo_s;
 typedef struct CICallerInfo_s CICallerInfo;
 
+typedef void (*CITrackerInfoCB) (CITracker *cit, CICallerInfo *ci, void *user_data);
+
 CITracker     *ci_tracker_new                          (void);
 void           ci_tracker_set_system_bus_connection    (CITracker        *cit, 
                                                         DBusConnection   *system_bus_connection);
@@ -54,10 +56,18 @@ void           ci_tracker_name_owner_changed           (CITracker        *cit,
 void           ci_tracker_active_changed               (CITracker        *cit,
                                                         const char       *session_objpath, 
                                                         gboolean          is_active);
+void           ci_tracker_session_removed              (CITracker        *cit,
+                                                        const char       *session_objpath);
 #endif
 
 CICallerInfo  *ci_tracker_get_info                     (CITracker        *cit,
                                                         const char       *system_bus_unique_name);
+gboolean       ci_tracker_resolve_info                 (CITracker        *cit,
+                                                        const char       *system_bus_unique_name,
+                                                        CITrackerInfoCB   cb,
+                                                        void             *user_data);
+gboolean       ci_tracker_is_resolving                 (CITracker        *cit,
+                                                        const char       *system_bus_unique_name);
 
 uid_t         ci_tracker_caller_get_uid                (CICallerInfo *ci);
 const char   *ci_tracker_caller_get_sysbus_unique_name (CICallerInfo *ci);
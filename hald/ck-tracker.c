@@ -797,6 +797,12 @@ ck_session_get_id (CKSession *session)
 	return g_path_get_basename (session->session_objpath);
 }
 
+const char *
+ck_session_get_objpath (CKSession *session)
+{
+	return session->session_objpath;
+}
+
 uid_t
 ck_session_get_user (CKSession *session)
 {
@@ -89,6 +89,7 @@ char 	   *ck_seat_get_id                        (CKSeat *seat);
 gboolean    ck_session_is_active                  (CKSession *session);
 CKSeat     *ck_session_get_seat                   (CKSession *session);
 char 	   *ck_session_get_id                     (CKSession *session);
+const char *ck_session_get_objpath                (CKSession *session);
 uid_t       ck_session_get_user                   (CKSession *session);
 gboolean    ck_session_is_local                   (CKSession *session);
 const char *ck_session_get_hostname               (CKSession *session);
@@ -43,13 +43,25 @@
 #include <expat.h>
 #include <glib.h>
 #include <config.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include "logger.h"
 #include "rule.h"
 
-static XML_Parser parser;
-static char s_error[256];
 static int haldc_verbose = 0;
+static int haldc_force = 0;
+
+/* fdi files are parsed by at most this many threads besides the main one */
+#define MAX_PARSE_THREADS 7
+
+/* the cache is built in memory and written out in one go */
+struct cache_buffer {
+	char		*data;
+	size_t		len;
+	size_t		size;
+};
 
 /* ctx of the current fdi file used for parsing */
 struct fdi_context {
@@ -57,7 +69,9 @@ struct fdi_context {
 	u_int32_t	match_at_depth[HAL_MAX_INDENT_DEPTH];
 	struct rule	rule;
 	off_t		position;
-	int		cache_fd;
+	struct cache_buffer *cb;
+	XML_Parser	parser;
+	char		error[256];
 };
 
 /* modified alphasort to count downwards */
@@ -176,23 +190,30 @@ get_merge_type (const char *str)
 #define ROUND32(len) ROUND(len, 4)
 #define RULES_ROUND(off) ROUND(off, __alignof__(struct rule))
 
-static void pad32_write(int fd, off_t offset, void *data, size_t len)
+/* make room for len bytes; anything not written is zero, like a hole in a file */
+static void cache_buffer_reserve(struct cache_buffer *cb, size_t len)
 {
-	ssize_t		result;
-	static char	pad[3] = {0, 0, 0};
+	size_t size;
 
-	lseek(fd, offset, SEEK_SET);
-	result = write(fd, data, len);
+	if (len <= cb->size)
+		return;
 
-	if (result != (ssize_t) len)
-		DIE(("Disk write error"));
+	for (size = MAX (cb->size, 4096); size < len; size *= 2)
+		;
+	cb->data = g_realloc(cb->data, size);
+	memset(cb->data + cb->size, 0, size - cb->size);
+	cb->size = size;
+}
 
-	if ((offset + len) & 0x03) {
-		result = write(fd, pad, 4 - ((offset + len) & 0x03));
+static void pad32_write(struct cache_buffer *cb, off_t offset, const void *data, size_t len)
+{
+	size_t end = ROUND32(offset + len);
 
-		if (result != (ssize_t) (4 - ((offset + len) & 0x03)))
-			DIE(("Disk write error"));
-	}
+	cache_buffer_reserve(cb, end);
+	memcpy(cb->data + offset, data, len);
+	memset(cb->data + offset + len, 0, end - (offset + len));
+	if (end > cb->len)
+		cb->len = end;
 }
 
 static void init_rule_struct(struct rule *rule)
@@ -216,8 +237,8 @@ static void store_key(struct fdi_context *fdi_ctx, const char *key)
 
 	fdi_ctx->rule.key_len = strlen(key) + 1;
 
-	pad32_write(fdi_ctx->cache_fd, fdi_ctx->position + sizeof(struct rule),
-	    (void*)key, fdi_ctx->rule.key_len);
+	pad32_write(fdi_ctx->cb, fdi_ctx->position + sizeof(struct rule),
+	    key, fdi_ctx->rule.key_len);
 
 	if (haldc_verbose)
 		HAL_INFO(("Storing key '%s' at rule=%08lx", key, fdi_ctx->position));
@@ -248,8 +269,8 @@ static void store_value(struct fdi_context *fdi_ctx, const char *value, size_t v
 		fdi_ctx->rule.value_len += value_len;
 	}
 
-	pad32_write(fdi_ctx->cache_fd, offset, (void*)value, value_len);
-	pad32_write(fdi_ctx->cache_fd, offset + value_len, "", 1);
+	pad32_write(fdi_ctx->cb, offset, value, value_len);
+	pad32_write(fdi_ctx->cb, offset + value_len, "", 1);
 
 	p = malloc(value_len + 1);
 
@@ -276,7 +297,7 @@ static void store_rule(struct fdi_context *fdi_ctx)
 		      ROUND32(fdi_ctx->rule.key_len) +
 		      ROUND32(fdi_ctx->rule.value_len));
 
-	pad32_write(fdi_ctx->cache_fd, fdi_ctx->position,
+	pad32_write(fdi_ctx->cb, fdi_ctx->position,
 		&fdi_ctx->rule, sizeof(struct rule));
 
 	if (haldc_verbose) {
@@ -311,9 +332,9 @@ static void set_jump_position(struct fdi_context *fdi_ctx)
 		DIE(("Rule depth underrun"));
 
 	fdi_ctx->depth--;
-	offset = RULES_ROUND(lseek(fdi_ctx->cache_fd, 0, SEEK_END));
+	offset = RULES_ROUND(fdi_ctx->cb->len);
 	offset32 = (u_int32_t)offset;
-	pad32_write(fdi_ctx->cache_fd,
+	pad32_write(fdi_ctx->cb,
 		fdi_ctx->match_at_depth[fdi_ctx->depth] + offsetof(struct rule, jump_position),
 		&offset32, sizeof(fdi_ctx->rule.jump_position));
 
@@ -336,15 +357,15 @@ start (void *data, const char *el, const char **attr)
 
 	init_rule_struct(&fdi_ctx->rule);
 	fdi_ctx->rule.rtype = get_rule_type(el);
-	fdi_ctx->position = RULES_ROUND(lseek(fdi_ctx->cache_fd, 0, SEEK_END));
+	fdi_ctx->position = RULES_ROUND(fdi_ctx->cb->len);
 	if (fdi_ctx->rule.rtype == RULE_UNKNOWN) return;
 
 	/* get key and attribute for current rule */
 	for (i = 0; attr[i] != NULL; i+=2) {
 		if (strcmp (attr[i], "key") == 0) {
 			if (fdi_ctx->rule.key_len > 0) {
-				snprintf (s_error, sizeof (s_error), "Bad rule: key already defined");
-				XML_StopParser (parser, FALSE);
+				snprintf (fdi_ctx->error, sizeof (fdi_ctx->error), "Bad rule: key already defined");
+				XML_StopParser (fdi_ctx->parser, FALSE);
 				return;
 			}
 
@@ -354,8 +375,8 @@ start (void *data, const char *el, const char **attr)
 		if (fdi_ctx->rule.rtype == RULE_SPAWN) {
 			if (strcmp(attr[i], "udi") == 0) {
 				if (fdi_ctx->rule.key_len > 0) {
-					snprintf (s_error, sizeof (s_error), "Bad rule: key already defined");
-					XML_StopParser (parser, FALSE);
+					snprintf (fdi_ctx->error, sizeof (fdi_ctx->error), "Bad rule: key already defined");
+					XML_StopParser (fdi_ctx->parser, FALSE);
 					return;
 				}
 
@@ -367,16 +388,16 @@ start (void *data, const char *el, const char **attr)
 		} else if (fdi_ctx->rule.rtype == RULE_MATCH) {
 
 			if (fdi_ctx->rule.key_len == 0) {
-				snprintf (s_error, sizeof (s_error), "Bad rule: value without a key");
-				XML_StopParser (parser, FALSE);
+				snprintf (fdi_ctx->error, sizeof (fdi_ctx->error), "Bad rule: value without a key");
+				XML_StopParser (fdi_ctx->parser, FALSE);
 				return;
 			}
 
 			fdi_ctx->rule.type_match = get_match_type(attr[i]);
 
 			if (fdi_ctx->rule.type_match == MATCH_UNKNOWN) {
-				snprintf (s_error, sizeof (s_error), "Bad rule: unknown type_match");
-				XML_StopParser (parser, FALSE);
+				snprintf (fdi_ctx->error, sizeof (fdi_ctx->error), "Bad rule: unknown type_match");
+				XML_StopParser (fdi_ctx->parser, FALSE);
 				return;
 			}
 
@@ -390,8 +411,8 @@ start (void *data, const char *el, const char **attr)
 			fdi_ctx->rule.type_merge = get_merge_type(attr[i + 1]);
 
 			if (fdi_ctx->rule.type_merge == MERGE_UNKNOWN) {
-				snprintf (s_error, sizeof (s_error), "Bad rule: unknown type_merge");
-				XML_StopParser (parser, FALSE);
+				snprintf (fdi_ctx->error, sizeof (fdi_ctx->error), "Bad rule: unknown type_merge");
+				XML_StopParser (fdi_ctx->parser, FALSE);
 				return;
 			}
 
@@ -400,8 +421,8 @@ start (void *data, const char *el, const char **attr)
 	}
 
 	if (fdi_ctx->rule.key_len == 0) {
-		snprintf (s_error, sizeof (s_error), "Bad rule: key not found");
-		XML_StopParser (parser, FALSE);
+		snprintf (fdi_ctx->error, sizeof (fdi_ctx->error), "Bad rule: key not found");
+		XML_StopParser (fdi_ctx->parser, FALSE);
 		return;
 	}
 
@@ -448,109 +469,105 @@ end (void *data, const char *el){
 
 	/* only valid if element is in the current context */
 	if (fdi_ctx->rule.rtype != rtype) {
-		snprintf (s_error, sizeof (s_error), "Unexpected tag '%s'", el);
-		XML_StopParser (parser, FALSE);
+		snprintf (fdi_ctx->error, sizeof (fdi_ctx->error), "Unexpected tag '%s'", el);
+		XML_StopParser (fdi_ctx->parser, FALSE);
 		return;
 	}
 	store_rule(fdi_ctx);
 }
 
+/* an fdi file to put in the cache */
+struct fdi_job {
+	gchar		*path;
+	u_int64_t	mtime;
+	u_int64_t	size;
+	/* the rules of the file, starting at offset 0 */
+	struct cache_buffer blob;
+	/* or the same from the previous cache, starting at offset base */
+	const char	*old_rules;
+	u_int32_t	old_base;
+	u_int32_t	old_len;
+	/* why the file is skipped; reported by the main thread, as
+	 * logging isn't thread safe */
+	gboolean	failed;
+	int		error_line;
+	gchar		*error;
+};
+
 /* decompile an fdi file into a list of rules as this is quicker than opening then each time we want to search */
-static int
-rules_add_fdi_file (const char *filename, int fd)
+static void
+rules_add_fdi_file (struct fdi_job *job)
 {
 	struct fdi_context *fdi_ctx;
 	char *buf;
 	gsize buflen;
 	int rc;
-	int ret;
 
-	ret = -1;
+	job->failed = TRUE;
 
-	if (!g_file_get_contents (filename, &buf, &buflen, NULL))
-		goto out;
+	if (!g_file_get_contents (job->path, &buf, &buflen, NULL))
+		return;
 
 	/* create new context */
 	fdi_ctx = g_new0 (struct fdi_context, 1);
-	memset(fdi_ctx, 0, sizeof(struct fdi_context));
 	init_rule_struct(&fdi_ctx->rule);
-	fdi_ctx->cache_fd = fd;
+	fdi_ctx->cb = &job->blob;
 
-	parser = XML_ParserCreate (NULL);
-	if (parser == NULL) {
-		HAL_ERROR (("Couldn't allocate memory for parser"));
+	fdi_ctx->parser = XML_ParserCreate (NULL);
+	if (fdi_ctx->parser == NULL) {
+		job->error = g_strdup ("Couldn't allocate memory for parser");
+		g_free (buf);
 		g_free (fdi_ctx);
-		goto out;
+		return;
 	}
-	XML_SetUserData (parser, fdi_ctx);
-	XML_SetElementHandler (parser, start, end);
-	XML_SetCharacterDataHandler (parser, cdata);
-	rc = XML_Parse (parser, buf, buflen, 1);
+	XML_SetUserData (fdi_ctx->parser, fdi_ctx);
+	XML_SetElementHandler (fdi_ctx->parser, start, end);
+	XML_SetCharacterDataHandler (fdi_ctx->parser, cdata);
+	rc = XML_Parse (fdi_ctx->parser, buf, buflen, 1);
 	if (rc == 0) {
-		if (XML_GetErrorCode (parser) == XML_ERROR_ABORTED) {
-			HAL_ERROR (("%s:%d: semantic error: %s",
-				    filename,
-				    (int) XML_GetCurrentLineNumber (parser),
-				    s_error));
-			syslog (LOG_ERR,
-				"error in fdi file %s:%d: %s",
-				filename,
-				(int) XML_GetCurrentLineNumber (parser),
-				s_error);
-
-		} else {
-			HAL_ERROR (("%s:%d: XML parse error: %s",
-				    filename,
-				    (int) XML_GetCurrentLineNumber (parser),
-				    XML_ErrorString (XML_GetErrorCode (parser))));
-			syslog (LOG_ERR,
-				"error in fdi file %s:%d: %s",
-				filename,
-				(int) XML_GetCurrentLineNumber (parser),
-				XML_ErrorString (XML_GetErrorCode (parser)));
-		}
-
-		XML_ParserFree (parser);
+		job->error_line = (int) XML_GetCurrentLineNumber (fdi_ctx->parser);
+		if (XML_GetErrorCode (fdi_ctx->parser) == XML_ERROR_ABORTED)
+			job->error = g_strdup_printf ("semantic error: %s", fdi_ctx->error);
+		else
+			job->error = g_strdup_printf ("XML parse error: %s",
+						      XML_ErrorString (XML_GetErrorCode (fdi_ctx->parser)));
+
+		XML_ParserFree (fdi_ctx->parser);
 		g_free (buf);
 		g_free (fdi_ctx);
-		goto out;
+		return;
 	}
-	XML_ParserFree (parser);
+	XML_ParserFree (fdi_ctx->parser);
 	g_free (buf);
 
 	/* insert last dummy rule into list */
 	init_rule_struct(&fdi_ctx->rule);
 	fdi_ctx->rule.rtype = RULE_EOF;
-	fdi_ctx->position = RULES_ROUND(lseek(fdi_ctx->cache_fd, 0, SEEK_END));
-	store_key(fdi_ctx, filename);
+	fdi_ctx->position = RULES_ROUND(fdi_ctx->cb->len);
+	store_key(fdi_ctx, job->path);
 	store_value(fdi_ctx, "", 0);
 	store_rule(fdi_ctx);
 	g_free (fdi_ctx);
-	ret = lseek(fd, 0, SEEK_END);
-out:
-	return ret;
-
+	job->failed = FALSE;
 }
 
 
-/* recurse a directory tree, searching and adding fdi files - returns
- * number of skipped fdi files or -1 on unrecoverable errors
+/* recurse a directory tree, searching for fdi files and adding them to
+ * jobs in the order they go into the cache - returns -1 on unrecoverable
+ * errors
  */
 static int
-rules_search_and_add_fdi_files (const char *dir, int fd)
+rules_search_fdi_files (const char *dir, GPtrArray *jobs)
 {
 	int i;
 	int num_entries;
 	struct dirent **name_list;
-	int num_skipped_fdi_files;
 
 	if (dir == NULL) {
 		HAL_ERROR (("Given 'dir' == NULL"));
 		goto error;
 	}
 
-	num_skipped_fdi_files = 0;
-
 	num_entries = scandir (dir, &name_list, NULL, _alphasort);
 	if (num_entries == -1) {
 		HAL_ERROR (("Cannot scan '%s': %s", dir, strerror (errno)));
@@ -561,59 +578,825 @@ rules_search_and_add_fdi_files (const char *dir, int fd)
 		int len;
 		char *filename;
 		gchar *full_path;
+		struct stat st;
 
 		filename = name_list[i]->d_name;
 		len = strlen (filename);
 		full_path = g_strdup_printf ("%s/%s", dir, filename);
-		if (g_file_test (full_path, (G_FILE_TEST_IS_REGULAR))) {
+		if (stat (full_path, &st) != 0) {
+			/* went away, or a dangling link */
+		} else if (S_ISREG (st.st_mode)) {
 			if (len >= 5 && strcmp(&filename[len - 4], ".fdi") == 0) {
-				int fdi_rules_size;
-				off_t offset_before;
-				offset_before = lseek (fd, 0, SEEK_CUR);
-				fdi_rules_size = rules_add_fdi_file (full_path, fd);
-				if (fdi_rules_size < 0) {
-					HAL_ERROR (("error processing fdi file '%s'", full_path));
-					/* try to just skip this file */
-					if (ftruncate (fd, offset_before) != 0) {
-						HAL_ERROR (("Cannot truncate rules fdi"));
-						goto error;
-					}
-					lseek (fd, 0, SEEK_END);
-					HAL_INFO (("skipped fdi file '%s'", full_path));
-					num_skipped_fdi_files++;
-				}
+				struct fdi_job *job;
+
+				job = g_new0 (struct fdi_job, 1);
+				job->path = full_path;
+				job->mtime = st.st_mtime;
+				job->size = st.st_size;
+				g_ptr_array_add (jobs, job);
+				full_path = NULL;
 			}
-		} else if (g_file_test (full_path, (G_FILE_TEST_IS_DIR)) && filename[0] != '.') {
-			int num_bytes;
-			char *dirname;
-			int ret;
-
-			num_bytes = len + strlen (dir) + 1 + 1;
-			dirname = (char *) malloc (num_bytes);
-			if (dirname == NULL)
-				break;
-
-			snprintf (dirname, num_bytes, "%s/%s", dir, filename);
-			ret = rules_search_and_add_fdi_files (dirname, fd);
-			if (ret == -1)
+		} else if (S_ISDIR (st.st_mode) && filename[0] != '.') {
+			if (rules_search_fdi_files (full_path, jobs) == -1) {
+				g_free (full_path);
 				goto error;
-			num_skipped_fdi_files += ret;
-			free (dirname);
+			}
 		}
 		g_free (full_path);
 		free (name_list[i]);
 	}
 
-	for (; i >= 0; i--) {
-		free (name_list[i]);
-	}
 	free (name_list);
 
-	return num_skipped_fdi_files;
+	return 0;
 error:
 	return -1;
 }
 
+/* the fdi files to parse, shared by the parser threads */
+struct fdi_pool {
+	GPtrArray	*jobs;
+	guint		next_job;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t	lock;
+#endif
+};
+
+static void *
+parse_thread (void *data)
+{
+	struct fdi_pool *pool = data;
+	struct fdi_job *job;
+	guint i;
+
+	for (;;) {
+#ifdef HAVE_PTHREAD
+		pthread_mutex_lock (&pool->lock);
+#endif
+		i = pool->next_job++;
+#ifdef HAVE_PTHREAD
+		pthread_mutex_unlock (&pool->lock);
+#endif
+		if (i >= pool->jobs->len)
+			break;
+
+		job = g_ptr_array_index (pool->jobs, i);
+		if (job->old_rules == NULL)
+			rules_add_fdi_file (job);
+	}
+	return NULL;
+}
+
+/* parse all fdi files that can't be taken from the old cache; the files
+ * are independent, so this is done by a few threads */
+static void
+rules_parse_fdi_files (GPtrArray *jobs)
+{
+	struct fdi_pool pool;
+#ifdef HAVE_PTHREAD
+	pthread_t threads[MAX_PARSE_THREADS];
+	long num_cpus;
+	guint num_threads;
+	guint i;
+#endif
+
+	pool.jobs = jobs;
+	pool.next_job = 0;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init (&pool.lock, NULL);
+
+	/* verbose output comes from the parser and the logger isn't thread safe */
+	num_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+	num_threads = haldc_verbose ? 0 : MIN (num_cpus > 1 ? (guint) num_cpus - 1 : 0, MAX_PARSE_THREADS);
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create (&threads[i], NULL, parse_thread, &pool) != 0)
+			break;
+	}
+	num_threads = i;
+#endif
+	/* help out; this also does all the work if no thread could be started */
+	parse_thread (&pool);
+#ifdef HAVE_PTHREAD
+	for (i = 0; i < num_threads; i++)
+		pthread_join (threads[i], NULL);
+
+	pthread_mutex_destroy (&pool.lock);
+#endif
+}
+
+/* Copy the rules of an fdi file to the end of the cache. Offsets in the
+ * rules are relative to where they were stored before, at old_base;
+ * operands of match rules are compiled again later.
+ */
+static u_int32_t
+rules_append (struct cache_buffer *cb, const char *rules, u_int32_t len, u_int32_t old_base)
+{
+	u_int32_t base;
+	u_int32_t pos;
+
+	base = RULES_ROUND(cb->len);
+	pad32_write (cb, base, rules, len);
+
+	for (pos = 0; pos < len; ) {
+		struct rule *rule = (struct rule *) (cb->data + base + pos);
+
+		if (rule->rule_size == 0)
+			DIE(("Invalid rule size in rule %08x", base + pos));
+
+		if (rule->jump_position != 0)
+			rule->jump_position = rule->jump_position - old_base + base;
+		/* rules without a value point at the empty string in the header */
+		if (rule->value_len != 0)
+			rule->value_offset = rule->value_offset - old_base + base;
+		rule->match_offset = 0;
+
+		pos += rule->rule_size;
+	}
+
+	return base;
+}
+
+/* add the fdi files of a section to the cache, in order - returns number
+ * of skipped fdi files */
+static int
+rules_add_fdi_files (struct cache_buffer *cb, GPtrArray *jobs, guint from, guint to,
+		     GArray *files)
+{
+	int num_skipped_fdi_files;
+	guint i;
+
+	num_skipped_fdi_files = 0;
+
+	for (i = from; i < to; i++) {
+		struct fdi_job *job = g_ptr_array_index (jobs, i);
+		struct cache_fdi_file file;
+
+		memset (&file, 0, sizeof (struct cache_fdi_file));
+		if (job->old_rules != NULL) {
+			file.start = rules_append (cb, job->old_rules, job->old_len, job->old_base);
+			file.end = file.start + job->old_len;
+		} else if (!job->failed) {
+			file.start = rules_append (cb, job->blob.data, job->blob.len, 0);
+			file.end = file.start + job->blob.len;
+		} else {
+			if (job->error != NULL) {
+				HAL_ERROR (("%s:%d: %s", job->path, job->error_line, job->error));
+				syslog (LOG_ERR, "error in fdi file %s:%d: %s",
+					job->path, job->error_line, job->error);
+			}
+			HAL_ERROR (("error processing fdi file '%s'", job->path));
+			/* try to just skip this file */
+			HAL_INFO (("skipped fdi file '%s'", job->path));
+			num_skipped_fdi_files++;
+			continue;
+		}
+
+		file.mtime = job->mtime;
+		file.size = job->size;
+		/* the name is filled in once the rules are all in place */
+		file.name = i;
+		g_array_append_val (files, file);
+	}
+
+	return num_skipped_fdi_files;
+}
+
+static void
+fdi_job_free (struct fdi_job *job)
+{
+	g_free (job->path);
+	g_free (job->blob.data);
+	g_free (job->error);
+	g_free (job);
+}
+
+/* Check that the rules of an fdi file in the old cache can be copied:
+ * every rule lies inside [start,end) and what it points to does too.
+ * A damaged old cache then means parsing the file again rather than
+ * writing a broken cache.
+ */
+static gboolean
+rules_old_file_ok (const gchar *old, const struct cache_fdi_file *file)
+{
+	u_int32_t pos;
+	rule_type rtype = RULE_UNKNOWN;
+
+	if (file->start % __alignof__ (struct rule) != 0)
+		return FALSE;
+
+	for (pos = file->start; pos < file->end; ) {
+		const struct rule *rule = (const struct rule *) (old + pos);
+
+		if (file->end - pos < sizeof (struct rule))
+			return FALSE;
+		/* the padding after the last rule isn't part of the file */
+		if (rule->rule_size < sizeof (struct rule) ||
+		    rule->rule_size % __alignof__ (struct rule) != 0 ||
+		    rule->rule_size > RULES_ROUND (file->end) - pos ||
+		    rule->key_len == 0 || rule->key_len > file->end - pos - sizeof (struct rule))
+			return FALSE;
+		if (rule->jump_position != 0 &&
+		    (rule->jump_position < file->start || rule->jump_position > file->end))
+			return FALSE;
+		if (rule->value_len != 0 &&
+		    (rule->value_offset < file->start || rule->value_offset >= file->end ||
+		     rule->value_len > file->end - rule->value_offset))
+			return FALSE;
+
+		rtype = rule->rtype;
+		pos += rule->rule_size;
+	}
+
+	/* every file ends with its RULE_EOF */
+	return rtype == RULE_EOF;
+}
+
+/* Take the rules of every fdi file that didn't change since the cache was
+ * last generated from that cache. Returns the contents of the old cache,
+ * which the jobs point into, or NULL.
+ */
+static gchar *
+rules_reuse_old_cache (const char *cachename, GPtrArray *jobs)
+{
+	struct cache_header *header;
+	const struct cache_fdi_file *files;
+	GHashTable *by_path;
+	struct stat st;
+	gchar *old;
+	gsize len;
+	guint num_reused;
+	u_int32_t i;
+
+	/* a file changed in the same second as the old cache was written
+	 * may have changed after it, so only trust older ones */
+	if (stat (cachename, &st) != 0)
+		return NULL;
+	if (!g_file_get_contents (cachename, &old, &len, NULL))
+		return NULL;
+
+	header = (struct cache_header *) old;
+	if (len < sizeof (struct cache_header) ||
+	    header->version != RULES_CACHE_VERSION ||
+	    header->all_rules_size > len ||
+	    header->fdi_files > len ||
+	    header->num_fdi_files > (len - header->fdi_files) / sizeof (struct cache_fdi_file) ||
+	    header->fdi_files % __alignof__ (struct cache_fdi_file) != 0) {
+		g_free (old);
+		return NULL;
+	}
+
+	files = (const struct cache_fdi_file *) (old + header->fdi_files);
+	by_path = g_hash_table_new (g_str_hash, g_str_equal);
+	for (i = 0; i < header->num_fdi_files; i++) {
+		if (files[i].start < files[i].end &&
+		    files[i].end <= header->all_rules_size &&
+		    files[i].name < len &&
+		    memchr (old + files[i].name, '\0', len - files[i].name) != NULL)
+			g_hash_table_insert (by_path, old + files[i].name, (gpointer) &files[i]);
+	}
+
+	num_reused = 0;
+	for (i = 0; i < jobs->len; i++) {
+		struct fdi_job *job = g_ptr_array_index (jobs, i);
+		const struct cache_fdi_file *file;
+
+		file = g_hash_table_lookup (by_path, job->path);
+		if (file != NULL && file->mtime == job->mtime && file->size == job->size &&
+		    job->mtime < (u_int64_t) st.st_mtime) {
+			if (!rules_old_file_ok (old, file)) {
+				HAL_WARNING (("Rules of '%s' in the old cache are damaged, parsing it again", job->path));
+				continue;
+			}
+			job->old_rules = old + file->start;
+			job->old_base = file->start;
+			job->old_len = file->end - file->start;
+			num_reused++;
+		}
+	}
+	g_hash_table_destroy (by_path);
+
+	if (haldc_verbose)
+		HAL_INFO (("reusing %d of %d fdi files from the old cache", num_reused, jobs->len));
+
+	return old;
+}
+
+/* a key of the index while it is being built */
+struct index_key {
+	const char	*key;
+	u_int32_t	key_offset;
+	GArray		*any;		/* block numbers */
+	GHashTable	*values;	/* value string -> struct index_value */
+};
+
+struct index_value {
+	const char	*value;
+	u_int32_t	value_offset;
+	GArray		*blocks;	/* block numbers */
+};
+
+/* whether a failing match of this type implies the property is missing */
+static gboolean
+match_needs_property (const struct rule *rule, const char *value)
+{
+	switch (rule->type_match) {
+	case MATCH_EXISTS:
+		return strcmp (value, "false") != 0;
+	case MATCH_STRING:
+	case MATCH_INT:
+	case MATCH_UINT64:
+	case MATCH_BOOL:
+	case MATCH_DOUBLE:
+	case MATCH_EMPTY:
+	case MATCH_ISASCII:
+	case MATCH_IS_ABS_PATH:
+	case MATCH_CONTAINS:
+	case MATCH_CONTAINS_NCASE:
+	case MATCH_PREFIX:
+	case MATCH_PREFIX_NCASE:
+	case MATCH_SUFFIX:
+	case MATCH_SUFFIX_NCASE:
+	case MATCH_COMPARE_LT:
+	case MATCH_COMPARE_LE:
+	case MATCH_COMPARE_GT:
+	case MATCH_COMPARE_GE:
+	case MATCH_COMPARE_NE:
+	case MATCH_CONTAINS_OUTOF:
+	case MATCH_INT_OUTOF:
+	case MATCH_PREFIX_OUTOF:
+	case MATCH_STRING_OUTOF:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+static void
+index_key_free (gpointer data)
+{
+	struct index_key *ik = data;
+
+	g_array_free (ik->any, TRUE);
+	g_hash_table_destroy (ik->values);
+	g_free (ik);
+}
+
+static void
+index_value_free (gpointer data)
+{
+	struct index_value *iv = data;
+
+	g_array_free (iv->blocks, TRUE);
+	g_free (iv);
+}
+
+static void
+index_collect_key (gpointer key, gpointer value, gpointer user_data)
+{
+	g_ptr_array_add ((GPtrArray *) user_data, value);
+}
+
+static int
+index_key_compare (const void *a, const void *b)
+{
+	const struct index_key *ka = *(const struct index_key **) a;
+	const struct index_key *kb = *(const struct index_key **) b;
+
+	return strcmp (ka->key, kb->key);
+}
+
+static int
+index_value_compare (const void *a, const void *b)
+{
+	const struct index_value *va = *(const struct index_value **) a;
+	const struct index_value *vb = *(const struct index_value **) b;
+
+	return strcmp (va->value, vb->value);
+}
+
+/* append data to the cache file and return its offset */
+static u_int32_t
+index_append (struct cache_buffer *cb, void *data, size_t len)
+{
+	off_t offset;
+
+	offset = ROUND32(cb->len);
+	if (len > 0)
+		pad32_write (cb, offset, data, len);
+	return (u_int32_t) offset;
+}
+
+/**
+ * rules_build_index:
+ * @cb:		the cache
+ * @start:	offset of the first rule of the section
+ * @end:	offset just after the last rule of the section
+ *
+ * Returns:	offset of the struct cache_index written for the section
+ *
+ * Split a section into top-level blocks and file each block under the key
+ * (and for string matches the value) of its outermost match.
+ */
+static u_int32_t
+rules_build_index (struct cache_buffer *cb, u_int32_t start, u_int32_t end)
+{
+	struct cache_index index;
+	char *buf;
+	size_t len;
+	u_int32_t pos;
+	GArray *blocks;
+	GArray *unindexed;
+	GHashTable *keys;
+	GPtrArray *sorted_keys;
+	struct cache_index_key *key_table;
+	u_int32_t n;
+	u_int32_t i;
+	u_int32_t num_indexed;
+
+	len = end - start;
+	buf = g_malloc (MAX (len, 1));
+	memcpy (buf, cb->data + start, len);
+
+	blocks = g_array_new (FALSE, FALSE, sizeof (u_int32_t));
+	unindexed = g_array_new (FALSE, FALSE, sizeof (u_int32_t));
+	keys = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, index_key_free);
+	num_indexed = 0;
+
+	for (pos = start; pos < end; ) {
+		struct rule *rule = (struct rule *) (buf + (pos - start));
+		const char *value;
+		struct index_key *ik;
+		struct index_value *iv;
+
+		n = blocks->len;
+		g_array_append_val (blocks, pos);
+
+		if (rule->rtype != RULE_MATCH) {
+			/* nothing to do for the end of an fdi file */
+			if (rule->rtype != RULE_EOF)
+				g_array_append_val (unindexed, n);
+			pos += rule->rule_size;
+			continue;
+		}
+
+		if (rule->jump_position <= pos || rule->jump_position > end)
+			DIE(("Invalid jump position in rule %08x", pos));
+
+		value = rule->value_offset >= start ? buf + (rule->value_offset - start) : "";
+
+		/* key paths like '@info.parent:foo' refer to another device */
+		if (strchr (rule->key, ':') != NULL || !match_needs_property (rule, value)) {
+			g_array_append_val (unindexed, n);
+			pos = rule->jump_position;
+			continue;
+		}
+
+		ik = g_hash_table_lookup (keys, rule->key);
+		if (ik == NULL) {
+			ik = g_new0 (struct index_key, 1);
+			ik->key = rule->key;
+			ik->key_offset = pos + offsetof (struct rule, key);
+			ik->any = g_array_new (FALSE, FALSE, sizeof (u_int32_t));
+			ik->values = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, index_value_free);
+			g_hash_table_insert (keys, (gpointer) ik->key, ik);
+		}
+
+		if (rule->type_match == MATCH_STRING) {
+			iv = g_hash_table_lookup (ik->values, value);
+			if (iv == NULL) {
+				iv = g_new0 (struct index_value, 1);
+				iv->value = value;
+				iv->value_offset = rule->value_offset;
+				iv->blocks = g_array_new (FALSE, FALSE, sizeof (u_int32_t));
+				g_hash_table_insert (ik->values, (gpointer) iv->value, iv);
+			}
+			g_array_append_val (iv->blocks, n);
+		} else {
+			g_array_append_val (ik->any, n);
+		}
+		num_indexed++;
+
+		pos = rule->jump_position;
+	}
+
+	memset (&index, 0, sizeof (struct cache_index));
+	index.num_blocks = blocks->len;
+	g_array_append_val (blocks, end);
+	index.blocks = index_append (cb, blocks->data, blocks->len * sizeof (u_int32_t));
+	index.num_unindexed = unindexed->len;
+	index.unindexed = index_append (cb, unindexed->data, unindexed->len * sizeof (u_int32_t));
+
+	sorted_keys = g_ptr_array_new ();
+	g_hash_table_foreach (keys, index_collect_key, sorted_keys);
+	qsort (sorted_keys->pdata, sorted_keys->len, sizeof (gpointer), index_key_compare);
+
+	key_table = g_new0 (struct cache_index_key, MAX (sorted_keys->len, 1));
+	for (i = 0; i < sorted_keys->len; i++) {
+		struct index_key *ik = g_ptr_array_index (sorted_keys, i);
+		struct cache_index_value *value_table;
+		GPtrArray *sorted_values;
+		u_int32_t j;
+
+		key_table[i].key = ik->key_offset;
+		key_table[i].num_any = ik->any->len;
+		key_table[i].any = index_append (cb, ik->any->data, ik->any->len * sizeof (u_int32_t));
+
+		sorted_values = g_ptr_array_new ();
+		g_hash_table_foreach (ik->values, index_collect_key, sorted_values);
+		qsort (sorted_values->pdata, sorted_values->len, sizeof (gpointer), index_value_compare);
+
+		value_table = g_new0 (struct cache_index_value, MAX (sorted_values->len, 1));
+		for (j = 0; j < sorted_values->len; j++) {
+			struct index_value *iv = g_ptr_array_index (sorted_values, j);
+
+			value_table[j].value = iv->value_offset;
+			value_table[j].num_blocks = iv->blocks->len;
+			value_table[j].blocks = index_append (cb, iv->blocks->data, iv->blocks->len * sizeof (u_int32_t));
+		}
+		key_table[i].num_values = sorted_values->len;
+		key_table[i].values = index_append (cb, value_table, sorted_values->len * sizeof (struct cache_index_value));
+
+		g_free (value_table);
+		g_ptr_array_free (sorted_values, TRUE);
+	}
+	index.num_keys = sorted_keys->len;
+	index.keys = index_append (cb, key_table, sorted_keys->len * sizeof (struct cache_index_key));
+
+	if (haldc_verbose)
+		HAL_INFO (("index: %d blocks, %d indexed under %d keys, %d unindexed",
+			   index.num_blocks, num_indexed, index.num_keys, index.num_unindexed));
+
+	g_free (key_table);
+	g_ptr_array_free (sorted_keys, TRUE);
+	g_hash_table_destroy (keys);
+	g_array_free (unindexed, TRUE);
+	g_array_free (blocks, TRUE);
+	g_free (buf);
+
+	return index_append (cb, &index, sizeof (struct cache_index));
+}
+
+/* append a string to the cache file and return its offset */
+static u_int32_t
+append_string (struct cache_buffer *cb, const char *s)
+{
+	return index_append (cb, (void *) s, strlen (s) + 1);
+}
+
+/* find a seed for which rule_hash() puts every value in a slot of its
+ * own, growing the table until there is one */
+static u_int32_t *
+build_perfect_hash (char **values, u_int32_t num_values, u_int32_t *size, u_int32_t *seed)
+{
+	u_int32_t *table;
+	u_int32_t n;
+	u_int32_t s;
+	u_int32_t i;
+
+	for (n = 2; n < 2 * num_values; n *= 2)
+		;
+	table = g_new (u_int32_t, n);
+
+	for (;;) {
+		for (s = 0; s < 256; s++) {
+			memset (table, 0, n * sizeof (u_int32_t));
+			for (i = 0; i < num_values; i++) {
+				u_int32_t slot = rule_hash (values[i], s) & (n - 1);
+
+				if (table[slot] != 0) {
+					/* a repeated value can share the slot */
+					if (strcmp (values[table[slot] - 1], values[i]) == 0)
+						continue;
+					break;
+				}
+				table[slot] = i + 1;
+			}
+			if (i == num_values) {
+				*size = n;
+				*seed = s;
+				return table;
+			}
+		}
+		n *= 2;
+		table = g_renew (u_int32_t, table, n);
+	}
+}
+
+/* decode the operands of a match rule the same way the daemon used to
+ * do it on every match, and append them to the cache file */
+static u_int32_t
+compile_match (struct cache_buffer *cb, u_int32_t pos, const struct rule *rule, const char *value)
+{
+	struct rule_match m;
+	off_t offset;
+
+	memset (&m, 0, sizeof (struct rule_match));
+
+	/* key paths like '@block.storage_device:storage.bus' */
+	if (strchr (rule->key, ':') != NULL) {
+		gchar **tokens;
+		struct rule_hop *hops;
+		u_int32_t i;
+
+		tokens = g_strsplit (rule->key, ":", 64);
+		m.num_hops = g_strv_length (tokens) - 1;
+		hops = g_new0 (struct rule_hop, m.num_hops);
+		for (i = 0; i < m.num_hops; i++) {
+			hops[i].indirect = tokens[i][0] == '@';
+			hops[i].name = append_string (cb, tokens[i] + hops[i].indirect);
+		}
+		m.prop = append_string (cb, tokens[m.num_hops]);
+		m.hops = index_append (cb, hops, m.num_hops * sizeof (struct rule_hop));
+		g_free (hops);
+		g_strfreev (tokens);
+	} else {
+		m.prop = pos + offsetof (struct rule, key);
+	}
+
+	switch (rule->type_match) {
+	case MATCH_INT:
+		m.number = (int) strtol (value, NULL, 0);
+		break;
+
+	case MATCH_UINT64:
+		m.number = (int64_t) strtol (value, NULL, 0);
+		break;
+
+	case MATCH_DOUBLE:
+		m.real = atof (value);
+		break;
+
+	case MATCH_COMPARE_LT:
+	case MATCH_COMPARE_LE:
+	case MATCH_COMPARE_GT:
+	case MATCH_COMPARE_GE:
+	case MATCH_COMPARE_NE:
+		m.number = strtoll (value, NULL, 0);
+		m.real = atof (value);
+		break;
+
+	case MATCH_BOOL:
+		if (strcmp (value, "false") == 0)
+			m.number = FALSE;
+		else if (strcmp (value, "true") == 0)
+			m.number = TRUE;
+		else
+			m.flags |= RULE_MATCH_NEVER;
+		break;
+
+	case MATCH_EXISTS:
+	case MATCH_EMPTY:
+	case MATCH_ISASCII:
+	case MATCH_IS_ABS_PATH:
+		if (strcmp (value, "false") == 0)
+			m.flags |= RULE_MATCH_NEGATE;
+		break;
+
+	case MATCH_CONTAINS_NCASE:
+	case MATCH_PREFIX_NCASE:
+	case MATCH_SUFFIX_NCASE:
+	{
+		gchar *lower;
+
+		lower = g_utf8_strdown (value, -1);
+		m.ncase_value = append_string (cb, lower);
+		g_free (lower);
+		break;
+	}
+
+	case MATCH_CONTAINS_OUTOF:
+	case MATCH_PREFIX_OUTOF:
+	case MATCH_STRING_OUTOF:
+	case MATCH_INT_OUTOF:
+	{
+		gchar **values;
+		u_int32_t *table;
+		u_int32_t num;
+		u_int32_t i;
+
+		values = g_strsplit (value, ";", 0);
+		num = g_strv_length (values);
+		table = g_new0 (u_int32_t, MAX (num, 1));
+		for (i = 0; i < num; i++) {
+			if (rule->type_match == MATCH_INT_OUTOF) {
+				long v = strtol (values[i], NULL, 0);
+
+				/* compared against an int32 property, so a value
+				 * out of range can never match */
+				if (v == (long) (int32_t) v)
+					table[m.num_values++] = (u_int32_t) (int32_t) v;
+			} else {
+				table[m.num_values++] = append_string (cb, values[i]);
+			}
+		}
+		m.values = index_append (cb, table, m.num_values * sizeof (u_int32_t));
+		g_free (table);
+
+		if (rule->type_match == MATCH_STRING_OUTOF && m.num_values > 0) {
+			table = build_perfect_hash (values, m.num_values, &m.hash_size, &m.hash_seed);
+			m.hash = index_append (cb, table, m.hash_size * sizeof (u_int32_t));
+			g_free (table);
+		}
+		g_strfreev (values);
+		break;
+	}
+
+	default:
+		break;
+	}
+
+	offset = ROUND (cb->len, __alignof__ (struct rule_match));
+	pad32_write (cb, offset, &m, sizeof (struct rule_match));
+	return (u_int32_t) offset;
+}
+
+/**
+ * rules_compile_matches:
+ * @cb:		the cache
+ * @start:	offset of the first rule of the section
+ * @end:	offset just after the last rule of the section
+ *
+ * Store the decoded operands of every match rule of a section and point
+ * the rules at them.
+ */
+static void
+rules_compile_matches (struct cache_buffer *cb, u_int32_t start, u_int32_t end)
+{
+	char *buf;
+	size_t len;
+	u_int32_t pos;
+	u_int32_t num_matches;
+
+	len = end - start;
+	buf = g_malloc (MAX (len, 1));
+	memcpy (buf, cb->data + start, len);
+
+	num_matches = 0;
+	for (pos = start; pos < end; ) {
+		struct rule *rule = (struct rule *) (buf + (pos - start));
+		const char *value;
+		u_int32_t match_offset;
+
+		if (rule->rule_size == 0)
+			DIE(("Invalid rule size in rule %08x", pos));
+
+		if (rule->rtype == RULE_MATCH) {
+			value = rule->value_offset >= start ? buf + (rule->value_offset - start) : "";
+			match_offset = compile_match (cb, pos, rule, value);
+			pad32_write (cb, pos + offsetof (struct rule, match_offset),
+				     &match_offset, sizeof (match_offset));
+			num_matches++;
+		}
+		pos += rule->rule_size;
+	}
+
+	if (haldc_verbose)
+		HAL_INFO (("compiled %d match rules", num_matches));
+
+	g_free (buf);
+}
+
+
+/* find the fdi files of a section, either in the directory given in the
+ * environment or in the default ones */
+static int
+rules_search_section (const char *source, const char *section, GPtrArray *jobs)
+{
+	gchar *dir;
+	int ret;
+
+	if (source != NULL)
+		return rules_search_fdi_files (source, jobs);
+
+	dir = g_strdup_printf ("%s/hal/fdi/%s", PACKAGE_DATA_DIR, section);
+	ret = rules_search_fdi_files (dir, jobs);
+	g_free (dir);
+	if (ret == -1)
+		return -1;
+
+	dir = g_strdup_printf ("%s/hal/fdi/%s", PACKAGE_SYSCONF_DIR, section);
+	ret = rules_search_fdi_files (dir, jobs);
+	g_free (dir);
+	return ret;
+}
+
+static gboolean
+write_all (int fd, const char *data, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write (fd, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return FALSE;
+		data += n;
+		len -= n;
+	}
+	return TRUE;
+}
 
 /* returns number of skipped fdi files or -1 on unrecoverable errors */
 static int
@@ -622,14 +1405,34 @@ di_rules_init (void)
 	char * cachename;
 	int fd = -1;
 	struct cache_header header;
-	gchar *cachename_temp;
-	char *hal_fdi_source_preprobe = getenv ("HAL_FDI_SOURCE_PREPROBE");
-	char *hal_fdi_source_information = getenv ("HAL_FDI_SOURCE_INFORMATION");
-	char *hal_fdi_source_policy = getenv ("HAL_FDI_SOURCE_POLICY");
-	int n;
+	struct cache_buffer cb;
+	gchar *cachename_temp = NULL;
+	gchar *old_cache = NULL;
+	const char *sources[3];
+	const char *sections[3] = {"preprobe", "information", "policy"};
+	u_int32_t *section_offsets[3];
+	guint section_ends[3];
+	GPtrArray *jobs;
+	GArray *files;
+	off_t offset;
 	int num_skipped_fdi_files;
+	int ret;
+	guint i;
 
 	num_skipped_fdi_files = 0;
+	ret = -1;
+
+	memset(&cb, 0, sizeof(struct cache_buffer));
+	memset(&header, 0, sizeof(struct cache_header));
+	jobs = g_ptr_array_new ();
+	files = g_array_new (FALSE, FALSE, sizeof (struct cache_fdi_file));
+
+	sources[0] = getenv ("HAL_FDI_SOURCE_PREPROBE");
+	sources[1] = getenv ("HAL_FDI_SOURCE_INFORMATION");
+	sources[2] = getenv ("HAL_FDI_SOURCE_POLICY");
+	section_offsets[0] = &header.fdi_rules_preprobe;
+	section_offsets[1] = &header.fdi_rules_information;
+	section_offsets[2] = &header.fdi_rules_policy;
 
 	cachename = getenv ("HAL_FDI_CACHE_NAME");
 	if(cachename == NULL)
@@ -637,62 +1440,69 @@ di_rules_init (void)
 	if (haldc_verbose)
 		HAL_INFO (("Loading rules"));
 
-	cachename_temp = g_strconcat (cachename, "~", NULL);
-
-	fd = open(cachename_temp, O_CREAT|O_RDWR|O_TRUNC, 0644);
-	if(fd < 0) {
-		HAL_ERROR (("Unable to open fdi cache '%s' file for writing: %s", cachename_temp, strerror(errno)));
-		goto error;
+	for (i = 0; i < 3; i++) {
+		if (rules_search_section (sources[i], sections[i], jobs) == -1)
+			goto error;
+		section_ends[i] = jobs->len;
 	}
 
-	memset(&header, 0, sizeof(struct cache_header));
-	pad32_write(fd, 0, &header, sizeof(struct cache_header));
+	/* only parse what changed since the last time */
+	if (!haldc_force)
+		old_cache = rules_reuse_old_cache (cachename, jobs);
+	rules_parse_fdi_files (jobs);
 
-	header.fdi_rules_preprobe = RULES_ROUND(lseek(fd, 0, SEEK_END));
-	if (hal_fdi_source_preprobe != NULL) {
-		if ((n = rules_search_and_add_fdi_files (hal_fdi_source_preprobe, fd)) == -1)
-			goto error;
-		num_skipped_fdi_files += n;
-	} else {
-		if ((n = rules_search_and_add_fdi_files (PACKAGE_DATA_DIR "/hal/fdi/preprobe", fd)) == -1)
-			goto error;
-		num_skipped_fdi_files += n;
-		if ((n = rules_search_and_add_fdi_files (PACKAGE_SYSCONF_DIR "/hal/fdi/preprobe", fd)) == -1)
-			goto error;
-		num_skipped_fdi_files += n;
-	}
+	pad32_write(&cb, 0, &header, sizeof(struct cache_header));
 
-	header.fdi_rules_information = RULES_ROUND(lseek(fd, 0, SEEK_END));
-	if (hal_fdi_source_information != NULL) {
-		if ((n = rules_search_and_add_fdi_files (hal_fdi_source_information, fd)) == -1)
-			goto error;
-		num_skipped_fdi_files += n;
-	} else {
-		if ((n = rules_search_and_add_fdi_files (PACKAGE_DATA_DIR "/hal/fdi/information", fd)) == -1)
-			goto error;
-		num_skipped_fdi_files += n;
-		if ((n = rules_search_and_add_fdi_files (PACKAGE_SYSCONF_DIR "/hal/fdi/information", fd)) == -1)
-			goto error;
-		num_skipped_fdi_files += n;
+	for (i = 0; i < 3; i++) {
+		*section_offsets[i] = RULES_ROUND(cb.len);
+		num_skipped_fdi_files += rules_add_fdi_files (&cb, jobs, i == 0 ? 0 : section_ends[i - 1],
+							      section_ends[i], files);
 	}
 
-	header.fdi_rules_policy = RULES_ROUND(lseek(fd, 0, SEEK_END));
-	if (hal_fdi_source_policy != NULL) {
-		if ((n = rules_search_and_add_fdi_files (hal_fdi_source_policy, fd)) == -1)
-			goto error;
-		num_skipped_fdi_files += n;
-	} else {
-		if ((n = rules_search_and_add_fdi_files (PACKAGE_DATA_DIR "/hal/fdi/policy", fd)) == -1)
-			goto error;
-		num_skipped_fdi_files += n;
-		if ((n = rules_search_and_add_fdi_files (PACKAGE_SYSCONF_DIR "/hal/fdi/policy", fd)) == -1)
-			goto error;
-		num_skipped_fdi_files += n;
+	header.all_rules_size = cb.len;
+
+	rules_compile_matches (&cb, header.fdi_rules_preprobe, header.fdi_rules_information);
+	rules_compile_matches (&cb, header.fdi_rules_information, header.fdi_rules_policy);
+	rules_compile_matches (&cb, header.fdi_rules_policy, header.all_rules_size);
+
+	header.fdi_index_preprobe = rules_build_index (&cb, header.fdi_rules_preprobe, header.fdi_rules_information);
+	header.fdi_index_information = rules_build_index (&cb, header.fdi_rules_information, header.fdi_rules_policy);
+	header.fdi_index_policy = rules_build_index (&cb, header.fdi_rules_policy, header.all_rules_size);
+
+	/* remember where the rules of each file are for the next time */
+	for (i = 0; i < files->len; i++) {
+		struct cache_fdi_file *file = &g_array_index (files, struct cache_fdi_file, i);
+		struct fdi_job *job = g_ptr_array_index (jobs, file->name);
+
+		file->name = append_string (&cb, job->path);
 	}
+	offset = ROUND (cb.len, __alignof__ (struct cache_fdi_file));
+	if (files->len > 0)
+		pad32_write (&cb, offset, files->data, files->len * sizeof (struct cache_fdi_file));
+	header.fdi_files = offset;
+	header.num_fdi_files = files->len;
+
+	header.version = RULES_CACHE_VERSION;
+	pad32_write(&cb, 0, &header, sizeof(struct cache_header));
 
-	header.all_rules_size = lseek(fd, 0, SEEK_END);
-	pad32_write(fd, 0, &header, sizeof(struct cache_header));
+	/* write it all at once, and replace the old cache atomically */
+	cachename_temp = g_strconcat (cachename, "~", NULL);
+	fd = open(cachename_temp, O_CREAT|O_WRONLY|O_TRUNC, 0644);
+	if(fd < 0) {
+		HAL_ERROR (("Unable to open fdi cache '%s' file for writing: %s", cachename_temp, strerror(errno)));
+		goto error;
+	}
+	if (!write_all (fd, cb.data, cb.len)) {
+		HAL_ERROR (("Cannot write fdi cache '%s': %s", cachename_temp, strerror(errno)));
+		goto error;
+	}
+	/* the new name must not point at data that isn't on disk yet */
+	if (fsync (fd) != 0) {
+		HAL_ERROR (("Cannot sync fdi cache '%s': %s", cachename_temp, strerror(errno)));
+		goto error;
+	}
 	close(fd);
+	fd = -1;
 	if (rename (cachename_temp, cachename) != 0) {
 		HAL_ERROR (("Cannot rename '%s' to '%s': %s", cachename_temp, cachename, strerror (errno)));
 		goto error;
@@ -708,16 +1518,25 @@ di_rules_init (void)
 		HAL_INFO (("Generating rules done (occupying %d bytes)", header.all_rules_size));
 	}
 
-	g_free (cachename_temp);
-	return num_skipped_fdi_files;
+	ret = num_skipped_fdi_files;
+	goto out;
+
 error:
 	HAL_ERROR (("Error generating fdi cache"));
 	if (fd >= 0)
 		close (fd);
+	if (cachename_temp != NULL)
+		unlink (cachename_temp);
 
-	unlink (cachename_temp);
+out:
 	g_free (cachename_temp);
-	return -1;
+	for (i = 0; i < jobs->len; i++)
+		fdi_job_free (g_ptr_array_index (jobs, i));
+	g_ptr_array_free (jobs, TRUE);
+	g_array_free (files, TRUE);
+	g_free (old_cache);
+	g_free (cb.data);
+	return ret;
 }
 
 /**
@@ -756,6 +1575,7 @@ int main(int argc, char * argv[])
 			{"help", 0, NULL, 0},
 			{"version", 0, NULL, 0},
 			{"verbose", 0, NULL, 0},
+			{"force", 0, NULL, 0},
 			{NULL, 0, NULL, 0}
 		};
 
@@ -776,6 +1596,8 @@ int main(int argc, char * argv[])
 				return 0;
 			} else if (strcmp (opt, "verbose") == 0) {
 				haldc_verbose = 1;
+			} else if (strcmp (opt, "force") == 0) {
+				haldc_force = 1;
 			}
 			break;
 
@@ -0,0 +1,487 @@
+/***************************************************************************
+ * CVSID: $Id$
+ *
+ * create_ids_cache.c : compile pci.ids and usb.ids into a binary cache
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ **************************************************************************/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <syslog.h>
+#include <glib.h>
+#include <config.h>
+
+#include "logger.h"
+#include "ids_cache.h"
+
+static int haldc_verbose = 0;
+
+/* a line of pci.ids / usb.ids before it is sorted into its table */
+struct ids_record {
+	guint32		parent;		/* vendor id for products, vendor << 16 | product for subsystems */
+	guint32		id;
+	guint32		name;
+	guint32		seq;		/* line order; keeps sorting stable */
+};
+
+/* string pool shared by all tables; offset 0 is the empty string */
+static GString *strings;
+
+static GArray *records[IDS_CACHE_NUM_TABLES];
+
+static gboolean
+parse_hex4 (const char *s, guint32 *result)
+{
+	int i;
+	guint32 val;
+
+	val = 0;
+	for (i = 0; i < 4; i++) {
+		/* the text parser in ids.c matches against "%04x" */
+		if (s[i] >= '0' && s[i] <= '9')
+			val = (val << 4) | (s[i] - '0');
+		else if (s[i] >= 'a' && s[i] <= 'f')
+			val = (val << 4) | (s[i] - 'a' + 10);
+		else
+			return FALSE;
+	}
+	*result = val;
+	return TRUE;
+}
+
+static void
+add_record (ids_cache_table_type table, guint32 parent, guint32 id,
+	    const char *line, unsigned int line_len, unsigned int name_start)
+{
+	struct ids_record r;
+	unsigned int i;
+
+	for (i = name_start; i < line_len; i++) {
+		if (!isspace (line[i]))
+			break;
+	}
+
+	r.parent = parent;
+	r.id = id;
+	r.name = strings->len;
+	r.seq = records[table]->len;
+	g_string_append_len (strings, line + i, line_len - i);
+	g_string_append_c (strings, '\0');
+
+	g_array_append_val (records[table], r);
+}
+
+/**
+ *  ids_parse:
+ *  @contents:           Text of pci.ids or usb.ids
+ *  @len:                Number of bytes in contents
+ *  @vendors:            Table for vendor lines
+ *  @products:           Table for product lines
+ *  @subsystems:         Table for subsystem lines or -1 to ignore them
+ *
+ *  Split an ids file into records. Lines are classified exactly like the
+ *  text lookups in ids.c do it, so that both give the same answers.
+ */
+static void
+ids_parse (const char *contents, gsize len,
+	   ids_cache_table_type vendors,
+	   ids_cache_table_type products,
+	   int subsystems)
+{
+	gsize pos;
+	gboolean have_vendor;
+	gboolean have_product;
+	guint32 vendor_id;
+	guint32 product_id;
+
+	have_vendor = FALSE;
+	have_product = FALSE;
+	vendor_id = 0;
+	product_id = 0;
+
+	for (pos = 0; pos < len; ) {
+		const char *line;
+		unsigned int line_len;
+		unsigned int num_tabs;
+		guint32 id;
+		guint32 id2;
+
+		line = contents + pos;
+		for (line_len = 0; pos < len && contents[pos] != '\n'; pos++)
+			line_len++;
+		pos++;
+
+		/* skip lines with no content and comments */
+		if (line_len < 4 || line[0] == '#')
+			continue;
+
+		for (num_tabs = 0; num_tabs < line_len && line[num_tabs] == '\t'; num_tabs++)
+			;
+
+		switch (num_tabs) {
+		case 0:
+			have_vendor = parse_hex4 (line, &vendor_id);
+			have_product = FALSE;
+			if (have_vendor)
+				add_record (vendors, 0, vendor_id, line, line_len, 4);
+			break;
+
+		case 1:
+			have_product = FALSE;
+			if (!have_vendor || line_len < 5)
+				break;
+			if (parse_hex4 (line + 1, &product_id)) {
+				have_product = TRUE;
+				add_record (products, vendor_id, product_id, line, line_len, 5);
+			}
+			break;
+
+		case 2:
+			if (subsystems < 0 || !have_product || line_len < 11)
+				break;
+			if (parse_hex4 (line + 2, &id) && parse_hex4 (line + 7, &id2))
+				add_record (subsystems, (vendor_id << 16) | product_id,
+					    (id << 16) | id2, line, line_len, 11);
+			break;
+
+		default:
+			break;
+		}
+	}
+}
+
+static gboolean
+ids_parse_file (const char *path, struct ids_cache_source *source,
+		ids_cache_table_type vendors,
+		ids_cache_table_type products,
+		int subsystems)
+{
+	struct stat statbuf;
+	gchar *contents;
+	gsize len;
+	GError *error;
+
+	memset (source, 0, sizeof (struct ids_cache_source));
+
+	if (stat (path, &statbuf) != 0) {
+		/* a missing database is cached as an empty one */
+		HAL_INFO (("Couldn't stat '%s': %s", path, strerror (errno)));
+		return TRUE;
+	}
+
+	error = NULL;
+	if (!g_file_get_contents (path, &contents, &len, &error)) {
+		HAL_ERROR (("Couldn't read '%s': %s", path, error->message));
+		g_error_free (error);
+		return FALSE;
+	}
+
+	source->mtime = statbuf.st_mtime;
+	source->size = statbuf.st_size;
+
+	ids_parse (contents, len, vendors, products, subsystems);
+	g_free (contents);
+
+	if (haldc_verbose)
+		HAL_INFO (("Parsed '%s': %d vendors, %d products", path,
+			   records[vendors]->len, records[products]->len));
+	return TRUE;
+}
+
+static int
+ids_record_compare (gconstpointer a, gconstpointer b)
+{
+	const struct ids_record *ra = a;
+	const struct ids_record *rb = b;
+
+	if (ra->parent != rb->parent)
+		return ra->parent < rb->parent ? -1 : 1;
+	if (ra->id != rb->id)
+		return ra->id < rb->id ? -1 : 1;
+	if (ra->seq != rb->seq)
+		return ra->seq < rb->seq ? -1 : 1;
+	return 0;
+}
+
+/* sort a table and drop duplicate ids, keeping the first occurrence */
+static void
+ids_sort (ids_cache_table_type table)
+{
+	GArray *a;
+	guint i;
+	guint n;
+
+	a = records[table];
+	if (a->len == 0)
+		return;
+
+	qsort (a->data, a->len, sizeof (struct ids_record), ids_record_compare);
+
+	for (i = 1, n = 1; i < a->len; i++) {
+		struct ids_record *prev = &g_array_index (a, struct ids_record, n - 1);
+		struct ids_record *cur = &g_array_index (a, struct ids_record, i);
+
+		if (cur->parent == prev->parent && cur->id == prev->id)
+			continue;
+		if (n != i)
+			g_array_index (a, struct ids_record, n) = *cur;
+		n++;
+	}
+	g_array_set_size (a, n);
+}
+
+/**
+ *  ids_build_table:
+ *  @table:              Table to convert
+ *  @children:           Table holding the children of @table or -1
+ *  @child_shift:        How far the parent key of the children is shifted
+ *
+ *  Returns:             Newly allocated array of entries
+ *
+ *  Convert the sorted records of a table into cache entries and link
+ *  each of them to its range in the (sorted) child table.
+ */
+static struct ids_cache_entry *
+ids_build_table (ids_cache_table_type table, int children, int child_shift)
+{
+	GArray *a;
+	GArray *c;
+	struct ids_cache_entry *entries;
+	guint i;
+	guint j;
+
+	a = records[table];
+	c = children >= 0 ? records[children] : NULL;
+	entries = g_new0 (struct ids_cache_entry, MAX (a->len, 1));
+
+	for (i = 0, j = 0; i < a->len; i++) {
+		struct ids_record *r = &g_array_index (a, struct ids_record, i);
+		guint32 key;
+
+		entries[i].id = r->id;
+		entries[i].name = r->name;
+
+		if (c == NULL)
+			continue;
+
+		key = (child_shift > 0 ? (r->parent << child_shift) : 0) | r->id;
+		while (j < c->len && g_array_index (c, struct ids_record, j).parent < key)
+			j++;
+		entries[i].first_child = j;
+		while (j < c->len && g_array_index (c, struct ids_record, j).parent == key)
+			j++;
+		entries[i].num_children = j - entries[i].first_child;
+	}
+
+	return entries;
+}
+
+static gboolean
+write_all (int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len > 0) {
+		ssize_t n;
+
+		n = write (fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return FALSE;
+		}
+		p += n;
+		len -= n;
+	}
+	return TRUE;
+}
+
+/* returns 0 on success, -1 on error */
+static int
+ids_cache_generate (void)
+{
+	char *cachename;
+	gchar *cachename_temp;
+	struct ids_cache_header header;
+	struct ids_cache_entry *entries[IDS_CACHE_NUM_TABLES];
+	guint32 offset;
+	int fd;
+	int n;
+
+	cachename = getenv ("HAL_IDS_CACHE_NAME");
+	if (cachename == NULL)
+		cachename = HALD_IDS_CACHE_FILE;
+
+	memset (&header, 0, sizeof (struct ids_cache_header));
+	header.magic = IDS_CACHE_MAGIC;
+	header.version = IDS_CACHE_VERSION;
+
+	strings = g_string_sized_new (256 * 1024);
+	g_string_append_c (strings, '\0');
+	for (n = 0; n < IDS_CACHE_NUM_TABLES; n++)
+		records[n] = g_array_new (FALSE, FALSE, sizeof (struct ids_record));
+
+#ifdef USE_PCI_IDS
+	if (!ids_parse_file (PCI_IDS_DIR "/pci.ids", &header.pci_source,
+			     IDS_CACHE_PCI_VENDORS, IDS_CACHE_PCI_PRODUCTS, IDS_CACHE_PCI_SUBSYSTEMS))
+		return -1;
+#endif
+#ifdef USE_USB_IDS
+	if (!ids_parse_file (USB_IDS_DIR "/usb.ids", &header.usb_source,
+			     IDS_CACHE_USB_VENDORS, IDS_CACHE_USB_PRODUCTS, -1))
+		return -1;
+#endif
+
+	for (n = 0; n < IDS_CACHE_NUM_TABLES; n++)
+		ids_sort (n);
+
+	entries[IDS_CACHE_PCI_VENDORS] = ids_build_table (IDS_CACHE_PCI_VENDORS, IDS_CACHE_PCI_PRODUCTS, 0);
+	entries[IDS_CACHE_PCI_PRODUCTS] = ids_build_table (IDS_CACHE_PCI_PRODUCTS, IDS_CACHE_PCI_SUBSYSTEMS, 16);
+	entries[IDS_CACHE_PCI_SUBSYSTEMS] = ids_build_table (IDS_CACHE_PCI_SUBSYSTEMS, -1, 0);
+	entries[IDS_CACHE_USB_VENDORS] = ids_build_table (IDS_CACHE_USB_VENDORS, IDS_CACHE_USB_PRODUCTS, 0);
+	entries[IDS_CACHE_USB_PRODUCTS] = ids_build_table (IDS_CACHE_USB_PRODUCTS, -1, 0);
+
+	offset = sizeof (struct ids_cache_header);
+	for (n = 0; n < IDS_CACHE_NUM_TABLES; n++) {
+		header.tables[n].offset = offset;
+		header.tables[n].num_entries = records[n]->len;
+		offset += records[n]->len * sizeof (struct ids_cache_entry);
+	}
+	header.strings_offset = offset;
+	header.strings_size = strings->len;
+
+	/* write to a temporary file and rename so hald never sees a partial cache */
+	cachename_temp = g_strconcat (cachename, "~", NULL);
+	fd = open (cachename_temp, O_CREAT|O_WRONLY|O_TRUNC, 0644);
+	if (fd < 0) {
+		HAL_ERROR (("Unable to open ids cache '%s' file for writing: %s", cachename_temp, strerror (errno)));
+		goto error;
+	}
+
+	if (!write_all (fd, &header, sizeof (struct ids_cache_header)))
+		goto error;
+	for (n = 0; n < IDS_CACHE_NUM_TABLES; n++) {
+		if (!write_all (fd, entries[n], records[n]->len * sizeof (struct ids_cache_entry)))
+			goto error;
+	}
+	if (!write_all (fd, strings->str, strings->len))
+		goto error;
+
+	if (close (fd) != 0) {
+		fd = -1;
+		goto error;
+	}
+	fd = -1;
+
+	if (rename (cachename_temp, cachename) != 0) {
+		HAL_ERROR (("Cannot rename '%s' to '%s': %s", cachename_temp, cachename, strerror (errno)));
+		goto error;
+	}
+
+	if (haldc_verbose)
+		HAL_INFO (("Generating ids cache done (occupying %d bytes)", offset + strings->len));
+
+	g_free (cachename_temp);
+	return 0;
+
+error:
+	HAL_ERROR (("Error generating ids cache: %s", strerror (errno)));
+	if (fd >= 0)
+		close (fd);
+	unlink (cachename_temp);
+	g_free (cachename_temp);
+	return -1;
+}
+
+/**
+ * usage:
+ *
+ * Print out program usage.
+ *
+ */
+static void
+usage (void)
+{
+	fprintf (stderr, "\n" "usage : hald-generate-ids-cache [OPTION]\n");
+	fprintf (stderr,
+		 "\n"
+		 "	--help		Show this information and exit.\n"
+		 "	--verbose	Show verbose processing output.\n"
+		 "	--version	Output version information and exit.\n"
+		 "\n"
+		 "hald-generate-ids-cache is a tool to generate a binary cache from\n"
+		 "the pci.ids and usb.ids databases.\n"
+		 "\n"
+		 "For more information visit http://freedesktop.org/Software/hal\n"
+		 "\n");
+}
+
+
+int main(int argc, char * argv[])
+{
+	openlog ("hald", LOG_PID, LOG_DAEMON);
+
+	while (1) {
+		int c;
+		int option_index = 0;
+		const char *opt;
+		static struct option long_options[] = {
+			{"help", 0, NULL, 0},
+			{"version", 0, NULL, 0},
+			{"verbose", 0, NULL, 0},
+			{NULL, 0, NULL, 0}
+		};
+
+		c = getopt_long (argc, argv, "",
+				 long_options, &option_index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 0:
+			opt = long_options[option_index].name;
+
+			if (strcmp (opt, "help") == 0) {
+				usage ();
+				return 0;
+			} else if (strcmp (opt, "version") == 0) {
+				fprintf (stderr, "HAL package version: " PACKAGE_VERSION "\n");
+				return 0;
+			} else if (strcmp (opt, "verbose") == 0) {
+				haldc_verbose = 1;
+			}
+			break;
+
+		default:
+			usage ();
+			return 1;
+			break;
+		}
+	}
+
+	return ids_cache_generate () == 0 ? 0 : 1;
+}
@@ -55,10 +55,63 @@ remove_from_locked_set (HalDevice *device)
         locked_devices = g_slist_remove (locked_devices, device);
 }
 
+/*
+ * Properties live in a per-device array sorted by key, in slots of 16
+ * bytes on 64 bit. Slots move when properties are added or removed, so a string is
+ * never kept in the slot itself: getters hand out string pointers that
+ * callers keep across such changes. Strings and the elements of string
+ * lists are instead shared between all devices with a reference count,
+ * as many of them ("true", subsystem and vendor names, capabilities, ...)
+ * occur on several devices.
+ */
+
+typedef struct {
+	guint refcount;
+	char str[1];
+} SharedString;
+
+/* string -> SharedString */
+static GHashTable *shared_strings = NULL;
+
+static const char *
+shared_string_ref (const char *str)
+{
+	SharedString *s;
+	size_t len;
+
+	if (shared_strings == NULL)
+		shared_strings = g_hash_table_new (g_str_hash, g_str_equal);
+
+	s = g_hash_table_lookup (shared_strings, str);
+	if (s == NULL) {
+		len = strlen (str);
+		s = g_malloc (G_STRUCT_OFFSET (SharedString, str) + len + 1);
+		s->refcount = 0;
+		memcpy (s->str, str, len + 1);
+		g_hash_table_insert (shared_strings, s->str, s);
+	}
+	s->refcount++;
+
+	return s->str;
+}
+
+static void
+shared_string_unref (const char *str)
+{
+	SharedString *s;
+
+	s = (SharedString *) (str - G_STRUCT_OFFSET (SharedString, str));
+	if (--s->refcount == 0) {
+		g_hash_table_remove (shared_strings, s->str);
+		g_free (s);
+	}
+}
+
 struct _HalProperty {
+	GQuark key;
 	int type;
 	union {
-		char *str_value;
+		const char *str_value;
 		dbus_int32_t int_value;
  		dbus_uint64_t uint64_value;
 		dbus_bool_t bool_value;
@@ -69,27 +122,25 @@ struct _HalProperty {
 typedef struct _HalProperty HalProperty;
 
 static inline void
-hal_property_free (HalProperty *prop)
+hal_property_strlist_free (GSList *strlist)
 {
-	if (prop->type == HAL_PROPERTY_TYPE_STRING) {
-		g_free (prop->v.str_value);
-	} else if (prop->type == HAL_PROPERTY_TYPE_STRLIST) {
-		GSList *i;
-		for (i = prop->v.strlist_value; i != NULL; i = g_slist_next (i)) {
-			g_free (i->data);
-		}
-		g_slist_free (prop->v.strlist_value);
-	}
-	g_slice_free (HalProperty, prop);
+	GSList *i;
+
+	for (i = strlist; i != NULL; i = g_slist_next (i))
+		shared_string_unref (i->data);
+	g_slist_free (strlist);
 }
 
-static inline HalProperty *
-hal_property_new (int type)
+/* release what the value of a slot refers to */
+static inline void
+hal_property_clear (HalProperty *prop)
 {
-	HalProperty *prop;
-	prop = g_slice_new0 (HalProperty);
-	prop->type = type;
-	return prop;
+	if (prop->type == HAL_PROPERTY_TYPE_STRING) {
+		if (prop->v.str_value != NULL)
+			shared_string_unref (prop->v.str_value);
+	} else if (prop->type == HAL_PROPERTY_TYPE_STRLIST) {
+		hal_property_strlist_free (prop->v.strlist_value);
+	}
 }
 
 static inline int
@@ -147,7 +198,7 @@ hal_property_to_string (HalProperty *prop)
 
 	switch (prop->type) {
 	case HAL_PROPERTY_TYPE_STRING:
-		return g_strdup (prop->v.str_value);
+		return g_strdup (hal_property_get_string (prop));
 	case HAL_PROPERTY_TYPE_INT32:
 		return g_strdup_printf ("%d", prop->v.int_value);
 	case HAL_PROPERTY_TYPE_UINT64:
@@ -193,27 +244,35 @@ static inline void
 hal_property_set_string (HalProperty *prop, const char *value)
 {
 	char *endchar;
-	gboolean validated = TRUE;
+	char *fixed;
+	const char *old;
 
 	g_return_if_fail (prop != NULL);
 	g_return_if_fail (prop->type == HAL_PROPERTY_TYPE_STRING ||
 			  prop->type == HAL_PROPERTY_TYPE_INVALID);
 
-	prop->type = HAL_PROPERTY_TYPE_STRING;
-	if (prop->v.str_value != NULL)
-		g_free (prop->v.str_value);
-	prop->v.str_value = g_strdup (value != NULL ? value : "");
-
-	while (!g_utf8_validate (prop->v.str_value, -1,
-				 (const char **) &endchar)) {
-		validated = FALSE;
-		*endchar = '?';
-	}
+	if (value == NULL)
+		value = "";
 
-	if (!validated) {
+	fixed = NULL;
+	if (!g_utf8_validate (value, -1, NULL)) {
+		fixed = g_strdup (value);
+		while (!g_utf8_validate (fixed, -1, (const char **) &endchar))
+			*endchar = '?';
 		HAL_WARNING (("Property has invalid UTF-8 string '%s', it was changed to: '%s'", 
-			      value, prop->v.str_value));
+			      value, fixed));
+		value = fixed;
 	}
+
+	/* drop the old value only after taking the new one, they may be the same */
+	old = prop->type == HAL_PROPERTY_TYPE_STRING ? prop->v.str_value : NULL;
+
+	prop->type = HAL_PROPERTY_TYPE_STRING;
+	prop->v.str_value = shared_string_ref (value);
+
+	if (old != NULL)
+		shared_string_unref (old);
+	g_free (fixed);
 }
 
 static inline void
@@ -262,7 +321,8 @@ hal_property_strlist_append (HalProperty *prop, const char *value)
 	g_return_val_if_fail (prop != NULL, FALSE);
 	g_return_val_if_fail (prop->type == HAL_PROPERTY_TYPE_STRLIST, FALSE);
 
-	prop->v.strlist_value = g_slist_append (prop->v.strlist_value, g_strdup (value));
+	prop->v.strlist_value = g_slist_append (prop->v.strlist_value,
+						(gpointer) shared_string_ref (value));
 
 	return TRUE;
 }
@@ -273,7 +333,8 @@ hal_property_strlist_prepend (HalProperty *prop, const char *value)
 	g_return_val_if_fail (prop != NULL, FALSE);
 	g_return_val_if_fail (prop->type == HAL_PROPERTY_TYPE_STRLIST, FALSE);
 
-	prop->v.strlist_value = g_slist_prepend (prop->v.strlist_value, g_strdup (value));
+	prop->v.strlist_value = g_slist_prepend (prop->v.strlist_value,
+						 (gpointer) shared_string_ref (value));
 
 	return TRUE;
 }
@@ -293,7 +354,7 @@ hal_property_strlist_remove_elem (HalProperty *prop, guint index)
 	if (elem == NULL)
 		return FALSE;
 
-	g_free (elem->data);
+	shared_string_unref (elem->data);
 	prop->v.strlist_value = g_slist_delete_link (prop->v.strlist_value, elem);
 	return TRUE;
 }
@@ -334,20 +395,21 @@ hal_property_strlist_remove (HalProperty *prop, const char *value)
 	return FALSE;
 }
 
-static inline gboolean 
-hal_property_strlist_clear (HalProperty *prop)
+/* Replace the list with a copy of @value; @value may be the current list */
+static inline void
+hal_property_strlist_set (HalProperty *prop, GSList *value)
 {
-	GSList *elem;
-
-	g_return_val_if_fail (prop != NULL, FALSE);
-	g_return_val_if_fail (prop->type == HAL_PROPERTY_TYPE_STRLIST, FALSE);
+	GSList *old;
+	GSList *l;
 
-	for (elem = prop->v.strlist_value; elem != NULL; elem = g_slist_next (elem)) {
-		g_free (elem->data);
-	}
-	g_slist_free (prop->v.strlist_value);
+	old = prop->v.strlist_value;
+	prop->v.strlist_value = NULL;
+	for (l = value; l != NULL; l = l->next)
+		prop->v.strlist_value = g_slist_prepend (prop->v.strlist_value,
+							 (gpointer) shared_string_ref (l->data));
+	prop->v.strlist_value = g_slist_reverse (prop->v.strlist_value);
 
-	return TRUE;
+	hal_property_strlist_free (old);
 }
 
 
@@ -362,7 +424,10 @@ struct _HalDevicePrivate
 	int num_addons;
 	int num_addons_ready;
 
-	GHashTable *props;
+	/* sorted by key */
+	HalProperty *props;
+	guint num_props;
+	guint props_size;
 };
 
 enum {
@@ -384,6 +449,7 @@ static void
 hal_device_finalize (GObject *obj)
 {
 	HalDevice *device = HAL_DEVICE (obj);
+	guint i;
 
 	runner_device_finalized (device);
 
@@ -396,7 +462,9 @@ hal_device_finalize (GObject *obj)
 
 	g_free (device->private->udi);
 
-	g_hash_table_destroy (device->private->props);
+	for (i = 0; i < device->private->num_props; i++)
+		hal_property_clear (&device->private->props[i]);
+	g_free (device->private->props);
 
 	g_free (device->private);
 
@@ -487,10 +555,9 @@ hal_device_init (HalDevice *device)
 	device->private->num_addons = 0;
 	device->private->num_addons_ready = 0;
 
-	device->private->props = g_hash_table_new_full (g_direct_hash,
-							g_direct_equal,
-							NULL,
-							(GDestroyNotify) hal_property_free);
+	device->private->props = NULL;
+	device->private->num_props = 0;
+	device->private->props_size = 0;
 }
 
 GType
@@ -533,18 +600,96 @@ hal_device_new (void)
 	return device;
 }
 
+/* Index of the property with the given key, or where it would go */
+static guint
+hal_device_property_index (HalDevice *device, GQuark key, gboolean *found)
+{
+	HalProperty *props = device->private->props;
+	guint low;
+	guint high;
+	guint mid;
+
+	low = 0;
+	high = device->private->num_props;
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (props[mid].key < key)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	*found = (low < device->private->num_props && props[low].key == key);
+	return low;
+}
+
 static inline HalProperty *
 hal_device_property_find (HalDevice *device, const char *key)
 {
-	GQuark quark = g_quark_try_string (key);
+	GQuark quark;
+	gboolean found;
+	guint i;
 
 	g_return_val_if_fail (device != NULL, NULL);
 	g_return_val_if_fail (key != NULL, NULL);
 
-	if (quark)
-	    return g_hash_table_lookup (device->private->props, GINT_TO_POINTER(quark));
-	else
-	    return NULL;
+	quark = g_quark_try_string (key);
+	if (!quark)
+		return NULL;
+
+	i = hal_device_property_index (device, quark, &found);
+	return found ? &device->private->props[i] : NULL;
+}
+
+/* Add a property that the device doesn't have yet; returns its slot,
+ * which is only valid until the next property is added or removed */
+static HalProperty *
+hal_device_property_add (HalDevice *device, const char *key, int type)
+{
+	HalDevicePrivate *priv = device->private;
+	HalProperty *prop;
+	GQuark quark;
+	gboolean found;
+	guint i;
+
+	quark = g_quark_from_string (key);
+	i = hal_device_property_index (device, quark, &found);
+	g_return_val_if_fail (!found, &priv->props[i]);
+
+	/* grow in small steps; most devices end up with a few dozen */
+	if (priv->num_props == priv->props_size) {
+		priv->props_size += 8;
+		priv->props = g_renew (HalProperty, priv->props, priv->props_size);
+	}
+
+	memmove (&priv->props[i + 1], &priv->props[i],
+		 (priv->num_props - i) * sizeof (HalProperty));
+	priv->num_props++;
+
+	prop = &priv->props[i];
+	memset (prop, 0, sizeof (HalProperty));
+	prop->key = quark;
+	prop->type = type;
+	return prop;
+}
+
+static gboolean
+hal_device_property_delete (HalDevice *device, GQuark key)
+{
+	HalDevicePrivate *priv = device->private;
+	gboolean found;
+	guint i;
+
+	i = hal_device_property_index (device, key, &found);
+	if (!found)
+		return FALSE;
+
+	hal_property_clear (&priv->props[i]);
+	priv->num_props--;
+	memmove (&priv->props[i], &priv->props[i + 1],
+		 (priv->num_props - i) * sizeof (HalProperty));
+
+	return TRUE;
 }
 
 typedef struct 
@@ -576,14 +721,15 @@ merge_device_rewrite_cb (HalDevice *source,
 
 	type = hal_device_property_get_type (source, key);
 
-	p = hal_device_property_find (source, key);
-
 	/* only remove target if it exists with a different type */
 	target_type = hal_device_property_get_type (ud->target, target_key);
 	if (target_type != HAL_PROPERTY_TYPE_INVALID && target_type != type) {
 		hal_device_property_remove (ud->target, target_key);
 	}
 
+	/* after the removal, which moves the slots if target is source */
+	p = hal_device_property_find (source, key);
+
 	switch (type) {
 	case HAL_PROPERTY_TYPE_STRING:
 		hal_device_property_set_string (ud->target, target_key, hal_property_get_string (p));
@@ -838,7 +984,7 @@ hal_device_num_properties (HalDevice *device)
 {
 	g_return_val_if_fail (device != NULL, -1);
 
-	return g_hash_table_size (device->private->props);
+	return device->private->num_props;
 }
 
 gboolean
@@ -862,43 +1008,28 @@ hal_device_property_to_string (HalDevice *device, const char *key)
 	return hal_property_to_string (prop);
 }
 
-typedef struct 
-{
-	HalDevice *device;
-	HalDevicePropertyForeachFn callback;
-	gpointer user_data;
-} hdpfe_ud_t;
-
-static void
-hdpfe (gpointer key,
-       gpointer value,
-       gpointer user_data)
-{
-	hdpfe_ud_t *c;
-	HalProperty *prop;
-	const gchar *key_string = g_quark_to_string ((GQuark) GPOINTER_TO_UINT(key));
-
-	c = (hdpfe_ud_t *) user_data;
-	prop = (HalProperty *) value;
-
-	c->callback (c->device, key_string, c->user_data);
-}
-
 void
 hal_device_property_foreach (HalDevice *device,
 			     HalDevicePropertyForeachFn callback,
 			     gpointer user_data)
 {
-	hdpfe_ud_t c;
+	GQuark key;
+	gboolean found;
+	guint i;
 
 	g_return_if_fail (device != NULL);
 	g_return_if_fail (callback != NULL);
 
-	c.device = device;
-	c.callback = callback;
-	c.user_data = user_data;
+	i = 0;
+	while (i < device->private->num_props) {
+		key = device->private->props[i].key;
+		callback (device, g_quark_to_string (key), user_data);
 
-	g_hash_table_foreach (device->private->props, hdpfe, &c);
+		/* the callback may have added or removed properties */
+		i = hal_device_property_index (device, key, &found);
+		if (found)
+			i++;
+	}
 }
 
 int
@@ -1083,18 +1214,20 @@ hal_device_property_set_string (HalDevice *device, const char *key,
 		g_signal_emit (device, signals[PRE_PROPERTY_CHANGED], 0,
 			       key, FALSE);
 
+		/* a handler may have added properties and moved the slot */
+		prop = hal_device_property_find (device, key);
+		if (prop == NULL)
+			return FALSE;
+
 		hal_property_set_string (prop, value);
 
 		g_signal_emit (device, signals[PROPERTY_CHANGED], 0,
 			       key, FALSE, FALSE);
 
 	} else {
-		prop = hal_property_new (HAL_PROPERTY_TYPE_STRING);
+		prop = hal_device_property_add (device, key, HAL_PROPERTY_TYPE_STRING);
 		hal_property_set_string (prop, value);
 
-		g_hash_table_insert (device->private->props,
-			GINT_TO_POINTER(g_quark_from_string (key)), prop);
-
 		g_signal_emit (device, signals[PROPERTY_CHANGED], 0,
 			       key, FALSE, TRUE);
 	}
@@ -1122,16 +1255,19 @@ hal_device_property_set_int (HalDevice *device, const char *key,
 		g_signal_emit (device, signals[PRE_PROPERTY_CHANGED], 0,
 			       key, FALSE);
 
+		/* a handler may have added properties and moved the slot */
+		prop = hal_device_property_find (device, key);
+		if (prop == NULL)
+			return FALSE;
+
 		hal_property_set_int (prop, value);
 
 		g_signal_emit (device, signals[PROPERTY_CHANGED], 0,
 			       key, FALSE, FALSE);
 
 	} else {
-		prop = hal_property_new (HAL_PROPERTY_TYPE_INT32);
+		prop = hal_device_property_add (device, key, HAL_PROPERTY_TYPE_INT32);
 		hal_property_set_int (prop, value);
-		g_hash_table_insert (device->private->props,
-			GINT_TO_POINTER(g_quark_from_string (key)), prop);
 
 		g_signal_emit (device, signals[PROPERTY_CHANGED], 0,
 			       key, FALSE, TRUE);
@@ -1160,16 +1296,19 @@ hal_device_property_set_uint64 (HalDevice *device, const char *key,
 		g_signal_emit (device, signals[PRE_PROPERTY_CHANGED], 0,
 			       key, FALSE);
 
+		/* a handler may have added properties and moved the slot */
+		prop = hal_device_property_find (device, key);
+		if (prop == NULL)
+			return FALSE;
+
 		hal_property_set_uint64 (prop, value);
 
 		g_signal_emit (device, signals[PROPERTY_CHANGED], 0,
 			       key, FALSE, FALSE);
 
 	} else {
-		prop = hal_property_new (HAL_PROPERTY_TYPE_UINT64);
+		prop = hal_device_property_add (device, key, HAL_PROPERTY_TYPE_UINT64);
 		hal_property_set_uint64 (prop, value);
-		g_hash_table_insert (device->private->props,
-			GINT_TO_POINTER(g_quark_from_string (key)), prop);
 
 		g_signal_emit (device, signals[PROPERTY_CHANGED], 0,
 			       key, FALSE, TRUE);
@@ -1198,16 +1337,19 @@ hal_device_property_set_bool (HalDevice *device, const char *key,
 		g_signal_emit (device, signals[PRE_PROPERTY_CHANGED], 0,
 			       key, FALSE);
 
+		/* a handler may have added properties and moved the slot */
+		prop = hal_device_property_find (device, key);
+		if (prop == NULL)
+			return FALSE;
+
 		hal_property_set_bool (prop, value);
 
 		g_signal_emit (device, signals[PROPERTY_CHANGED], 0,
 			       key, FALSE, FALSE);
 
 	} else {
-		prop = hal_property_new (HAL_PROPERTY_TYPE_BOOLEAN);
+		prop = hal_device_property_add (device, key, HAL_PROPERTY_TYPE_BOOLEAN);
 		hal_property_set_bool (prop, value);
-		g_hash_table_insert (device->private->props,
-			GINT_TO_POINTER(g_quark_from_string (key)), prop);
 
 		g_signal_emit (device, signals[PROPERTY_CHANGED], 0,
 			       key, FALSE, TRUE);
@@ -1236,16 +1378,19 @@ hal_device_property_set_double (HalDevice *device, const char *key,
 		g_signal_emit (device, signals[PRE_PROPERTY_CHANGED], 0,
 			       key, FALSE);
 
+		/* a handler may have added properties and moved the slot */
+		prop = hal_device_property_find (device, key);
+		if (prop == NULL)
+			return FALSE;
+
 		hal_property_set_double (prop, value);
 
 		g_signal_emit (device, signals[PROPERTY_CHANGED], 0,
 			       key, FALSE, FALSE);
 
 	} else {
-		prop = hal_property_new (HAL_PROPERTY_TYPE_DOUBLE);
+		prop = hal_device_property_add (device, key, HAL_PROPERTY_TYPE_DOUBLE);
 		hal_property_set_double (prop, value);
-		g_hash_table_insert (device->private->props,
-			GINT_TO_POINTER(g_quark_from_string (key)), prop);
 
 		g_signal_emit (device, signals[PROPERTY_CHANGED], 0,
 			       key, FALSE, TRUE);
@@ -1286,29 +1431,19 @@ hal_device_property_set_strlist (HalDevice *device, const char *key,
 		g_signal_emit (device, signals[PRE_PROPERTY_CHANGED], 0,
 			       key, FALSE);
 
-		/* TODO: check why  hal_property_strlist_clear (prop) not work and why
-		 *       we need to remove the key and a new one to get this running:
-		 *	 - multiple copy calls mixed with e.g. append rules   
-		 */
+		/* a handler may have added properties and moved the slot */
+		prop = hal_device_property_find (device, key);
+		if (prop == NULL)
+			return FALSE;
 
-		g_hash_table_remove (device->private->props, GINT_TO_POINTER(g_quark_from_string(key)));
-		prop = hal_property_new (HAL_PROPERTY_TYPE_STRLIST);
-		for (l = value ; l != NULL; l = l->next) {
-			hal_property_strlist_append (prop, l->data);
-		}
-		g_hash_table_insert (device->private->props, GINT_TO_POINTER(g_quark_from_string (key)),
-				     prop);
+		hal_property_strlist_set (prop, value);
 
 		g_signal_emit (device, signals[PROPERTY_CHANGED], 0,
 			       key, FALSE, FALSE);
 
 	} else {
-		prop = hal_property_new (HAL_PROPERTY_TYPE_STRLIST);
-		for (l = value ; l != NULL; l = l->next) {
-			hal_property_strlist_append (prop, l->data);
-		}
-		g_hash_table_insert (device->private->props, GINT_TO_POINTER(g_quark_from_string (key)),
-				     prop);
+		prop = hal_device_property_add (device, key, HAL_PROPERTY_TYPE_STRLIST);
+		hal_property_strlist_set (prop, value);
 
 		g_signal_emit (device, signals[PROPERTY_CHANGED], 0,
 			       key, FALSE, TRUE);
@@ -1362,12 +1497,11 @@ gboolean
 hal_device_property_remove (HalDevice *device, const char *key)
 {
 	GQuark quark = g_quark_try_string (key);
-	if (quark && g_hash_table_lookup (device->private->props, GINT_TO_POINTER(quark))) {
+	if (quark && hal_device_property_find (device, key) != NULL) {
 		g_signal_emit (device, signals[PRE_PROPERTY_CHANGED], 0,
 			       key, TRUE);
 
-		if (g_hash_table_remove (device->private->props,
-					 GINT_TO_POINTER(quark))) {
+		if (hal_device_property_delete (device, quark)) {
 			g_signal_emit (device, signals[PROPERTY_CHANGED], 0,
 				       key, TRUE, FALSE);
 			return TRUE;
@@ -1480,12 +1614,9 @@ hal_device_property_strlist_append (HalDevice    *device,
 				       key, FALSE, FALSE);
 
 	} else {
-		prop = hal_property_new (HAL_PROPERTY_TYPE_STRLIST);
+		prop = hal_device_property_add (device, key, HAL_PROPERTY_TYPE_STRLIST);
 		hal_property_strlist_append (prop, value);
 
-		g_hash_table_insert (device->private->props,
-			GINT_TO_POINTER(g_quark_from_string (key)), prop);
-
 		if (!changeset)
 			g_signal_emit (device, signals[PROPERTY_CHANGED], 0,
 				       key, FALSE, TRUE);
@@ -1539,12 +1670,9 @@ hal_device_property_strlist_prepend (HalDevice    *device,
 			       key, FALSE, FALSE);
 
 	} else {
-		prop = hal_property_new (HAL_PROPERTY_TYPE_STRLIST);
+		prop = hal_device_property_add (device, key, HAL_PROPERTY_TYPE_STRLIST);
 		hal_property_strlist_prepend (prop, value);
 
-		g_hash_table_insert (device->private->props,
-			GINT_TO_POINTER(g_quark_from_string (key)), prop);
-
 		g_signal_emit (device, signals[PROPERTY_CHANGED], 0,
 			       key, FALSE, TRUE);
 	}
@@ -1588,9 +1716,7 @@ hal_device_property_strlist_clear (HalDevice    *device,
 	prop = hal_device_property_find (device, key);
 
 	if (prop == NULL) {
-		prop = hal_property_new (HAL_PROPERTY_TYPE_STRLIST);
-		g_hash_table_insert (device->private->props,
-			GINT_TO_POINTER(g_quark_from_string (key)), prop);
+		prop = hal_device_property_add (device, key, HAL_PROPERTY_TYPE_STRLIST);
 
 		if (!changeset)
 			g_signal_emit (device, signals[PROPERTY_CHANGED], 0,
@@ -1601,10 +1727,7 @@ hal_device_property_strlist_clear (HalDevice    *device,
 	if (hal_property_get_type (prop) != HAL_PROPERTY_TYPE_STRLIST)
 		return FALSE;
 	
-        /* TODO: check why  hal_property_strlist_clear (prop) not work */ 
-	g_hash_table_remove (device->private->props, GINT_TO_POINTER(g_quark_from_string(key)));
-	prop = hal_property_new (HAL_PROPERTY_TYPE_STRLIST);
-	g_hash_table_insert (device->private->props, GINT_TO_POINTER(g_quark_from_string(key)), prop);
+	hal_property_strlist_set (prop, NULL);
 
 	if (!changeset) {
 		g_signal_emit (device, signals[PROPERTY_CHANGED], 0,
@@ -1639,12 +1762,9 @@ hal_device_property_strlist_add (HalDevice *device,
 		}
 
 	} else {
-		prop = hal_property_new (HAL_PROPERTY_TYPE_STRLIST);
+		prop = hal_device_property_add (device, key, HAL_PROPERTY_TYPE_STRLIST);
 		hal_property_strlist_prepend (prop, value);
 
-		g_hash_table_insert (device->private->props,
-			GINT_TO_POINTER(g_quark_from_string (key)), prop);
-
 		g_signal_emit (device, signals[PROPERTY_CHANGED], 0,
 			       key, FALSE, TRUE);
 
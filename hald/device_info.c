@@ -54,6 +54,7 @@
 #include "device_store.h"
 #include "util.h"
 #include "rule.h"
+#include "rule_match.h"
 #include "osspec.h"
 
 void *rules_ptr = NULL;
@@ -226,618 +227,6 @@ resolve_udiprop_path (const char *path, const char *source_udi,
 					 (char *) *prop_result, HAL_PATH_MAX);
 }
 
-/* Compare the value of a property on a hal device object against a string value
- * and return the result. Note that this works for several types, e.g. both strings
- * and integers - in the latter case the given right side string will be interpreted
- * as a number.
- *
- * The comparison might not make sense if you are comparing a property which is an integer
- * against a string in which case this function returns FALSE. Also, if the property doesn't
- * exist this function will also return FALSE.
- *
- * @param  d                    hal device object
- * @param  key                  Key of the property to compare
- * @param  right_side           Value to compare against
- * @param  result               Pointer to where to store result
- * @return                      TRUE if, and only if, the comparison could take place
- */
-static gboolean
-match_compare_property (HalDevice *d, const char *key, const char *right_side, dbus_int64_t *result)
-{
-	gboolean rc;
-	int proptype;
-
-	rc = FALSE;
-
-	if (!hal_device_has_property (d, key))
-		goto out;
-
-	proptype = hal_device_property_get_type (d, key);
-	switch (proptype) {
-	case HAL_PROPERTY_TYPE_STRING:
-		*result = (dbus_int64_t) strcmp (hal_device_property_get_string (d, key), right_side);
-		rc = TRUE;
-		break;
-
-	case HAL_PROPERTY_TYPE_INT32:
-		*result = ((dbus_int64_t) hal_device_property_get_int (d, key)) - strtoll (right_side, NULL, 0);
-		rc = TRUE;
-		break;
-
-	case HAL_PROPERTY_TYPE_UINT64:
-		*result = ((dbus_int64_t) hal_device_property_get_uint64 (d, key)) - ((dbus_int64_t) strtoll (right_side, NULL, 0));
-		rc = TRUE;
-		break;
-
-	case HAL_PROPERTY_TYPE_DOUBLE:
-		*result = (dbus_int64_t) ceil (hal_device_property_get_double (d, key) - atof (right_side));
-		rc = TRUE;
-		break;
-
-	default:
-		/* explicit fallthrough */
-	case HAL_PROPERTY_TYPE_BOOLEAN:
-		/* explicit blank since this doesn't make sense */
-		break;
-	}
-
-out:
-	return rc;
-}
-
-static gboolean
-handle_match (struct rule *rule, HalDevice *d)
-{
-	char resolve_scratch[HAL_PATH_MAX*2 + 3];
-	const char *udi_to_check;
-	const char *prop_to_check;
-	const char *key = rule->key;
-	const char *value = (char *)RULES_PTR(rule->value_offset);
-	const char *d_udi;
-	
-	d_udi = hal_device_get_udi (d);
-
-	/* Resolve key paths like 'someudi/foo/bar/baz:prop.name' '@prop.here.is.an.udi:with.prop.name' */
-	if (!resolve_udiprop_path (key,
-				   d_udi,
-				   &udi_to_check,
-				   &prop_to_check,
-				   resolve_scratch)) {
-		/*HAL_ERROR (("Could not resolve keypath '%s' on udi '%s'", key, value));*/
-		return FALSE;
-	}
-
-	if (strcmp(udi_to_check, d_udi)) {
-		d = hal_device_store_find (hald_get_gdl (), udi_to_check);
-		if (d == NULL)
-			d = hal_device_store_find (hald_get_tdl (), udi_to_check);
-		if (d == NULL) {
-			HAL_ERROR (("Could not find device with udi '%s'", udi_to_check));
-			return FALSE;
-		}
-	}
-
-	switch (rule->type_match) {
-	case MATCH_STRING:
-	{
-		if (hal_device_property_get_type (d, prop_to_check) != HAL_PROPERTY_TYPE_STRING)
-			return FALSE;
-		if (strcmp (hal_device_property_get_string (d, prop_to_check), value) != 0)
-			return FALSE;
-		return TRUE;
-	}
-
-	case MATCH_INT:
-	{
-		int val = strtol (value, NULL, 0);
-
-		if (hal_device_property_get_type (d, prop_to_check) != HAL_PROPERTY_TYPE_INT32)
-			return FALSE;
-		if (hal_device_property_get_int (d, prop_to_check) != val)
-			return FALSE;
-		return TRUE;
-	}
-
-	case MATCH_UINT64:
-	{
-		dbus_uint64_t val = strtol (value, NULL, 0);
-
-		if (hal_device_property_get_type (d, prop_to_check) != HAL_PROPERTY_TYPE_UINT64)
-			return FALSE;
-		if (hal_device_property_get_uint64 (d, prop_to_check) != val)
-			return FALSE;
-		return TRUE;
-	}
-
-	case MATCH_BOOL:
-	{
-		dbus_bool_t val;
-
-		if (strcmp (value, "false") == 0)
-			val = FALSE;
-		else if (strcmp (value, "true") == 0)
-			val = TRUE;
-		else
-			return FALSE;
-
-		if (hal_device_property_get_type (d, prop_to_check) != HAL_PROPERTY_TYPE_BOOLEAN)
-			return FALSE;
-		if (hal_device_property_get_bool (d, prop_to_check) != val)
-			return FALSE;
-		return TRUE;
-	}
-
-	case MATCH_DOUBLE:
-	{
-		double val = atof (value);
-
-		if (hal_device_property_get_type (d, prop_to_check) != HAL_PROPERTY_TYPE_DOUBLE)
-			return FALSE;
-		if (hal_device_property_get_double (d, prop_to_check) != val)
-			return FALSE;
-		return TRUE;
-	}
-
-	case MATCH_EXISTS:
-	{
-		dbus_bool_t should_exist = TRUE;
-
-		if (strcmp (value, "false") == 0)
-			should_exist = FALSE;
-
-		if (should_exist) {
-			if (hal_device_has_property (d, prop_to_check))
-				return TRUE;
-			else
-				return FALSE;
-		} else {
-			if (hal_device_has_property (d, prop_to_check))
-				return FALSE;
-			else
-				return TRUE;
-		}
-	}
-
-	case MATCH_EMPTY:
-	{
-		dbus_bool_t is_empty = TRUE;
-		dbus_bool_t should_be_empty = TRUE;
-
-		if (strcmp (value, "false") == 0)
-			should_be_empty = FALSE;
-		if (hal_device_property_get_type (d, prop_to_check) != HAL_PROPERTY_TYPE_STRING)
-			return FALSE;
-		if (hal_device_has_property (d, prop_to_check)) {
-			const char *s;
-			s = hal_device_property_get_string (d, prop_to_check);
-			if (s != NULL) {
-				if (strlen (s) > 0)
-					is_empty = FALSE;
-			}
-		}
-
-		if (should_be_empty) {
-			if (is_empty)
-				return TRUE;
-			else
-				return FALSE;
-		} else {
-			if (is_empty)
-				return FALSE;
-			else
-				return TRUE;
-		}
-	}
-
-	case MATCH_ISASCII:
-	{
-		dbus_bool_t is_ascii = TRUE;
-		dbus_bool_t should_be_ascii = TRUE;
-		unsigned int i;
-		const char *str;
-
-		if (strcmp (value, "false") == 0)
-			should_be_ascii = FALSE;
-
-		if (hal_device_property_get_type (d, prop_to_check) != HAL_PROPERTY_TYPE_STRING)
-			return FALSE;
-
-		is_ascii = TRUE;
-
-		str = hal_device_property_get_string (d, prop_to_check);
-		for (i = 0; str[i] != '\0'; i++) {
-			if (((unsigned char) str[i]) > 0x7f)
-				is_ascii = FALSE;
-		}
-
-		if (should_be_ascii) {
-			if (is_ascii)
-				return TRUE;
-			else
-				return FALSE;
-		} else {
-			if (is_ascii)
-				return FALSE;
-			else
-				return TRUE;
-		}
-	}
-
-	case MATCH_IS_ABS_PATH:
-	{
-		const char *path = NULL;
-		dbus_bool_t is_absolute_path = FALSE;
-		dbus_bool_t should_be_absolute_path = TRUE;
-
-		if (strcmp (value, "false") == 0)
-			should_be_absolute_path = FALSE;
-
-		if (hal_device_property_get_type (d, prop_to_check) != HAL_PROPERTY_TYPE_STRING)
-			return FALSE;
-
-		if (hal_device_has_property (d, prop_to_check)) {
-			path = hal_device_property_get_string (d, prop_to_check);
-			if (g_path_is_absolute (path))
-				is_absolute_path = TRUE;
-		}
-
-		if (should_be_absolute_path) {
-			if (is_absolute_path)
-				return TRUE;
-			else
-				return FALSE;
-		} else {
-			if (is_absolute_path)
-				return FALSE;
-			else
-				return TRUE;
-		}
-	}
-
-	case MATCH_CONTAINS:
-	case MATCH_CONTAINS_NOT:
-	{
-		dbus_bool_t contains = FALSE;
-
-		if (hal_device_has_property (d, prop_to_check) && value != NULL) {
-
-			if (hal_device_property_get_type (d, prop_to_check) == HAL_PROPERTY_TYPE_STRING) {
-				const char *haystack;
-
-				haystack = hal_device_property_get_string (d, prop_to_check);
-				if (haystack != NULL &&  (strstr(haystack, value) != NULL))
-					contains = TRUE;
-			} else if (hal_device_property_get_type (d, prop_to_check) == HAL_PROPERTY_TYPE_STRLIST) {
-				HalDeviceStrListIter iter;
-				for (hal_device_property_strlist_iter_init (d, prop_to_check, &iter);
-				     hal_device_property_strlist_iter_is_valid (&iter);
-				     hal_device_property_strlist_iter_next (&iter)) {
-					const char *str = hal_device_property_strlist_iter_get_value (&iter);
-					if (strcmp (str, value) == 0) {
-						contains = TRUE;
-						break;
-					}
-				}
-			} else {
-				return FALSE;
-			}
-		}
-	
-		if (rule->type_match == MATCH_CONTAINS) {	
-			return contains;
-		} else {
-			return !contains; /* rule->type_match == MATCH_CONTAINS_NOT  */
-		}
-	}
-	
-	case MATCH_CONTAINS_OUTOF:
-	case MATCH_PREFIX_OUTOF:
-	case MATCH_STRING_OUTOF:
-	{
-		dbus_bool_t contains = FALSE;
-
-		if (hal_device_has_property (d, prop_to_check) && value != NULL) {
-
-			if (hal_device_property_get_type (d, prop_to_check) == HAL_PROPERTY_TYPE_STRING) {
-				const char *haystack;
-				gchar **values;
-        			int i;
-
-                		values = g_strsplit (value, ";", 0);
-				
-				haystack = hal_device_property_get_string (d, prop_to_check);
-				if (haystack != NULL && values != NULL) {
-					for (i = 0; values [i] ; ++i) {
-						if (rule->type_match == MATCH_CONTAINS_OUTOF) {
-							if (strstr(haystack, values[i]) != NULL) {
-								contains = TRUE;
-								break;
-							}
-						}
-						else if (rule->type_match == MATCH_PREFIX_OUTOF) {
-							if (g_str_has_prefix (haystack, values[i])) {
-								contains = TRUE;
-								break;
-							}	
-						}
-						else if (rule->type_match == MATCH_STRING_OUTOF) {
-							if (strcmp (haystack, values[i]) == 0) {
-								contains = TRUE;
-								break;
-							}
-						}
-					}
-				}
-				g_strfreev (values);	
-			} 
-		}
-	
-		return contains;
-	}
-
-	case MATCH_INT_OUTOF:
-	{
-		dbus_bool_t contained = FALSE;
-
-		if (hal_device_has_property (d, prop_to_check) && value != NULL) {
-
-			if (hal_device_property_get_type (d, prop_to_check) == HAL_PROPERTY_TYPE_INT32) {
-				gchar **values;
-        			int i;
-				int to_check;
-
-                		values = g_strsplit (value, ";", 0);
-				to_check = hal_device_property_get_int (d, prop_to_check);				
-
-				if (values != NULL) {
-					for (i = 0; values [i] ; ++i) {
-                				if (to_check == strtol (values[i], NULL, 0)) {
-							contained = TRUE;
-							break;
-						}	
-					}
-				}
-				g_strfreev (values);	
-			} 
-		}
-	
-		return contained;
-	}
-
-
-	case MATCH_SIBLING_CONTAINS:
-	{
-		dbus_bool_t contains = FALSE;
-		const char *parent_udi;
-
-		parent_udi = hal_device_property_get_string (d, "info.parent");
-		if (parent_udi != NULL) {
-			GSList *i;
-			GSList *siblings;
-
-			siblings = hal_device_store_match_multiple_key_value_string (hald_get_gdl (),
-										     "info.parent",
-										     parent_udi);
-			for (i = siblings; i != NULL; i = g_slist_next (i)) {
-				HalDevice *sib = HAL_DEVICE (i->data);
-
-				if (sib == d)
-					continue;
-
-				HAL_INFO (("Checking sibling '%s' of '%s' whether '%s' contains '%s'",
-					   hal_device_get_udi (sib), hal_device_get_udi (d), prop_to_check, value));
-
-				if (hal_device_property_get_type (sib, prop_to_check) == HAL_PROPERTY_TYPE_STRING) {
-					if (hal_device_has_property (sib, prop_to_check)) {
-						const char *haystack;
-						
-						haystack = hal_device_property_get_string (sib, prop_to_check);
-						if (value != NULL && haystack != NULL && strstr (haystack, value))
-							contains = TRUE;
-					}
-				} else if (hal_device_property_get_type (sib, prop_to_check) == HAL_PROPERTY_TYPE_STRLIST && value != NULL) {
-					HalDeviceStrListIter iter;
-					for (hal_device_property_strlist_iter_init (sib, prop_to_check, &iter);
-					     hal_device_property_strlist_iter_is_valid (&iter);
-					     hal_device_property_strlist_iter_next (&iter)) {
-						const char *str = hal_device_property_strlist_iter_get_value (&iter);
-						if (strcmp (str, value) == 0) {
-							contains = TRUE;
-							break;
-						}
-					}
-				}
-
-				if (contains)
-					break;
-
-			} /* for all siblings */
-			g_slist_free (siblings);			
-		}
-
-		return contains;
-	}
-
-	case MATCH_CONTAINS_NCASE:
-	{
-		dbus_bool_t contains_ncase = FALSE;
-
-		if (hal_device_property_get_type (d, prop_to_check) == HAL_PROPERTY_TYPE_STRING) {
-			if (hal_device_has_property (d, prop_to_check)) {
-				char *value_lowercase;
-				char *haystack_lowercase;
-
-				value_lowercase   = g_utf8_strdown (value, -1);
-				haystack_lowercase = g_utf8_strdown (hal_device_property_get_string (d, prop_to_check), -1);
-				if (value_lowercase != NULL && haystack_lowercase != NULL &&
-				    strstr (haystack_lowercase, value_lowercase))
-					contains_ncase = TRUE;
-
-				g_free (value_lowercase);
-				g_free (haystack_lowercase);
-			}
-		} else if (hal_device_property_get_type (d, prop_to_check) == HAL_PROPERTY_TYPE_STRLIST && value != NULL) {
-			HalDeviceStrListIter iter;
-			for (hal_device_property_strlist_iter_init (d, prop_to_check, &iter);
-			     hal_device_property_strlist_iter_is_valid (&iter);
-			     hal_device_property_strlist_iter_next (&iter)) {
-				const char *str = hal_device_property_strlist_iter_get_value (&iter);
-				if (g_ascii_strcasecmp (str, value) == 0) {
-					contains_ncase = TRUE;
-					break;
-				}
-			}
-		} else {
-			return FALSE;
-		}
-		return contains_ncase;
-	}
-
-	case MATCH_PREFIX:
-	{
-		dbus_bool_t prefix = FALSE;
-
-		if (hal_device_property_get_type (d, prop_to_check) == HAL_PROPERTY_TYPE_STRING) {
-			if (hal_device_has_property (d, prop_to_check)) {
-				const char *haystack;
-				haystack = hal_device_property_get_string (d, prop_to_check);
-				if (value != NULL && haystack != NULL &&
-				    g_str_has_prefix (haystack, value)) {
-					prefix = TRUE;
-				}
-			}
-		} else {
-			return FALSE;
-		}
-
-		return prefix;
-	}
-
-	case MATCH_PREFIX_NCASE:
-	{
-		dbus_bool_t prefix_ncase = FALSE;
-
-		if (hal_device_property_get_type (d, prop_to_check) == HAL_PROPERTY_TYPE_STRING) {
-			if (hal_device_has_property (d, prop_to_check)) {
-				char *value_lowercase;
-				char *haystack_lowercase;
-				value_lowercase   = g_utf8_strdown (value, -1);
-				haystack_lowercase = g_utf8_strdown (hal_device_property_get_string (d, prop_to_check), -1);
-				if (value_lowercase != NULL && haystack_lowercase != NULL &&
-				    g_str_has_prefix (haystack_lowercase, value_lowercase)) {
-					prefix_ncase = TRUE;
-				}
-				g_free (value_lowercase);
-				g_free (haystack_lowercase);
-			}
-		} else {
-			return FALSE;
-		}
-		return prefix_ncase;
-	}
-
-	case MATCH_SUFFIX:
-	{
-		dbus_bool_t suffix = FALSE;
-
-		if (hal_device_property_get_type (d, prop_to_check) == HAL_PROPERTY_TYPE_STRING) {
-			if (hal_device_has_property (d, prop_to_check)) {
-				const char *haystack;
-				haystack = hal_device_property_get_string (d, prop_to_check);
-				if (value != NULL && haystack != NULL &&
-				    g_str_has_suffix (haystack, value)) {
-					suffix = TRUE;
-				}
-			}
-		} else {
-			return FALSE;
-		}
-
-		return suffix;
-	}
-
-	case MATCH_SUFFIX_NCASE:
-	{
-		dbus_bool_t suffix_ncase = FALSE;
-
-		if (hal_device_property_get_type (d, prop_to_check) == HAL_PROPERTY_TYPE_STRING) {
-			if (hal_device_has_property (d, prop_to_check)) {
-				char *value_lowercase;
-				char *haystack_lowercase;
-				value_lowercase   = g_utf8_strdown (value, -1);
-				haystack_lowercase = g_utf8_strdown (hal_device_property_get_string (d, prop_to_check), -1);
-				if (value_lowercase != NULL && haystack_lowercase != NULL &&
-				    g_str_has_suffix (haystack_lowercase, value_lowercase)) {
-					suffix_ncase = TRUE;
-				}
-				g_free (value_lowercase);
-				g_free (haystack_lowercase);
-			}
-		} else {
-			return FALSE;
-		}
-		return suffix_ncase;
-	}
-
-	case MATCH_COMPARE_LT:
-	{
-		dbus_int64_t result;
-
-		if (!match_compare_property (d, prop_to_check, value, &result))
-			return FALSE;
-		else
-			return result < 0;
-	}
-
-	case MATCH_COMPARE_LE:
-	{
-		dbus_int64_t result;
-
-		if (!match_compare_property (d, prop_to_check, value, &result))
-			return FALSE;
-		else
-			return result <= 0;
-	}
-
-	case MATCH_COMPARE_GT:
-	{
-		dbus_int64_t result;
-
-		if (!match_compare_property (d, prop_to_check, value, &result))
-			return FALSE;
-		else
-			return result > 0;
-	}
-
-	case MATCH_COMPARE_GE:
-	{
-		dbus_int64_t result;
-
-		if (!match_compare_property (d, prop_to_check, value, &result))
-			return FALSE;
-		else
-			return result >= 0;
-	}
-
-	case MATCH_COMPARE_NE:
-	{
-		dbus_int64_t result;
-
-		if (!match_compare_property (d, prop_to_check, value, &result))
-			return FALSE;
-		else
-			return result != 0;
-	}
-
-
-	default:
-		HAL_INFO(("match ERROR"));
-		return FALSE;
-	}
-
-	// return FALSE;
-}
-
 /* we have finished the callouts for a device, now add it to the gdl */
 static void
 spawned_device_callouts_add_done (HalDevice *d, gpointer userdata1, gpointer userdata2)
@@ -1099,19 +488,22 @@ static struct rule *di_jump(struct rule *rule){
 }
 
 
-/* process a match and merge comand for a device */
-static void
-rules_match_and_merge_device (void *fdi_rules_list, HalDevice *d)
+/* process a match and merge comand for a device; stops at fdi_rules_end
+ * if that is not NULL. Returns TRUE if any rule modified the device. */
+static gboolean
+rules_match_and_merge_device (void *fdi_rules_list, void *fdi_rules_end, HalDevice *d)
 {
 	struct rule *rule = fdi_rules_list;
-	while (rule != NULL){
+	gboolean modified = FALSE;
+
+	while (rule != NULL && (fdi_rules_end == NULL || (void *) rule < fdi_rules_end)){
 		/*HAL_INFO(("== Iterating rules =="));*/
 
 		switch (rule->rtype) {
 		case RULE_MATCH:
 			/* skip non-matching rules block */
 			/*HAL_INFO(("%p match '%s' at %s", rule, rule->key, hal_device_get_udi (d)));*/
-			if (!handle_match (rule, d)) {
+			if (!rule_match_device (rule, d)) {
 				/*HAL_INFO(("no match, skip to rule (%llx)", rule->jump_position));*/
 				rule = di_jump(rule);
 
@@ -1127,9 +519,14 @@ rules_match_and_merge_device (void *fdi_rules_list, HalDevice *d)
 		case RULE_ADDSET:
 		case RULE_REMOVE:
 		case RULE_CLEAR:
-		case RULE_SPAWN:
 		case RULE_MERGE:
 			/*HAL_INFO(("%p merge '%s' at %s", rule, rule->key, hal_device_get_udi (d)));*/
+			if (handle_merge (rule, d))
+				modified = TRUE;
+			break;
+
+		case RULE_SPAWN:
+			/* adds a new device, leaves this one alone */
 			handle_merge (rule, d);
 			break;
 
@@ -1146,6 +543,141 @@ rules_match_and_merge_device (void *fdi_rules_list, HalDevice *d)
 		if (rule)
 			rule = di_next(rule);
 	}
+
+	return modified;
+}
+
+/* a sorted list of block numbers from the rule index */
+struct index_cursor {
+	const u_int32_t *pos;
+	const u_int32_t *end;
+};
+
+/* add the part of a block list at or after block 'from' to the cursors */
+static void
+index_cursor_add (struct index_cursor *cursors, unsigned int *num_cursors,
+		  u_int32_t list, u_int32_t num, u_int32_t from)
+{
+	const u_int32_t *blocks = (const u_int32_t *) RULES_PTR(list);
+	u_int32_t lo = 0;
+	u_int32_t hi = num;
+
+	while (lo < hi) {
+		u_int32_t mid = lo + (hi - lo) / 2;
+		if (blocks[mid] < from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo < num) {
+		cursors[*num_cursors].pos = blocks + lo;
+		cursors[*num_cursors].end = blocks + num;
+		(*num_cursors)++;
+	}
+}
+
+static const struct cache_index_value *
+index_find_value (const struct cache_index_key *key, const char *value)
+{
+	const struct cache_index_value *values = (const struct cache_index_value *) RULES_PTR(key->values);
+	u_int32_t lo = 0;
+	u_int32_t hi = key->num_values;
+
+	while (lo < hi) {
+		u_int32_t mid = lo + (hi - lo) / 2;
+		int r = strcmp ((const char *) RULES_PTR(values[mid].value), value);
+		if (r == 0)
+			return &values[mid];
+		else if (r < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+/* gather the lists of blocks from 'from' on that can match the device as it is now */
+static unsigned int
+index_cursors_init (const struct cache_index *index, HalDevice *d,
+		    struct index_cursor *cursors, u_int32_t from)
+{
+	const struct cache_index_key *keys = (const struct cache_index_key *) RULES_PTR(index->keys);
+	unsigned int num_cursors = 0;
+	u_int32_t i;
+
+	index_cursor_add (cursors, &num_cursors, index->unindexed, index->num_unindexed, from);
+
+	for (i = 0; i < index->num_keys; i++) {
+		const char *key = (const char *) RULES_PTR(keys[i].key);
+		const struct cache_index_value *value;
+
+		if (!hal_device_has_property (d, key))
+			continue;
+
+		index_cursor_add (cursors, &num_cursors, keys[i].any, keys[i].num_any, from);
+
+		if (keys[i].num_values > 0 &&
+		    hal_device_property_get_type (d, key) == HAL_PROPERTY_TYPE_STRING) {
+			value = index_find_value (&keys[i], hal_device_property_get_string (d, key));
+			if (value != NULL)
+				index_cursor_add (cursors, &num_cursors, value->blocks, value->num_blocks, from);
+		}
+	}
+
+	return num_cursors;
+}
+
+/* process a rule section for a device, only looking at the blocks that
+ * the index says can match */
+static void
+rules_match_and_merge_device_indexed (const struct cache_index *index, HalDevice *d)
+{
+	const u_int32_t *blocks = (const u_int32_t *) RULES_PTR(index->blocks);
+	struct index_cursor *cursors;
+	unsigned int num_cursors;
+
+	/* at most the unindexed list plus two lists per key */
+	cursors = g_new (struct index_cursor, 1 + 2 * index->num_keys);
+	num_cursors = index_cursors_init (index, d, cursors, 0);
+
+	while (num_cursors > 0) {
+		struct rule *rule;
+		unsigned int i;
+		unsigned int min;
+		u_int32_t block;
+
+		/* the lists are disjoint; take the lowest block of all */
+		for (i = 1, min = 0; i < num_cursors; i++) {
+			if (*cursors[i].pos < *cursors[min].pos)
+				min = i;
+		}
+		block = *cursors[min].pos++;
+		if (cursors[min].pos == cursors[min].end)
+			cursors[min] = cursors[--num_cursors];
+
+		rule = (struct rule *) RULES_PTR(blocks[block]);
+		if (rule->rtype == RULE_MATCH) {
+			if (!rule_match_device (rule, d))
+				continue;
+			rule = di_next (rule);
+		}
+		/* the block may have changed properties the index is keyed on */
+		if (rules_match_and_merge_device (rule, RULES_PTR(blocks[block + 1]), d))
+			num_cursors = index_cursors_init (index, d, cursors, block + 1);
+	}
+
+	g_free (cursors);
+}
+
+/* process a rule section for a device */
+static void
+rules_match_and_merge_section (u_int32_t rules, u_int32_t index, HalDevice *d)
+{
+	if (index != 0)
+		rules_match_and_merge_device_indexed ((const struct cache_index *) RULES_PTR(index), d);
+	else
+		rules_match_and_merge_device (RULES_PTR(rules), NULL, d);
 }
 
 /* merge the device info type, either preprobe, info or policy */
@@ -1168,7 +700,7 @@ di_search_and_merge (HalDevice *d, DeviceInfoType type){
 			/*HAL_INFO(("preprobe rules offset: %ld", header->fdi_rules_preprobe));
 			HAL_INFO(("preprobe rules size: %ld",
 			header->fdi_rules_information - header->fdi_rules_preprobe));*/
-			rules_match_and_merge_device (RULES_PTR(header->fdi_rules_preprobe), d);
+			rules_match_and_merge_section (header->fdi_rules_preprobe, header->fdi_index_preprobe, d);
 		}
 		break;
 
@@ -1179,7 +711,7 @@ di_search_and_merge (HalDevice *d, DeviceInfoType type){
 			/*HAL_INFO(("information rules offset: %ld", header->fdi_rules_information));
 			HAL_INFO(("information rules size: %ld",
 			header->fdi_rules_policy - header->fdi_rules_information));*/
-			rules_match_and_merge_device (RULES_PTR(header->fdi_rules_information), d);
+			rules_match_and_merge_section (header->fdi_rules_information, header->fdi_index_information, d);
 		}
 		break;
 
@@ -1190,7 +722,7 @@ di_search_and_merge (HalDevice *d, DeviceInfoType type){
 			/*HAL_INFO(("policy rules offset: %ld", header->fdi_rules_policy));
 			HAL_INFO(("policy rules size: %ld",
 			header->all_rules_size - header->fdi_rules_policy));*/
-			rules_match_and_merge_device (RULES_PTR(header->fdi_rules_policy), d);
+			rules_match_and_merge_section (header->fdi_rules_policy, header->fdi_index_policy, d);
 		}
 		break;
 
@@ -29,6 +29,7 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "device_store.h"
@@ -48,12 +49,111 @@ enum {
 
 static guint signals[LAST_SIGNAL] = { 0 };
 
+/* What the store keeps about each of its devices */
+typedef struct {
+	GList *link;		/* in store->devices */
+	char *udi;		/* key the device is filed under in store->udi_index */
+} StoreEntry;
+
+static void
+store_entry_free (gpointer data)
+{
+	StoreEntry *entry = data;
+
+	g_free (entry->udi);
+	g_free (entry);
+}
+
+/* the set of UDIs changed; hal_device_store_get_after_udi() sorts again */
+static void
+udi_index_invalidate_sorted (HalDeviceStore *store)
+{
+	if (store->sorted_udis != NULL) {
+		g_ptr_array_free (store->sorted_udis, TRUE);
+		store->sorted_udis = NULL;
+	}
+}
+
+static void
+udi_index_add (HalDeviceStore *store, HalDevice *device, StoreEntry *entry)
+{
+	GSList *devices;
+
+	devices = g_hash_table_lookup (store->udi_index, entry->udi);
+	if (devices == NULL)
+		udi_index_invalidate_sorted (store);
+	devices = g_slist_prepend (devices, device);
+	/* the hash table frees the new key if it already has one */
+	g_hash_table_insert (store->udi_index, g_strdup (entry->udi), devices);
+}
+
+/* A UDI is no longer used; if it looks like <base>_<n>, suffix n of base
+ * may be handed out again. Lowering the hint of a base that merely looks
+ * similar only costs a lookup in hal_util_make_udi_unique(). */
+static void
+udi_suffix_release (HalDeviceStore *store, const char *udi)
+{
+	const char *p;
+	const char *digits;
+	char *base;
+	gpointer hint;
+	guint suffix;
+
+	digits = strrchr (udi, '_');
+	if (digits == NULL || digits[1] == '\0')
+		return;
+	digits++;
+	for (p = digits; *p != '\0'; p++) {
+		if (!g_ascii_isdigit (*p))
+			return;
+	}
+	/* we never generate leading zeros */
+	if (digits[0] == '0' && digits[1] != '\0')
+		return;
+
+	base = g_strndup (udi, digits - 1 - udi);
+	if (g_hash_table_lookup_extended (store->udi_suffixes, base, NULL, &hint)) {
+		suffix = (guint) strtoul (digits, NULL, 10);
+		if (suffix < GPOINTER_TO_UINT (hint))
+			hal_device_store_set_udi_suffix (store, base, suffix);
+	}
+	g_free (base);
+}
+
+static void
+udi_index_remove (HalDeviceStore *store, HalDevice *device, StoreEntry *entry)
+{
+	GSList *devices;
+
+	devices = g_hash_table_lookup (store->udi_index, entry->udi);
+	devices = g_slist_remove (devices, device);
+	if (devices == NULL) {
+		udi_index_invalidate_sorted (store);
+		g_hash_table_remove (store->udi_index, entry->udi);
+		udi_suffix_release (store, entry->udi);
+	} else {
+		g_hash_table_insert (store->udi_index, g_strdup (entry->udi), devices);
+	}
+}
+
+static void
+udi_index_free_devices (gpointer data)
+{
+	g_slist_free ((GSList *) data);
+}
+
 static void
 hal_device_store_finalize (GObject *obj)
 {
 	HalDeviceStore *store = HAL_DEVICE_STORE (obj);
 
-	g_slist_foreach (store->devices, (GFunc) g_object_unref, NULL);
+	g_list_foreach (store->devices, (GFunc) g_object_unref, NULL);
+	g_list_free (store->devices);
+	g_hash_table_destroy (store->entries);
+	udi_index_invalidate_sorted (store);
+	g_hash_table_destroy (store->udi_index);
+	g_hash_table_destroy (store->udi_suffixes);
+	g_hash_table_destroy (store->property_index);
 
 	if (parent_class->finalize)
 		parent_class->finalize (obj);
@@ -134,10 +234,20 @@ hal_device_store_class_init (HalDeviceStoreClass *klass)
 
 }
 
+static void property_index_free (gpointer data);
+
 static void
 hal_device_store_init (HalDeviceStore *device)
 {
-	device->property_index = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	device->entries = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, store_entry_free);
+	device->udi_index = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, udi_index_free_devices);
+	device->udi_suffixes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	device->property_index = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, property_index_free);
+
+	/* capability lookups are frequent enough to always index them */
+	hal_device_store_index_property (device, "info.capabilities");
+	/* and this makes the parent -> children edges of the device tree */
+	hal_device_store_index_property (device, "info.parent");
 }
 
 GType
@@ -179,21 +289,8 @@ static void
 property_index_check_all (HalDeviceStore *store, HalDevice *device, gboolean add);
 
 static void
-property_index_modify_string (HalDeviceStore *store, HalDevice *device,
-			      const char *key, gboolean added);
-
-static void
-device_pre_property_changed (HalDevice *device,
-			      const char *key,
-			      gboolean removed,
-			      gpointer data)
-{
-	HalDeviceStore *store = HAL_DEVICE_STORE (data);
-
-	if (hal_device_property_get_type (device, key) == HAL_PROPERTY_TYPE_STRING) {
-		property_index_modify_string(store, device, key, FALSE);
-	}
-}
+property_index_update (HalDeviceStore *store, HalDevice *device,
+		       const char *key, gboolean added);
 
 
 static void
@@ -204,11 +301,21 @@ emit_device_property_changed (HalDevice *device,
 			      gpointer data)
 {
 	HalDeviceStore *store = HAL_DEVICE_STORE (data);
-
-	if (hal_device_property_get_type (device, key) == HAL_PROPERTY_TYPE_STRING) {
-		property_index_modify_string(store, device, key, TRUE);
+	StoreEntry *entry;
+
+	/* hal_device_set_udi() on a device in the store */
+	if (strcmp (key, "info.udi") == 0) {
+		entry = g_hash_table_lookup (store->entries, device);
+		if (entry != NULL && strcmp (entry->udi, hal_device_get_udi (device)) != 0) {
+			udi_index_remove (store, device, entry);
+			g_free (entry->udi);
+			entry->udi = g_strdup (hal_device_get_udi (device));
+			udi_index_add (store, device, entry);
+		}
 	}
 
+	property_index_update (store, device, key, TRUE);
+
 	g_signal_emit (store, signals[DEVICE_PROPERTY_CHANGED], 0,
 		       device, key, added, removed);
 }
@@ -252,6 +359,7 @@ void
 hal_device_store_add (HalDeviceStore *store, HalDevice *device)
 {
 	const char buf[] = "/org/freedesktop/Hal/devices/";
+	StoreEntry *entry;
 
 	if (strncmp(hal_device_get_udi (device), buf, sizeof (buf) - 1) != 0) {
 		
@@ -259,13 +367,24 @@ hal_device_store_add (HalDeviceStore *store, HalDevice *device)
 			   "UDI must start with '/org/freedesktop/Hal/devices/'"));
 		goto out;
 	}
-	store->devices = g_slist_prepend (store->devices,
-					  g_object_ref (device));
+
+	if (g_hash_table_lookup (store->entries, device) != NULL) {
+		HAL_WARNING (("Device %s is already in the store", hal_device_get_udi (device)));
+		goto out;
+	}
+
+	store->devices = g_list_prepend (store->devices,
+					 g_object_ref (device));
+	store->num_devices++;
+
+	entry = g_new0 (StoreEntry, 1);
+	entry->link = store->devices;
+	entry->udi = g_strdup (hal_device_get_udi (device));
+	g_hash_table_insert (store->entries, device, entry);
+	udi_index_add (store, device, entry);
 
 	g_signal_connect (device, "property_changed",
 			  G_CALLBACK (emit_device_property_changed), store);
-	g_signal_connect (device, "pre_property_changed",
-			  G_CALLBACK (device_pre_property_changed), store);
 	g_signal_connect (device, "capability_added",
 			  G_CALLBACK (emit_device_capability_added), store);
 	g_signal_connect (device, "lock_acquired",
@@ -283,17 +402,29 @@ out:
 gboolean
 hal_device_store_remove (HalDeviceStore *store, HalDevice *device)
 {
-	if (!g_slist_find (store->devices, device))
+	StoreEntry *entry;
+	GSList *i;
+
+	entry = g_hash_table_lookup (store->entries, device);
+	if (entry == NULL)
 		return FALSE;
 
-	store->devices = g_slist_remove (store->devices, device);
+	/* step foreach loops that were about to visit the device past it */
+	for (i = store->iterators; i != NULL; i = i->next) {
+		GList **next = i->data;
+
+		if (*next == entry->link)
+			*next = entry->link->next;
+	}
+
+	store->devices = g_list_delete_link (store->devices, entry->link);
+	store->num_devices--;
+	udi_index_remove (store, device, entry);
+	g_hash_table_remove (store->entries, device);
 
 	g_signal_handlers_disconnect_by_func (device,
 					      (gpointer)emit_device_property_changed,
 					      store);
-	g_signal_handlers_disconnect_by_func (device,
-					      (gpointer)device_pre_property_changed,
-					      store);
 	g_signal_handlers_disconnect_by_func (device,
 					      (gpointer)emit_device_capability_added,
 					      store);
@@ -316,16 +447,11 @@ hal_device_store_remove (HalDeviceStore *store, HalDevice *device)
 HalDevice *
 hal_device_store_find (HalDeviceStore *store, const char *udi)
 {
-	GSList *iter;
-
-	for (iter = store->devices; iter != NULL; iter = iter->next) {
-		HalDevice *d = iter->data;
+	GSList *devices;
 
-		if (strcmp (hal_device_get_udi (d), udi) == 0)
-			return d;
-	}
+	devices = g_hash_table_lookup (store->udi_index, udi);
 
-	return NULL;
+	return devices != NULL ? HAL_DEVICE (devices->data) : NULL;
 }
 
 void
@@ -333,20 +459,60 @@ hal_device_store_foreach (HalDeviceStore *store,
 			  HalDeviceStoreForeachFn callback,
 			  gpointer user_data)
 {
-	GSList *iter;
+	GList *iter;
+	GList *next;
 
 	g_return_if_fail (store != NULL);
 	g_return_if_fail (callback != NULL);
 
-	for (iter = store->devices; iter != NULL; iter = iter->next) {
+	/* the callback may remove devices; hal_device_store_remove()
+	 * keeps next valid */
+	store->iterators = g_slist_prepend (store->iterators, &next);
+
+	for (iter = store->devices; iter != NULL; iter = next) {
 		HalDevice *d = HAL_DEVICE (iter->data);
 		gboolean cont;
 
+		next = iter->next;
 		cont = callback (store, d, user_data);
 
 		if (cont == FALSE)
-			return;
+			break;
 	}
+
+	store->iterators = g_slist_remove (store->iterators, &next);
+}
+
+/**
+ * hal_device_store_get_udi_suffix:
+ * @store:	the store
+ * @base_udi:	UDI that was taken
+ *
+ * Returns:	n such that <base_udi>_0 to <base_udi>_<n - 1> are all in the
+ *		store; <base_udi>_<n> may or may not be
+ */
+guint
+hal_device_store_get_udi_suffix (HalDeviceStore *store, const char *base_udi)
+{
+	return GPOINTER_TO_UINT (g_hash_table_lookup (store->udi_suffixes, base_udi));
+}
+
+/**
+ * hal_device_store_set_udi_suffix:
+ * @store:	the store
+ * @base_udi:	UDI that was taken
+ * @suffix:	see hal_device_store_get_udi_suffix()
+ *
+ * The store lowers the value again when a device with one of the lower
+ * suffixes is removed.
+ */
+void
+hal_device_store_set_udi_suffix (HalDeviceStore *store, const char *base_udi, guint suffix)
+{
+	if (suffix == 0)
+		g_hash_table_remove (store->udi_suffixes, base_udi);
+	else
+		g_hash_table_insert (store->udi_suffixes, g_strdup (base_udi), GUINT_TO_POINTER (suffix));
 }
 
 static gboolean
@@ -365,7 +531,7 @@ hal_device_store_print (HalDeviceStore *store)
 {
 	fprintf (stderr, "===============================================\n");
         fprintf (stderr, "Dumping %u devices\n", 
-		 g_slist_length (store->devices));
+		 store->num_devices);
 	fprintf (stderr, "===============================================\n");
 	hal_device_store_foreach (store, 
 				  hal_device_store_print_foreach_fn, 
@@ -373,25 +539,117 @@ hal_device_store_print (HalDeviceStore *store)
 	fprintf (stderr, "===============================================\n");
 }
 
+/**
+ * PropertyIndex:
+ *
+ * Index of the devices in a store by the value of a single property.
+ * Strings, integers and booleans are filed under their value and string
+ * lists under each of their elements, so both "key == value" and "key
+ * contains value" are hash lookups.
+ */
+typedef struct {
+	GHashTable *values;	/* PropertyIndexValue -> itself */
+	GHashTable *devices;	/* HalDevice -> GSList of PropertyIndexValue it is filed under */
+} PropertyIndex;
+
+typedef struct {
+	int type;		/* type of the property; strlist elements use HAL_PROPERTY_TYPE_STRLIST */
+	dbus_uint64_t number;	/* value of int32, uint64 and boolean properties */
+	char *string;		/* value of strings and strlist elements */
+	GSList *devices;	/* devices having this value */
+} PropertyIndexValue;
+
+static guint
+property_index_value_hash (gconstpointer key)
+{
+	const PropertyIndexValue *v = key;
+
+	if (v->string != NULL)
+		return g_str_hash (v->string) ^ v->type;
+	return (guint) (v->number ^ (v->number >> 32)) ^ v->type;
+}
+
+static gboolean
+property_index_value_equal (gconstpointer a, gconstpointer b)
+{
+	const PropertyIndexValue *va = a;
+	const PropertyIndexValue *vb = b;
+
+	if (va->type != vb->type)
+		return FALSE;
+	if (va->string != NULL || vb->string != NULL)
+		return va->string != NULL && vb->string != NULL && strcmp (va->string, vb->string) == 0;
+	return va->number == vb->number;
+}
+
+static void
+property_index_value_free (gpointer data)
+{
+	PropertyIndexValue *v = data;
+
+	g_slist_free (v->devices);
+	g_free (v->string);
+	g_free (v);
+}
+
+static void
+property_index_free_device_values (gpointer key, gpointer value, gpointer user_data)
+{
+	g_slist_free ((GSList *) value);
+}
+
+static void
+property_index_free (gpointer data)
+{
+	PropertyIndex *index = data;
+
+	g_hash_table_foreach (index->devices, property_index_free_device_values, NULL);
+	g_hash_table_destroy (index->devices);
+	g_hash_table_destroy (index->values);
+	g_free (index);
+}
+
+/* devices filed under a value, or NULL if the key is not indexed */
+static GSList **
+property_index_lookup (HalDeviceStore *store, const char *key,
+		       int type, dbus_uint64_t number, const char *string,
+		       gboolean *indexed)
+{
+	PropertyIndex *index;
+	PropertyIndexValue search;
+	PropertyIndexValue *v;
+
+	index = g_hash_table_lookup (store->property_index, key);
+	*indexed = (index != NULL);
+	if (index == NULL)
+		return NULL;
+
+	search.type = type;
+	search.number = number;
+	search.string = (char *) string;
+	v = g_hash_table_lookup (index->values, &search);
+
+	return v != NULL ? &v->devices : NULL;
+}
+
 HalDevice *
 hal_device_store_match_key_value_string (HalDeviceStore *store,
 					 const char *key,
 					 const char *value)
 {
-	GSList *iter;
-	GSList *devices;
-	GHashTable *index;
+	GList *iter;
+	GSList **devices;
+	gboolean indexed;
 
 	g_return_val_if_fail (store != NULL, NULL);
 	g_return_val_if_fail (key != NULL, NULL);
 	g_return_val_if_fail (value != NULL, NULL);
 
-	index = g_hash_table_lookup (store->property_index, key);
+	devices = property_index_lookup (store, key, HAL_PROPERTY_TYPE_STRING, 0, value, &indexed);
 
-	if (index) {
-		devices = g_hash_table_lookup (index, value);
-		if (devices)
-			return (HalDevice*) devices->data;
+	if (indexed) {
+		if (devices != NULL && *devices != NULL)
+			return (HalDevice*) (*devices)->data;
 		else
 			return NULL;
 	} else {
@@ -420,11 +678,22 @@ hal_device_store_match_key_value_int (HalDeviceStore *store,
 				      const char *key,
 				      int value)
 {
-	GSList *iter;
+	GList *iter;
+	GSList **devices;
+	gboolean indexed;
 
 	g_return_val_if_fail (store != NULL, NULL);
 	g_return_val_if_fail (key != NULL, NULL);
 
+	devices = property_index_lookup (store, key, HAL_PROPERTY_TYPE_INT32, (dbus_uint64_t) value, NULL, &indexed);
+
+	if (indexed) {
+		if (devices != NULL && *devices != NULL)
+			return (HalDevice*) (*devices)->data;
+		else
+			return NULL;
+	}
+
 	for (iter = store->devices; iter != NULL; iter = iter->next) {
 		HalDevice *d = HAL_DEVICE (iter->data);
 		int type;
@@ -448,20 +717,19 @@ hal_device_store_match_multiple_key_value_string (HalDeviceStore *store,
 						  const char *key,
 						  const char *value)
 {
-	GSList *iter;
+	GList *iter;
 	GSList *matches = NULL;
-	GSList *devices;
-	GHashTable *index;
+	GSList **devices;
+	gboolean indexed;
 
 	g_return_val_if_fail (store != NULL, NULL);
 	g_return_val_if_fail (key != NULL, NULL);
 	g_return_val_if_fail (value != NULL, NULL);
 
-	index = g_hash_table_lookup (store->property_index, key);
+	devices = property_index_lookup (store, key, HAL_PROPERTY_TYPE_STRING, 0, value, &indexed);
 
-	if (index) {
-		devices = g_hash_table_lookup (index, value);
-		return g_slist_copy(devices);
+	if (indexed) {
+		return devices != NULL ? g_slist_copy (*devices) : NULL;
 	} else {
 		for (iter = store->devices; iter != NULL; iter = iter->next) {
 			HalDevice *d = HAL_DEVICE (iter->data);
@@ -483,43 +751,333 @@ hal_device_store_match_multiple_key_value_string (HalDeviceStore *store,
 	return matches;
 }
 
+GSList *
+hal_device_store_match_multiple_key_value_int (HalDeviceStore *store,
+					       const char *key,
+					       int value)
+{
+	GList *iter;
+	GSList *matches = NULL;
+	GSList **devices;
+	gboolean indexed;
+
+	g_return_val_if_fail (store != NULL, NULL);
+	g_return_val_if_fail (key != NULL, NULL);
+
+	devices = property_index_lookup (store, key, HAL_PROPERTY_TYPE_INT32, (dbus_uint64_t) value, NULL, &indexed);
+
+	if (indexed)
+		return devices != NULL ? g_slist_copy (*devices) : NULL;
+
+	for (iter = store->devices; iter != NULL; iter = iter->next) {
+		HalDevice *d = HAL_DEVICE (iter->data);
+
+		if (hal_device_property_get_type (d, key) != HAL_PROPERTY_TYPE_INT32)
+			continue;
+
+		if (hal_device_property_get_int (d, key) == value)
+			matches = g_slist_prepend (matches, d);
+	}
+
+	return matches;
+}
+
+GSList *
+hal_device_store_match_multiple_key_strlist_contains (HalDeviceStore *store,
+						      const char *key,
+						      const char *value)
+{
+	GList *iter;
+	GSList *matches = NULL;
+	GSList **devices;
+	gboolean indexed;
+
+	g_return_val_if_fail (store != NULL, NULL);
+	g_return_val_if_fail (key != NULL, NULL);
+	g_return_val_if_fail (value != NULL, NULL);
+
+	devices = property_index_lookup (store, key, HAL_PROPERTY_TYPE_STRLIST, 0, value, &indexed);
+
+	if (indexed)
+		return devices != NULL ? g_slist_copy (*devices) : NULL;
+
+	for (iter = store->devices; iter != NULL; iter = iter->next) {
+		HalDevice *d = HAL_DEVICE (iter->data);
+
+		if (hal_device_property_strlist_contains (d, key, value))
+			matches = g_slist_prepend (matches, d);
+	}
+
+	return matches;
+}
+
+static void
+udi_index_collect_key (gpointer key, gpointer value, gpointer user_data)
+{
+	g_ptr_array_add ((GPtrArray *) user_data, key);
+}
+
+static gint
+udi_index_compare_keys (gconstpointer a, gconstpointer b)
+{
+	return strcmp (*((const char **) a), *((const char **) b));
+}
+
+/**
+ * hal_device_store_get_after_udi:
+ * @store:	the store
+ * @udi:	UDI to continue after, or "" to start at the beginning
+ * @max_devices: maximum number of devices to return
+ *
+ * Walk the store in UDI order, e.g. to hand it out in chunks. The UDIs
+ * are sorted once and kept sorted until a UDI is added or removed, so a
+ * chunk costs a binary search plus the devices returned.
+ *
+ * Returns:	up to @max_devices devices whose UDI sorts after @udi, in
+ *		UDI order; free the list with g_slist_free()
+ */
+GSList *
+hal_device_store_get_after_udi (HalDeviceStore *store, const char *udi, guint max_devices)
+{
+	GPtrArray *sorted;
+	GSList *result;
+	GSList *devices;
+	guint lo;
+	guint hi;
+	guint mid;
+	guint num_devices;
+
+	g_return_val_if_fail (store != NULL, NULL);
+	g_return_val_if_fail (udi != NULL, NULL);
+
+	if (store->sorted_udis == NULL) {
+		store->sorted_udis = g_ptr_array_sized_new (g_hash_table_size (store->udi_index));
+		/* the keys stay put until they are removed from the table */
+		g_hash_table_foreach (store->udi_index, udi_index_collect_key, store->sorted_udis);
+		g_ptr_array_sort (store->sorted_udis, udi_index_compare_keys);
+	}
+	sorted = store->sorted_udis;
+
+	/* first UDI sorting after @udi */
+	lo = 0;
+	hi = sorted->len;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp (g_ptr_array_index (sorted, mid), udi) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	result = NULL;
+	num_devices = 0;
+	for (; lo < sorted->len && num_devices < max_devices; lo++) {
+		devices = g_hash_table_lookup (store->udi_index, g_ptr_array_index (sorted, lo));
+		for (; devices != NULL && num_devices < max_devices; devices = devices->next) {
+			result = g_slist_prepend (result, devices->data);
+			num_devices++;
+		}
+	}
+
+	return g_slist_reverse (result);
+}
+
+/**
+ * hal_device_store_get_children:
+ * @store:	the store
+ * @device:	the parent
+ *
+ * Returns:	devices in @store whose info.parent is the UDI of @device;
+ *		free the list with g_slist_free()
+ */
+GSList *
+hal_device_store_get_children (HalDeviceStore *store, HalDevice *device)
+{
+	GSList **devices;
+	gboolean indexed;
+
+	g_return_val_if_fail (store != NULL, NULL);
+	g_return_val_if_fail (device != NULL, NULL);
+
+	devices = property_index_lookup (store, "info.parent", HAL_PROPERTY_TYPE_STRING, 0,
+					 hal_device_get_udi (device), &indexed);
+
+	return devices != NULL ? g_slist_copy (*devices) : NULL;
+}
+
+static GSList *
+subtree_prepend (HalDeviceStore *store, HalDevice *device, GHashTable *visited, GSList *result)
+{
+	GSList **children;
+	GSList *l;
+	gboolean indexed;
+
+	/* a broken info.parent could make a cycle */
+	if (g_hash_table_lookup (visited, device) != NULL)
+		return result;
+	g_hash_table_insert (visited, device, device);
+
+	result = g_slist_prepend (result, device);
+
+	children = property_index_lookup (store, "info.parent", HAL_PROPERTY_TYPE_STRING, 0,
+					  hal_device_get_udi (device), &indexed);
+	if (children != NULL) {
+		for (l = *children; l != NULL; l = l->next)
+			result = subtree_prepend (store, HAL_DEVICE (l->data), visited, result);
+	}
+
+	return result;
+}
+
+/**
+ * hal_device_store_get_subtree:
+ * @store:	the store
+ * @device:	root of the subtree
+ *
+ * Returns:	@device followed by all its descendants in @store, parents
+ *		before their children; free the list with g_slist_free()
+ */
+GSList *
+hal_device_store_get_subtree (HalDeviceStore *store, HalDevice *device)
+{
+	GHashTable *visited;
+	GSList *result;
+
+	g_return_val_if_fail (store != NULL, NULL);
+	g_return_val_if_fail (device != NULL, NULL);
+
+	visited = g_hash_table_new (g_direct_hash, g_direct_equal);
+	result = subtree_prepend (store, device, visited, NULL);
+	g_hash_table_destroy (visited);
+
+	return g_slist_reverse (result);
+}
 
 void
 hal_device_store_index_property (HalDeviceStore *store, const char *key)
 {
-	GHashTable *index;
+	PropertyIndex *index;
+	GList *iter;
 
 	index = g_hash_table_lookup (store->property_index, key);
 
 	if (!index) {
-		index = g_hash_table_new (g_str_hash, g_str_equal);
+		index = g_new0 (PropertyIndex, 1);
+		index->values = g_hash_table_new_full (property_index_value_hash,
+						       property_index_value_equal,
+						       NULL,
+						       property_index_value_free);
+		index->devices = g_hash_table_new (g_direct_hash, g_direct_equal);
 		g_hash_table_insert (store->property_index, g_strdup (key), index);
+
+		for (iter = store->devices; iter != NULL; iter = iter->next)
+			property_index_update (store, HAL_DEVICE (iter->data), key, TRUE);
 	}
 }
 
+/* file a device under one value */
+static GSList *
+property_index_file (PropertyIndex *index, HalDevice *device, GSList *filed,
+		     int type, dbus_uint64_t number, const char *string)
+{
+	PropertyIndexValue search;
+	PropertyIndexValue *v;
+
+	search.type = type;
+	search.number = number;
+	search.string = (char *) string;
+
+	v = g_hash_table_lookup (index->values, &search);
+	if (v == NULL) {
+		v = g_new0 (PropertyIndexValue, 1);
+		v->type = type;
+		v->number = number;
+		v->string = g_strdup (string);
+		g_hash_table_insert (index->values, v, v);
+	} else if (g_slist_find (filed, v) != NULL) {
+		/* e.g. the same element twice in a strlist */
+		return filed;
+	}
+
+	v->devices = g_slist_prepend (v->devices, device);
+	return g_slist_prepend (filed, v);
+}
+
+/**
+ * property_index_update:
+ * @store:	the store
+ * @device:	device whose property changed
+ * @key:	the property
+ * @added:	FALSE if the device is leaving the store
+ *
+ * Move a device to the index entries matching the current value of a
+ * property. The entries a device is filed under are remembered, so this
+ * works for changes that are not announced beforehand, like strlist edits.
+ */
 static void
-property_index_modify_string (HalDeviceStore *store, HalDevice *device,
-			      const char *key, gboolean added)
+property_index_update (HalDeviceStore *store, HalDevice *device,
+		       const char *key, gboolean added)
 {
-	GHashTable *index;
-	const char *value;
-	GSList *devices;
+	PropertyIndex *index;
+	GSList *filed;
+	GSList *l;
+	HalDeviceStrListIter iter;
 
-	value = hal_device_property_get_string (device, key);
 	index = g_hash_table_lookup (store->property_index, key);
-
 	if (!index) return;
 
-	devices = g_hash_table_lookup (index, value);
+	filed = g_hash_table_lookup (index->devices, device);
+	for (l = filed; l != NULL; l = l->next) {
+		PropertyIndexValue *v = l->data;
+
+		v->devices = g_slist_remove (v->devices, device);
+		if (v->devices == NULL)
+			g_hash_table_remove (index->values, v);
+	}
+	g_slist_free (filed);
+	g_hash_table_remove (index->devices, device);
+
+	if (!added)
+		return;
+
+	filed = NULL;
+	switch (hal_device_property_get_type (device, key)) {
+	case HAL_PROPERTY_TYPE_STRING:
+		filed = property_index_file (index, device, filed, HAL_PROPERTY_TYPE_STRING, 0,
+					     hal_device_property_get_string (device, key));
+		break;
+
+	case HAL_PROPERTY_TYPE_INT32:
+		filed = property_index_file (index, device, filed, HAL_PROPERTY_TYPE_INT32,
+					     (dbus_uint64_t) hal_device_property_get_int (device, key), NULL);
+		break;
+
+	case HAL_PROPERTY_TYPE_UINT64:
+		filed = property_index_file (index, device, filed, HAL_PROPERTY_TYPE_UINT64,
+					     hal_device_property_get_uint64 (device, key), NULL);
+		break;
+
+	case HAL_PROPERTY_TYPE_BOOLEAN:
+		filed = property_index_file (index, device, filed, HAL_PROPERTY_TYPE_BOOLEAN,
+					     hal_device_property_get_bool (device, key) ? 1 : 0, NULL);
+		break;
+
+	case HAL_PROPERTY_TYPE_STRLIST:
+		for (hal_device_property_strlist_iter_init (device, key, &iter);
+		     hal_device_property_strlist_iter_is_valid (&iter);
+		     hal_device_property_strlist_iter_next (&iter))
+			filed = property_index_file (index, device, filed, HAL_PROPERTY_TYPE_STRLIST, 0,
+						     hal_device_property_strlist_iter_get_value (&iter));
+		break;
+
+	default:
+		break;
+	}
 
-	if (added) { /*add*/
-		HAL_DEBUG (("adding %p to (%s,%s)", device, key, value));
-		devices = g_slist_prepend (devices, device);
-	} else { /*remove*/
-		HAL_DEBUG (("removing %p from (%s,%s)", device, key, value));
-		devices = g_slist_remove_all (devices, device);
+	if (filed != NULL) {
+		HAL_DEBUG (("indexed %p under %d values of %s", device, g_slist_length (filed), key));
+		g_hash_table_insert (index->devices, device, filed);
 	}
-	g_hash_table_insert (index, (gpointer) value, devices);
 }
 
 #if GLIB_CHECK_VERSION (2,14,0)
@@ -547,10 +1105,7 @@ property_index_check_all (HalDeviceStore *store, HalDevice *device, gboolean add
 
 	indexed_properties = g_hash_table_get_keys (store->property_index);
 	for (lp = indexed_properties; lp; lp = g_list_next (lp)) {
-		if (hal_device_property_get_type (device, lp->data) == HAL_PROPERTY_TYPE_STRING) {
-			property_index_modify_string (store, device, lp->data, added);
-		}
+		property_index_update (store, device, lp->data, added);
 	}
 	g_list_free (indexed_properties);
 }
-
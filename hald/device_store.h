@@ -37,7 +37,13 @@ typedef struct _HalDeviceStoreClass HalDeviceStoreClass;
 struct _HalDeviceStore {
 	GObject parent;
 
-	GSList *devices;
+	GList *devices;			/* newest first */
+	guint num_devices;
+	GHashTable *entries;		/* HalDevice -> private bookkeeping */
+	GHashTable *udi_index;		/* UDI -> GSList of HalDevice */
+	GPtrArray *sorted_udis;		/* keys of udi_index in strcmp order, NULL until needed */
+	GHashTable *udi_suffixes;	/* base UDI -> lowest _<n> suffix that may be free */
+	GSList *iterators;		/* foreach loops in progress */
 	GHashTable *property_index;
 };
 
@@ -120,8 +126,30 @@ GSList         *hal_device_store_match_multiple_key_value_string (HalDeviceStore
 								  const char *key,
 								  const char *value);
 
+GSList         *hal_device_store_match_multiple_key_value_int (HalDeviceStore *store,
+							       const char *key,
+							       int value);
+
+GSList         *hal_device_store_match_multiple_key_strlist_contains (HalDeviceStore *store,
+								      const char *key,
+								      const char *value);
+
+GSList         *hal_device_store_get_after_udi (HalDeviceStore *store,
+					       const char *udi,
+					       guint max_devices);
+
+GSList         *hal_device_store_get_children (HalDeviceStore *store,
+					       HalDevice *device);
+
+GSList         *hal_device_store_get_subtree (HalDeviceStore *store,
+					      HalDevice *device);
+
 void hal_device_store_print (HalDeviceStore *store);
 
 void		hal_device_store_index_property (HalDeviceStore *store, const char *key);
 
+guint		hal_device_store_get_udi_suffix (HalDeviceStore *store, const char *base_udi);
+
+void		hal_device_store_set_udi_suffix (HalDeviceStore *store, const char *base_udi, guint suffix);
+
 #endif /* DEVICE_STORE_H */
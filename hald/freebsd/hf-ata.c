@@ -261,8 +261,8 @@ hf_ata_privileged_init (void)
 static void
 hf_ata_probe (void)
 {
-  GSList *gdl_devices;
-  GSList *l;
+  GList *gdl_devices;
+  GList *l;
 
   /*
    * There must be no pending device, otherwise hf-scsi did not call
@@ -275,7 +275,7 @@ hf_ata_probe (void)
     return;
 
   /* we might modify the gdl while iterating, so we must use a copy */
-  gdl_devices = g_slist_copy(hald_get_gdl()->devices);
+  gdl_devices = g_list_copy(hald_get_gdl()->devices);
   HF_LIST_FOREACH(l, gdl_devices)
     {
       HalDevice *device = l->data;
@@ -283,7 +283,7 @@ hf_ata_probe (void)
       if (hal_device_has_property(device, "ide_host.number") && ! hal_device_property_get_bool(device, "info.ignore"))
 	hf_ata_probe_devices(device);
     }
-  g_slist_free(gdl_devices);
+  g_list_free(gdl_devices);
 }
 
 void
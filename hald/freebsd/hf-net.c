@@ -215,7 +215,7 @@ hf_net_device_new (const char *interface, HalDevice *parent, GError **err)
 static gboolean
 hf_net_update_timeout_cb (gpointer data)
 {
-  GSList *l;
+  GList *l;
 
   if (hf_is_waiting)
     return TRUE;
@@ -88,7 +88,7 @@ hf_usb_find_controller (int index)
 static HalDevice *
 hf_usb_find_hub (const struct usb_device_info *device_info)
 {
-  GSList *a;
+  GList *a;
 
   g_return_val_if_fail(device_info != NULL, FALSE);
 
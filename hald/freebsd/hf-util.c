@@ -224,7 +224,7 @@ hf_pending_gdl_new (void)
 {
   HalDeviceStore *store;
   GList *l;
-  GSList *sl;
+  GList *sl;
 
   store = hal_device_store_new();
 
@@ -587,7 +587,7 @@ hf_device_store_match (HalDeviceStore *store, ...)
 {
   GSList *props = NULL;
   va_list args;
-  GSList *a;
+  GList *a;
   HalDevice *device = NULL;
 
   g_return_val_if_fail(HAL_IS_DEVICE_STORE(store), NULL);
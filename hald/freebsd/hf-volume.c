@@ -252,7 +252,7 @@ hf_volume_device_add (HalDevice *parent,
 static void
 hf_volume_update_mounts (void)
 {
-  GSList *l;
+  GList *l;
   struct statfs *mounts;
   int n_mounts;
 
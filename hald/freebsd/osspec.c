@@ -105,6 +105,9 @@ osspec_init (void)
 
   pci_ids_init();
 
+  /* looked up by SCSI devices to find their host */
+  hal_device_store_index_property(hald_get_gdl(), "scsi_host.host");
+
   for (i = 0; i < (int) G_N_ELEMENTS(handlers); i++)
     if (handlers[i]->init)
       handlers[i]->init();
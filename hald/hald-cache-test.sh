@@ -12,7 +12,7 @@ export HAL_FDI_SOURCE_PREPROBE HAL_FDI_SOURCE_INFORMATION \
 
 #gdb run --args ./hald-generate-fdi-cache
 ./hald-generate-fdi-cache || exit 2
-./hald-cache-test || exit 2
+./hald-cache-test "$@" || exit 2
 
 #required by distcheck
 rm -Rf .local-fdi-test
@@ -351,6 +351,16 @@ handle_sigterm (int value)
 	written = write (sigterm_unix_signal_pipe_fds[1], marker, 1);
 }
 
+static void 
+handle_sigusr1 (int value)
+{
+	ssize_t written;
+	static char marker[1] = {'U'};
+
+	/* same as above, this just dumps statistics */
+	written = write (sigterm_unix_signal_pipe_fds[1], marker, 1);
+}
+
 static gboolean
 sigterm_iochn_data (GIOChannel *source, 
 		    GIOCondition condition, 
@@ -369,6 +379,11 @@ sigterm_iochn_data (GIOChannel *source,
 		goto out;
 	}
 
+	if (data[0] == 'U') {
+		hald_dbus_print_method_stats ();
+		goto out;
+	}
+
 	HAL_INFO (("Caught SIGTERM, initiating shutdown"));
 	hald_runner_kill_all();
 	exit (0);
@@ -761,6 +776,9 @@ main (int argc, char *argv[])
 	/* Finally, setup unix signal handler for TERM */
 	signal (SIGTERM, handle_sigterm);
 
+	/* and for USR1, which logs D-Bus method statistics */
+	signal (SIGUSR1, handle_sigusr1);
+
 	/* set up the local dbus server */
 	if (!hald_dbus_local_server_init ())
 		return 1;
@@ -834,12 +852,12 @@ my_shutdown (gpointer data)
 {
 	HalDeviceStore *gdl;
 	
-	HAL_INFO (("Num devices in TDL: %d", g_slist_length ((hald_get_tdl ())->devices)));
-	HAL_INFO (("Num devices in GDL: %d", g_slist_length ((hald_get_gdl ())->devices)));
+	HAL_INFO (("Num devices in TDL: %d", (hald_get_tdl ())->num_devices));
+	HAL_INFO (("Num devices in GDL: %d", (hald_get_gdl ())->num_devices));
 	
 	gdl = hald_get_gdl ();
 next:
-	if (g_slist_length (gdl->devices) > 0) {
+	if (gdl->devices != NULL) {
 		HalDevice *d = HAL_DEVICE(gdl->devices->data);
 		hal_device_store_remove (gdl, d);
 		g_object_unref (d);
@@ -417,6 +417,259 @@ manager_get_all_devices_with_properties (DBusConnection * connection,
 	return DBUS_HANDLER_RESULT_HANDLED;
 }
 
+/* Append a (sa{sv}) struct for a device with the given properties, or
+ * all of them if num_keys is 0 */
+static void
+append_device_with_properties (DBusMessageIter *iter, HalDevice *d, char **keys, int num_keys)
+{
+	DBusMessageIter iter_struct;
+	DBusMessageIter iter_dict;
+	const char *udi;
+	int n;
+
+	dbus_message_iter_open_container (iter,
+					  DBUS_TYPE_STRUCT,
+					  NULL,
+					  &iter_struct);
+	udi = hal_device_get_udi (d);
+	dbus_message_iter_append_basic (&iter_struct, DBUS_TYPE_STRING, &udi);
+	dbus_message_iter_open_container (&iter_struct, 
+					  DBUS_TYPE_ARRAY,
+					  DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+					  DBUS_TYPE_STRING_AS_STRING
+					  DBUS_TYPE_VARIANT_AS_STRING
+					  DBUS_DICT_ENTRY_END_CHAR_AS_STRING,
+					  &iter_dict);
+
+	if (num_keys == 0) {
+		hal_device_property_foreach (d, foreach_property_append, &iter_dict);
+	} else {
+		for (n = 0; n < num_keys; n++) {
+			if (hal_device_has_property (d, keys[n]))
+				foreach_property_append (d, keys[n], &iter_dict);
+		}
+	}
+
+	dbus_message_iter_close_container (&iter_struct, &iter_dict);
+	dbus_message_iter_close_container (iter, &iter_struct);
+}
+
+/** 
+ *  manager_get_devices_properties:
+ *  @connection:         D-BUS connection
+ *  @message:            Message
+ *
+ *  Returns:             What to do with the message
+ *
+ *  Get the given properties, or all of them if keys is empty, of each
+ *  of the given devices in one go. Devices are returned in the order
+ *  they were asked for; devices that don't exist are left out.
+ *
+ *  <pre>
+ *  array{struct {object_reference, map{string, any}}}
+ *      Manager.GetDevicesProperties(array{object_reference} udis,
+ *                                   array{string} keys)
+ *  </pre>
+ *
+ */
+DBusHandlerResult
+manager_get_devices_properties (DBusConnection * connection,
+				DBusMessage * message)
+{
+	DBusMessage *reply;
+	DBusMessageIter iter;
+	DBusMessageIter iter_array;
+	DBusError error;
+	char **udis;
+	int num_udis;
+	char **keys;
+	int num_keys;
+	HalDevice *d;
+	int n;
+
+	dbus_error_init (&error);
+	if (!dbus_message_get_args (message, &error,
+				    DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &udis, &num_udis,
+				    DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &keys, &num_keys,
+				    DBUS_TYPE_INVALID)) {
+		raise_syntax (connection, message, "Manager.GetDevicesProperties");
+		dbus_error_free (&error);
+
+		return DBUS_HANDLER_RESULT_HANDLED;
+	}
+
+	reply = dbus_message_new_method_return (message);
+	if (reply == NULL)
+		DIE (("No memory"));
+
+	dbus_message_iter_init_append (reply, &iter);
+	dbus_message_iter_open_container (&iter, 
+					  DBUS_TYPE_ARRAY,
+                                          "(sa{sv})",
+					  &iter_array);
+
+	for (n = 0; n < num_udis; n++) {
+		d = hal_device_store_find (hald_get_gdl (), udis[n]);
+		if (d != NULL)
+			append_device_with_properties (&iter_array, d, keys, num_keys);
+	}
+
+	dbus_message_iter_close_container (&iter, &iter_array);
+
+	if (!dbus_connection_send (connection, reply, NULL))
+		DIE (("No memory"));
+
+	dbus_message_unref (reply);
+	dbus_free_string_array (udis);
+	dbus_free_string_array (keys);
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/* Number of devices GetDevicesWithPropertiesFiltered returns per call
+ * if the caller doesn't ask for less */
+#define FILTERED_DEVICES_MAX_CHUNK 256
+
+static gint
+compare_device_udi (gconstpointer a, gconstpointer b)
+{
+	return strcmp (hal_device_get_udi (HAL_DEVICE (a)), hal_device_get_udi (HAL_DEVICE (b)));
+}
+
+/** 
+ *  manager_get_devices_with_properties_filtered:
+ *  @connection:         D-BUS connection
+ *  @message:            Message
+ *
+ *  Returns:             What to do with the message
+ *
+ *  Get the devices that have the given capability and where the given
+ *  string property has the given value; an empty capability or key
+ *  matches all devices. Only the properties in wanted_keys are returned,
+ *  or all of them if it is empty.
+ *
+ *  Devices are returned in order of their UDI, at most max_devices at a
+ *  time. Pass the returned cursor to get the next chunk; it is empty
+ *  once all devices have been returned. Start with an empty cursor.
+ *
+ *  <pre>
+ *  array{struct {object_reference, map{string, any}}}, string
+ *      Manager.GetDevicesWithPropertiesFiltered(string capability,
+ *                                               string key,
+ *                                               string value,
+ *                                               array{string} wanted_keys,
+ *                                               string cursor,
+ *                                               uint32 max_devices)
+ *  </pre>
+ *
+ */
+DBusHandlerResult
+manager_get_devices_with_properties_filtered (DBusConnection * connection,
+					      DBusMessage * message)
+{
+	DBusMessage *reply;
+	DBusMessageIter iter;
+	DBusMessageIter iter_array;
+	DBusError error;
+	const char *capability;
+	const char *key;
+	const char *value;
+	const char *cursor;
+	const char *next_cursor;
+	char **wanted_keys;
+	int num_wanted_keys;
+	dbus_uint32_t max_devices;
+	dbus_uint32_t num_devices;
+	const char *last_udi;
+	GSList *devices;
+	GSList *candidates;
+	GSList *l;
+
+	dbus_error_init (&error);
+	if (!dbus_message_get_args (message, &error,
+				    DBUS_TYPE_STRING, &capability,
+				    DBUS_TYPE_STRING, &key,
+				    DBUS_TYPE_STRING, &value,
+				    DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &wanted_keys, &num_wanted_keys,
+				    DBUS_TYPE_STRING, &cursor,
+				    DBUS_TYPE_UINT32, &max_devices,
+				    DBUS_TYPE_INVALID)) {
+		raise_syntax (connection, message, "Manager.GetDevicesWithPropertiesFiltered");
+		dbus_error_free (&error);
+
+		return DBUS_HANDLER_RESULT_HANDLED;
+	}
+
+	if (max_devices == 0 || max_devices > FILTERED_DEVICES_MAX_CHUNK)
+		max_devices = FILTERED_DEVICES_MAX_CHUNK;
+
+	/* UDI order keeps the cursor valid while devices come and go. One
+	 * more device than asked for tells if there is another chunk. */
+	if (key[0] == '\0' && capability[0] == '\0') {
+		devices = hal_device_store_get_after_udi (hald_get_gdl (), cursor, max_devices + 1);
+	} else {
+		/* the property index gives the few devices that match; only
+		 * those after the cursor need sorting */
+		if (key[0] != '\0')
+			candidates = hal_device_store_match_multiple_key_value_string (hald_get_gdl (), key, value);
+		else
+			candidates = hal_device_store_match_multiple_key_strlist_contains (hald_get_gdl (),
+											   "info.capabilities",
+											   capability);
+		devices = NULL;
+		for (l = candidates; l != NULL; l = l->next) {
+			HalDevice *d = HAL_DEVICE (l->data);
+
+			if (cursor[0] != '\0' && strcmp (hal_device_get_udi (d), cursor) <= 0)
+				continue;
+			if (key[0] != '\0' && capability[0] != '\0' && !hal_device_has_capability (d, capability))
+				continue;
+			devices = g_slist_prepend (devices, d);
+		}
+		g_slist_free (candidates);
+		devices = g_slist_sort (devices, compare_device_udi);
+	}
+
+	reply = dbus_message_new_method_return (message);
+	if (reply == NULL)
+		DIE (("No memory"));
+
+	dbus_message_iter_init_append (reply, &iter);
+	dbus_message_iter_open_container (&iter, 
+					  DBUS_TYPE_ARRAY,
+                                          "(sa{sv})",
+					  &iter_array);
+
+	next_cursor = "";
+	last_udi = NULL;
+	num_devices = 0;
+	for (l = devices; l != NULL; l = l->next) {
+		HalDevice *d = HAL_DEVICE (l->data);
+
+		/* more to come; continue after the last one we return */
+		if (num_devices == max_devices) {
+			next_cursor = last_udi;
+			break;
+		}
+		last_udi = hal_device_get_udi (d);
+		num_devices++;
+
+		append_device_with_properties (&iter_array, d, wanted_keys, num_wanted_keys);
+	}
+
+	dbus_message_iter_close_container (&iter, &iter_array);
+	dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &next_cursor);
+
+	if (!dbus_connection_send (connection, reply, NULL))
+		DIE (("No memory"));
+
+	dbus_message_unref (reply);
+	g_slist_free (devices);
+	dbus_free_string_array (wanted_keys);
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
 /** 
  *  manager_get_all_devices: 
  *  @connection:         D-BUS connection
@@ -597,27 +850,6 @@ manager_find_device_string_match (DBusConnection * connection,
 	return DBUS_HANDLER_RESULT_HANDLED;
 }
 
-typedef struct {
-	const char *capability;
-	DBusMessageIter *iter;
-} DeviceCapabilityInfo;
-
-static gboolean
-foreach_device_by_capability (HalDeviceStore *store, HalDevice *device, gpointer user_data)
-{
-	DeviceCapabilityInfo *info = (DeviceCapabilityInfo *) user_data;
-
-	if (hal_device_has_capability (device, info->capability)) {
-		const char *udi;
-		udi = hal_device_get_udi (device);
-		dbus_message_iter_append_basic (info->iter,
-						DBUS_TYPE_STRING,
-						&udi);
-	}
-
-	return TRUE;
-}
-
 /**  
  *  manager_find_device_by_capability:
  *  @connection:         D-BUS connection
@@ -641,7 +873,8 @@ manager_find_device_by_capability (DBusConnection * connection,
 	DBusMessageIter iter_array;
 	DBusError error;
 	const char *capability;
-	DeviceCapabilityInfo info;
+	GSList *devices;
+	GSList *l;
 
 	HAL_TRACE (("entering"));
 
@@ -665,12 +898,87 @@ manager_find_device_by_capability (DBusConnection * connection,
 					  DBUS_TYPE_STRING_AS_STRING,
 					  &iter_array);
 
-	info.capability = capability;
-	info.iter = &iter_array;
+	/* info.capabilities is always indexed */
+	devices = hal_device_store_match_multiple_key_strlist_contains (hald_get_gdl (),
+									"info.capabilities",
+									capability);
+	for (l = devices; l != NULL; l = l->next) {
+		const char *udi;
 
-	hal_device_store_foreach (hald_get_gdl (),
-				  foreach_device_by_capability,
-				  &info);
+		udi = hal_device_get_udi (HAL_DEVICE (l->data));
+		dbus_message_iter_append_basic (&iter_array,
+						DBUS_TYPE_STRING,
+						&udi);
+	}
+	g_slist_free (devices);
+
+	dbus_message_iter_close_container (&iter, &iter_array);
+
+	if (!dbus_connection_send (connection, reply, NULL))
+		DIE (("No memory"));
+
+	dbus_message_unref (reply);
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+
+/* Reply with the UDIs of the children or of the whole subtree of a device */
+static DBusHandlerResult
+manager_get_related_devices (DBusConnection * connection,
+			     DBusMessage * message,
+			     gboolean subtree)
+{
+	DBusMessage *reply;
+	DBusMessageIter iter;
+	DBusMessageIter iter_array;
+	DBusError error;
+	const char *udi;
+	HalDevice *d;
+	GSList *devices;
+	GSList *l;
+
+	dbus_error_init (&error);
+	if (!dbus_message_get_args (message, &error,
+				    DBUS_TYPE_STRING, &udi,
+				    DBUS_TYPE_INVALID)) {
+		raise_syntax (connection, message,
+			      subtree ? "Manager.GetSubtree" : "Manager.GetChildren");
+		dbus_error_free (&error);
+
+		return DBUS_HANDLER_RESULT_HANDLED;
+	}
+
+	HAL_TRACE (("entering, udi=%s", udi));
+
+	d = hal_device_store_find (hald_get_gdl (), udi);
+	if (d == NULL) {
+		raise_no_such_device (connection, message, udi);
+		return DBUS_HANDLER_RESULT_HANDLED;
+	}
+
+	reply = dbus_message_new_method_return (message);
+	if (reply == NULL)
+		DIE (("No memory"));
+
+	dbus_message_iter_init_append (reply, &iter);
+	dbus_message_iter_open_container (&iter, 
+					  DBUS_TYPE_ARRAY,
+					  DBUS_TYPE_STRING_AS_STRING,
+					  &iter_array);
+
+	/* info.parent is always indexed */
+	if (subtree)
+		devices = hal_device_store_get_subtree (hald_get_gdl (), d);
+	else
+		devices = hal_device_store_get_children (hald_get_gdl (), d);
+	for (l = devices; l != NULL; l = l->next) {
+		udi = hal_device_get_udi (HAL_DEVICE (l->data));
+		dbus_message_iter_append_basic (&iter_array,
+						DBUS_TYPE_STRING,
+						&udi);
+	}
+	g_slist_free (devices);
 
 	dbus_message_iter_close_container (&iter, &iter_array);
 
@@ -682,6 +990,45 @@ manager_find_device_by_capability (DBusConnection * connection,
 	return DBUS_HANDLER_RESULT_HANDLED;
 }
 
+/**  
+ *  manager_get_children:
+ *  @connection:         D-BUS connection
+ *  @message:            Message
+ *
+ *  Returns:             What to do with the message
+ *
+ *  Get the devices whose parent is the given device.
+ *
+ *  <pre>
+ *  array{object_reference} Manager.GetChildren(object_reference udi)
+ *  </pre>
+ *
+ */
+DBusHandlerResult
+manager_get_children (DBusConnection * connection, DBusMessage * message)
+{
+	return manager_get_related_devices (connection, message, FALSE);
+}
+
+/**  
+ *  manager_get_subtree:
+ *  @connection:         D-BUS connection
+ *  @message:            Message
+ *
+ *  Returns:             What to do with the message
+ *
+ *  Get a device and all its descendants, parents before their children.
+ *
+ *  <pre>
+ *  array{object_reference} Manager.GetSubtree(object_reference udi)
+ *  </pre>
+ *
+ */
+DBusHandlerResult
+manager_get_subtree (DBusConnection * connection, DBusMessage * message)
+{
+	return manager_get_related_devices (connection, message, TRUE);
+}
 
 /**  
  *  manager_device_exists:
@@ -2826,19 +3173,138 @@ device_unlock (DBusConnection *connection,
 /** Counter for atomic updating */
 static int atomic_count = 0;
 
-/** Number of updates pending */
-static int num_pending_updates = 0;
-
-/** Structure for queing updates */
+/** Net change of one property during an atomic update */
 typedef struct PendingUpdate_s {
-	char *udi;                    /**< udi of device */
-	char *key;                    /**< key of property; free when done */
-	dbus_bool_t removed;          /**< true iff property was removed */
-	dbus_bool_t added;            /**< true iff property was added */
-	struct PendingUpdate_s *next; /**< next update or #NULL */
+	char *key;                    /**< key of property */
+	dbus_bool_t existed_before;   /**< true iff property existed when the update began */
+	dbus_bool_t exists_now;       /**< true iff property exists after the last change */
 } PendingUpdate;
 
-static PendingUpdate *pending_updates_head = NULL;
+/** Changes to one device during an atomic update */
+typedef struct PendingDevice_s {
+	char *udi;                    /**< udi of device */
+	GHashTable *updates;          /**< key -> PendingUpdate */
+	GSList *update_list;          /**< PendingUpdate's, most recent first */
+} PendingDevice;
+
+/** udi -> PendingDevice for devices with updates pending */
+static GHashTable *pending_devices = NULL;
+
+/** PendingDevice's in order of their first update, most recent first */
+static GSList *pending_device_list = NULL;
+
+static void
+pending_update_queue (const char *udi, const char *key,
+		      dbus_bool_t added, dbus_bool_t removed)
+{
+	PendingDevice *pd;
+	PendingUpdate *pu;
+
+	if (pending_devices == NULL)
+		pending_devices = g_hash_table_new (g_str_hash, g_str_equal);
+
+	pd = g_hash_table_lookup (pending_devices, udi);
+	if (pd == NULL) {
+		pd = g_new0 (PendingDevice, 1);
+		pd->udi = g_strdup (udi);
+		pd->updates = g_hash_table_new (g_str_hash, g_str_equal);
+		g_hash_table_insert (pending_devices, pd->udi, pd);
+		pending_device_list = g_slist_prepend (pending_device_list, pd);
+	}
+
+	pu = g_hash_table_lookup (pd->updates, key);
+	if (pu == NULL) {
+		pu = g_new0 (PendingUpdate, 1);
+		pu->key = g_strdup (key);
+		pu->existed_before = !added;
+		g_hash_table_insert (pd->updates, pu->key, pu);
+		pd->update_list = g_slist_prepend (pd->update_list, pu);
+	}
+	pu->exists_now = !removed;
+}
+
+static void
+pending_device_emit (PendingDevice *pd)
+{
+	DBusMessage *message;
+	DBusMessageIter iter;
+	DBusMessageIter iter_array;
+	dbus_int32_t num_updates;
+	GSList *l;
+
+	/* a property that was added and then removed again didn't change */
+	num_updates = 0;
+	for (l = pd->update_list; l != NULL; l = l->next) {
+		PendingUpdate *pu = l->data;
+
+		if (pu->existed_before || pu->exists_now)
+			num_updates++;
+	}
+	if (num_updates == 0 || dbus_connection == NULL)
+		return;
+
+	/* prepare message */
+	message = dbus_message_new_signal (pd->udi,
+					   "org.freedesktop.Hal.Device",
+					   "PropertyModified");
+	dbus_message_iter_init_append (message, &iter);
+	dbus_message_iter_append_basic (&iter, DBUS_TYPE_INT32, &num_updates);
+
+	dbus_message_iter_open_container (&iter, 
+					  DBUS_TYPE_ARRAY,
+					  DBUS_STRUCT_BEGIN_CHAR_AS_STRING
+					  DBUS_TYPE_STRING_AS_STRING
+					  DBUS_TYPE_BOOLEAN_AS_STRING
+					  DBUS_TYPE_BOOLEAN_AS_STRING
+					  DBUS_STRUCT_END_CHAR_AS_STRING,
+					  &iter_array);
+
+	for (l = pd->update_list; l != NULL; l = l->next) {
+		PendingUpdate *pu = l->data;
+		DBusMessageIter iter_struct;
+		dbus_bool_t removed;
+		dbus_bool_t added;
+
+		if (!pu->existed_before && !pu->exists_now)
+			continue;
+
+		removed = !pu->exists_now;
+		added = !pu->existed_before;
+
+		dbus_message_iter_open_container (&iter_array,
+						  DBUS_TYPE_STRUCT,
+						  NULL,
+						  &iter_struct);
+		dbus_message_iter_append_basic (&iter_struct, DBUS_TYPE_STRING, &(pu->key));
+		dbus_message_iter_append_basic (&iter_struct, DBUS_TYPE_BOOLEAN, &removed);
+		dbus_message_iter_append_basic (&iter_struct, DBUS_TYPE_BOOLEAN, &added);
+		dbus_message_iter_close_container (&iter_array, &iter_struct);
+	}
+
+	dbus_message_iter_close_container (&iter, &iter_array);
+
+	if (!dbus_connection_send (dbus_connection, message, NULL))
+		DIE (("error broadcasting message"));
+
+	dbus_message_unref (message);
+}
+
+static void
+pending_device_free (PendingDevice *pd)
+{
+	GSList *l;
+
+	for (l = pd->update_list; l != NULL; l = l->next) {
+		PendingUpdate *pu = l->data;
+
+		g_free (pu->key);
+		g_free (pu);
+	}
+	g_slist_free (pd->update_list);
+	g_hash_table_destroy (pd->updates);
+	g_free (pd->udi);
+	g_free (pd);
+}
 
 /** 
  *  device_property_atomic_update_begin:
@@ -2864,9 +3330,7 @@ device_property_atomic_update_begin (void)
 void
 device_property_atomic_update_end (void)
 {
-	PendingUpdate *pu_iter = NULL;
-	PendingUpdate *pu_iter_next = NULL;
-	PendingUpdate *pu_iter2 = NULL;
+	GSList *l;
 
 	--atomic_count;
 
@@ -2875,94 +3339,24 @@ device_property_atomic_update_end (void)
 		atomic_count = 0;
 	}
 
-	if (atomic_count == 0 && num_pending_updates > 0) {
-		DBusMessage *message;
-		DBusMessageIter iter;
-		DBusMessageIter iter_array;
+	if (atomic_count == 0 && pending_device_list != NULL) {
+		GSList *devices;
 
-		for (pu_iter = pending_updates_head;
-		     pu_iter != NULL; pu_iter = pu_iter_next) {
-			int num_updates_this;
+		/* detach first; sending may cause more updates */
+		devices = g_slist_reverse (pending_device_list);
+		pending_device_list = NULL;
+		g_hash_table_destroy (pending_devices);
+		pending_devices = NULL;
 
-			pu_iter_next = pu_iter->next;
-
-			/* see if we've already processed this */
-			if (pu_iter->udi == NULL)
-				goto already_processed;
-
-			/* count number of updates for this device */
-			num_updates_this = 0;
-			for (pu_iter2 = pu_iter; pu_iter2 != NULL; pu_iter2 = pu_iter2->next) {
-				if (strcmp (pu_iter2->udi, pu_iter->udi) == 0)
-					num_updates_this++;
-			}
+		/* one signal per device with the net change of each key */
+		for (l = devices; l != NULL; l = l->next) {
+			PendingDevice *pd = l->data;
 
-			/* prepare message */
-			message = dbus_message_new_signal (pu_iter->udi,
-							   "org.freedesktop.Hal.Device",
-							   "PropertyModified");
-			dbus_message_iter_init_append (message, &iter);
-			dbus_message_iter_append_basic (&iter, DBUS_TYPE_INT32,
-							&num_updates_this);
-
-			dbus_message_iter_open_container (&iter, 
-							  DBUS_TYPE_ARRAY,
-							  DBUS_STRUCT_BEGIN_CHAR_AS_STRING
-							  DBUS_TYPE_STRING_AS_STRING
-							  DBUS_TYPE_BOOLEAN_AS_STRING
-							  DBUS_TYPE_BOOLEAN_AS_STRING
-							  DBUS_STRUCT_END_CHAR_AS_STRING,
-							  &iter_array);
-
-			for (pu_iter2 = pu_iter; pu_iter2 != NULL;
-			     pu_iter2 = pu_iter2->next) {
-				if (strcmp (pu_iter2->udi, pu_iter->udi) == 0) {
-					DBusMessageIter iter_struct;
-					dbus_message_iter_open_container (&iter_array,
-									  DBUS_TYPE_STRUCT,
-									  NULL,
-									  &iter_struct);
-					dbus_message_iter_append_basic
-					    (&iter_struct, 
-					     DBUS_TYPE_STRING,
-					     &(pu_iter2->key));
-					dbus_message_iter_append_basic
-					    (&iter_struct,
-					     DBUS_TYPE_BOOLEAN,
-					     &(pu_iter2->removed));
-					dbus_message_iter_append_basic
-					    (&iter_struct, 
-					     DBUS_TYPE_BOOLEAN,
-					     &(pu_iter2->added));
-
-					dbus_message_iter_close_container (&iter_array, &iter_struct);
-
-					/* signal this is already processed */
-					g_free (pu_iter2->key);
-					if (pu_iter2 != pu_iter) {
-						g_free (pu_iter2->udi);
-						pu_iter2->udi = NULL;
-					}
-				}
-			}
-
-			g_free (pu_iter->udi);
-			dbus_message_iter_close_container (&iter, &iter_array);
-
-			if (dbus_connection != NULL) {
-				if (!dbus_connection_send (dbus_connection, message, NULL))
-					DIE (("error broadcasting message"));
-			}
-
-			dbus_message_unref (message);
-
-		already_processed:
-			g_free (pu_iter);
-
-		} /* for all updates */
-
-		num_pending_updates = 0;
-		pending_updates_head = NULL;
+			pd->update_list = g_slist_reverse (pd->update_list);
+			pending_device_emit (pd);
+			pending_device_free (pd);
+		}
+		g_slist_free (devices);
 	}
 }
 
@@ -2985,17 +3379,7 @@ device_send_signal_property_modified (HalDevice *device, const char *key,
 */
 
 	if (atomic_count > 0) {
-		PendingUpdate *pu;
-
-		pu = g_new0 (PendingUpdate, 1);
-		pu->udi = g_strdup (udi);
-		pu->key = g_strdup (key);
-		pu->removed = removed;
-		pu->added = added;
-		pu->next = pending_updates_head;
-
-		pending_updates_head = pu;
-		num_pending_updates++;
+		pending_update_queue (udi, key, added, removed);
 	} else {
 		dbus_int32_t i;
 		DBusMessageIter iter_struct;
@@ -4482,6 +4866,21 @@ do_introspect (DBusConnection  *connection,
 				       "    <method name=\"GetAllDevicesWithProperties\">\n"
 				       "      <arg name=\"devices_with_props\" direction=\"out\" type=\"a(sa{sv})\"/>\n"
 				       "    </method>\n"
+				       "    <method name=\"GetDevicesWithPropertiesFiltered\">\n"
+				       "      <arg name=\"devices_with_props\" direction=\"out\" type=\"a(sa{sv})\"/>\n"
+				       "      <arg name=\"next_cursor\" direction=\"out\" type=\"s\"/>\n"
+				       "      <arg name=\"capability\" direction=\"in\" type=\"s\"/>\n"
+				       "      <arg name=\"key\" direction=\"in\" type=\"s\"/>\n"
+				       "      <arg name=\"value\" direction=\"in\" type=\"s\"/>\n"
+				       "      <arg name=\"wanted_keys\" direction=\"in\" type=\"as\"/>\n"
+				       "      <arg name=\"cursor\" direction=\"in\" type=\"s\"/>\n"
+				       "      <arg name=\"max_devices\" direction=\"in\" type=\"u\"/>\n"
+				       "    </method>\n"
+				       "    <method name=\"GetDevicesProperties\">\n"
+				       "      <arg name=\"devices_with_props\" direction=\"out\" type=\"a(sa{sv})\"/>\n"
+				       "      <arg name=\"udis\" direction=\"in\" type=\"as\"/>\n"
+				       "      <arg name=\"keys\" direction=\"in\" type=\"as\"/>\n"
+				       "    </method>\n"
 				       "    <method name=\"DeviceExists\">\n"
 				       "      <arg name=\"does_it_exist\" direction=\"out\" type=\"b\"/>\n"
 				       "      <arg name=\"udi\" direction=\"in\" type=\"s\"/>\n"
@@ -4495,6 +4894,14 @@ do_introspect (DBusConnection  *connection,
 				       "      <arg name=\"devices\" direction=\"out\" type=\"as\"/>\n"
 				       "      <arg name=\"capability\" direction=\"in\" type=\"s\"/>\n"
 				       "    </method>\n"
+				       "    <method name=\"GetChildren\">\n"
+				       "      <arg name=\"devices\" direction=\"out\" type=\"as\"/>\n"
+				       "      <arg name=\"udi\" direction=\"in\" type=\"s\"/>\n"
+				       "    </method>\n"
+				       "    <method name=\"GetSubtree\">\n"
+				       "      <arg name=\"devices\" direction=\"out\" type=\"as\"/>\n"
+				       "      <arg name=\"udi\" direction=\"in\" type=\"s\"/>\n"
+				       "    </method>\n"
 				       "    <method name=\"NewDevice\">\n"
 				       "      <arg name=\"temporary_udi\" direction=\"out\" type=\"s\"/>\n"
 				       "    </method>\n"
@@ -4859,6 +5266,236 @@ reply_from_fwd_message (DBusPendingCall *pending_call,
 	dbus_pending_call_unref (pending_call);
 }
 
+static DBusHandlerResult
+device_string_list_append (DBusConnection *connection, DBusMessage *message)
+{
+	return device_string_list_append_prepend (connection, message, FALSE);
+}
+
+static DBusHandlerResult
+device_string_list_prepend (DBusConnection *connection, DBusMessage *message)
+{
+	return device_string_list_append_prepend (connection, message, TRUE);
+}
+
+/* Buckets of the dispatch latency histogram: < 10us, < 100us, ..., >= 100ms */
+#define METHOD_LATENCY_BUCKETS 6
+
+/** A method implemented by hald itself */
+typedef struct {
+	const char *interface;
+	const char *member;
+	/** only dispatched to when called on the Manager object */
+	dbus_bool_t manager_only;
+	/** checks who the caller is, so calls wait for ci_tracker_resolve_info() */
+	dbus_bool_t needs_caller_info;
+	/** exactly one of these is set */
+	DBusHandlerResult (*handler) (DBusConnection *connection, DBusMessage *message);
+	DBusHandlerResult (*local_handler) (DBusConnection *connection, DBusMessage *message,
+					    dbus_bool_t local_interface);
+
+	/** number of calls dispatched */
+	guint hits;
+	/** time spent in the handler, see METHOD_LATENCY_BUCKETS */
+	guint latency[METHOD_LATENCY_BUCKETS];
+} MethodDispatch;
+
+#define MANAGER_METHOD(member, handler) \
+	{ "org.freedesktop.Hal.Manager", member, TRUE, FALSE, handler, NULL, 0, { 0 } }
+#define MANAGER_LOCAL_METHOD(member, handler) \
+	{ "org.freedesktop.Hal.Manager", member, TRUE, FALSE, NULL, handler, 0, { 0 } }
+#define MANAGER_PRIVILEGED_METHOD(member, handler) \
+	{ "org.freedesktop.Hal.Manager", member, TRUE, TRUE, NULL, handler, 0, { 0 } }
+#define DEVICE_METHOD(member, handler) \
+	{ "org.freedesktop.Hal.Device", member, FALSE, FALSE, handler, NULL, 0, { 0 } }
+#define DEVICE_LOCAL_METHOD(member, handler) \
+	{ "org.freedesktop.Hal.Device", member, FALSE, FALSE, NULL, handler, 0, { 0 } }
+#define DEVICE_PRIVILEGED_METHOD(member, handler) \
+	{ "org.freedesktop.Hal.Device", member, FALSE, TRUE, NULL, handler, 0, { 0 } }
+
+static MethodDispatch method_dispatch_table[] = {
+	MANAGER_METHOD ("GetAllDevices", manager_get_all_devices),
+	MANAGER_METHOD ("GetAllDevicesWithProperties", manager_get_all_devices_with_properties),
+	MANAGER_METHOD ("GetDevicesWithPropertiesFiltered", manager_get_devices_with_properties_filtered),
+	MANAGER_METHOD ("GetDevicesProperties", manager_get_devices_properties),
+	MANAGER_METHOD ("DeviceExists", manager_device_exists),
+	MANAGER_METHOD ("FindDeviceStringMatch", manager_find_device_string_match),
+	MANAGER_METHOD ("FindDeviceByCapability", manager_find_device_by_capability),
+	MANAGER_METHOD ("GetChildren", manager_get_children),
+	MANAGER_METHOD ("GetSubtree", manager_get_subtree),
+	MANAGER_PRIVILEGED_METHOD ("NewDevice", manager_new_device),
+	MANAGER_PRIVILEGED_METHOD ("Remove", manager_remove),
+	MANAGER_PRIVILEGED_METHOD ("CommitToGdl", manager_commit_to_gdl),
+	MANAGER_LOCAL_METHOD ("AcquireGlobalInterfaceLock", device_acquire_global_interface_lock),
+	MANAGER_LOCAL_METHOD ("ReleaseGlobalInterfaceLock", device_release_global_interface_lock),
+	MANAGER_LOCAL_METHOD ("SingletonAddonIsReady", singleton_addon_is_ready),
+
+	DEVICE_PRIVILEGED_METHOD ("AcquireInterfaceLock", device_acquire_interface_lock),
+	DEVICE_LOCAL_METHOD ("ReleaseInterfaceLock", device_release_interface_lock),
+	DEVICE_PRIVILEGED_METHOD ("IsCallerLockedOut", device_is_caller_locked_out),
+	DEVICE_PRIVILEGED_METHOD ("IsCallerPrivileged", device_is_caller_privileged),
+	DEVICE_PRIVILEGED_METHOD ("IsLockedByOthers", device_is_locked_by_others),
+	DEVICE_METHOD ("GetAllProperties", device_get_all_properties),
+	DEVICE_PRIVILEGED_METHOD ("SetMultipleProperties", device_set_multiple_properties),
+	DEVICE_METHOD ("GetProperty", device_get_property),
+	DEVICE_METHOD ("GetPropertyString", device_get_property),
+	DEVICE_METHOD ("GetPropertyStringList", device_get_property),
+	DEVICE_METHOD ("GetPropertyInteger", device_get_property),
+	DEVICE_METHOD ("GetPropertyBoolean", device_get_property),
+	DEVICE_METHOD ("GetPropertyDouble", device_get_property),
+	DEVICE_PRIVILEGED_METHOD ("SetProperty", device_set_property),
+	DEVICE_PRIVILEGED_METHOD ("SetPropertyString", device_set_property),
+	DEVICE_PRIVILEGED_METHOD ("SetPropertyInteger", device_set_property),
+	DEVICE_PRIVILEGED_METHOD ("SetPropertyBoolean", device_set_property),
+	DEVICE_PRIVILEGED_METHOD ("SetPropertyDouble", device_set_property),
+	DEVICE_PRIVILEGED_METHOD ("RemoveProperty", device_remove_property),
+	DEVICE_METHOD ("GetPropertyType", device_get_property_type),
+	DEVICE_METHOD ("PropertyExists", device_property_exists),
+	DEVICE_PRIVILEGED_METHOD ("AddCapability", device_add_capability),
+	DEVICE_METHOD ("QueryCapability", device_query_capability),
+	DEVICE_METHOD ("Lock", device_lock),
+	DEVICE_METHOD ("Unlock", device_unlock),
+	DEVICE_METHOD ("StringListAppend", device_string_list_append),
+	DEVICE_METHOD ("StringListPrepend", device_string_list_prepend),
+	DEVICE_METHOD ("StringListRemove", device_string_list_remove),
+	DEVICE_PRIVILEGED_METHOD ("Rescan", device_rescan),
+	DEVICE_PRIVILEGED_METHOD ("Reprobe", device_reprobe),
+	DEVICE_LOCAL_METHOD ("EmitCondition", device_emit_condition),
+	DEVICE_LOCAL_METHOD ("ClaimInterface", device_claim_interface),
+#if 0
+	DEVICE_LOCAL_METHOD ("ReleaseInterface", device_release_interface),
+#endif
+	DEVICE_LOCAL_METHOD ("AddonIsReady", addon_is_ready),
+
+	{ "org.freedesktop.DBus.Introspectable", "Introspect", FALSE, FALSE, NULL, do_introspect, 0, { 0 } }
+};
+
+/** interface -> (member -> MethodDispatch) */
+static GHashTable *method_dispatch = NULL;
+
+static void
+method_dispatch_init (void)
+{
+	guint n;
+
+	method_dispatch = g_hash_table_new (g_str_hash, g_str_equal);
+	for (n = 0; n < G_N_ELEMENTS (method_dispatch_table); n++) {
+		MethodDispatch *md = &method_dispatch_table[n];
+		GHashTable *members;
+
+		members = g_hash_table_lookup (method_dispatch, md->interface);
+		if (members == NULL) {
+			members = g_hash_table_new (g_str_hash, g_str_equal);
+			g_hash_table_insert (method_dispatch, (gpointer) md->interface, members);
+		}
+		g_hash_table_insert (members, (gpointer) md->member, md);
+	}
+}
+
+static MethodDispatch *
+method_dispatch_lookup (DBusMessage *message)
+{
+	const char *interface;
+	const char *member;
+	const char *path;
+	GHashTable *members;
+	MethodDispatch *md;
+
+	if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_CALL)
+		return NULL;
+
+	interface = dbus_message_get_interface (message);
+	member = dbus_message_get_member (message);
+	if (interface == NULL || member == NULL)
+		return NULL;
+
+	if (method_dispatch == NULL)
+		method_dispatch_init ();
+
+	members = g_hash_table_lookup (method_dispatch, interface);
+	if (members == NULL)
+		return NULL;
+
+	md = g_hash_table_lookup (members, member);
+	if (md == NULL)
+		return NULL;
+
+	if (md->manager_only) {
+		path = dbus_message_get_path (message);
+		if (path == NULL || strcmp (path, "/org/freedesktop/Hal/Manager") != 0)
+			return NULL;
+	}
+
+	return md;
+}
+
+/* methods on device-specific interfaces go to addons and method
+ * handlers which check who the caller is */
+static gboolean
+method_needs_caller_info (DBusMessage *message)
+{
+	MethodDispatch *md;
+
+	md = method_dispatch_lookup (message);
+	return md == NULL || md->needs_caller_info;
+}
+
+static DBusHandlerResult
+method_dispatch_call (MethodDispatch *md, DBusConnection *connection, DBusMessage *message,
+		      dbus_bool_t local_interface)
+{
+	DBusHandlerResult result;
+	GTimeVal start;
+	GTimeVal end;
+	glong usec;
+	guint bucket;
+
+	g_get_current_time (&start);
+
+	if (md->handler != NULL)
+		result = md->handler (connection, message);
+	else
+		result = md->local_handler (connection, message, local_interface);
+
+	/* Note that this is the time until the handler returned; methods
+	 * that reply asynchronously are done long after that */
+	g_get_current_time (&end);
+	usec = (end.tv_sec - start.tv_sec) * G_USEC_PER_SEC + (end.tv_usec - start.tv_usec);
+	for (bucket = 0; bucket < METHOD_LATENCY_BUCKETS - 1 && usec >= 10; bucket++)
+		usec /= 10;
+
+	md->hits++;
+	md->latency[bucket]++;
+
+	return result;
+}
+
+/** 
+ *  hald_dbus_print_method_stats:
+ *
+ *  Log how often each method hald implements itself was called and a
+ *  histogram of the time spent handling it. Methods that were never
+ *  called are left out.
+ */
+void
+hald_dbus_print_method_stats (void)
+{
+	guint n;
+
+	HAL_INFO (("Method calls (count, then <10us <100us <1ms <10ms <100ms >=100ms):"));
+	for (n = 0; n < G_N_ELEMENTS (method_dispatch_table); n++) {
+		MethodDispatch *md = &method_dispatch_table[n];
+
+		if (md->hits == 0)
+			continue;
+
+		HAL_INFO (("  %s.%s: %u (%u %u %u %u %u %u)",
+			   md->interface, md->member, md->hits,
+			   md->latency[0], md->latency[1], md->latency[2],
+			   md->latency[3], md->latency[4], md->latency[5]));
+	}
+}
+
 static DBusHandlerResult
 hald_dbus_filter_handle_methods (DBusConnection *connection, DBusMessage *message, 
 				 void *user_data, dbus_bool_t local_interface)
@@ -4870,216 +5507,11 @@ hald_dbus_filter_handle_methods (DBusConnection *connection, DBusMessage *messag
 		   dbus_message_get_member (message),
 		   local_interface));*/
 
-	if (dbus_message_is_method_call (message,
-					 "org.freedesktop.Hal.Manager",
-					 "GetAllDevices") &&
-		   strcmp (dbus_message_get_path (message),
-			   "/org/freedesktop/Hal/Manager") == 0) {
-		return manager_get_all_devices (connection, message);
-	} else if (dbus_message_is_method_call (message,
-                                                "org.freedesktop.Hal.Manager",
-                                                "GetAllDevicesWithProperties") &&
-		   strcmp (dbus_message_get_path (message),
-			   "/org/freedesktop/Hal/Manager") == 0) {
-		return manager_get_all_devices_with_properties (connection, message);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Manager",
-						"DeviceExists") &&
-		   strcmp (dbus_message_get_path (message),
-			   "/org/freedesktop/Hal/Manager") == 0) {
-		return manager_device_exists (connection, message);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Manager",
-						"FindDeviceStringMatch") &&
-		   strcmp (dbus_message_get_path (message),
-			   "/org/freedesktop/Hal/Manager") == 0) {
-		return manager_find_device_string_match (connection,
-							 message);
-	} else if (dbus_message_is_method_call
-		   (message, "org.freedesktop.Hal.Manager",
-		    "FindDeviceByCapability")
-		   && strcmp (dbus_message_get_path (message),
-			      "/org/freedesktop/Hal/Manager") == 0) {
-		return manager_find_device_by_capability (connection,
-							  message);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Manager",
-						"NewDevice") &&
-		   strcmp (dbus_message_get_path (message),
-			    "/org/freedesktop/Hal/Manager") == 0) {
-		return manager_new_device (connection, message, local_interface);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Manager",
-						"Remove") &&
-		   strcmp (dbus_message_get_path (message),
-			    "/org/freedesktop/Hal/Manager") == 0) {
-		return manager_remove (connection, message, local_interface);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Manager",
-						"CommitToGdl") &&
-		   strcmp (dbus_message_get_path (message),
-			    "/org/freedesktop/Hal/Manager") == 0) {
-		return manager_commit_to_gdl (connection, message, local_interface);
-
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Manager",
-						"AcquireGlobalInterfaceLock") &&
-                   strcmp (dbus_message_get_path (message), "/org/freedesktop/Hal/Manager") == 0) {
-		return device_acquire_global_interface_lock (connection, message, local_interface);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Manager",
-						"ReleaseGlobalInterfaceLock") &&
-                   strcmp (dbus_message_get_path (message), "/org/freedesktop/Hal/Manager") == 0) {
-		return device_release_global_interface_lock (connection, message, local_interface);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Manager",
-						"SingletonAddonIsReady") &&
-		   strcmp (dbus_message_get_path (message),
-			    "/org/freedesktop/Hal/Manager") == 0) {
-		return singleton_addon_is_ready (connection, message, local_interface);
-
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Device",
-						"AcquireInterfaceLock")) {
-		return device_acquire_interface_lock (connection, message, local_interface);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Device",
-						"ReleaseInterfaceLock")) {
-		return device_release_interface_lock (connection, message, local_interface);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Device",
-						"IsCallerLockedOut")) {
-		return device_is_caller_locked_out (connection, message, local_interface);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Device",
-						"IsCallerPrivileged")) {
-		return device_is_caller_privileged (connection, message, local_interface);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Device",
-						"IsLockedByOthers")) {
-		return device_is_locked_by_others (connection, message, local_interface);
-	} else if (dbus_message_is_method_call (message,
-					      "org.freedesktop.Hal.Device",
-					      "GetAllProperties")) {
-		return device_get_all_properties (connection, message);
-	} else if (dbus_message_is_method_call (message,
-					      "org.freedesktop.Hal.Device",
-					      "SetMultipleProperties")) {
-		return device_set_multiple_properties (connection, message, local_interface);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Device",
-						"GetProperty")) {
-		return device_get_property (connection, message);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Device",
-						"GetPropertyString")) {
-		return device_get_property (connection, message);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Device",
-						"GetPropertyStringList")) {
-		return device_get_property (connection, message);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Device",
-						"GetPropertyInteger")) {
-		return device_get_property (connection, message);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Device",
-						"GetPropertyBoolean")) {
-		return device_get_property (connection, message);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Device",
-						"GetPropertyDouble")) {
-		return device_get_property (connection, message);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Device",
-						"SetProperty")) {
-		return device_set_property (connection, message, local_interface);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Device",
-						"SetPropertyString")) {
-		return device_set_property (connection, message, local_interface);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Device",
-						"SetPropertyInteger")) {
-		return device_set_property (connection, message, local_interface);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Device",
-						"SetPropertyBoolean")) {
-		return device_set_property (connection, message, local_interface);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Device",
-						"SetPropertyDouble")) {
-		return device_set_property (connection, message, local_interface);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Device",
-						"RemoveProperty")) {
-		return device_remove_property (connection, message, local_interface);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Device",
-						"GetPropertyType")) {
-		return device_get_property_type (connection, message);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Device",
-						"PropertyExists")) {
-		return device_property_exists (connection, message);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Device",
-						"AddCapability")) {
-		return device_add_capability (connection, message, local_interface);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Device",
-						"QueryCapability")) {
-		return device_query_capability (connection, message);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Device",
-						"Lock")) {
-		return device_lock (connection, message);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Device",
-						"Unlock")) {
-		return device_unlock (connection, message);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Device",
-						"StringListAppend")) {
-		return device_string_list_append_prepend (connection, message, FALSE);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Device",
-						"StringListPrepend")) {
-		return device_string_list_append_prepend (connection, message, TRUE);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Device",
-						"StringListRemove")) {
-		return device_string_list_remove (connection, message);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Device",
-						"Rescan")) {
-		return device_rescan (connection, message, local_interface);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Device",
-						"Reprobe")) {
-		return device_reprobe (connection, message, local_interface);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Device",
-						"EmitCondition")) {
-		return device_emit_condition (connection, message, local_interface);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Device",
-						"ClaimInterface")) {
-		return device_claim_interface (connection, message, local_interface);
-#if 0
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Device",
-						"ReleaseInterface")) {
-		return device_release_interface (connection, message, local_interface);
-#endif
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.Hal.Device",
-						"AddonIsReady")) {
-		return addon_is_ready (connection, message, local_interface);
-	} else if (dbus_message_is_method_call (message,
-						"org.freedesktop.DBus.Introspectable",
-						"Introspect")) {
-		return do_introspect (connection, message, local_interface);
+	MethodDispatch *md;
+
+	md = method_dispatch_lookup (message);
+	if (md != NULL) {
+		return method_dispatch_call (md, connection, message, local_interface);
 	} else {
 		const char *interface;
 		const char *udi;
@@ -5216,6 +5648,37 @@ out:
 	return osspec_filter_function (connection, message, user_data);
 }
 
+/* Called once we know who sent a method call that was parked in
+ * hald_dbus_filter_function() */
+static void
+parked_method_call_resolved (CITracker *cit, CICallerInfo *ci, void *user_data)
+{
+	DBusMessage *message = (DBusMessage *) user_data;
+	DBusMessage *reply;
+
+	/* we lost the connection meanwhile */
+	if (dbus_connection == NULL)
+		goto out;
+
+	/* if we don't handle it libdbus would normally reply for us */
+	if (hald_dbus_filter_handle_methods (dbus_connection, message, NULL, FALSE) == DBUS_HANDLER_RESULT_NOT_YET_HANDLED &&
+	    !dbus_message_get_no_reply (message)) {
+		reply = dbus_message_new_error_printf (message, DBUS_ERROR_UNKNOWN_METHOD,
+						       "Method \"%s\" with signature \"%s\" on interface \"%s\" doesn't exist",
+						       dbus_message_get_member (message),
+						       dbus_message_get_signature (message),
+						       dbus_message_get_interface (message) != NULL ? 
+						       dbus_message_get_interface (message) : "(null)");
+		if (reply != NULL) {
+			dbus_connection_send (dbus_connection, reply, NULL);
+			dbus_message_unref (reply);
+		}
+	}
+
+out:
+	dbus_message_unref (message);
+}
+
 /**  
  *  hald_dbus_filter_function:
  *  @connection:          D-BUS connection
@@ -5308,6 +5771,19 @@ hald_dbus_filter_function (DBusConnection * connection,
                         ck_tracker_process_system_bus_message (ck_tracker, message);
                 }
 #endif
+		/* don't block the main loop finding out who a new caller is;
+		 * park calls that need to know until we do. Calls queued
+		 * behind a parked one wait too so they stay in order. */
+		if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_METHOD_CALL &&
+		    (method_needs_caller_info (message) ||
+		     ci_tracker_is_resolving (ci_tracker, dbus_message_get_sender (message)))) {
+			dbus_message_ref (message);
+			if (ci_tracker_resolve_info (ci_tracker, dbus_message_get_sender (message),
+						     parked_method_call_resolved, message))
+				return DBUS_HANDLER_RESULT_HANDLED;
+			dbus_message_unref (message);
+		}
+
 		return hald_dbus_filter_handle_methods (connection, message, user_data, FALSE);
         }
 
@@ -5771,6 +6247,8 @@ hald_dbus_session_removed (CKTracker *tracker, CKSession *session, void *user_da
 	HAL_INFO (("In hald_dbus_session_removed for session '%s' on seat '%s'", 
 		   session_id, ck_session_get_seat (session) != NULL ? seat_id : "(NONE)"));
 
+	ci_tracker_session_removed (ci_tracker, ck_session_get_objpath (session));
+
 	d = hal_device_store_find (hald_get_gdl (), "/org/freedesktop/Hal/devices/computer");
 	if (d == NULL) {
 		d = hal_device_store_find (hald_get_tdl (), "/org/freedesktop/Hal/devices/computer");
@@ -5803,6 +6281,7 @@ static void
 hald_dbus_ck_disappeared (CKTracker *tracker, void *user_data)
 {
 	HAL_INFO (("In hald_dbus_ck_disappeared"));
+	ci_tracker_session_removed (ci_tracker, NULL);
         reconfigure_acl ();
 }
 
@@ -34,10 +34,18 @@ DBusHandlerResult manager_get_all_devices           (DBusConnection *connection,
 						     DBusMessage    *message);
 DBusHandlerResult manager_get_all_devices_with_properties (DBusConnection *connection,
 						     DBusMessage    *message);
+DBusHandlerResult manager_get_devices_with_properties_filtered (DBusConnection *connection,
+						     DBusMessage    *message);
+DBusHandlerResult manager_get_devices_properties    (DBusConnection *connection,
+						     DBusMessage    *message);
 DBusHandlerResult manager_find_device_string_match  (DBusConnection *connection,
 						     DBusMessage    *message);
 DBusHandlerResult manager_find_device_by_capability (DBusConnection *connection,
 						     DBusMessage    *message);
+DBusHandlerResult manager_get_children              (DBusConnection *connection,
+						     DBusMessage    *message);
+DBusHandlerResult manager_get_subtree               (DBusConnection *connection,
+						     DBusMessage    *message);
 DBusHandlerResult manager_device_exists             (DBusConnection *connection,
 						     DBusMessage    *message);
 DBusHandlerResult device_get_all_properties         (DBusConnection *connection,
@@ -115,6 +123,8 @@ DBusHandlerResult hald_dbus_filter_function (DBusConnection * connection, DBusMe
 
 char *hald_dbus_local_server_addr (void);
 
+void hald_dbus_print_method_stats (void);
+
 gboolean device_is_executing_method (HalDevice *d, const char *interface_name, const char *method_name);
 
 
@@ -69,30 +69,200 @@ typedef struct {
 	gboolean is_singleton;
 	gpointer data1;
 	gpointer data2;
+	GList *device_link;	/* our node in the device's queue */
 } RunningProcess;
 
-/* list of RunningProcess */
-static GSList *running_processes = NULL;
+/* pid -> RunningProcess */
+static GHashTable *running_processes = NULL;
+/* HalDevice -> GQueue of RunningProcess */
+static GHashTable *running_processes_by_device = NULL;
+
+typedef struct {
+	HalDevice *device;
+	gchar *command_line;
+	HalRunTerminatedCB cb;
+	gboolean is_singleton;
+	gboolean cancelled;
+	gpointer data1;
+	gpointer data2;
+} PendingStart;
+
+/* list of PendingStart; Start requests whose reply hasn't arrived yet */
+static GSList *pending_starts = NULL;
+
+/* UDIs whose helpers should be killed, sent to the runner in one go */
+static GPtrArray *pending_kills = NULL;
+static guint pending_kills_source = 0;
+
+static void
+running_processes_init (void)
+{
+	running_processes = g_hash_table_new (g_direct_hash, g_direct_equal);
+	running_processes_by_device = g_hash_table_new (g_direct_hash, g_direct_equal);
+}
+
+static void
+running_processes_add (RunningProcess *rp)
+{
+	GQueue *queue;
+
+	g_hash_table_insert (running_processes, GINT_TO_POINTER (rp->pid), rp);
+
+	queue = g_hash_table_lookup (running_processes_by_device, rp->device);
+	if (queue == NULL) {
+		queue = g_queue_new ();
+		g_hash_table_insert (running_processes_by_device, rp->device, queue);
+	}
+	g_queue_push_head (queue, rp);
+	rp->device_link = g_queue_peek_head_link (queue);
+}
+
+/* Unlink rp from both indexes; the caller frees it */
+static void
+running_processes_remove (RunningProcess *rp)
+{
+	GQueue *queue;
+
+	g_hash_table_remove (running_processes, GINT_TO_POINTER (rp->pid));
+
+	queue = g_hash_table_lookup (running_processes_by_device, rp->device);
+	if (queue != NULL) {
+		g_queue_delete_link (queue, rp->device_link);
+		if (g_queue_is_empty (queue)) {
+			g_hash_table_remove (running_processes_by_device, rp->device);
+			g_queue_free (queue);
+		}
+	}
+	rp->device_link = NULL;
+}
 
 static void
 running_processes_remove_device (HalDevice * device)
 {
 	GSList *i;
-	GSList *j;
-
-	for (i = running_processes; i != NULL; i = j) {
-		RunningProcess *rp;
+	GQueue *queue;
+	RunningProcess *rp;
 
-		j = g_slist_next (i);
-		rp = i->data;
+	/* a Start may still be in flight for the device */
+	for (i = pending_starts; i != NULL; i = g_slist_next (i)) {
+		PendingStart *ps = i->data;
 
-		if (rp->device == device) {
-			g_free (rp);
-			running_processes =
-			    g_slist_delete_link (running_processes, i);
+		if (ps->device == device) {
+			ps->device = NULL;
+			ps->cancelled = TRUE;
 		}
+	}
+
+	if (running_processes_by_device == NULL)
+		return;
+
+	queue = g_hash_table_lookup (running_processes_by_device, device);
+	if (queue == NULL)
+		return;
+
+	g_hash_table_remove (running_processes_by_device, device);
+	while ((rp = g_queue_pop_head (queue)) != NULL) {
+		g_hash_table_remove (running_processes, GINT_TO_POINTER (rp->pid));
+		g_free (rp);
+	}
+	g_queue_free (queue);
+}
+
+static gboolean
+free_device_queue (gpointer key, gpointer value, gpointer user_data)
+{
+	g_queue_free ((GQueue *) value);
+	return TRUE;
+}
+
+static gboolean
+free_running_process (gpointer key, gpointer value, gpointer user_data)
+{
+	g_free (value);
+	return TRUE;
+}
+
+/* Forget about every running process at once */
+static void
+running_processes_remove_all (void)
+{
+	if (running_processes == NULL)
+		return;
+
+	HAL_INFO (("Dropping %d running processes",
+		   g_hash_table_size (running_processes)));
+
+	g_hash_table_foreach_remove (running_processes_by_device, free_device_queue, NULL);
+	g_hash_table_foreach_remove (running_processes, free_running_process, NULL);
+}
+
+static void
+pending_kills_clear (void)
+{
+	guint i;
+
+	if (pending_kills_source != 0) {
+		g_source_remove (pending_kills_source);
+		pending_kills_source = 0;
+	}
+
+	if (pending_kills == NULL)
+		return;
+
+	for (i = 0; i < pending_kills->len; i++)
+		g_free (g_ptr_array_index (pending_kills, i));
+	g_ptr_array_set_size (pending_kills, 0);
+}
+
+/* Send the queued kills as a single KillUdis message. This must be done
+ * before any other message goes to the runner, so that e.g. a helper
+ * started for a device that was re-added isn't killed by a stale
+ * request. */
+static void
+pending_kills_flush (void)
+{
+	DBusMessage *msg;
+	DBusMessageIter iter;
+	DBusMessageIter array_iter;
+	guint i;
+
+	if (pending_kills == NULL || pending_kills->len == 0 ||
+	    runner_connection == NULL)
+		return;
+
+	HAL_INFO (("Killing helpers of %d devices", pending_kills->len));
+
+	msg = dbus_message_new_method_call ("org.freedesktop.HalRunner",
+					    "/org/freedesktop/HalRunner",
+					    "org.freedesktop.HalRunner",
+					    "KillUdis");
+	if (msg == NULL)
+		DIE (("No memory"));
+	dbus_message_set_no_reply (msg, TRUE);
 
+	dbus_message_iter_init_append (msg, &iter);
+	dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+					  DBUS_TYPE_STRING_AS_STRING,
+					  &array_iter);
+	for (i = 0; i < pending_kills->len; i++) {
+		const char *udi = g_ptr_array_index (pending_kills, i);
+
+		dbus_message_iter_append_basic (&array_iter, DBUS_TYPE_STRING, &udi);
 	}
+	dbus_message_iter_close_container (&iter, &array_iter);
+
+	dbus_connection_send (runner_connection, msg, NULL);
+	dbus_message_unref (msg);
+
+	pending_kills_clear ();
+}
+
+static gboolean
+pending_kills_flush_idle (gpointer data)
+{
+	pending_kills_source = 0;
+	pending_kills_flush ();
+	return FALSE;
 }
 
 void
@@ -117,28 +287,20 @@ runner_server_message_handler (DBusConnection * connection,
 		if (dbus_message_get_args (message, &error,
 					   DBUS_TYPE_INT64, &dpid,
 					   DBUS_TYPE_INVALID)) {
-			GSList *i;
+			RunningProcess *rp;
 			GPid pid;
 
 			pid = (GPid) dpid;
 
 			HAL_INFO (("Previously started process with pid %d exited", pid));
 
-			for (i = running_processes; i != NULL;
-			     i = g_slist_next (i)) {
-				RunningProcess *rp;
-
-				rp = i->data;
-
-				if (rp->pid == pid) {
-					rp->cb (rp->device, 0, 0, NULL,
-						rp->data1, rp->data2);
-					g_free (rp);
-					running_processes =
-					    g_slist_delete_link
-					    (running_processes, i);
-					break;
-				}
+			rp = g_hash_table_lookup (running_processes,
+						  GINT_TO_POINTER (pid));
+			if (rp != NULL) {
+				running_processes_remove (rp);
+				rp->cb (rp->device, 0, 0, NULL,
+					rp->data1, rp->data2);
+				g_free (rp);
 			}
 		} else {
 			dbus_error_free (&error);
@@ -209,16 +371,19 @@ hald_runner_stop_runner (void)
 {
 	if (runner_server != NULL) {
 		DBusMessage *msg;
+		GSList *i;
 
 		/* Don't care about running processes anymore */
 
-		HAL_INFO (("running_processes %p, num = %d",
-			   running_processes,
-			   g_slist_length (running_processes)));
+		running_processes_remove_all ();
+		pending_kills_clear ();
 
-		g_slist_foreach (running_processes, (GFunc) g_free, NULL);
-		g_slist_free (running_processes);
-		running_processes = NULL;
+		for (i = pending_starts; i != NULL; i = g_slist_next (i)) {
+			PendingStart *ps = i->data;
+
+			ps->device = NULL;
+			ps->cancelled = TRUE;
+		}
 
 		HAL_INFO (("Killing runner with pid %d", runner_pid));
 
@@ -252,7 +417,8 @@ hald_runner_start_runner (void)
 	const char *hald_runner_path;
 	char *server_address;
 
-	running_processes = NULL;
+	if (running_processes == NULL)
+		running_processes_init ();
 
 	dbus_error_init (&err);
 	runner_server = dbus_server_listen (DBUS_SERVER_ADDRESS, &err);
@@ -286,7 +452,11 @@ hald_runner_start_runner (void)
 				     PACKAGE_BIN_DIR);
 	}
 
-	/*env[2] = "DBUS_VERBOSE=1"; */
+	if (g_getenv ("HALD_RUNNER_PREFORK") != NULL)
+		env[2] = g_strdup_printf ("HALD_RUNNER_PREFORK=%s",
+					  g_getenv ("HALD_RUNNER_PREFORK"));
+
+	/*env[3] = "DBUS_VERBOSE=1"; */
 
 
 	if (!g_spawn_async
@@ -300,6 +470,7 @@ hald_runner_start_runner (void)
 	}
 	g_free (env[0]);
 	g_free (env[1]);
+	g_free (env[2]);
 
 	HAL_INFO (("Runner has pid %d", runner_pid));
 
@@ -602,17 +773,95 @@ add_environment (DBusMessageIter * iter, HalDevice * device,
 	return TRUE;
 }
 
-/* Start a helper, returns true on a successfull start */
+static void
+pending_start_free (PendingStart *ps)
+{
+	pending_starts = g_slist_remove (pending_starts, ps);
+	g_free (ps->command_line);
+	g_free (ps);
+}
+
+/* Handle the runner's reply to Start. The runner sends the reply before
+ * it can emit StartedProcessExited for the new pid, so registering the
+ * process here can't miss its exit. */
+static gboolean
+process_start_reply (DBusMessage *reply, PendingStart *ps)
+{
+	DBusError error;
+	dbus_int64_t pid_from_runner;
+	RunningProcess *rp;
+
+	dbus_error_init (&error);
+	if (dbus_set_error_from_message (&error, reply)) {
+		HAL_ERROR (("Error running '%s': %s: %s", ps->command_line, error.name, error.message));
+		dbus_error_free (&error);
+		return FALSE;
+	}
+
+	if (!dbus_message_get_args (reply, &error,
+				    DBUS_TYPE_INT64, &pid_from_runner,
+				    DBUS_TYPE_INVALID)) {
+		HAL_ERROR (("Error extracting out_pid from runner's Start()"));
+		dbus_error_free (&error);
+		/* the process was started all the same */
+		return TRUE;
+	}
+
+	if (ps->cb != NULL && !ps->cancelled) {
+		rp = g_new0 (RunningProcess, 1);
+		rp->pid = (GPid) pid_from_runner;
+		rp->cb = ps->cb;
+		rp->is_singleton = ps->is_singleton;
+		rp->device = ps->device;
+		rp->data1 = ps->data1;
+		rp->data2 = ps->data2;
+
+		running_processes_add (rp);
+		HAL_INFO (("running_processes num = %d", g_hash_table_size (running_processes)));
+	}
+
+	return TRUE;
+}
+
+static void
+start_notify (DBusPendingCall *pending, void *user_data)
+{
+	PendingStart *ps = (PendingStart *) user_data;
+	DBusMessage *reply;
+
+	reply = dbus_pending_call_steal_reply (pending);
+	if (!process_start_reply (reply, ps) && ps->cb != NULL && !ps->cancelled) {
+		/* we already told the caller it was started; report it
+		 * as terminated instead */
+		ps->cb (ps->device, HALD_RUN_FAILED, 0, NULL, ps->data1, ps->data2);
+	}
+	dbus_message_unref (reply);
+	dbus_pending_call_unref (pending);
+}
+
+/* Start a helper, returns true on a successfull start.
+ *
+ * Device helpers (addons) are started without waiting for the runner:
+ * during coldplug hundreds are started back to back and hald shouldn't
+ * block on each of them. TRUE then means the request was queued, and if
+ * the runner fails to start the program cb is invoked with
+ * HALD_RUN_FAILED. Singletons are still started synchronously as the
+ * caller has to know whether to expect a connection from them.
+ */
 static gboolean
 runner_start (HalDevice * device, const gchar * command_line,
 	      char **extra_env, gboolean singleton,
 	      HalRunTerminatedCB cb, gpointer data1, gpointer data2)
 {
 	DBusMessage *msg, *reply;
+	DBusPendingCall *call;
 	DBusError error;
 	DBusMessageIter iter;
+	PendingStart *ps;
+	gboolean ret;
+
+	pending_kills_flush ();
 
-	dbus_error_init (&error);
 	msg = dbus_message_new_method_call ("org.freedesktop.HalRunner",
 					    "/org/freedesktop/HalRunner",
 					    "org.freedesktop.HalRunner",
@@ -630,54 +879,50 @@ runner_start (HalDevice * device, const gchar * command_line,
 		goto error;
 	}
 
-	/* Wait for the reply, should be almost instantanious */
-	reply = dbus_connection_send_with_reply_and_block (runner_connection,
-							   msg, -1, &error);
-	if (reply) {
-		gboolean ret =
-		    (dbus_message_get_type (reply) ==
-		     DBUS_MESSAGE_TYPE_METHOD_RETURN);
-
-		if (ret) {
-			dbus_int64_t pid_from_runner;
-			if (dbus_message_get_args (reply, &error,
-						   DBUS_TYPE_INT64,
-						   &pid_from_runner,
-						   DBUS_TYPE_INVALID)) {
-				if (cb != NULL) {
-					RunningProcess *rp;
-					rp = g_new0 (RunningProcess, 1);
-					rp->pid = (GPid) pid_from_runner;
-					rp->cb = cb;
-					rp->is_singleton = singleton;
-					if (singleton)
-						rp->device = NULL;
-					else
-						rp->device = device;
-					rp->data1 = data1;
-					rp->data2 = data2;
-
-					running_processes =
-					    g_slist_prepend
-					    (running_processes, rp);
-					HAL_INFO (("running_processes %p, num = %d", running_processes, g_slist_length (running_processes)));
-				}
-			} else {
-				HAL_ERROR (("Error extracting out_pid from runner's Start()"));
-				dbus_error_free (&error);
-			}
+	ps = g_new0 (PendingStart, 1);
+	ps->device = singleton ? NULL : device;
+	ps->command_line = g_strdup (command_line);
+	ps->cb = cb;
+	ps->is_singleton = singleton;
+	ps->data1 = data1;
+	ps->data2 = data2;
+
+	if (!singleton) {
+		if (!dbus_connection_send_with_reply (runner_connection,
+						      msg, &call, -1))
+			DIE (("No memory"));
+		if (call == NULL) {
+			/* disconnected from the runner */
+			pending_start_free (ps);
+			goto error;
 		}
 
-		dbus_message_unref (reply);
+		pending_starts = g_slist_prepend (pending_starts, ps);
+		dbus_pending_call_set_notify (call, start_notify, ps,
+					      (DBusFreeFunction) pending_start_free);
 		dbus_message_unref (msg);
-		return ret;
-	} else {
+		return TRUE;
+	}
+
+	/* Wait for the reply, should be almost instantanious */
+	dbus_error_init (&error);
+	reply = dbus_connection_send_with_reply_and_block (runner_connection,
+							   msg, -1, &error);
+	if (reply == NULL) {
 		if (dbus_error_is_set (&error)) {
 			HAL_ERROR (("Error running '%s': %s: %s", command_line, error.name, error.message));
 			dbus_error_free (&error);
 		}
+		pending_start_free (ps);
+		goto error;
 	}
 
+	ret = process_start_reply (reply, ps);
+	pending_start_free (ps);
+	dbus_message_unref (reply);
+	dbus_message_unref (msg);
+	return ret;
+
 error:
 	dbus_message_unref (msg);
 	return FALSE;
@@ -795,6 +1040,8 @@ hald_runner_run_method (HalDevice * device,
 	DBusPendingCall *call;
 	HelperData *hd = NULL;
 
+	pending_kills_flush ();
+
 	msg = dbus_message_new_method_call ("org.freedesktop.HalRunner",
 					    "/org/freedesktop/HalRunner",
 					    "org.freedesktop.HalRunner",
@@ -865,6 +1112,8 @@ hald_runner_run_sync (HalDevice * device,
 	gboolean error_on_stderr = FALSE;
 	DBusError error;
 
+	pending_kills_flush ();
+
 	msg = dbus_message_new_method_call ("org.freedesktop.HalRunner",
 					    "/org/freedesktop/HalRunner",
 					    "org.freedesktop.HalRunner",
@@ -912,37 +1161,21 @@ error:
 }
 
 
+/* Kill all helpers of a device. The request is queued and sent along
+ * with those for other devices removed in the same main loop iteration;
+ * the runner handles messages in order, so later requests still see the
+ * helpers gone. */
 void
 hald_runner_kill_device (HalDevice * device)
 {
-	DBusMessage *msg, *reply;
-	DBusError err;
-	DBusMessageIter iter;
-	const char *udi;
-
 	running_processes_remove_device (device);
 
-	msg = dbus_message_new_method_call ("org.freedesktop.HalRunner",
-					    "/org/freedesktop/HalRunner",
-					    "org.freedesktop.HalRunner",
-					    "Kill");
-	if (msg == NULL)
-		DIE (("No memory"));
-	dbus_message_iter_init_append (msg, &iter);
-	udi = hal_device_get_udi (device);
-	dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &udi);
-
-	/* Wait for the reply, should be almost instantanious */
-	dbus_error_init (&err);
-	reply = dbus_connection_send_with_reply_and_block (runner_connection,
-							   msg, -1, &err);
-	if (reply) {
-		dbus_message_unref (reply);
-	} else {
-		dbus_error_free (&err);
-	}
+	if (pending_kills == NULL)
+		pending_kills = g_ptr_array_new ();
+	g_ptr_array_add (pending_kills, g_strdup (hal_device_get_udi (device)));
 
-	dbus_message_unref (msg);
+	if (pending_kills_source == 0)
+		pending_kills_source = g_idle_add (pending_kills_flush_idle, NULL);
 }
 
 void
@@ -951,6 +1184,10 @@ hald_runner_kill_all (void)
 	DBusMessage *msg, *reply;
 	DBusError err;
 
+	/* KillAll covers whatever is queued */
+	pending_kills_clear ();
+	running_processes_remove_all ();
+
 	msg = dbus_message_new_method_call ("org.freedesktop.HalRunner",
 					    "/org/freedesktop/HalRunner",
 					    "org.freedesktop.HalRunner",
@@ -54,9 +54,9 @@ hald_runner_start_runner(void);
 void
 hald_runner_stop_runner(void);
 
-/* Start a helper, returns true on a successfull start. 
- * cb will be called on abnormal or premature termination
- * only 
+/* Start a helper, returns true if the start was requested; the runner
+ * is not waited for. cb will be called on abnormal or premature
+ * termination only, including a failure to start the program.
  */
 gboolean
 hald_runner_start (HalDevice *device, const gchar *command_line, char **extra_env, 
@@ -29,6 +29,7 @@
 
 #include <ctype.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -41,8 +42,281 @@
 #include <dbus/dbus-glib.h>
 
 #include "logger.h"
+#include "hald_runner.h"
 
 #include "ids.h"
+#include "ids_cache.h"
+
+#if defined(USE_PCI_IDS) || defined(USE_USB_IDS)
+
+/** Pointer to where the binary ids cache is mapped */
+static char *ids_cache = NULL;
+
+/** Length of the mapping at ids_cache */
+static size_t ids_cache_len;
+
+/** Whether ids_cache_open() has been called */
+static gboolean ids_cache_opened = FALSE;
+
+static const char *
+ids_cache_get_name (void)
+{
+	const char *cachename;
+
+	cachename = getenv ("HAL_IDS_CACHE_NAME");
+	if (cachename == NULL)
+		cachename = HALD_IDS_CACHE_FILE;
+	return cachename;
+}
+
+/**
+ *  ids_cache_source_is_current:
+ *  @path:               Path of the text database
+ *  @source:             Stamp recorded in the cache
+ *
+ *  Returns:             #TRUE iff the cache was generated from the file
+ *                       as it is now
+ */
+static gboolean
+ids_cache_source_is_current (const char *path, const struct ids_cache_source *source)
+{
+	struct stat statbuf;
+
+	if (stat (path, &statbuf) != 0)
+		return source->mtime == 0 && source->size == 0;
+
+	return source->mtime == (guint64) statbuf.st_mtime &&
+		source->size == (guint64) statbuf.st_size;
+}
+
+/**
+ *  ids_cache_load:
+ *
+ *  Returns:             #TRUE if an up to date cache was mapped
+ *
+ *  Map the binary ids cache and check that it is sane and was generated
+ *  from the current pci.ids and usb.ids.
+ */
+static gboolean
+ids_cache_load (void)
+{
+	const char *cachename;
+	const struct ids_cache_header *header;
+	struct stat statbuf;
+	int fd;
+	int n;
+
+	cachename = ids_cache_get_name ();
+
+	fd = open (cachename, O_RDONLY);
+	if (fd < 0)
+		return FALSE;
+
+	if (fstat (fd, &statbuf) != 0 ||
+	    statbuf.st_size < (off_t) sizeof (struct ids_cache_header)) {
+		close (fd);
+		return FALSE;
+	}
+
+	ids_cache_len = statbuf.st_size;
+	ids_cache = mmap (NULL, ids_cache_len, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+	if (ids_cache == MAP_FAILED) {
+		HAL_WARNING (("Couldn't mmap ids cache '%s', errno=%d: %s", cachename, errno, strerror (errno)));
+		ids_cache = NULL;
+		return FALSE;
+	}
+
+	header = (const struct ids_cache_header *) ids_cache;
+	if (header->magic != IDS_CACHE_MAGIC || header->version != IDS_CACHE_VERSION)
+		goto invalid;
+
+	for (n = 0; n < IDS_CACHE_NUM_TABLES; n++) {
+		if (header->tables[n].offset > ids_cache_len ||
+		    header->tables[n].num_entries >
+		    (ids_cache_len - header->tables[n].offset) / sizeof (struct ids_cache_entry))
+			goto invalid;
+	}
+
+	/* the pool must start with the empty string and be terminated */
+	if (header->strings_size == 0 ||
+	    header->strings_offset > ids_cache_len ||
+	    header->strings_size > ids_cache_len - header->strings_offset ||
+	    ids_cache[header->strings_offset] != '\0' ||
+	    ids_cache[header->strings_offset + header->strings_size - 1] != '\0')
+		goto invalid;
+
+#ifdef USE_PCI_IDS
+	if (!ids_cache_source_is_current (PCI_IDS_DIR "/pci.ids", &header->pci_source))
+		goto invalid;
+#endif
+#ifdef USE_USB_IDS
+	if (!ids_cache_source_is_current (USB_IDS_DIR "/usb.ids", &header->usb_source))
+		goto invalid;
+#endif
+
+	return TRUE;
+
+invalid:
+	munmap (ids_cache, ids_cache_len);
+	ids_cache = NULL;
+	return FALSE;
+}
+
+static gboolean ids_cache_regen_success;
+
+static void
+ids_cache_regen_cb (HalDevice *d,
+		    guint32 exit_type,
+		    gint return_code,
+		    gchar **error,
+		    gpointer data1,
+		    gpointer data2)
+{
+	ids_cache_regen_success = (exit_type == HALD_RUN_SUCCESS && return_code == 0);
+}
+
+static void
+ids_cache_regen (void)
+{
+	char *extra_env[2] = {NULL, NULL};
+	char *val;
+
+	HAL_INFO (("Regenerating ids cache.."));
+
+	val = getenv ("HAL_IDS_CACHE_NAME");
+	if (val != NULL)
+		extra_env[0] = g_strdup_printf ("HAL_IDS_CACHE_NAME=%s", val);
+
+	ids_cache_regen_success = FALSE;
+	hald_runner_run_sync (NULL,
+			      "hald-generate-ids-cache",
+			      extra_env,
+			      60000,
+			      ids_cache_regen_cb,
+			      NULL,
+			      NULL);
+
+	g_free (extra_env[0]);
+
+	if (!ids_cache_regen_success)
+		HAL_WARNING (("ids cache regeneration failed"));
+}
+
+/**
+ *  ids_cache_open:
+ *
+ *  Returns:             #TRUE if lookups can use the binary cache
+ *
+ *  Map the binary ids cache, regenerating it first if it is missing or
+ *  stale. If that fails the text databases are used instead.
+ */
+static gboolean
+ids_cache_open (void)
+{
+	if (ids_cache_opened)
+		return ids_cache != NULL;
+	ids_cache_opened = TRUE;
+
+	if (!ids_cache_load ()) {
+		ids_cache_regen ();
+		if (!ids_cache_load ()) {
+			HAL_WARNING (("No usable ids cache; falling back to the text databases"));
+			return FALSE;
+		}
+	}
+
+	HAL_INFO (("Using ids cache '%s'", ids_cache_get_name ()));
+	return TRUE;
+}
+
+static inline const struct ids_cache_entry *
+ids_cache_get_table (ids_cache_table_type table, guint32 *num_entries)
+{
+	const struct ids_cache_header *header;
+
+	header = (const struct ids_cache_header *) ids_cache;
+	*num_entries = header->tables[table].num_entries;
+	return (const struct ids_cache_entry *) (ids_cache + header->tables[table].offset);
+}
+
+static inline char *
+ids_cache_get_string (guint32 offset)
+{
+	const struct ids_cache_header *header;
+
+	header = (const struct ids_cache_header *) ids_cache;
+	if (offset >= header->strings_size)
+		return NULL;
+	return ids_cache + header->strings_offset + offset;
+}
+
+/**
+ *  ids_cache_find:
+ *  @table:              Table to search
+ *  @first:              Index of the first entry to consider
+ *  @num:                Number of entries to consider
+ *  @id:                 Id to look for
+ *
+ *  Returns:             The entry or NULL if not found
+ *
+ *  Binary search a sorted range of a cache table.
+ */
+static const struct ids_cache_entry *
+ids_cache_find (ids_cache_table_type table, guint32 first, guint32 num, guint32 id)
+{
+	const struct ids_cache_entry *entries;
+	guint32 num_entries;
+	guint32 lo;
+	guint32 hi;
+
+	entries = ids_cache_get_table (table, &num_entries);
+	if (first > num_entries || num > num_entries - first)
+		return NULL;
+
+	lo = first;
+	hi = first + num;
+	while (lo < hi) {
+		guint32 mid = lo + (hi - lo) / 2;
+
+		if (entries[mid].id == id)
+			return &entries[mid];
+		else if (entries[mid].id < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+/* find a vendor and optionally one of its products */
+static void
+ids_cache_find_vendor_product (ids_cache_table_type vendors,
+			       ids_cache_table_type products,
+			       int vendor_id, int product_id,
+			       char **vendor_name,
+			       const struct ids_cache_entry **product)
+{
+	const struct ids_cache_entry *vendor;
+	guint32 num_vendors;
+
+	*product = NULL;
+
+	if (vendor_id == 0)
+		return;
+
+	ids_cache_get_table (vendors, &num_vendors);
+	vendor = ids_cache_find (vendors, 0, num_vendors, vendor_id);
+	if (vendor == NULL)
+		return;
+	*vendor_name = ids_cache_get_string (vendor->name);
+
+	if (product_id != 0)
+		*product = ids_cache_find (products, vendor->first_child,
+					   vendor->num_children, product_id);
+}
+
+#endif /* USE_PCI_IDS || USE_USB_IDS */
 
 #ifdef USE_PCI_IDS
 /** Pointer to where the pci.ids file is loaded */
@@ -109,6 +383,39 @@ pci_ids_line_iter_has_more (void)
 }
 
 
+/* lookup in the binary cache; see ids_find_pci() */
+static void
+ids_cache_find_pci (int vendor_id, int product_id,
+		    int subsys_vendor_id, int subsys_product_id,
+		    char **vendor_name, char **product_name,
+		    char **subsys_vendor_name, char **subsys_product_name)
+{
+	const struct ids_cache_entry *product;
+	const struct ids_cache_entry *subsys;
+	guint32 num_vendors;
+
+	ids_cache_find_vendor_product (IDS_CACHE_PCI_VENDORS, IDS_CACHE_PCI_PRODUCTS,
+				       vendor_id, product_id,
+				       vendor_name, &product);
+	if (product != NULL)
+		*product_name = ids_cache_get_string (product->name);
+
+	if (subsys_vendor_id != 0) {
+		ids_cache_get_table (IDS_CACHE_PCI_VENDORS, &num_vendors);
+		subsys = ids_cache_find (IDS_CACHE_PCI_VENDORS, 0, num_vendors, subsys_vendor_id);
+		if (subsys != NULL)
+			*subsys_vendor_name = ids_cache_get_string (subsys->name);
+	}
+
+	if (product != NULL && subsys_vendor_id != 0 && subsys_product_id != 0) {
+		subsys = ids_cache_find (IDS_CACHE_PCI_SUBSYSTEMS,
+					 product->first_child, product->num_children,
+					 ((guint32) subsys_vendor_id << 16) | (guint32) subsys_product_id);
+		if (subsys != NULL)
+			*subsys_product_name = ids_cache_get_string (subsys->name);
+	}
+}
+
 /** 
  *  ids_find_pci:
  *  @vendor_id:           PCI vendor id or 0 if unknown
@@ -156,6 +463,14 @@ ids_find_pci (int vendor_id, int product_id,
 	*subsys_vendor_name = NULL;
 	*subsys_product_name = NULL;
 
+	if (ids_cache != NULL) {
+		ids_cache_find_pci (vendor_id, product_id,
+				    subsys_vendor_id, subsys_product_id,
+				    vendor_name, product_name,
+				    subsys_vendor_name, subsys_product_name);
+		return;
+	}
+
 	for (pci_ids_line_iter_init (); pci_ids_line_iter_has_more ();) {
 		line = pci_ids_line_iter_get_line (&line_len);
 
@@ -318,6 +633,9 @@ out:
 void
 pci_ids_init (void)
 {
+	if (ids_cache_open ())
+		return;
+
 	/* Load /usr/share/hwdata/pci.ids */
 	pci_ids_load (PCI_IDS_DIR "/pci.ids");
 }
@@ -422,6 +740,17 @@ ids_find_usb (int vendor_id, int product_id,
 	*vendor_name = NULL;
 	*product_name = NULL;
 
+	if (ids_cache != NULL) {
+		const struct ids_cache_entry *product;
+
+		ids_cache_find_vendor_product (IDS_CACHE_USB_VENDORS, IDS_CACHE_USB_PRODUCTS,
+					       vendor_id, product_id,
+					       vendor_name, &product);
+		if (product != NULL)
+			*product_name = ids_cache_get_string (product->name);
+		return;
+	}
+
 	for (usb_ids_line_iter_init (); usb_ids_line_iter_has_more ();) {
 		line = usb_ids_line_iter_get_line (&line_len);
 
@@ -539,6 +868,9 @@ out:
 void
 usb_ids_init (void)
 {
+	if (ids_cache_open ())
+		return;
+
 	/* Load /usr/share/hwdata/usb.ids */
 	usb_ids_load (USB_IDS_DIR "/usb.ids");
 }
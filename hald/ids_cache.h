@@ -0,0 +1,84 @@
+/***************************************************************************
+ * CVSID: $Id$
+ *
+ * ids_cache.h : on-disk layout of the binary pci.ids / usb.ids cache
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ **************************************************************************/
+
+#ifndef IDS_CACHE_H
+#define IDS_CACHE_H
+
+#include <glib.h>
+
+/*
+ * The cache is written by hald-generate-ids-cache and mmap'ed by hald.
+ * It is a header followed by a number of tables of struct ids_cache_entry
+ * and a pool of NUL-terminated strings. Everything is in host byte order.
+ *
+ * Each table is sorted by id. Vendor entries refer to a contiguous range
+ * of the product table holding their products, and PCI product entries
+ * refer to a contiguous range of the subsystem table. This makes every
+ * lookup a binary search without any allocation.
+ */
+
+#define IDS_CACHE_MAGIC		0x53444948	/* "HIDS" */
+#define IDS_CACHE_VERSION	1
+
+typedef enum {
+	IDS_CACHE_PCI_VENDORS,
+	IDS_CACHE_PCI_PRODUCTS,
+	IDS_CACHE_PCI_SUBSYSTEMS,
+	IDS_CACHE_USB_VENDORS,
+	IDS_CACHE_USB_PRODUCTS,
+	IDS_CACHE_NUM_TABLES
+} ids_cache_table_type;
+
+/* stamp of the text database the cache was generated from; all zero if
+ * the file did not exist */
+struct ids_cache_source {
+	guint64		mtime;
+	guint64		size;
+};
+
+struct ids_cache_table {
+	guint32		offset;		/* offset of the first entry in the file */
+	guint32		num_entries;
+};
+
+struct ids_cache_entry {
+	guint32		id;		/* vendor or product id; for subsystems
+					 * (subsys_vendor << 16) | subsys_product */
+	guint32		name;		/* offset into the string pool */
+	guint32		first_child;	/* index into the next table */
+	guint32		num_children;
+};
+
+struct ids_cache_header {
+	guint32			magic;
+	guint32			version;
+	struct ids_cache_source	pci_source;
+	struct ids_cache_source	usb_source;
+	struct ids_cache_table	tables[IDS_CACHE_NUM_TABLES];
+	guint32			strings_offset;
+	guint32			strings_size;
+};
+
+#define HALD_IDS_CACHE_FILE PACKAGE_LOCALSTATEDIR "/cache/hald/ids-cache"
+
+#endif /* IDS_CACHE_H */
@@ -55,6 +55,7 @@ enum {
 };
 
 #define ACPI_POLL_INTERVAL 30 /* in seconds */
+#define ACPI_POLL_INTERVAL_MAX 240 /* in seconds */
 
 typedef struct ACPIDevHandler_s
 {
@@ -165,6 +166,15 @@ battery_poll_infrequently (gpointer data) {
 }
 
 
+/* number of properties the fallback polls changed since acpi_poll() last looked */
+static guint acpi_poll_changes = 0;
+
+static void
+acpi_poll_count_change (HalDevice *d, const char *key, gboolean removed, gboolean added, gpointer user_data)
+{
+	acpi_poll_changes++;
+}
+
 /** 
  *  acpi_poll_battery:
  *
@@ -192,10 +202,15 @@ acpi_poll_battery (void)
 		d = HAL_DEVICE (i->data);
 		if (hal_device_has_property (d, "linux.acpi_type") &&
 		    hal_device_property_get_bool (d, "battery.present")) {
+			gulong handler;
+
+			handler = g_signal_connect (d, "property_changed",
+						    G_CALLBACK (acpi_poll_count_change), NULL);
 			hal_util_grep_discard_existing_data ();
 			device_property_atomic_update_begin ();
 			battery_refresh_poll (d);
 			device_property_atomic_update_end ();		
+			g_signal_handler_disconnect (d, handler);
 		}
 	}
 
@@ -229,23 +244,53 @@ acpi_poll_acadap (void)
 	for (i = acadap_devices; i != NULL; i = g_slist_next (i)) {
 		d = HAL_DEVICE (i->data);
 		if (hal_device_has_property (d, "linux.acpi_type")) {
+			gulong handler;
+
+			handler = g_signal_connect (d, "property_changed",
+						    G_CALLBACK (acpi_poll_count_change), NULL);
 			hal_util_grep_discard_existing_data ();
 			device_property_atomic_update_begin ();
 			ac_adapter_refresh_poll (d);
 			device_property_atomic_update_end ();		
+			g_signal_handler_disconnect (d, handler);
 		}
 	}
 	g_slist_free (acadap_devices);
 	return TRUE;
 }
 
+static guint acpi_poll_interval = ACPI_POLL_INTERVAL;
+static guint acpi_poll_source = 0;
+
+static gboolean acpi_poll (gpointer data);
+
+/* (re)start the fallback poll timer with the current interval */
+static void
+acpi_poll_schedule (void)
+{
+	if (acpi_poll_source != 0)
+		g_source_remove (acpi_poll_source);
+
+#ifdef HAVE_GLIB_2_14
+	acpi_poll_source = g_timeout_add_seconds (acpi_poll_interval,
+						  acpi_poll,
+						  NULL);
+#else
+	acpi_poll_source = g_timeout_add (1000 * acpi_poll_interval,
+					  acpi_poll,
+					  NULL);
+#endif
+}
+
 /** 
  *  acpi_poll:
  *  @data:		Ignored
  *
- *  Returns:		TRUE
+ *  Returns:		FALSE, the timeout is rescheduled
  *
- *  Fallback polling method called every minute. 
+ *  Fallback polling method. It starts every ACPI_POLL_INTERVAL seconds,
+ *  and backs off up to ACPI_POLL_INTERVAL_MAX while polls find nothing
+ *  that the ACPI events didn't already tell us.
  *
  *  Note: This just forces a poll refresh for *every* ac_adapter
  *        and primary battery in the system.
@@ -253,13 +298,23 @@ acpi_poll_acadap (void)
 static gboolean
 acpi_poll (gpointer data)
 {
+	acpi_poll_source = 0;
+	acpi_poll_changes = 0;
+
 	/*
 	 * These forced updates take care of really broken BIOS's that don't
 	 * emit acad or acadapt events.
 	 */
 	acpi_poll_acadap ();
 	acpi_poll_battery ();
-	return TRUE;
+
+	if (acpi_poll_changes > 0)
+		acpi_poll_interval = ACPI_POLL_INTERVAL;
+	else
+		acpi_poll_interval = MIN (acpi_poll_interval * 2, ACPI_POLL_INTERVAL_MAX);
+
+	acpi_poll_schedule ();
+	return FALSE;
 }
 
 static gboolean
@@ -291,6 +346,12 @@ ac_adapter_refresh (HalDevice *d, ACPIDevHandler *handler, gboolean force_full_r
 	 * want to wait for the next random refresh from acpi_poll.
 	 */
 	acpi_poll_battery ();
+
+	/* the charge rate changes with the AC state, so poll closely again */
+	if (acpi_poll_source != 0) {
+		acpi_poll_interval = ACPI_POLL_INTERVAL;
+		acpi_poll_schedule ();
+	}
 	
 	return TRUE;
 }
@@ -474,6 +535,10 @@ battery_refresh (HalDevice *d, ACPIDevHandler *handler, gboolean force_full_refr
 
 		/* poll ac adapter for machines which never give ACAP events */
 		acpi_poll_acadap ();
+
+		/* we're up to date, no need to poll for a while */
+		if (acpi_poll_source != 0)
+			acpi_poll_schedule ();
 	}
 
 	return TRUE;
@@ -731,10 +796,10 @@ acpi_synthesize_item (const gchar *fullpath, int acpi_type)
 {
 	HotplugEvent *hotplug_event;
 	HAL_INFO (("Processing %s", fullpath));
-	hotplug_event = g_slice_new0 (HotplugEvent);
+	hotplug_event = hotplug_event_new ();
 	hotplug_event->action = HOTPLUG_ACTION_ADD;
 	hotplug_event->type = HOTPLUG_EVENT_ACPI;
-	g_strlcpy (hotplug_event->acpi.acpi_path, fullpath, sizeof (hotplug_event->acpi.acpi_path));
+	hotplug_event->acpi.acpi_path = hotplug_event_strdup (hotplug_event, fullpath);
 	hotplug_event->acpi.acpi_type = acpi_type;
 	hotplug_event_enqueue (hotplug_event);
 }
@@ -859,10 +924,10 @@ acpi_synthesize_sonypi_display (void)
 	if (!found)
 		return;
 
-	hotplug_event = g_slice_new0 (HotplugEvent);
+	hotplug_event = hotplug_event_new ();
 	hotplug_event->action = HOTPLUG_ACTION_ADD;
 	hotplug_event->type = HOTPLUG_EVENT_ACPI;
-	g_strlcpy (hotplug_event->acpi.acpi_path, path, sizeof (hotplug_event->acpi.acpi_path));
+	hotplug_event->acpi.acpi_path = hotplug_event_strdup (hotplug_event, path);
 	hotplug_event->acpi.acpi_type = ACPI_TYPE_SONYPI_DISPLAY;
 	hotplug_event_enqueue (hotplug_event);
 
@@ -937,15 +1002,7 @@ acpi_synthesize_hotplug_events (void)
 	acpi_synthesize_sonypi_display ();
 
 	/* setup timer for things that we need to poll */
-#ifdef HAVE_GLIB_2_14
-	g_timeout_add_seconds (ACPI_POLL_INTERVAL,
-                               acpi_poll,
-                               NULL);
-#else
-	g_timeout_add (1000 * ACPI_POLL_INTERVAL,
-		       acpi_poll,
-		       NULL);
-#endif
+	acpi_poll_schedule ();
 
 	/* setup timer for things that we need only to poll infrequently */
 
@@ -1275,10 +1332,10 @@ acpi_generate_add_hotplug_event (HalDevice *d)
 	acpi_path = hal_device_property_get_string (d, "linux.acpi_path");
 	acpi_type = hal_device_property_get_int (d, "linux.acpi_type");
 
-	hotplug_event = g_slice_new0 (HotplugEvent);
+	hotplug_event = hotplug_event_new ();
 	hotplug_event->action = HOTPLUG_ACTION_ADD;
 	hotplug_event->type = HOTPLUG_EVENT_ACPI;
-	g_strlcpy (hotplug_event->acpi.acpi_path, acpi_path, sizeof (hotplug_event->acpi.acpi_path));
+	hotplug_event->acpi.acpi_path = hotplug_event_strdup (hotplug_event, acpi_path);
 	hotplug_event->acpi.acpi_type = acpi_type;
 	return hotplug_event;
 }
@@ -1293,10 +1350,10 @@ acpi_generate_remove_hotplug_event (HalDevice *d)
 	acpi_path = hal_device_property_get_string (d, "linux.acpi_path");
 	acpi_type = hal_device_property_get_int (d, "linux.acpi_type");
 
-	hotplug_event = g_slice_new0 (HotplugEvent);
+	hotplug_event = hotplug_event_new ();
 	hotplug_event->action = HOTPLUG_ACTION_REMOVE;
 	hotplug_event->type = HOTPLUG_EVENT_ACPI;
-	g_strlcpy (hotplug_event->acpi.acpi_path, acpi_path, sizeof (hotplug_event->acpi.acpi_path));
+	hotplug_event->acpi.acpi_path = hotplug_event_strdup (hotplug_event, acpi_path);
 	hotplug_event->acpi.acpi_type = acpi_type;
 	return hotplug_event;
 }
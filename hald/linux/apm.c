@@ -297,16 +297,16 @@ apm_synthesize_hotplug_events (void)
 	/* Set appropriate properties on the computer object */
 	hal_device_property_set_string (computer, "power_management.type", "apm");
 
-	hotplug_event = g_slice_new0 (HotplugEvent);
+	hotplug_event = hotplug_event_new ();
 	hotplug_event->action = HOTPLUG_ACTION_ADD;
 	hotplug_event->type = HOTPLUG_EVENT_APM;
-	g_strlcpy (hotplug_event->apm.apm_path, "/proc/apm", sizeof (hotplug_event->apm.apm_path));
+	hotplug_event->apm.apm_path = "/proc/apm";
 	hotplug_event->apm.apm_type = APM_TYPE_BATTERY;
 	hotplug_event_enqueue (hotplug_event);
 
-	hotplug_event = g_slice_new0 (HotplugEvent);
+	hotplug_event = hotplug_event_new ();
 	hotplug_event->type = HOTPLUG_EVENT_APM;
-	g_strlcpy (hotplug_event->apm.apm_path, "/proc/apm", sizeof (hotplug_event->apm.apm_path));
+	hotplug_event->apm.apm_path = "/proc/apm";
 	hotplug_event->apm.apm_type = APM_TYPE_AC_ADAPTER;
 	hotplug_event_enqueue (hotplug_event);
 
@@ -519,10 +519,10 @@ apm_generate_add_hotplug_event (HalDevice *d)
 	apm_path = hal_device_property_get_string (d, "linux.apm_path");
 	apm_type = hal_device_property_get_int (d, "linux.apm_type");
 
-	hotplug_event = g_slice_new0 (HotplugEvent);
+	hotplug_event = hotplug_event_new ();
 	hotplug_event->action = HOTPLUG_ACTION_ADD;
 	hotplug_event->type = HOTPLUG_EVENT_APM;
-	g_strlcpy (hotplug_event->apm.apm_path, apm_path, sizeof (hotplug_event->apm.apm_path));
+	hotplug_event->apm.apm_path = hotplug_event_strdup (hotplug_event, apm_path);
 	hotplug_event->apm.apm_type = apm_type;
 	return hotplug_event;
 }
@@ -537,10 +537,10 @@ apm_generate_remove_hotplug_event (HalDevice *d)
 	apm_path = hal_device_property_get_string (d, "linux.apm_path");
 	apm_type = hal_device_property_get_int (d, "linux.apm_type");
 
-	hotplug_event = g_slice_new0 (HotplugEvent);
+	hotplug_event = hotplug_event_new ();
 	hotplug_event->action = HOTPLUG_ACTION_REMOVE;
 	hotplug_event->type = HOTPLUG_EVENT_APM;
-	g_strlcpy (hotplug_event->apm.apm_path, apm_path, sizeof (hotplug_event->apm.apm_path));
+	hotplug_event->apm.apm_path = hotplug_event_strdup (hotplug_event, apm_path);
 	hotplug_event->apm.apm_type = apm_type;
 	return hotplug_event;
 }
@@ -38,6 +38,7 @@
 #include <syslog.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #include <dbus/dbus.h>
 #include <dbus/dbus-glib.h>
@@ -49,6 +50,7 @@
 #include "../logger.h"
 #include "../osspec.h"
 #include "../util.h"
+#include "../../partutil/partutil.h"
 
 #include "coldplug.h"
 #include "hotplug.h"
@@ -200,37 +202,125 @@ cleanup_mountpoint_cb (HalDevice *d, guint32 exit_type,
 	g_free (mount_point);
 }
 
-void
-blockdev_refresh_mount_state (HalDevice *d)
+/* A line of /proc/mounts naming a file as the mounted filesystem */
+typedef struct {
+	char *fsname;
+	char *dir;
+	gboolean is_device;	/* FALSE if fsname is not a device node */
+	dev_t devt;		/* 0:0 if the device node doesn't exist */
+	gboolean is_read_only;
+} MountEntry;
+
+/* The mount table as of the last refresh */
+typedef struct {
+	GSList *entries;		/* all MountEntry's in /proc/mounts order */
+	GHashTable *by_dir;		/* mount point -> MountEntry */
+	GHashTable *by_devt;		/* dev_t -> first MountEntry for it */
+	GHashTable *by_fsname;		/* fsname -> first MountEntry with devt 0:0 */
+} MountSnapshot;
+
+static MountSnapshot *mount_snapshot = NULL;
+
+static guint
+devt_hash (gconstpointer key)
+{
+	dev_t devt = *((const dev_t *) key);
+
+	return (major (devt) << 20) ^ minor (devt);
+}
+
+static gboolean
+devt_equal (gconstpointer a, gconstpointer b)
+{
+	return *((const dev_t *) a) == *((const dev_t *) b);
+}
+
+static void
+mount_entry_free (MountEntry *entry)
+{
+	g_free (entry->fsname);
+	g_free (entry->dir);
+	g_free (entry);
+}
+
+static void
+mount_snapshot_free (MountSnapshot *snapshot)
+{
+	g_hash_table_destroy (snapshot->by_dir);
+	g_hash_table_destroy (snapshot->by_devt);
+	g_hash_table_destroy (snapshot->by_fsname);
+	g_slist_foreach (snapshot->entries, (GFunc) mount_entry_free, NULL);
+	g_slist_free (snapshot->entries);
+	g_free (snapshot);
+}
+
+/* Find the device a /proc/mounts line refers to. Returns FALSE if the
+ * mounted file is not a device node. */
+static gboolean
+mount_entry_resolve (struct mntent *mnt, dev_t *devt)
+{
+	struct stat statbuf;
+
+	/*
+	 * We can't just stat() the mountpoint, because it breaks all sorts
+	 * non-disk filesystems. So assume, that the names in /proc/mounts
+	 * are existing device-files used to mount the filesystem.
+	 */
+	*devt = makedev (0, 0);
+	if (stat (mnt->mnt_fsname, &statbuf) == 0) {
+		/* not a device node */
+		if (major (statbuf.st_rdev) == 0)
+			return FALSE;
+
+		/* found major/minor */
+		*devt = statbuf.st_rdev;
+	} else {
+		/* The root filesystem may be mounted by a device name that doesn't
+		 * exist in the real root, like /dev/root, which the kernel uses
+		 * internally, when no initramfs image is used. For "/", it is safe
+		 * to get the major/minor by stat()'ing the mount-point.
+		 */
+		if (strcmp (mnt->mnt_dir, "/") == 0 && stat ("/", &statbuf) == 0)
+			*devt = statbuf.st_dev;
+
+		/* DING DING DING... the device-node may not exist, or is
+		 * already deleted, but the device may be still mounted.
+		 *
+		 * We will fall back to looking up the device-name, instead
+		 * of using major/minor.
+		 */
+	}
+
+	return TRUE;
+}
+
+/* Parse /proc/mounts. Lines that are unchanged since @old reuse what we
+ * found out about the mounted file then, so only new mounts are stat()'ed. */
+static MountSnapshot *
+mount_snapshot_read (MountSnapshot *old)
 {
 	FILE *f;
 	struct mntent mnt;
 	char buf[1024];
-	GSList *volumes = NULL;
-	GSList *volume;
+	MountSnapshot *snapshot;
+	MountEntry *entry;
+	MountEntry *prev;
+	GSList *l;
 
 	/* open /proc/mounts */
 	g_snprintf (buf, sizeof (buf), "%s/mounts", "/proc");
 	if ((f = setmntent (buf, "r")) == NULL) {
 		HAL_ERROR (("Could not open /proc/mounts"));
-		return;
+		return NULL;
 	}
 
-	if (d)
-		volumes = g_slist_append (NULL, d);
-	else
-		volumes = hal_device_store_match_multiple_key_value_string (hald_get_gdl (), "info.category", "volume");
-
-	if (!volumes)
-		goto exit;
+	snapshot = g_new0 (MountSnapshot, 1);
+	snapshot->by_dir = g_hash_table_new (g_str_hash, g_str_equal);
+	snapshot->by_devt = g_hash_table_new (devt_hash, devt_equal);
+	snapshot->by_fsname = g_hash_table_new (g_str_hash, g_str_equal);
 
 	/* loop over /proc/mounts */
 	while (getmntent_r (f, &mnt, buf, sizeof(buf)) != NULL) {
-		struct stat statbuf;
-		dev_t devt;
-
-		/* HAL_INFO ((" * /proc/mounts contain dev %s - type %s", mnt.mnt_fsname, mnt.mnt_type)); */
-
 		/* We don't handle nfs mounts in HAL and stat() on mountpoints,
 		 * and we would block on 'stale nfs handle'.
 		 */
@@ -241,137 +331,290 @@ blockdev_refresh_mount_state (HalDevice *d)
 		if (mnt.mnt_fsname[0] != '/')
 			continue;
 
-		/*
-		 * We can't just stat() the mountpoint, because it breaks all sorts
-		 * non-disk filesystems. So assume, that the names in /proc/mounts
-		 * are existing device-files used to mount the filesystem.
-		 */
-		devt = makedev(0, 0);
-		if (stat (mnt.mnt_fsname, &statbuf) == 0) {
-			/* not a device node */
-			if (major (statbuf.st_rdev) == 0)
-				continue;
-
-			/* found major/minor */
-			devt = statbuf.st_rdev;
+		entry = g_new0 (MountEntry, 1);
+		entry->fsname = g_strdup (mnt.mnt_fsname);
+		entry->dir = g_strdup (mnt.mnt_dir);
+		entry->is_read_only = hasmntopt (&mnt, MNTOPT_RO) ? TRUE : FALSE;
+
+		prev = old != NULL ? g_hash_table_lookup (old->by_dir, mnt.mnt_dir) : NULL;
+		if (prev != NULL && strcmp (prev->fsname, mnt.mnt_fsname) == 0) {
+			entry->is_device = prev->is_device;
+			entry->devt = prev->devt;
 		} else {
-			/* The root filesystem may be mounted by a device name that doesn't
-			 * exist in the real root, like /dev/root, which the kernel uses
-			 * internally, when no initramfs image is used. For "/", it is safe
-			 * to get the major/minor by stat()'ing the mount-point.
-			 */
-			if (strcmp (mnt.mnt_dir, "/") == 0 && stat ("/", &statbuf) == 0)
-				devt = statbuf.st_dev;
+			entry->is_device = mount_entry_resolve (&mnt, &entry->devt);
+		}
 
-			/* DING DING DING... the device-node may not exist, or is
-			 * already deleted, but the device may be still mounted.
-			 *
-			 * We will fall back to looking up the device-name, instead
-			 * of using major/minor.
-		 	 */
+		snapshot->entries = g_slist_prepend (snapshot->entries, entry);
+	}
+	endmntent (f);
+
+	snapshot->entries = g_slist_reverse (snapshot->entries);
+	for (l = snapshot->entries; l != NULL; l = l->next) {
+		entry = l->data;
+
+		g_hash_table_insert (snapshot->by_dir, entry->dir, entry);
+		if (!entry->is_device)
+			continue;
+
+		if (major (entry->devt) != 0) {
+			if (g_hash_table_lookup (snapshot->by_devt, &entry->devt) == NULL)
+				g_hash_table_insert (snapshot->by_devt, &entry->devt, entry);
+		} else {
+			if (g_hash_table_lookup (snapshot->by_fsname, entry->fsname) == NULL)
+				g_hash_table_insert (snapshot->by_fsname, entry->fsname, entry);
 		}
+	}
+
+	return snapshot;
+}
 
-		/* HAL_INFO (("* found mounts dev %s (%i:%i)", mnt.mnt_fsname,
-			   major (devt), minor (devt))); */
+/* The mount of a volume in @snapshot, if any */
+static MountEntry *
+mount_snapshot_lookup_volume (MountSnapshot *snapshot, HalDevice *d)
+{
+	MountEntry *entry;
+	const char *device_name;
+	int majornum;
+	dev_t devt;
+
+	/* lookup dev_t or devname of known hal devices */
+	majornum = hal_device_property_get_int (d, "block.major");
+	if (majornum != 0) {
+		devt = makedev (majornum, hal_device_property_get_int (d, "block.minor"));
+		entry = g_hash_table_lookup (snapshot->by_devt, &devt);
+		if (entry != NULL)
+			return entry;
+	}
 
-		for (volume = volumes; volume != NULL; volume = g_slist_next (volume)) {
-			HalDevice *dev;
-			gboolean is_match;
+	device_name = hal_device_property_get_string (d, "block.device");
+	if (device_name == NULL)
+		return NULL;
 
-			is_match = FALSE;
-			dev = HAL_DEVICE (volume->data);
+	return g_hash_table_lookup (snapshot->by_fsname, device_name);
+}
 
-			/* lookup dev_t or devname of known hal devices */
-			if (major (devt) == 0) {
-				const char *device_name;
+static gboolean
+mount_entry_equal (MountEntry *a, MountEntry *b)
+{
+	return a->is_read_only == b->is_read_only && strcmp (a->dir, b->dir) == 0;
+}
 
-				device_name = hal_device_property_get_string (dev, "block.device");
-				if (device_name == NULL)
-					continue;
+typedef struct {
+	GHashTable *other;
+	GSList *changed;
+} MountDiff;
 
-				if (strcmp (device_name, mnt.mnt_fsname) == 0)
-					is_match = TRUE;
-			} else {
-				unsigned int majornum;
-				unsigned int minornum;
+static void
+mount_diff_devt (gpointer key, gpointer value, gpointer user_data)
+{
+	MountDiff *diff = user_data;
+	MountEntry *other;
 
-				majornum = hal_device_property_get_int (dev, "block.major");
-				if (majornum == 0)
-					continue;
-				minornum = hal_device_property_get_int (dev, "block.minor");
-				/* HAL_INFO (("  match %s (%i:%i)", hal_device_get_udi (dev), majornum, minornum)); */
+	other = g_hash_table_lookup (diff->other, key);
+	if (other == NULL || !mount_entry_equal (value, other))
+		diff->changed = g_slist_prepend (diff->changed, key);
+}
 
-				if (majornum == major (devt) && minornum == minor (devt))
-					is_match = TRUE;
-			}
+static gboolean
+is_volume (HalDevice *d)
+{
+	const char *category;
 
-			if (is_match) {
-				/* found entry for this device in /proc/mounts */
-				device_property_atomic_update_begin ();
-				hal_device_property_set_bool (dev, "volume.is_mounted", TRUE);
-				hal_device_property_set_bool (dev, "volume.is_mounted_read_only",
-							      hasmntopt (&mnt, MNTOPT_RO) ? TRUE : FALSE);
-				hal_device_property_set_string (dev, "volume.mount_point", mnt.mnt_dir);
-				device_property_atomic_update_end ();
-				/* HAL_INFO (("  set %s to be mounted at %s (%s)", hal_device_get_udi (dev),
-					   mnt.mnt_dir, hasmntopt (&mnt, MNTOPT_RO) ? "ro" : "rw")); */
-				volumes = g_slist_delete_link (volumes, volume);
-				break;
-			}
+	category = hal_device_property_get_string (d, "info.category");
+	return category != NULL && strcmp (category, "volume") == 0;
+}
+
+/* Volumes with the given device number. Volumes still being added are
+ * in the TDL, but may already be mounted, so look there too. */
+static GSList *
+volumes_by_devt (dev_t devt)
+{
+	HalDeviceStore *stores[2];
+	GSList *devices;
+	GSList *volumes;
+	GSList *l;
+	int i;
+
+	stores[0] = hald_get_gdl ();
+	stores[1] = hald_get_tdl ();
+
+	volumes = NULL;
+	for (i = 0; i < 2; i++) {
+		devices = hal_device_store_match_multiple_key_value_int (stores[i], "block.minor", minor (devt));
+		for (l = devices; l != NULL; l = l->next) {
+			HalDevice *d = HAL_DEVICE (l->data);
+
+			if (is_volume (d) && hal_device_property_get_int (d, "block.major") == (int) major (devt))
+				volumes = g_slist_prepend (volumes, d);
 		}
+		g_slist_free (devices);
 	}
 
-	/* all remaining volumes are not mounted */
+	return volumes;
+}
+
+/* Volumes with the given device file, in the GDL or the TDL */
+static GSList *
+volumes_by_device_file (const char *device_file)
+{
+	HalDeviceStore *stores[2];
+	GSList *devices;
+	GSList *volumes;
+	GSList *l;
+	int i;
+
+	stores[0] = hald_get_gdl ();
+	stores[1] = hald_get_tdl ();
+
+	volumes = NULL;
+	for (i = 0; i < 2; i++) {
+		devices = hal_device_store_match_multiple_key_value_string (stores[i], "block.device", device_file);
+		for (l = devices; l != NULL; l = l->next) {
+			if (is_volume (HAL_DEVICE (l->data)))
+				volumes = g_slist_prepend (volumes, l->data);
+		}
+		g_slist_free (devices);
+	}
+
+	return volumes;
+}
+
+/* Diff two snapshots; returns the volumes whose mount may have changed */
+static GSList *
+mount_snapshot_diff (MountSnapshot *old, MountSnapshot *new)
+{
+	MountDiff diff;
+	GSList *volumes;
+	GSList *l;
+
+	volumes = NULL;
+
+	/* mounts that are new or changed, then mounts that are gone */
+	diff.changed = NULL;
+	diff.other = old->by_devt;
+	g_hash_table_foreach (new->by_devt, mount_diff_devt, &diff);
+	diff.other = new->by_devt;
+	g_hash_table_foreach (old->by_devt, mount_diff_devt, &diff);
+	for (l = diff.changed; l != NULL; l = l->next)
+		volumes = g_slist_concat (volumes_by_devt (*((dev_t *) l->data)), volumes);
+	g_slist_free (diff.changed);
+
+	/* same for devices we only know by name */
+	diff.changed = NULL;
+	diff.other = old->by_fsname;
+	g_hash_table_foreach (new->by_fsname, mount_diff_devt, &diff);
+	diff.other = new->by_fsname;
+	g_hash_table_foreach (old->by_fsname, mount_diff_devt, &diff);
+	for (l = diff.changed; l != NULL; l = l->next)
+		volumes = g_slist_concat (volumes_by_device_file ((const char *) l->data), volumes);
+	g_slist_free (diff.changed);
+
+	return volumes;
+}
+
+static void
+volume_set_mount_state (HalDevice *dev, MountEntry *entry)
+{
+	if (entry != NULL) {
+		/* found entry for this device in /proc/mounts */
+		device_property_atomic_update_begin ();
+		hal_device_property_set_bool (dev, "volume.is_mounted", TRUE);
+		hal_device_property_set_bool (dev, "volume.is_mounted_read_only", entry->is_read_only);
+		hal_device_property_set_string (dev, "volume.mount_point", entry->dir);
+		device_property_atomic_update_end ();
+		/* HAL_INFO (("  set %s to be mounted at %s (%s)", hal_device_get_udi (dev),
+			   entry->dir, entry->is_read_only ? "ro" : "rw")); */
+		return;
+	}
+
+	/* do nothing if we have a Unmount() method running on the object. This is
+	 * is because on Linux /proc/mounts is changed immediately while umount(8)
+	 * doesn't return until the block cache is flushed. Note that when Unmount()
+	 * terminates we'll be checking /proc/mounts again so this event is not
+	 * lost... it is merely delayed...
+	 */
+	if (device_is_executing_method (dev, "org.freedesktop.Hal.Device.Volume", "Unmount")) {
+		HAL_INFO (("/proc/mounts tells that %s is unmounted - waiting for Unmount() to complete to change mount state", hal_device_get_udi (dev)));
+	} else {
+		char *mount_point;
+
+		mount_point = g_strdup (hal_device_property_get_string (dev, "volume.mount_point"));
+		device_property_atomic_update_begin ();
+		hal_device_property_set_bool (dev, "volume.is_mounted", FALSE);
+		hal_device_property_set_bool (dev, "volume.is_mounted_read_only", FALSE);
+		hal_device_property_set_string (dev, "volume.mount_point", "");
+		device_property_atomic_update_end ();
+		/*HAL_INFO (("set %s to unmounted", hal_device_get_udi (dev)));*/
+
+		if (mount_point != NULL && strlen (mount_point) > 0 && 
+		    hal_util_is_mounted_by_hald (mount_point)) {
+			char *cleanup_stdin;
+			char *extra_env[2];
+
+			HAL_INFO (("Cleaning up directory '%s' since it was created by HAL's Mount()", mount_point));
+
+			extra_env[0] = g_strdup_printf ("HALD_CLEANUP=%s", mount_point);
+			extra_env[1] = NULL;
+			cleanup_stdin = "\n";
+
+			hald_runner_run_method (dev, 
+						"hal-storage-cleanup-mountpoint", 
+						extra_env, 
+						cleanup_stdin, TRUE,
+						0,
+						cleanup_mountpoint_cb,
+						g_strdup (mount_point), NULL);
+		}
+
+		g_free (mount_point);
+	}
+}
+
+/**
+ * blockdev_refresh_mount_state:
+ * @d:		volume to refresh, or NULL for all volumes in the GDL
+ *
+ * Update the mount state of volumes from /proc/mounts. The table is
+ * compared with the one read last time and only volumes whose entry
+ * changed are touched; @d is always refreshed.
+ */
+void
+blockdev_refresh_mount_state (HalDevice *d)
+{
+	MountSnapshot *snapshot;
+	GSList *volumes;
+	GSList *volume;
+	GHashTable *seen;
+
+	snapshot = mount_snapshot_read (mount_snapshot);
+	if (snapshot == NULL)
+		return;
+
+	if (mount_snapshot != NULL) {
+		volumes = mount_snapshot_diff (mount_snapshot, snapshot);
+		mount_snapshot_free (mount_snapshot);
+	} else {
+		volumes = hal_device_store_match_multiple_key_value_string (hald_get_gdl (), "info.category", "volume");
+	}
+	mount_snapshot = snapshot;
+
+	if (d != NULL)
+		volumes = g_slist_prepend (volumes, d);
+
+	/* the same volume may show up twice, e.g. moved from name to dev_t */
+	seen = g_hash_table_new (g_direct_hash, g_direct_equal);
 	for (volume = volumes; volume != NULL; volume = g_slist_next (volume)) {
 		HalDevice *dev;
 
 		dev = HAL_DEVICE (volume->data);
-		/* do nothing if we have a Unmount() method running on the object. This is
-		 * is because on Linux /proc/mounts is changed immediately while umount(8)
-		 * doesn't return until the block cache is flushed. Note that when Unmount()
-		 * terminates we'll be checking /proc/mounts again so this event is not
-		 * lost... it is merely delayed...
-		 */
-		if (device_is_executing_method (dev, "org.freedesktop.Hal.Device.Volume", "Unmount")) {
-			HAL_INFO (("/proc/mounts tells that %s is unmounted - waiting for Unmount() to complete to change mount state", hal_device_get_udi (dev)));
-		} else {
-			char *mount_point;
-
-			mount_point = g_strdup (hal_device_property_get_string (dev, "volume.mount_point"));
-			device_property_atomic_update_begin ();
-			hal_device_property_set_bool (dev, "volume.is_mounted", FALSE);
-			hal_device_property_set_bool (dev, "volume.is_mounted_read_only", FALSE);
-			hal_device_property_set_string (dev, "volume.mount_point", "");
-			device_property_atomic_update_end ();
-			/*HAL_INFO (("set %s to unmounted", hal_device_get_udi (dev)));*/
-			
-			if (mount_point != NULL && strlen (mount_point) > 0 && 
-			    hal_util_is_mounted_by_hald (mount_point)) {
-				char *cleanup_stdin;
-				char *extra_env[2];
-				
-				HAL_INFO (("Cleaning up directory '%s' since it was created by HAL's Mount()", mount_point));
-				
-				extra_env[0] = g_strdup_printf ("HALD_CLEANUP=%s", mount_point);
-				extra_env[1] = NULL;
-				cleanup_stdin = "\n";
-				
-				hald_runner_run_method (dev, 
-							"hal-storage-cleanup-mountpoint", 
-							extra_env, 
-							cleanup_stdin, TRUE,
-							0,
-							cleanup_mountpoint_cb,
-							g_strdup (mount_point), NULL);
-			}
-
-			g_free (mount_point);
-		}
+		if (g_hash_table_lookup (seen, dev) != NULL)
+			continue;
+		g_hash_table_insert (seen, dev, dev);
 
+		volume_set_mount_state (dev, mount_snapshot_lookup_volume (snapshot, dev));
 	}
+	g_hash_table_destroy (seen);
 	g_slist_free (volumes);
-exit:
-	endmntent (f);
 }
 
 static void
@@ -387,15 +630,12 @@ generate_fakevolume_hotplug_event_add_for_storage_device (HalDevice *d)
 
 	snprintf (fake_sysfs_path, sizeof(fake_sysfs_path), "%s/fakevolume", sysfs_path);
 
-	hotplug_event = g_slice_new0 (HotplugEvent);
+	hotplug_event = hotplug_event_new ();
 	hotplug_event->action = HOTPLUG_ACTION_ADD;
 	hotplug_event->type = HOTPLUG_EVENT_SYSFS_BLOCK;
-	g_strlcpy (hotplug_event->sysfs.subsystem, "block", sizeof (hotplug_event->sysfs.subsystem));
-	g_strlcpy (hotplug_event->sysfs.sysfs_path, fake_sysfs_path, sizeof (hotplug_event->sysfs.sysfs_path));
-	if (device_file != NULL)
-		g_strlcpy (hotplug_event->sysfs.device_file, device_file, sizeof (hotplug_event->sysfs.device_file));
-	else
-		hotplug_event->sysfs.device_file[0] = '\0';
+	hotplug_event->sysfs.subsystem = "block";
+	hotplug_event->sysfs.sysfs_path = hotplug_event_strdup (hotplug_event, fake_sysfs_path);
+	hotplug_event->sysfs.device_file = hotplug_event_strdup (hotplug_event, device_file);
 	hotplug_event->sysfs.net_ifindex = -1;
 
 	hotplug_event_enqueue (hotplug_event);
@@ -1676,6 +1916,65 @@ force_unmount (HalDevice *d, void *end_token)
 	}
 }
 
+static void
+blockdev_drop_part_table_cache_done (HalDevice *d, guint32 exit_type,
+				     gint return_code, gchar **error,
+				     gpointer data1, gpointer data2)
+{
+	if (exit_type != HALD_RUN_SUCCESS || return_code != 0)
+		HAL_WARNING (("Cannot remove partition table cache %s (exit_type=%d, return_code=%d)",
+			      (char *) data1, exit_type, return_code));
+	g_free (data1);
+}
+
+/* Drop the partition table hald-probe-storage saved for a disk; it may be
+ * stale once the disk changed or went away. The cache directory is only
+ * writable by root, so this goes through the runner. */
+static void
+blockdev_invalidate_part_table_cache (HalDevice *d)
+{
+	char *command_line;
+	dev_t devt;
+
+	if (hal_device_property_get_bool (d, "block.is_volume"))
+		return;
+
+	devt = makedev (hal_device_property_get_int (d, "block.major"),
+			hal_device_property_get_int (d, "block.minor"));
+	command_line = g_strdup_printf ("hald-probe-storage --drop-partition-table-cache %" G_GUINT64_FORMAT,
+					(guint64) devt);
+	/* not for the device, which may be about to go away */
+	hald_runner_run (NULL, command_line, NULL, HAL_HELPER_TIMEOUT,
+			 blockdev_drop_part_table_cache_done, command_line, NULL);
+}
+
+/** Create the directory hald-probe-storage saves partition tables in.
+ *
+ *  The probers run as root and trust what they read from it, so it must
+ *  belong to root and not be writable by anyone else; this also takes
+ *  back a directory an older hald gave to HAL_USER. Must be called while
+ *  still running as root.
+ */
+void
+blockdev_privileged_init (void)
+{
+	int fd;
+
+	if (mkdir (PART_TABLE_CACHE_DIR, 0755) != 0 && errno != EEXIST) {
+		HAL_WARNING (("Cannot create %s: %s", PART_TABLE_CACHE_DIR, strerror (errno)));
+		return;
+	}
+
+	fd = open (PART_TABLE_CACHE_DIR, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fd < 0) {
+		HAL_WARNING (("Cannot open %s: %s", PART_TABLE_CACHE_DIR, strerror (errno)));
+		return;
+	}
+	if (fchown (fd, 0, 0) != 0 || fchmod (fd, 0755) != 0)
+		HAL_WARNING (("Cannot give %s to root: %s", PART_TABLE_CACHE_DIR, strerror (errno)));
+	close (fd);
+}
+
 void
 hotplug_event_begin_remove_blockdev (const gchar *sysfs_path, void *end_token)
 {
@@ -1691,6 +1990,8 @@ hotplug_event_begin_remove_blockdev (const gchar *sysfs_path, void *end_token)
 		HalDevice *fakevolume;
 		char fake_sysfs_path[HAL_PATH_MAX];
 
+		blockdev_invalidate_part_table_cache (d);
+
 		/* if we're a storage device synthesize hotplug rem event 
 		 * for the one potential fakevolume we've got 
 		 */
@@ -1732,10 +2033,12 @@ out:
 }
 
 void 
-hotplug_event_refresh_blockdev (gchar *sysfs_path, HalDevice *d, void *end_token)
+hotplug_event_refresh_blockdev (const gchar *sysfs_path, HalDevice *d, void *end_token)
 {
 	HAL_INFO (("block_change: sysfs_path=%s", sysfs_path));
 
+	blockdev_invalidate_part_table_cache (d);
+
         if (hal_device_property_get_bool (d, "storage.removable.support_async_notification")) {
                 blockdev_rescan_device (d);
         }
@@ -1829,9 +2132,6 @@ blockdev_generate_add_hotplug_event (HalDevice *d)
 	const char *serial;
 	const char *revision;
 	HotplugEvent *hotplug_event;
-	const char *nul;
-
-	nul = "\0";
 
 	sysfs_path = hal_device_property_get_string (d, "linux.sysfs_path");
 
@@ -1841,17 +2141,17 @@ blockdev_generate_add_hotplug_event (HalDevice *d)
 	serial      = hal_device_property_get_string (d, "storage.serial");
 	revision    = hal_device_property_get_string (d, "storage.firmware_revision");
 
-	hotplug_event = g_slice_new0 (HotplugEvent);
+	hotplug_event = hotplug_event_new ();
 	hotplug_event->action = HOTPLUG_ACTION_ADD;
 	hotplug_event->type = HOTPLUG_EVENT_SYSFS;
-	g_strlcpy (hotplug_event->sysfs.subsystem, "block", sizeof (hotplug_event->sysfs.subsystem));
-	g_strlcpy (hotplug_event->sysfs.sysfs_path, sysfs_path, sizeof (hotplug_event->sysfs.sysfs_path));
+	hotplug_event->sysfs.subsystem = "block";
+	hotplug_event->sysfs.sysfs_path = hotplug_event_strdup (hotplug_event, sysfs_path);
 
-	g_strlcpy (hotplug_event->sysfs.device_file, device_file != NULL ? device_file : nul, HAL_NAME_MAX);
-	g_strlcpy (hotplug_event->sysfs.vendor,           vendor != NULL ?      vendor : nul, HAL_NAME_MAX);
-	g_strlcpy (hotplug_event->sysfs.model,             model != NULL ?       model : nul, HAL_NAME_MAX);
-	g_strlcpy (hotplug_event->sysfs.serial,           serial != NULL ?      serial : nul, HAL_NAME_MAX);
-	g_strlcpy (hotplug_event->sysfs.revision,       revision != NULL ?    revision : nul, HAL_NAME_MAX);
+	hotplug_event->sysfs.device_file = hotplug_event_strdup (hotplug_event, device_file);
+	hotplug_event->sysfs.vendor = hotplug_event_strdup (hotplug_event, vendor);
+	hotplug_event->sysfs.model = hotplug_event_strdup (hotplug_event, model);
+	hotplug_event->sysfs.serial = hotplug_event_strdup (hotplug_event, serial);
+	hotplug_event->sysfs.revision = hotplug_event_strdup (hotplug_event, revision);
 
 	hotplug_event->sysfs.net_ifindex = -1;
 
@@ -1866,12 +2166,11 @@ blockdev_generate_remove_hotplug_event (HalDevice *d)
 
 	sysfs_path = hal_device_property_get_string (d, "linux.sysfs_path");
 
-	hotplug_event = g_slice_new0 (HotplugEvent);
+	hotplug_event = hotplug_event_new ();
 	hotplug_event->action = HOTPLUG_ACTION_REMOVE;
 	hotplug_event->type = HOTPLUG_EVENT_SYSFS;
-	g_strlcpy (hotplug_event->sysfs.subsystem, "block", sizeof (hotplug_event->sysfs.subsystem));
-	g_strlcpy (hotplug_event->sysfs.sysfs_path, sysfs_path, sizeof (hotplug_event->sysfs.sysfs_path));
-	hotplug_event->sysfs.device_file[0] = '\0';
+	hotplug_event->sysfs.subsystem = "block";
+	hotplug_event->sysfs.sysfs_path = hotplug_event_strdup (hotplug_event, sysfs_path);
 	hotplug_event->sysfs.net_ifindex = -1;
 
 	return hotplug_event;
@@ -1997,12 +2296,12 @@ blockdev_process_mdstat (void)
                         } else {
                                 HAL_INFO (("Adding md device at '%s' ('%s')", sysfs_path, device_file));
 
-                                hotplug_event = g_slice_new0 (HotplugEvent);
+                                hotplug_event = hotplug_event_new ();
                                 hotplug_event->action = HOTPLUG_ACTION_ADD;
                                 hotplug_event->type = HOTPLUG_EVENT_SYSFS_BLOCK;
-                                g_strlcpy (hotplug_event->sysfs.subsystem, "block", sizeof (hotplug_event->sysfs.subsystem));
-                                g_strlcpy (hotplug_event->sysfs.sysfs_path, sysfs_path, sizeof (hotplug_event->sysfs.sysfs_path));
-                                g_strlcpy (hotplug_event->sysfs.device_file, device_file, sizeof (hotplug_event->sysfs.device_file));
+                                hotplug_event->sysfs.subsystem = "block";
+                                hotplug_event->sysfs.sysfs_path = hotplug_event_strdup (hotplug_event, sysfs_path);
+                                hotplug_event->sysfs.device_file = hotplug_event_strdup (hotplug_event, device_file);
                                 hotplug_event->sysfs.net_ifindex = -1;
                                 hotplug_event_enqueue (hotplug_event);
                                 
@@ -2050,12 +2349,12 @@ blockdev_process_mdstat (void)
                                 
                                 HAL_INFO (("Removing md device at '%s' ('%s')", sysfs_path, device_file));
 
-                                hotplug_event = g_slice_new0 (HotplugEvent);
+                                hotplug_event = hotplug_event_new ();
                                 hotplug_event->action = HOTPLUG_ACTION_REMOVE;
                                 hotplug_event->type = HOTPLUG_EVENT_SYSFS_BLOCK;
-                                g_strlcpy (hotplug_event->sysfs.subsystem, "block", sizeof (hotplug_event->sysfs.subsystem));
-                                g_strlcpy (hotplug_event->sysfs.sysfs_path, sysfs_path, sizeof (hotplug_event->sysfs.sysfs_path));
-                                g_strlcpy (hotplug_event->sysfs.device_file, device_file, sizeof (hotplug_event->sysfs.device_file));
+                                hotplug_event->sysfs.subsystem = "block";
+                                hotplug_event->sysfs.sysfs_path = hotplug_event_strdup (hotplug_event, sysfs_path);
+                                hotplug_event->sysfs.device_file = hotplug_event_strdup (hotplug_event, device_file);
                                 hotplug_event->sysfs.net_ifindex = -1;
                                 hotplug_event_enqueue (hotplug_event);
                                 
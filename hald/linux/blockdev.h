@@ -32,7 +32,7 @@ void hotplug_event_begin_add_blockdev (const gchar *sysfs_path, const char *devi
 
 void hotplug_event_begin_remove_blockdev (const gchar *sysfs_path, void *end_token);
 
-void hotplug_event_refresh_blockdev (gchar *sysfs_path, HalDevice *d, void *end_token);
+void hotplug_event_refresh_blockdev (const gchar *sysfs_path, HalDevice *d, void *end_token);
 
 gboolean blockdev_rescan_device (HalDevice *d);
 
@@ -44,4 +44,6 @@ void blockdev_refresh_mount_state (HalDevice *d);
 
 void blockdev_process_mdstat (void);
 
+void blockdev_privileged_init (void);
+
 #endif /* BLOCKDEV_H */
@@ -29,6 +29,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <dirent.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <dbus/dbus.h>
@@ -47,14 +48,57 @@
 
 #define DMPREFIX "dm-"
 
+/* Upper bound for the threads scanning sysfs */
+#define COLDPLUG_MAX_SCAN_THREADS 8
+
+/* Coldplug events in progress at once, per CPU */
+#define COLDPLUG_MAX_RUNNING_PER_CPU 8
+
 struct sysfs_device {
+	struct sysfs_device *next;
 	char *path;
 	char *subsystem;
 	HotplugEventType type;
 };
 
+/* a device link the scan threads couldn't resolve, reported after the join */
+struct scan_error {
+	struct scan_error *next;
+	char *dir;
+	char *target;
+};
+
+/*
+ * Scanning sysfs is split into jobs of one directory each, which are run by
+ * a few threads. The threads only use libc and g_malloc, build their results
+ * in job private lists and never log; everything else, including the
+ * HotplugEvents, is done by the main thread once they're joined.
+ */
+typedef enum {
+	SCAN_JOB_DEVICES,	/* every entry of dir is a device */
+	SCAN_JOB_CLASS,		/* like SCAN_JOB_DEVICES, but skip "device" */
+	SCAN_JOB_BLOCK		/* dir is a disk, its entries partitions */
+} ScanJobType;
+
+typedef struct {
+	ScanJobType type;
+	char *dir;
+	char *subsystem;
+	struct sysfs_device *devices;
+	guint num_devices;
+	struct scan_error *errors;
+} ScanJob;
+
+typedef struct {
+	GPtrArray *jobs;
+	guint next_job;
+	pthread_mutex_t lock;
+} ScanPool;
+
 static GHashTable *sysfs_to_udev_map;
-static GSList *device_list;
+/* jobs of the scan in progress, and the devices they found */
+static GPtrArray *scan_jobs;
+static GPtrArray *device_list;
 static char dev_root[HAL_PATH_MAX];
 static gchar *udevinfo_stdout = NULL;
 static unsigned long long coldplug_seqnum = 0;
@@ -72,12 +116,67 @@ struct _UdevInfo
 	const char *fstype;
 	const char *fsversion;
 	const char *fsuuid;
-	const char *fslabel;
+	const char *fslabel;		/* decoded, owned by the UdevInfo */
+	char *data;			/* database file the strings point into, if read directly */
+	char *devname;			/* owned device_file, if the database has no N: */
 };
 
+/* The udev database is read directly if we find it in one of these
+ * places, newest layout first. Otherwise its export is parsed. */
+static const struct {
+	const char *dir;
+	gboolean by_devpath;		/* file names are escaped devpaths, not device ids */
+} udev_db_layouts[] = {
+	{ "/run/udev/data", FALSE },
+	{ "/dev/.udev/data", FALSE },
+	{ "/dev/.udev/db", TRUE }
+};
+
+static const char *udev_db_dir = NULL;
+static gboolean udev_db_by_devpath = FALSE;
+
 static void udev_info_free (gpointer data)
 {
-	g_slice_free(UdevInfo, data);
+	UdevInfo *info = data;
+
+	g_free ((char *) info->fslabel);
+	g_free (info->data);
+	g_free (info->devname);
+	g_slice_free(UdevInfo, info);
+}
+
+/* Take a N: or E: entry of the export or the database */
+static void
+udev_info_set (UdevInfo *info, char type, char *value)
+{
+	int len;
+
+	if (type == 'N') {
+		info->device_file = value;
+	} else if (type != 'E') {
+		return;
+	} else if (strncmp(value, "ID_VENDOR=", 10) == 0) {
+		info->vendor = &value[10];
+	} else if (strncmp(value, "ID_MODEL=", 9) == 0) {
+		info->model = &value[9];
+	} else if (strncmp(value, "ID_REVISION=", 12) == 0) {
+		info->revision = &value[12];
+	} else if (strncmp(value, "ID_SERIAL=", 10) == 0) {
+		info->serial = &value[10];
+	} else if (strncmp(value, "ID_FS_USAGE=", 12) == 0) {
+		info->fsusage = &value[12];
+	} else if (strncmp(value, "ID_FS_TYPE=", 11) == 0) {
+		info->fstype = &value[11];
+	} else if (strncmp(value, "ID_FS_VERSION=", 14) == 0) {
+		info->fsversion = &value[14];
+	} else if (strncmp(value, "ID_FS_UUID=", 11) == 0) {
+		info->fsuuid = &value[11];
+	} else if (strncmp(value, "ID_FS_LABEL_ENC=", 16) == 0) {
+		len = strlen (&value[16]);
+		g_free ((char *) info->fslabel);
+		info->fslabel = g_malloc0 (len + 1);
+		hal_util_decode_escape (&value[16], (char *)info->fslabel, len + 1);
+	}
 }
 
 
@@ -87,14 +186,13 @@ udev_info_to_hotplug_event (const UdevInfo *info)
 	HotplugEvent *hotplug_event;
 	gchar *str;
 
-	hotplug_event = g_slice_new0 (HotplugEvent);
-	g_strlcpy (hotplug_event->sysfs.sysfs_path, "/sys", sizeof(hotplug_event->sysfs.sysfs_path));
-	g_strlcat (hotplug_event->sysfs.sysfs_path, info->sysfs_path, sizeof(hotplug_event->sysfs.sysfs_path));
+	hotplug_event = hotplug_event_new ();
+	hotplug_event->sysfs.sysfs_path = hotplug_event_strdup_printf (hotplug_event, "/sys%s", info->sysfs_path);
 
 	HAL_INFO(("creating HotplugEvent for %s", hotplug_event->sysfs.sysfs_path));
 
 	if (info->device_file) {
-		g_snprintf (hotplug_event->sysfs.device_file, sizeof(hotplug_event->sysfs.device_file),
+		hotplug_event->sysfs.device_file = hotplug_event_strdup_printf (hotplug_event,
 			"%s/%s", dev_root, info->device_file);
 		HAL_INFO(("with device file %s", hotplug_event->sysfs.device_file));
 		if (strstr(hotplug_event->sysfs.device_file, "/" DMPREFIX) != NULL) {
@@ -103,47 +201,47 @@ udev_info_to_hotplug_event (const UdevInfo *info)
 		}
 	}
 	if ((str = hal_util_strdup_valid_utf8(info->vendor)) != NULL) {
-		g_strlcpy (hotplug_event->sysfs.vendor, str, sizeof(hotplug_event->sysfs.vendor));
+		hotplug_event->sysfs.vendor = hotplug_event_strdup (hotplug_event, str);
 		g_free (str);
 	}
 
 	if ((str = hal_util_strdup_valid_utf8(info->model)) != NULL) {
-		g_strlcpy (hotplug_event->sysfs.model, str, sizeof(hotplug_event->sysfs.model));
+		hotplug_event->sysfs.model = hotplug_event_strdup (hotplug_event, str);
 		g_free (str);
 	}
 
 	if ((str = hal_util_strdup_valid_utf8(info->revision)) != NULL) {
-		g_strlcpy (hotplug_event->sysfs.revision, str, sizeof(hotplug_event->sysfs.revision));
+		hotplug_event->sysfs.revision = hotplug_event_strdup (hotplug_event, str);
 		g_free (str);
 	}
 
 	if ((str = hal_util_strdup_valid_utf8(info->serial)) != NULL) {
-		g_strlcpy (hotplug_event->sysfs.serial, str, sizeof(hotplug_event->sysfs.serial));
+		hotplug_event->sysfs.serial = hotplug_event_strdup (hotplug_event, str);
 		g_free (str);
 	}
 
 	if ((str = hal_util_strdup_valid_utf8(info->fsusage)) != NULL) {
-		g_strlcpy (hotplug_event->sysfs.fsusage, str, sizeof(hotplug_event->sysfs.fsusage));
+		hotplug_event->sysfs.fsusage = hotplug_event_strdup (hotplug_event, str);
 		g_free (str);
 	}
 
 	if ((str = hal_util_strdup_valid_utf8(info->fstype)) != NULL) {
-		g_strlcpy (hotplug_event->sysfs.fstype, str, sizeof(hotplug_event->sysfs.fstype));
+		hotplug_event->sysfs.fstype = hotplug_event_strdup (hotplug_event, str);
 		g_free (str);
 	}
 
 	if ((str = hal_util_strdup_valid_utf8(info->fsversion)) != NULL) {
-		g_strlcpy (hotplug_event->sysfs.fsversion, str, sizeof(hotplug_event->sysfs.fsversion));
+		hotplug_event->sysfs.fsversion = hotplug_event_strdup (hotplug_event, str);
 		g_free (str);
 	}
 
 	if ((str = hal_util_strdup_valid_utf8(info->fsuuid)) != NULL) {
-		g_strlcpy (hotplug_event->sysfs.fsuuid, str, sizeof(hotplug_event->sysfs.fsuuid));
+		hotplug_event->sysfs.fsuuid = hotplug_event_strdup (hotplug_event, str);
 		g_free (str);
 	}
 
 	if ((str = hal_util_strdup_valid_utf8(info->fslabel)) != NULL) {
-		g_strlcpy (hotplug_event->sysfs.fslabel, str, sizeof(hotplug_event->sysfs.fslabel));
+		hotplug_event->sysfs.fslabel = hotplug_event_strdup (hotplug_event, str);
 		g_free (str);
 	}
 
@@ -159,7 +257,6 @@ hal_util_init_sysfs_to_udev_map (void)
 	int udevinfo_exitcode;
 	UdevInfo *info = NULL;
 	char *p;
-	int len;
 
 	sysfs_to_udev_map = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, udev_info_free);
 
@@ -235,29 +332,8 @@ hal_util_init_sysfs_to_udev_map (void)
 		if (info == NULL)
 			continue;
 
-		if (strncmp(line, "N: ", 3) == 0) {
-			info->device_file = &line[3];
-		} else if (strncmp(line, "E: ID_VENDOR=", 13) == 0) {
-			info->vendor = &line[13];
-		} else if (strncmp(line, "E: ID_MODEL=", 12) == 0) {
-			info->model = &line[12];
-		} else if (strncmp(line, "E: ID_REVISION=", 15) == 0) {
-			info->revision = &line[15];
-		} else if (strncmp(line, "E: ID_SERIAL=", 13) == 0) {
-			info->serial = &line[13];
-		} else if (strncmp(line, "E: ID_FS_USAGE=", 15) == 0) {
-			info->fsusage = &line[15];
-		} else if (strncmp(line, "E: ID_FS_TYPE=", 14) == 0) {
-			info->fstype = &line[14];
-		} else if (strncmp(line, "E: ID_FS_VERSION=", 17) == 0) {
-			info->fsversion = &line[17];
-		} else if (strncmp(line, "E: ID_FS_UUID=", 14) == 0) {
-			info->fsuuid = &line[14];
-		} else if (strncmp(line, "E: ID_FS_LABEL_ENC=", 19) == 0) {
-			len = strlen (&line[15]);
-			info->fslabel = g_malloc0 (len + 1);
-			hal_util_decode_escape (&line[19], (char *)info->fslabel, len + 1);
-		}
+		if (line[1] == ':' && line[2] == ' ')
+			udev_info_set (info, line[0], &line[3]);
 	}
 
 	return TRUE;
@@ -269,6 +345,166 @@ error:
 	return FALSE;
 }
 
+/* Get the udev root from udev.conf, like udevadm info -r does */
+static void
+udev_db_read_dev_root (void)
+{
+	gchar *contents;
+	gchar **lines;
+	gchar *value;
+	int i;
+	size_t len;
+
+	g_strlcpy (dev_root, "/dev", sizeof (dev_root));
+
+	if (!g_file_get_contents ("/etc/udev/udev.conf", &contents, NULL, NULL))
+		return;
+
+	lines = g_strsplit (contents, "\n", 0);
+	for (i = 0; lines[i] != NULL; i++) {
+		value = g_strstrip (lines[i]);
+		if (!g_str_has_prefix (value, "udev_root"))
+			continue;
+		value = strchr (value, '=');
+		if (value == NULL)
+			continue;
+		value = g_strstrip (value + 1);
+		if (value[0] == '"' || value[0] == '\'')
+			value++;
+		len = strlen (value);
+		if (len > 0 && (value[len - 1] == '"' || value[len - 1] == '\''))
+			value[--len] = '\0';
+		while (len > 1 && value[len - 1] == '/')
+			value[--len] = '\0';
+		if (len > 0)
+			g_strlcpy (dev_root, value, sizeof (dev_root));
+	}
+	g_strfreev (lines);
+	g_free (contents);
+}
+
+/** Prepare to read the udev database directly
+ *
+ *  @return                     FALSE if no database we know how to read
+ *                              was found
+ */
+static gboolean
+udev_db_init (void)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (udev_db_layouts); i++) {
+		if (g_file_test (udev_db_layouts[i].dir, G_FILE_TEST_IS_DIR)) {
+			udev_db_dir = udev_db_layouts[i].dir;
+			udev_db_by_devpath = udev_db_layouts[i].by_devpath;
+			break;
+		}
+	}
+	if (udev_db_dir == NULL)
+		return FALSE;
+
+	udev_db_read_dev_root ();
+	HAL_INFO (("reading udev database from %s, dev_root is %s", udev_db_dir, dev_root));
+	return TRUE;
+}
+
+/* Name of the database file of a device */
+static gchar *
+udev_db_get_filename (const char *sysfs_path, const char *subsystem)
+{
+	const char *devpath;
+	const char *dev;
+	GString *name;
+	gint ifindex;
+
+	if (udev_db_by_devpath) {
+		/* the devpath, with '/' and '\' escaped */
+		devpath = sysfs_path;
+		if (g_str_has_prefix (devpath, "/sys/"))
+			devpath += 4;
+
+		name = g_string_new (udev_db_dir);
+		g_string_append_c (name, '/');
+		for (; *devpath != '\0'; devpath++) {
+			if (*devpath == '/')
+				g_string_append (name, "\\x2f");
+			else if (*devpath == '\\')
+				g_string_append (name, "\\x5c");
+			else
+				g_string_append_c (name, *devpath);
+		}
+		return g_string_free (name, FALSE);
+	}
+
+	/* b<maj>:<min>, c<maj>:<min>, n<ifindex> or +<subsystem>:<sysname> */
+	dev = hal_util_get_string_from_file (sysfs_path, "dev");
+	if (dev != NULL && dev[0] != '\0')
+		return g_strdup_printf ("%s/%c%s", udev_db_dir,
+					strcmp (subsystem, "block") == 0 ? 'b' : 'c', dev);
+
+	if (strcmp (subsystem, "net") == 0 &&
+	    hal_util_get_int_from_file (sysfs_path, "ifindex", &ifindex, 10))
+		return g_strdup_printf ("%s/n%d", udev_db_dir, ifindex);
+
+	return g_strdup_printf ("%s/+%s:%s", udev_db_dir, subsystem, hal_util_get_last_element (sysfs_path));
+}
+
+/** Read the udev database entry of a device
+ *
+ *  @param  sysfs_path          Sysfs path of the device
+ *  @param  subsystem           Subsystem of the device
+ *  @return                     NULL if udev doesn't know the device, otherwise
+ *                              an entry to free with udev_info_free()
+ */
+static UdevInfo *
+udev_db_lookup (const char *sysfs_path, const char *subsystem)
+{
+	UdevInfo *info;
+	gchar *filename;
+	gchar *contents;
+	const gchar *devname;
+	char *p;
+	char *line;
+	char *end;
+
+	filename = udev_db_get_filename (sysfs_path, subsystem);
+	if (!g_file_get_contents (filename, &contents, NULL, NULL)) {
+		g_free (filename);
+		return NULL;
+	}
+	g_free (filename);
+
+	info = g_slice_new0 (UdevInfo);
+	info->data = contents;
+	/* udev_info_to_hotplug_event() wants it without /sys */
+	info->sysfs_path = sysfs_path + 4;
+
+	for (p = contents; *p != '\0'; p = end) {
+		line = p;
+		end = strchr (line, '\n');
+		if (end != NULL)
+			*end++ = '\0';
+		else
+			end = line + strlen (line);
+
+		if (line[0] != '\0' && line[1] == ':')
+			udev_info_set (info, line[0], &line[2]);
+	}
+
+	/* newer databases only have N: for renamed nodes */
+	if (info->device_file == NULL) {
+		devname = hal_util_grep_file (sysfs_path, "uevent", "DEVNAME=", FALSE);
+		if (devname != NULL && devname[0] != '\0') {
+			info->devname = g_strdup (devname);
+			info->device_file = info->devname;
+		}
+	}
+
+	HAL_INFO (("found (udevdb) '%s' -> '%s/%s'", sysfs_path, dev_root,
+		   info->device_file != NULL ? info->device_file : ""));
+	return info;
+}
+
 static HotplugEvent
 *coldplug_get_hotplug_event(const gchar *sysfs_path, const gchar *subsystem, HotplugEventType type)
 {
@@ -279,15 +515,20 @@ static HotplugEvent
 	UdevInfo *info;
 
 	/* lookup if udev has something stored in its database */
-	info = (UdevInfo*) g_hash_table_lookup (sysfs_to_udev_map, sysfs_path);
+	if (udev_db_dir != NULL)
+		info = udev_db_lookup (sysfs_path, subsystem);
+	else
+		info = (UdevInfo*) g_hash_table_lookup (sysfs_to_udev_map, sysfs_path);
 	if (info) {
 		hotplug_event = udev_info_to_hotplug_event (info);
 		HAL_INFO (("new event (dev node from udev) '%s' '%s'", hotplug_event->sysfs.sysfs_path, hotplug_event->sysfs.device_file));
+		if (udev_db_dir != NULL)
+			udev_info_free (info);
 	} else {
-		hotplug_event = g_slice_new0 (HotplugEvent);
+		hotplug_event = hotplug_event_new ();
 
 		/* device is not in udev database */
-		g_strlcpy(hotplug_event->sysfs.sysfs_path, sysfs_path, sizeof(hotplug_event->sysfs.sysfs_path));
+		hotplug_event->sysfs.sysfs_path = hotplug_event_strdup (hotplug_event, sysfs_path);
 
 		/* look if a device node is expected */
 		g_strlcpy(path, sysfs_path, sizeof(path));
@@ -307,7 +548,7 @@ static HotplugEvent
 			goto no_node;
 
 		HAL_INFO (("new event (dev node from kernel name) '%s' '%s'", sysfs_path, path));
-		g_strlcpy(hotplug_event->sysfs.device_file, path, sizeof(hotplug_event->sysfs.device_file));
+		hotplug_event->sysfs.device_file = hotplug_event_strdup (hotplug_event, path);
 		if (strstr(hotplug_event->sysfs.device_file, "/" DMPREFIX) != NULL) {
 			HAL_INFO (("Found a dm-device (%s) , mark it", hotplug_event->sysfs.device_file));
 			hotplug_event->sysfs.is_dm_device = TRUE;
@@ -317,7 +558,7 @@ static HotplugEvent
 no_node:
 	if (hotplug_event->sysfs.device_file[0] == '\0')
 		HAL_INFO (("new event (no dev node) '%s'", sysfs_path));
-	g_strlcpy (hotplug_event->sysfs.subsystem, subsystem, sizeof (hotplug_event->sysfs.subsystem));
+	hotplug_event->sysfs.subsystem = hotplug_event_strdup (hotplug_event, subsystem);
 	hotplug_event->action = HOTPLUG_ACTION_ADD;
 	hotplug_event->type = type;
 	hotplug_event->sysfs.net_ifindex = -1;
@@ -326,12 +567,43 @@ no_node:
 	return hotplug_event;
 }
 
-static int device_list_insert(const char *path, const char *subsystem,
+static guint
+coldplug_num_cpus (void)
+{
+	long num_cpus;
+
+	num_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+	return num_cpus > 0 ? (guint) num_cpus : 1;
+}
+
+/* hal_util_get_normalized_path() for the scan threads, which must not log:
+ * strip one component of dir for every leading "../" of target */
+static char *
+scan_normalize_path (const char *dir, const char *target)
+{
+	const char *p1 = dir + strlen (dir);
+	const char *p2 = target;
+
+	while (strncmp (p2, "../", 3) == 0) {
+		p2 += 3;
+		do {
+			if (p1 == dir)
+				return NULL;
+		} while (*(--p1) != '/');
+	}
+
+	return g_strdup_printf ("%.*s/%s", (int) (p1 - dir), dir, p2);
+}
+
+/* Called from the scan threads */
+static int device_list_insert(ScanJob *job, const char *path, const char *subsystem,
 			      HotplugEventType type)
 {
 	char filename[HAL_PATH_MAX];
+	char target[HAL_PATH_MAX];
 	struct stat statbuf;
 	struct sysfs_device *sysfs_dev = NULL;
+	ssize_t len;
 
 	/* we only have a device, if we have an uevent file */
 	g_strlcpy(filename, path, sizeof(filename));
@@ -341,66 +613,182 @@ static int device_list_insert(const char *path, const char *subsystem,
 	if (!(statbuf.st_mode & S_IWUSR))
 		goto error;
 
-	sysfs_dev = g_slice_new0 (struct sysfs_device);
-	if (sysfs_dev == NULL)
-		goto error;
+	/* not g_slice; it isn't thread safe without g_thread_init() */
+	sysfs_dev = g_new0 (struct sysfs_device, 1);
 
 	/* resolve possible link to real target */
 	if (lstat(path, &statbuf) < 0)
 		goto error;
 	if (S_ISLNK(statbuf.st_mode)) {
-		gchar *target;
-
-		if ((target = hal_util_readlink (path)) != NULL) {
-			gchar *normalized_target;
-
-			g_strlcpy(filename, path, sizeof(filename));
-			hal_util_path_ascend (filename);
-			normalized_target = hal_util_get_normalized_path (filename, target);
-			sysfs_dev->path = normalized_target;
-			goto found;
+		/* not hal_util_readlink(), it returns a static buffer */
+		len = readlink (path, target, sizeof (target) - 1);
+		if (len < 0)
+			goto error;
+		target[len] = '\0';
+
+		g_strlcpy(filename, path, sizeof(filename));
+		hal_util_path_ascend (filename);
+		sysfs_dev->path = scan_normalize_path (filename, target);
+		if (sysfs_dev->path == NULL) {
+			struct scan_error *err = g_new0 (struct scan_error, 1);
+
+			err->dir = g_strdup (filename);
+			err->target = g_strdup (target);
+			err->next = job->errors;
+			job->errors = err;
+			goto error;
 		}
-		goto error;
+		goto found;
 	}
 
 	sysfs_dev->path = g_strdup (path);
 found:
 	sysfs_dev->subsystem = g_strdup (subsystem);
-	device_list = g_slist_append (device_list, sysfs_dev);
+	sysfs_dev->next = job->devices;
+	job->devices = sysfs_dev;
+	job->num_devices++;
 	return 0;
 
 error:
-	g_slice_free (struct sysfs_device, sysfs_dev);
+	g_free (sysfs_dev);
 	return -1;
 }
 
+static void
+run_scan_job (ScanJob *job)
+{
+	DIR *dir;
+	struct dirent *dent;
+
+	if (job->type == SCAN_JOB_BLOCK &&
+	    device_list_insert(job, job->dir, job->subsystem, HOTPLUG_EVENT_SYSFS_BLOCK) != 0)
+		return;
+
+	dir = opendir(job->dir);
+	if (dir == NULL)
+		return;
+
+	for (dent = readdir(dir); dent != NULL; dent = readdir(dir)) {
+		char dirname[HAL_PATH_MAX];
+
+		if (dent->d_name[0] == '.')
+			continue;
+		if (job->type != SCAN_JOB_DEVICES && !strcmp(dent->d_name, "device"))
+			continue;
+
+		g_strlcpy(dirname, job->dir, sizeof(dirname));
+		g_strlcat(dirname, "/", sizeof(dirname));
+		g_strlcat(dirname, dent->d_name, sizeof(dirname));
+		device_list_insert(job, dirname, job->subsystem,
+				   job->type == SCAN_JOB_BLOCK ? HOTPLUG_EVENT_SYSFS_BLOCK : HOTPLUG_EVENT_SYSFS_DEVICE);
+	}
+	closedir(dir);
+}
+
+static void *
+scan_thread (void *data)
+{
+	ScanPool *pool = data;
+	guint i;
+
+	for (;;) {
+		pthread_mutex_lock (&pool->lock);
+		i = pool->next_job++;
+		pthread_mutex_unlock (&pool->lock);
+
+		if (i >= pool->jobs->len)
+			break;
+		run_scan_job (g_ptr_array_index (pool->jobs, i));
+	}
+	return NULL;
+}
+
+static void
+add_scan_job (ScanJobType type, const char *dir, const char *subsystem)
+{
+	ScanJob *job;
+
+	if (scan_jobs == NULL)
+		scan_jobs = g_ptr_array_new ();
+
+	job = g_new0 (ScanJob, 1);
+	job->type = type;
+	job->dir = g_strdup (dir);
+	job->subsystem = g_strdup (subsystem);
+	g_ptr_array_add (scan_jobs, job);
+}
+
+/* Run the queued scan jobs and collect what they found in device_list */
+static void
+run_scan_jobs (void)
+{
+	ScanPool pool;
+	pthread_t threads[COLDPLUG_MAX_SCAN_THREADS];
+	guint num_threads;
+	guint num_devices;
+	guint i;
+
+	if (scan_jobs == NULL)
+		return;
+
+	pool.jobs = scan_jobs;
+	pool.next_job = 0;
+	pthread_mutex_init (&pool.lock, NULL);
+
+	num_threads = MIN (coldplug_num_cpus (), COLDPLUG_MAX_SCAN_THREADS);
+	num_threads = MIN (num_threads, scan_jobs->len);
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create (&threads[i], NULL, scan_thread, &pool) != 0)
+			break;
+	}
+	num_threads = i;
+	/* help out; this also does all the work if no thread could be started */
+	scan_thread (&pool);
+	for (i = 0; i < num_threads; i++)
+		pthread_join (threads[i], NULL);
+
+	pthread_mutex_destroy (&pool.lock);
+
+	num_devices = 0;
+	for (i = 0; i < scan_jobs->len; i++)
+		num_devices += ((ScanJob *) g_ptr_array_index (scan_jobs, i))->num_devices;
+
+	device_list = g_ptr_array_sized_new (num_devices);
+	for (i = 0; i < scan_jobs->len; i++) {
+		ScanJob *job = g_ptr_array_index (scan_jobs, i);
+		struct sysfs_device *sysfs_dev;
+		struct scan_error *err;
+
+		for (sysfs_dev = job->devices; sysfs_dev != NULL; sysfs_dev = sysfs_dev->next)
+			g_ptr_array_add (device_list, sysfs_dev);
+
+		while ((err = job->errors) != NULL) {
+			HAL_ERROR (("Could not normalize '%s' and '%s', ignoring the device", err->dir, err->target));
+			job->errors = err->next;
+			g_free (err->dir);
+			g_free (err->target);
+			g_free (err);
+		}
+
+		g_free (job->dir);
+		g_free (job->subsystem);
+		g_free (job);
+	}
+	g_ptr_array_free (scan_jobs, TRUE);
+	scan_jobs = NULL;
+
+	HAL_INFO (("found %d devices using %d scan threads", num_devices, num_threads));
+}
+
 static void
 scan_single_bus (const char *bus_name)
 {
         char dirname[HAL_PATH_MAX];
-        DIR *dir2;
-        struct dirent *dent2;
         
         g_strlcpy(dirname, "/sys/bus/", sizeof(dirname));
         g_strlcat(dirname, bus_name, sizeof(dirname));
         g_strlcat(dirname, "/devices", sizeof(dirname));
-        
-        /* look for devices */
-        dir2 = opendir(dirname);
-        if (dir2 != NULL) {
-                for (dent2 = readdir(dir2); dent2 != NULL; dent2 = readdir(dir2)) {
-                        char dirname2[HAL_PATH_MAX];
-                        
-                        if (dent2->d_name[0] == '.')
-                                continue;
-                        
-                        g_strlcpy(dirname2, dirname, sizeof(dirname2));
-                        g_strlcat(dirname2, "/", sizeof(dirname2));
-                        g_strlcat(dirname2, dent2->d_name, sizeof(dirname2));
-                        device_list_insert(dirname2, bus_name, HOTPLUG_EVENT_SYSFS_DEVICE);
-                }
-                closedir(dir2);
-        }
+        add_scan_job (SCAN_JOB_DEVICES, dirname, bus_name);
 }
 
 static void scan_subsystem(const char *subsys)
@@ -416,8 +804,6 @@ static void scan_subsystem(const char *subsys)
 	if (dir != NULL) {
 		for (dent = readdir(dir); dent != NULL; dent = readdir(dir)) {
 			char dirname[HAL_PATH_MAX];
-			DIR *dir2;
-			struct dirent *dent2;
 
 			if (dent->d_name[0] == '.')
 				continue;
@@ -426,23 +812,7 @@ static void scan_subsystem(const char *subsys)
 			g_strlcat(dirname, "/", sizeof(dirname));
 			g_strlcat(dirname, dent->d_name, sizeof(dirname));
 			g_strlcat(dirname, "/devices", sizeof(dirname));
-
-			/* look for devices */
-			dir2 = opendir(dirname);
-			if (dir2 != NULL) {
-				for (dent2 = readdir(dir2); dent2 != NULL; dent2 = readdir(dir2)) {
-					char dirname2[HAL_PATH_MAX];
-
-					if (dent2->d_name[0] == '.')
-						continue;
-
-					g_strlcpy(dirname2, dirname, sizeof(dirname2));
-					g_strlcat(dirname2, "/", sizeof(dirname2));
-					g_strlcat(dirname2, dent2->d_name, sizeof(dirname2));
-					device_list_insert(dirname2, dent->d_name, HOTPLUG_EVENT_SYSFS_DEVICE);
-				}
-				closedir(dir2);
-			}
+			add_scan_job (SCAN_JOB_DEVICES, dirname, dent->d_name);
 		}
 		closedir(dir);
 	}
@@ -457,8 +827,6 @@ static void scan_block(void)
 	if (dir != NULL) {
 		for (dent = readdir(dir); dent != NULL; dent = readdir(dir)) {
 			char dirname[HAL_PATH_MAX];
-			DIR *dir2;
-			struct dirent *dent2;
 
 			if (dent->d_name[0] == '.')
 				continue;
@@ -471,27 +839,7 @@ static void scan_block(void)
 
 			g_strlcpy(dirname, "/sys/block/", sizeof(dirname));
 			g_strlcat(dirname, dent->d_name, sizeof(dirname));
-			if (device_list_insert(dirname, "block", HOTPLUG_EVENT_SYSFS_BLOCK) != 0)
-				continue;
-
-			/* look for partitions */
-			dir2 = opendir(dirname);
-			if (dir2 != NULL) {
-				for (dent2 = readdir(dir2); dent2 != NULL; dent2 = readdir(dir2)) {
-					char dirname2[HAL_PATH_MAX];
-
-					if (dent2->d_name[0] == '.')
-						continue;
-
-					if (!strcmp(dent2->d_name,"device"))
-						continue;
-					g_strlcpy(dirname2, dirname, sizeof(dirname2));
-					g_strlcat(dirname2, "/", sizeof(dirname2));
-					g_strlcat(dirname2, dent2->d_name, sizeof(dirname2));
-					device_list_insert(dirname2, "block", HOTPLUG_EVENT_SYSFS_BLOCK);
-				}
-				closedir(dir2);
-			}
+			add_scan_job (SCAN_JOB_BLOCK, dirname, "block");
 		}
 		closedir(dir);
 	}
@@ -506,64 +854,48 @@ static void scan_class(void)
 	if (dir != NULL) {
 		for (dent = readdir(dir); dent != NULL; dent = readdir(dir)) {
 			char dirname[HAL_PATH_MAX];
-			DIR *dir2;
-			struct dirent *dent2;
 
 			if (dent->d_name[0] == '.')
 				continue;
 
 			g_strlcpy(dirname, "/sys/class/", sizeof(dirname));
 			g_strlcat(dirname, dent->d_name, sizeof(dirname));
-			dir2 = opendir(dirname);
-			if (dir2 != NULL) {
-				for (dent2 = readdir(dir2); dent2 != NULL; dent2 = readdir(dir2)) {
-					char dirname2[HAL_PATH_MAX];
-
-					if (dent2->d_name[0] == '.')
-						continue;
-					if (!strcmp(dent2->d_name, "device"))
-						continue;
-
-					g_strlcpy(dirname2, dirname, sizeof(dirname2));
-					g_strlcat(dirname2, "/", sizeof(dirname2));
-					g_strlcat(dirname2, dent2->d_name, sizeof(dirname2));
-					device_list_insert(dirname2, dent->d_name, HOTPLUG_EVENT_SYSFS_DEVICE);
-				}
-				closedir(dir2);
-			}
+			add_scan_job (SCAN_JOB_CLASS, dirname, dent->d_name);
 		}
 		closedir(dir);
 	}
 }
 
+/* Enqueue events for the devices in device_list; the caller processes the queue */
 static void process_coldplug_events(void)
 {
-	GSList *dev;
+	guint i;
 
-	/* queue events for the devices */
-	for (dev = device_list; dev != NULL; dev = g_slist_next (dev)) {
+	if (device_list == NULL)
+		return;
+
+	for (i = 0; i < device_list->len; i++) {
 		HotplugEvent *hotplug_event;
-		struct sysfs_device *sysfs_dev = dev->data;
+		struct sysfs_device *sysfs_dev = g_ptr_array_index (device_list, i);
 
 		hotplug_event = coldplug_get_hotplug_event (sysfs_dev->path,
 							    sysfs_dev->subsystem,
 							    sysfs_dev->type);
 		hotplug_event_enqueue (hotplug_event);
-		hotplug_event_process_queue();
 
 		g_free (sysfs_dev->path);
 		g_free (sysfs_dev->subsystem);
-		g_slice_free (struct sysfs_device, sysfs_dev);
+		g_free (sysfs_dev);
 	}
 
-	g_slist_free (device_list);
+	g_ptr_array_free (device_list, TRUE);
 	device_list = NULL;
 }
 
 static int _device_order (const void *d1, const void *d2)
 {
-	const struct sysfs_device *dev1 = d1;
-	const struct sysfs_device *dev2 = d2;
+	const struct sysfs_device *dev1 = *(struct sysfs_device * const *) d1;
+	const struct sysfs_device *dev2 = *(struct sysfs_device * const *) d2;
 
 	/* device mapper needs to be the last events, to have the other block devs already around */
 	if (strstr (dev2->path, "/" DMPREFIX))
@@ -574,44 +906,69 @@ static int _device_order (const void *d1, const void *d2)
 	return strcmp(dev1->path, dev2->path);
 }
 
+/* Scan what was queued with the scan_* functions and enqueue the events in order */
+static void
+coldplug_scan_and_enqueue (void)
+{
+	run_scan_jobs ();
+	if (device_list == NULL)
+		return;
+	g_ptr_array_sort (device_list, _device_order);
+	process_coldplug_events ();
+}
+
 gboolean
 coldplug_synthesize_events (void)
 {
 	struct stat statbuf;
+	gboolean have_subsystem;
 
-	if (hal_util_init_sysfs_to_udev_map () == FALSE) {
+	/* entries are read as needed if we can read the database; else
+	 * fall back to the export */
+	if (!udev_db_init () && !hal_util_init_sysfs_to_udev_map ()) {
 		HAL_ERROR (("Unable to get sysfs to dev map"));
 		goto error;
 	}
 
+	/* events for independent devices run in parallel; don't start
+	 * hundreds of probers at once. osspec lifts this when coldplug is
+	 * done. */
+	hotplug_event_set_max_running (COLDPLUG_MAX_RUNNING_PER_CPU * coldplug_num_cpus ());
+
 	/* if we have /sys/subsystem, forget all the old stuff */
-	if (stat("/sys/subsystem", &statbuf) == 0) {
+	have_subsystem = (stat("/sys/subsystem", &statbuf) == 0);
+	if (have_subsystem) {
 		scan_subsystem ("subsystem");
-		device_list = g_slist_sort (device_list, _device_order);
-		process_coldplug_events ();
+		coldplug_scan_and_enqueue ();
 	} else {
 		scan_subsystem ("bus");
-		device_list = g_slist_sort (device_list, _device_order);
-		process_coldplug_events ();
+		coldplug_scan_and_enqueue ();
 
 		scan_class ();
                 scan_single_bus ("bluetooth");
-		device_list = g_slist_sort (device_list, _device_order);
-		process_coldplug_events ();
+		coldplug_scan_and_enqueue ();
 
 		/* scan /sys/block, if it isn't already a class */
 		if (stat("/sys/class/block", &statbuf) != 0) {
 			scan_block ();
-			device_list = g_slist_sort (device_list, _device_order);
-			process_coldplug_events ();
+			coldplug_scan_and_enqueue ();
 		}
+	}
+
+	/* everything is queued, start the events in one go */
+	hotplug_event_process_queue ();
 
+	if (!have_subsystem) {
                 /* add events from reading /proc/mdstat */
                 blockdev_process_mdstat ();
 	}
 
-	g_hash_table_destroy (sysfs_to_udev_map);
+	if (sysfs_to_udev_map != NULL) {
+		g_hash_table_destroy (sysfs_to_udev_map);
+		sysfs_to_udev_map = NULL;
+	}
 	g_free (udevinfo_stdout);
+	udevinfo_stdout = NULL;
 	return TRUE;
 
 error:
@@ -38,6 +38,7 @@
 #include <unistd.h>
 #include <asm/byteorder.h>
 #include <fcntl.h>
+#include <time.h>
 
 #ifdef HAL_LINUX_INPUT_HEADER_H
   #include HAL_LINUX_INPUT_HEADER_H
@@ -75,9 +76,9 @@ gboolean _have_sysfs_lid_button = FALSE;
 gboolean _have_sysfs_power_button = FALSE;
 gboolean _have_sysfs_sleep_button = FALSE;
 gboolean _have_sysfs_power_supply = FALSE; 
-static gboolean battery_poll_running = FALSE;
 
 #define POWER_SUPPLY_BATTERY_POLL_INTERVAL 30  /* in seconds */
+#define POWER_SUPPLY_BATTERY_POLL_INTERVAL_MAX 240  /* in seconds */
 #define DOCK_STATION_UNDOCK_POLL_INTERVAL 300  /* in milliseconds */
 
 /* we must use this kernel-compatible implementation */
@@ -2544,6 +2545,142 @@ refresh_battery_slow (HalDevice *d)
 	refresh_battery_fast (d);
 }
 
+/*
+ * Most batteries send a power_supply uevent whenever their state changes,
+ * and those end up in power_supply_refresh(). Polling is only a fallback
+ * for hardware that doesn't, so each battery has its own poll interval:
+ * it doubles every time a poll finds nothing new, and drops back to the
+ * minimum when one does. A uevent postpones the next poll, and a change
+ * of AC state resets all intervals since charge rates change with it.
+ * A single timeout is kept for the battery that is due first.
+ */
+typedef struct {
+	guint interval;		/* in seconds */
+	gint64 next_poll;	/* on the battery_poll_now () clock */
+} BatteryPoll;
+
+static guint battery_poll_source = 0;
+static gint64 battery_poll_due = 0;
+
+static gboolean power_supply_battery_poll (gpointer data);
+
+/* seconds on a clock that doesn't jump when the time of day is set */
+static gint64
+battery_poll_now (void)
+{
+#ifdef HAVE_GLIB_2_28
+	return g_get_monotonic_time () / G_USEC_PER_SEC;
+#else
+	struct timespec ts;
+
+	if (clock_gettime (CLOCK_MONOTONIC, &ts) != 0)
+		return time (NULL);
+	return ts.tv_sec;
+#endif
+}
+
+static BatteryPoll *
+battery_poll_get (HalDevice *d)
+{
+	BatteryPoll *poll;
+
+	poll = g_object_get_data (G_OBJECT (d), "hald-battery-poll");
+	if (poll == NULL) {
+		poll = g_new0 (BatteryPoll, 1);
+		poll->interval = POWER_SUPPLY_BATTERY_POLL_INTERVAL;
+		poll->next_poll = battery_poll_now () + poll->interval;
+		g_object_set_data_full (G_OBJECT (d), "hald-battery-poll", poll, g_free);
+	}
+	return poll;
+}
+
+static gboolean
+battery_is_polled (HalDevice *d)
+{
+	const char *subsys;
+
+	/* don't poll batteries if quirk is in place */
+	if (hal_device_property_get_bool (d, "battery.quirk.do_not_poll"))
+		return FALSE;
+
+	subsys = hal_device_property_get_string (d, "info.subsystem");
+	return subsys != NULL && strcmp (subsys, "power_supply") == 0;
+}
+
+/* make sure the poll timeout fires no later than @when */
+static void
+battery_poll_wakeup_at (gint64 when)
+{
+	gint64 now;
+	guint delay;
+
+	if (battery_poll_source != 0) {
+		if (battery_poll_due <= when)
+			return;
+		g_source_remove (battery_poll_source);
+	}
+
+	now = battery_poll_now ();
+	delay = when > now ? (guint) (when - now) : 1;
+	battery_poll_due = when;
+#ifdef HAVE_GLIB_2_14
+	battery_poll_source = g_timeout_add_seconds (delay, power_supply_battery_poll, NULL);
+#else
+	battery_poll_source = g_timeout_add (1000 * delay, power_supply_battery_poll, NULL);
+#endif
+}
+
+static void
+battery_poll_count_change (HalDevice *d, const char *key, gboolean removed, gboolean added, gpointer user_data)
+{
+	(*((guint *) user_data))++;
+}
+
+/* refresh a battery on behalf of the poll timer; returns TRUE if anything changed */
+static gboolean
+battery_poll_refresh (HalDevice *d)
+{
+	guint num_changes = 0;
+	gulong handler;
+
+	handler = g_signal_connect (d, "property_changed",
+				    G_CALLBACK (battery_poll_count_change), &num_changes);
+	hal_util_grep_discard_existing_data ();
+	device_property_atomic_update_begin ();
+	refresh_battery_fast (d);
+	device_property_atomic_update_end ();
+	g_signal_handler_disconnect (d, handler);
+
+	return num_changes > 0;
+}
+
+static void
+battery_poll_reset_all (void)
+{
+	GSList *i;
+	GSList *battery_devices;
+	gint64 now;
+
+	now = battery_poll_now ();
+	battery_devices = hal_device_store_match_multiple_key_value_string (hald_get_gdl (),
+									    "battery.type",
+									    "primary");
+	for (i = battery_devices; i != NULL; i = g_slist_next (i)) {
+		HalDevice *d = HAL_DEVICE (i->data);
+		BatteryPoll *poll;
+
+		if (!battery_is_polled (d))
+			continue;
+
+		poll = battery_poll_get (d);
+		poll->interval = POWER_SUPPLY_BATTERY_POLL_INTERVAL;
+		if (poll->next_poll > now + poll->interval)
+			poll->next_poll = now + poll->interval;
+		battery_poll_wakeup_at (poll->next_poll);
+	}
+	g_slist_free (battery_devices);
+}
+
 static gboolean
 power_supply_refresh (HalDevice *d)
 {
@@ -2556,10 +2693,17 @@ power_supply_refresh (HalDevice *d)
 		device_property_atomic_update_begin ();
 		refresh_ac_adapter (d);
 		device_property_atomic_update_end ();
+		battery_poll_reset_all ();
 	} else if (strcmp (type, "battery") == 0) {
+		BatteryPoll *poll;
+
 		device_property_atomic_update_begin ();
 		refresh_battery_fast (d);
 		device_property_atomic_update_end ();
+
+		/* we're up to date, no need to poll for a while */
+		poll = battery_poll_get (d);
+		poll->next_poll = battery_poll_now () + poll->interval;
 	} else {
 		HAL_WARNING (("Could not recognise power_supply type!"));
 		return FALSE;
@@ -2574,38 +2718,44 @@ power_supply_battery_poll (gpointer data) {
 	GSList *i;
 	GSList *battery_devices;
 	HalDevice *d;
-	gboolean battery_polled = FALSE;
+	BatteryPoll *poll;
+	gint64 now;
+	gint64 next_due = 0;
+
+	battery_poll_source = 0;
+	now = battery_poll_now ();
 
-	/* for now do it only for primary batteries and extend if neede for the other types */
+	/* for now do it only for primary batteries and extend if needed for the other types */
 	battery_devices = hal_device_store_match_multiple_key_value_string (hald_get_gdl (),
                                                                     	    "battery.type",
  	                                                                    "primary");
 
-	if (battery_devices) {
-		for (i = battery_devices; i != NULL; i = g_slist_next (i)) {
-			const char *subsys;
+	for (i = battery_devices; i != NULL; i = g_slist_next (i)) {
+		d = HAL_DEVICE (i->data);
 
-			d = HAL_DEVICE (i->data);
+		if (!battery_is_polled (d))
+			continue;
 
-			/* don't poll batteries if quirk is in place */
-			if (hal_device_property_get_bool (d, "battery.quirk.do_not_poll"))
-				continue;
+		poll = battery_poll_get (d);
+		if (poll->next_poll <= now) {
+			if (battery_poll_refresh (d))
+				poll->interval = POWER_SUPPLY_BATTERY_POLL_INTERVAL;
+			else
+				poll->interval = MIN (poll->interval * 2, POWER_SUPPLY_BATTERY_POLL_INTERVAL_MAX);
+			poll->next_poll = now + poll->interval;
+		}
 
-			subsys = hal_device_property_get_string (d, "info.subsystem");
-			if (subsys && (strcmp(subsys, "power_supply") == 0)) {
-				hal_util_grep_discard_existing_data();
-				device_property_atomic_update_begin ();
-				refresh_battery_fast(d);
-				device_property_atomic_update_end ();
-				battery_polled = TRUE;
-			}
-		}		
+		if (next_due == 0 || poll->next_poll < next_due)
+			next_due = poll->next_poll;
 	}
 
 	g_slist_free (battery_devices);
 
-	battery_poll_running = battery_polled;
-	return battery_polled;
+	/* the timeout stops once there is nothing left to poll */
+	if (next_due != 0)
+		battery_poll_wakeup_at (next_due);
+
+	return FALSE;
 }
 
 static HalDevice *
@@ -2653,18 +2803,8 @@ power_supply_add (const gchar *sysfs_path, const gchar *device_file, HalDevice *
 		hal_device_add_capability (d, "battery");
 
 		/* setup timer for things that we need to poll */
-		if (!battery_poll_running) {
-#ifdef HAVE_GLIB_2_14
-			g_timeout_add_seconds (POWER_SUPPLY_BATTERY_POLL_INTERVAL,
-                                               power_supply_battery_poll,
-                                               NULL);
-#else
-			g_timeout_add (1000 * POWER_SUPPLY_BATTERY_POLL_INTERVAL,
-                                       power_supply_battery_poll,
-                                       NULL);
-#endif
-			battery_poll_running = TRUE;
-		}
+		if (battery_type != NULL && strcmp (battery_type, "primary") == 0)
+			battery_poll_wakeup_at (battery_poll_get (d)->next_poll);
 	}
 
 	if (is_ac_adapter == TRUE) {
@@ -3060,9 +3200,7 @@ missing_scsi_host (const gchar *sysfs_path, HotplugEvent *device_event, HotplugA
 	{
 		GSList *siblings;
 
-		siblings = hal_device_store_match_multiple_key_value_string (hald_get_gdl(),
-									     "info.parent",
-									     hal_device_get_udi(d));
+		siblings = hal_device_store_get_children (hald_get_gdl (), d);
 		if (siblings && g_slist_next(siblings) != NULL)
 		{
 			g_slist_free(siblings);
@@ -3073,11 +3211,11 @@ missing_scsi_host (const gchar *sysfs_path, HotplugEvent *device_event, HotplugA
 
 	/* fake host event */
 	rc = TRUE;
-	host_event = g_slice_new0 (HotplugEvent);
+	host_event = hotplug_event_new ();
 	host_event->action = action;
 	host_event->type = HOTPLUG_EVENT_SYSFS_DEVICE;
-	g_strlcpy (host_event->sysfs.subsystem, "scsi_host", sizeof (host_event->sysfs.subsystem));
-	g_strlcpy (host_event->sysfs.sysfs_path, path, sizeof (host_event->sysfs.sysfs_path));
+	host_event->sysfs.subsystem = "scsi_host";
+	host_event->sysfs.sysfs_path = hotplug_event_strdup (host_event, path);
 	host_event->sysfs.net_ifindex = -1;
 
 	/* insert host before our event, so we can see it as parent */
@@ -5105,9 +5243,7 @@ hotplug_event_begin_remove_dev (const gchar *subsystem, const gchar *sysfs_path,
 				}
 
 				/* check if there are children left before remove the device */
-				children = hal_device_store_match_multiple_key_value_string (hald_get_gdl (), 
-                        								     "info.parent",
-											     hal_device_get_udi(d));
+				children = hal_device_store_get_children (hald_get_gdl (), d);
 
 				for (tmp = children; tmp != NULL; tmp = g_slist_next (tmp)) {
 			                child = HAL_DEVICE (tmp->data);
@@ -5206,15 +5342,12 @@ dev_generate_add_hotplug_event (HalDevice *d)
 	sysfs_path = hal_device_property_get_string (d, "linux.sysfs_path");
 	device_file = hal_device_property_get_string (d, "linux.device_file");
 
-	hotplug_event = g_slice_new0 (HotplugEvent);
+	hotplug_event = hotplug_event_new ();
 	hotplug_event->action = HOTPLUG_ACTION_ADD;
 	hotplug_event->type = HOTPLUG_EVENT_SYSFS;
-	g_strlcpy (hotplug_event->sysfs.subsystem, subsystem, sizeof (hotplug_event->sysfs.subsystem));
-	g_strlcpy (hotplug_event->sysfs.sysfs_path, sysfs_path, sizeof (hotplug_event->sysfs.sysfs_path));
-	if (device_file != NULL)
-		g_strlcpy (hotplug_event->sysfs.device_file, device_file, sizeof (hotplug_event->sysfs.device_file));
-	else
-		hotplug_event->sysfs.device_file[0] = '\0';
+	hotplug_event->sysfs.subsystem = hotplug_event_strdup (hotplug_event, subsystem);
+	hotplug_event->sysfs.sysfs_path = hotplug_event_strdup (hotplug_event, sysfs_path);
+	hotplug_event->sysfs.device_file = hotplug_event_strdup (hotplug_event, device_file);
 	hotplug_event->sysfs.net_ifindex = -1;
 
 	return hotplug_event;
@@ -5231,12 +5364,11 @@ dev_generate_remove_hotplug_event (HalDevice *d)
 	subsystem = hal_device_property_get_string (d, "linux.subsystem");
 	sysfs_path = hal_device_property_get_string (d, "linux.sysfs_path");
 
-	hotplug_event = g_slice_new0 (HotplugEvent);
+	hotplug_event = hotplug_event_new ();
 	hotplug_event->action = HOTPLUG_ACTION_REMOVE;
 	hotplug_event->type = HOTPLUG_EVENT_SYSFS;
-	g_strlcpy (hotplug_event->sysfs.subsystem, subsystem, sizeof (hotplug_event->sysfs.subsystem));
-	g_strlcpy (hotplug_event->sysfs.sysfs_path, sysfs_path, sizeof (hotplug_event->sysfs.sysfs_path));
-	hotplug_event->sysfs.device_file[0] = '\0';
+	hotplug_event->sysfs.subsystem = hotplug_event_strdup (hotplug_event, subsystem);
+	hotplug_event->sysfs.sysfs_path = hotplug_event_strdup (hotplug_event, sysfs_path);
 	hotplug_event->sysfs.net_ifindex = -1;
 
 	return hotplug_event;
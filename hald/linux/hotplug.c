@@ -28,6 +28,7 @@
 #endif
 
 #include <ctype.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
@@ -49,27 +50,497 @@
 
 #include "hotplug.h"
 
-/** Queue of ordered hotplug events */
-static GQueue *hotplug_event_queue = NULL;
+/* Strings of an event are packed into a short chain of blocks that is
+ * freed with the event; most events fit in the first block. */
+#define HOTPLUG_EVENT_STRINGS_BLOCK_SIZE 256
 
-/* Flag indicating if the queue should be reprocessed from the start */
-static gboolean hotplug_event_queue_restart = FALSE;
+struct _HotplugEventStrings
+{
+	HotplugEventStrings *next;
+	gsize size;
+	gsize used;
+	char data[1];
+};
+
+HotplugEvent *
+hotplug_event_new (void)
+{
+	HotplugEvent *hotplug_event;
 
-/** List of HotplugEvent objects we are currently processing */
-static GList *hotplug_events_in_progress = NULL;
+	hotplug_event = g_slice_new0 (HotplugEvent);
+	hotplug_event->sysfs.subsystem = "";
+	hotplug_event->sysfs.sysfs_path = "";
+	hotplug_event->sysfs.sysfs_path_old = "";
+	hotplug_event->sysfs.device_file = "";
+	hotplug_event->sysfs.vendor = "";
+	hotplug_event->sysfs.model = "";
+	hotplug_event->sysfs.revision = "";
+	hotplug_event->sysfs.serial = "";
+	hotplug_event->sysfs.fsusage = "";
+	hotplug_event->sysfs.fstype = "";
+	hotplug_event->sysfs.fsversion = "";
+	hotplug_event->sysfs.fslabel = "";
+	hotplug_event->sysfs.fsuuid = "";
+
+	return hotplug_event;
+}
+
+void
+hotplug_event_free (HotplugEvent *hotplug_event)
+{
+	HotplugEventStrings *strings;
+	HotplugEventStrings *next;
+
+	for (strings = hotplug_event->strings; strings != NULL; strings = next) {
+		next = strings->next;
+		g_free (strings);
+	}
+
+	g_slice_free (HotplugEvent, hotplug_event);
+}
+
+/** Copy a string into the storage of a hotplug event
+ *
+ *  @param  hotplug_event       Event the string belongs to
+ *  @param  str                 String to copy, may be NULL
+ *  @return                     Copy of the string, valid until the event
+ *                              is freed; "" if str is NULL
+ */
+const char *
+hotplug_event_strdup (HotplugEvent *hotplug_event, const char *str)
+{
+	HotplugEventStrings *strings;
+	gsize len;
+	char *copy;
+
+	if (str == NULL || str[0] == '\0')
+		return "";
+
+	len = strlen (str) + 1;
+	strings = hotplug_event->strings;
+	if (strings == NULL || strings->size - strings->used < len) {
+		gsize size;
+
+		size = MAX (len, HOTPLUG_EVENT_STRINGS_BLOCK_SIZE);
+		strings = g_malloc (G_STRUCT_OFFSET (HotplugEventStrings, data) + size);
+		strings->size = size;
+		strings->used = 0;
+		strings->next = hotplug_event->strings;
+		hotplug_event->strings = strings;
+	}
+
+	copy = strings->data + strings->used;
+	memcpy (copy, str, len);
+	strings->used += len;
+
+	return copy;
+}
+
+const char *
+hotplug_event_strdup_printf (HotplugEvent *hotplug_event, const char *format, ...)
+{
+	char buf[HAL_PATH_MAX];
+	va_list args;
+
+	va_start (args, format);
+	g_vsnprintf (buf, sizeof (buf), format, args);
+	va_end (args);
+
+	return hotplug_event_strdup (hotplug_event, buf);
+}
+
+/*
+ * Hotplug events are scheduled through a dependency graph instead of
+ * rescanning the whole queue: every sysfs event is attached to a node in a
+ * trie of sysfs path components (and, for 'move' events, to the node of its
+ * old path). When an event is enqueued, the conflicting events are found by
+ * walking its ancestors and the populated part of its subtree; each conflict
+ * becomes an edge from the earlier event to the later one. An event is
+ * dispatched when it no longer waits for anything, and ending it only
+ * touches the events that were waiting for it.
+ */
+
+typedef struct _HotplugPathNode HotplugPathNode;
+
+struct _HotplugPathNode
+{
+	HotplugPathNode *parent;
+	char *name;				/* path component; key in parent->children */
+	GHashTable *children;			/* path component -> HotplugPathNode */
+	GList *events;				/* events with this sysfs_path */
+	GList *events_old;			/* events with this sysfs_path_old */
+	guint num_subtree_events;		/* events attached here or below (sysfs_path only) */
+};
+
+typedef enum {
+	HOTPLUG_EVENT_STATE_QUEUED,
+	HOTPLUG_EVENT_STATE_RUNNING
+} HotplugEventState;
+
+struct _HotplugEventSched
+{
+	HotplugEventState state;
+	guint num_blockers;			/* number of events we wait for */
+	GSList *dependents;			/* events waiting for us */
+	GList *ready_link;			/* link in hotplug_events_ready */
+	GList *dm_gate_link;			/* link in hotplug_events_dm_gated */
+	HotplugPathNode *node;
+	HotplugPathNode *node_old;
+	gint64 position;			/* position in the queue, lower runs first */
+	gboolean holds_dm_gate;
+};
+
+/** Root of the sysfs path trie of queued and running events */
+static HotplugPathNode *hotplug_path_root = NULL;
+
+/** Events that are ready to run, ordered by queue position */
+static GQueue *hotplug_events_ready = NULL;
+
+/** Device mapper events that are ready but wait for the dm gate to open */
+static GQueue *hotplug_events_dm_gated = NULL;
+
+/** Number of queued or running non device mapper block events; device
+ *  mapper events are held back while this is non-zero */
+static guint hotplug_dm_gate = 0;
+
+/* Queue positions handed out for the tail and the head of the queue */
+static gint64 hotplug_tail_position = 0;
+static gint64 hotplug_head_position = -1;
+
+static guint hotplug_num_queued = 0;
+static guint hotplug_num_running = 0;
+
+/* Maximum number of events in progress at once; 0 means no limit */
+static guint hotplug_max_running = 0;
+static guint hotplug_process_source = 0;
+
+static gboolean
+hotplug_event_is_sysfs (HotplugEvent *hotplug_event)
+{
+	return hotplug_event->type == HOTPLUG_EVENT_SYSFS ||
+		hotplug_event->type == HOTPLUG_EVENT_SYSFS_DEVICE ||
+		hotplug_event->type == HOTPLUG_EVENT_SYSFS_BLOCK;
+}
+
+static HotplugPathNode *
+path_node_get (const char *path)
+{
+	char buf[HAL_PATH_MAX];
+	char *p;
+	char *component;
+	HotplugPathNode *node;
+	HotplugPathNode *child;
+
+	if (G_UNLIKELY (hotplug_path_root == NULL))
+		hotplug_path_root = g_slice_new0 (HotplugPathNode);
+
+	g_strlcpy (buf, path, sizeof (buf));
+	node = hotplug_path_root;
+	p = buf;
+	while (*p != '\0') {
+		while (*p == '/')
+			p++;
+		if (*p == '\0')
+			break;
+		component = p;
+		while (*p != '\0' && *p != '/')
+			p++;
+		if (*p != '\0')
+			*p++ = '\0';
+
+		child = NULL;
+		if (node->children != NULL)
+			child = g_hash_table_lookup (node->children, component);
+		else
+			node->children = g_hash_table_new (g_str_hash, g_str_equal);
+
+		if (child == NULL) {
+			child = g_slice_new0 (HotplugPathNode);
+			child->parent = node;
+			child->name = g_strdup (component);
+			g_hash_table_insert (node->children, child->name, child);
+		}
+		node = child;
+	}
+
+	return node;
+}
+
+/* Free @node and its ancestors as long as nothing is attached to them */
+static void
+path_node_prune (HotplugPathNode *node)
+{
+	HotplugPathNode *parent;
+
+	while (node != NULL && node != hotplug_path_root &&
+	       node->events == NULL && node->events_old == NULL &&
+	       (node->children == NULL || g_hash_table_size (node->children) == 0)) {
+		parent = node->parent;
+		g_hash_table_remove (parent->children, node->name);
+		if (node->children != NULL)
+			g_hash_table_destroy (node->children);
+		g_free (node->name);
+		g_slice_free (HotplugPathNode, node);
+		node = parent;
+	}
+}
+
+static void
+hotplug_event_attach (HotplugEvent *hotplug_event)
+{
+	HotplugEventSched *sched = hotplug_event->sched;
+	HotplugPathNode *node;
+
+	sched->node = path_node_get (hotplug_event->sysfs.sysfs_path);
+	sched->node->events = g_list_prepend (sched->node->events, hotplug_event);
+	for (node = sched->node; node != NULL; node = node->parent)
+		node->num_subtree_events++;
+
+	if (hotplug_event->sysfs.sysfs_path_old[0] != '\0') {
+		sched->node_old = path_node_get (hotplug_event->sysfs.sysfs_path_old);
+		sched->node_old->events_old = g_list_prepend (sched->node_old->events_old, hotplug_event);
+	}
+}
+
+static void
+hotplug_event_detach (HotplugEvent *hotplug_event)
+{
+	HotplugEventSched *sched = hotplug_event->sched;
+	HotplugPathNode *node;
+
+	if (sched->node_old != NULL) {
+		sched->node_old->events_old = g_list_remove (sched->node_old->events_old, hotplug_event);
+		path_node_prune (sched->node_old);
+		sched->node_old = NULL;
+	}
+
+	if (sched->node != NULL) {
+		for (node = sched->node; node != NULL; node = node->parent)
+			node->num_subtree_events--;
+		sched->node->events = g_list_remove (sched->node->events, hotplug_event);
+		path_node_prune (sched->node);
+		sched->node = NULL;
+	}
+}
+
+static void
+hotplug_event_make_ready (HotplugEvent *hotplug_event)
+{
+	HotplugEventSched *sched = hotplug_event->sched;
+	GList *lp;
+
+	if (hotplug_event_is_sysfs (hotplug_event) &&
+	    hotplug_event->sysfs.is_dm_device && hotplug_dm_gate > 0) {
+		HAL_DEBUG (("event %s is dm-device, have at least one non-dm block device in queue -> held event.",
+			    hotplug_event->sysfs.sysfs_path));
+		g_queue_push_tail (hotplug_events_dm_gated, hotplug_event);
+		sched->dm_gate_link = hotplug_events_dm_gated->tail;
+		return;
+	}
+
+	/* keep the ready queue in queue order; new events almost always go last */
+	for (lp = hotplug_events_ready->tail; lp != NULL; lp = lp->prev) {
+		if (((HotplugEvent *) lp->data)->sched->position < sched->position)
+			break;
+	}
+	if (lp == NULL) {
+		g_queue_push_head (hotplug_events_ready, hotplug_event);
+		sched->ready_link = hotplug_events_ready->head;
+	} else {
+		g_queue_insert_after (hotplug_events_ready, lp, hotplug_event);
+		sched->ready_link = lp->next;
+	}
+}
+
+static void
+hotplug_event_unmake_ready (HotplugEvent *hotplug_event)
+{
+	HotplugEventSched *sched = hotplug_event->sched;
+
+	if (sched->ready_link != NULL) {
+		g_queue_delete_link (hotplug_events_ready, sched->ready_link);
+		sched->ready_link = NULL;
+	}
+	if (sched->dm_gate_link != NULL) {
+		g_queue_delete_link (hotplug_events_dm_gated, sched->dm_gate_link);
+		sched->dm_gate_link = NULL;
+	}
+}
+
+/* Make @waiter wait until @blocker has ended */
+static void
+hotplug_event_add_dependency (HotplugEvent *blocker, HotplugEvent *waiter)
+{
+	blocker->sched->dependents = g_slist_prepend (blocker->sched->dependents, waiter);
+	waiter->sched->num_blockers++;
+	hotplug_event_unmake_ready (waiter);
+}
+
+typedef struct {
+	HotplugEvent *hotplug_event;
+	gboolean requeued;
+} HotplugOrderData;
+
+/*
+ * Orders @other, an event that is already queued or running, against
+ * @data->hotplug_event. The earlier event (by sequence number) has to finish
+ * before the later one may run; in addition nothing may run while an event
+ * with a different action is running for the same device (fd.o#23060).
+ */
+static void
+hotplug_event_order (HotplugOrderData *data, HotplugEvent *other, gboolean same_path)
+{
+	HotplugEvent *hotplug_event = data->hotplug_event;
+
+	if (other == hotplug_event)
+		return;
+
+	/* a reposted event keeps the events it was already holding back */
+	if (data->requeued && g_slist_find (hotplug_event->sched->dependents, other) != NULL)
+		return;
+
+	if (other->sysfs.seqnum < hotplug_event->sysfs.seqnum ||
+	    (same_path && other->sched->state == HOTPLUG_EVENT_STATE_RUNNING &&
+	     other->action != hotplug_event->action)) {
+		HAL_DEBUG (("event %s dependant on %s", hotplug_event->sysfs.sysfs_path, other->sysfs.sysfs_path));
+		hotplug_event_add_dependency (other, hotplug_event);
+	} else if (other->sysfs.seqnum > hotplug_event->sysfs.seqnum &&
+		   other->sched->state == HOTPLUG_EVENT_STATE_QUEUED) {
+		HAL_DEBUG (("event %s dependant on %s", other->sysfs.sysfs_path, hotplug_event->sysfs.sysfs_path));
+		hotplug_event_add_dependency (hotplug_event, other);
+	}
+}
+
+static void
+hotplug_event_order_list (HotplugOrderData *data, GList *events, gboolean same_path)
+{
+	GList *lp;
+
+	for (lp = events; lp != NULL; lp = lp->next)
+		hotplug_event_order (data, (HotplugEvent *) lp->data, same_path);
+}
+
+static void
+hotplug_event_order_subtree (gpointer key, gpointer value, gpointer user_data)
+{
+	HotplugPathNode *node = (HotplugPathNode *) value;
+
+	if (node->num_subtree_events == 0)
+		return;
+
+	hotplug_event_order_list ((HotplugOrderData *) user_data, node->events, FALSE);
+	if (node->children != NULL)
+		g_hash_table_foreach (node->children, hotplug_event_order_subtree, user_data);
+}
+
+/* Finds the events conflicting with @hotplug_event: the ones for the same
+ * device, its parents and its children, and the ones moving away from the
+ * same old path. */
+static void
+hotplug_event_find_dependencies (HotplugEvent *hotplug_event, gboolean requeued)
+{
+	HotplugEventSched *sched = hotplug_event->sched;
+	HotplugOrderData data;
+	HotplugPathNode *node;
+
+	data.hotplug_event = hotplug_event;
+	data.requeued = requeued;
+
+	for (node = sched->node; node != NULL; node = node->parent)
+		hotplug_event_order_list (&data, node->events, node == sched->node);
+
+	if (sched->node->children != NULL)
+		g_hash_table_foreach (sched->node->children, hotplug_event_order_subtree, &data);
+
+	if (sched->node_old != NULL)
+		hotplug_event_order_list (&data, sched->node_old->events_old, FALSE);
+}
+
+/* Non device mapper block events hold back all device mapper events */
+static void
+hotplug_event_hold_dm_gate (HotplugEvent *hotplug_event)
+{
+	if (hotplug_event->sched == NULL || hotplug_event->sched->holds_dm_gate)
+		return;
+
+	if (hotplug_event->type == HOTPLUG_EVENT_SYSFS_BLOCK && !hotplug_event->sysfs.is_dm_device) {
+		hotplug_event->sched->holds_dm_gate = TRUE;
+		hotplug_dm_gate++;
+	}
+}
+
+static void
+hotplug_event_release_dm_gate (HotplugEvent *hotplug_event)
+{
+	HotplugEvent *gated_event;
+
+	if (!hotplug_event->sched->holds_dm_gate)
+		return;
+
+	hotplug_event->sched->holds_dm_gate = FALSE;
+	if (--hotplug_dm_gate > 0)
+		return;
+
+	while ((gated_event = g_queue_pop_head (hotplug_events_dm_gated)) != NULL) {
+		gated_event->sched->dm_gate_link = NULL;
+		hotplug_event_make_ready (gated_event);
+	}
+}
+
+/* Removes @hotplug_event from the scheduler and releases the events waiting for it */
+static void
+hotplug_event_unschedule (HotplugEvent *hotplug_event)
+{
+	HotplugEventSched *sched = hotplug_event->sched;
+	GSList *i;
+
+	if (sched == NULL)
+		return;
+
+	if (sched->state == HOTPLUG_EVENT_STATE_RUNNING)
+		hotplug_num_running--;
+	else
+		hotplug_num_queued--;
+
+	hotplug_event_unmake_ready (hotplug_event);
+	hotplug_event_detach (hotplug_event);
+	hotplug_event_release_dm_gate (hotplug_event);
+
+	for (i = sched->dependents; i != NULL; i = g_slist_next (i)) {
+		HotplugEvent *waiter = (HotplugEvent *) i->data;
+
+		if (--waiter->sched->num_blockers == 0 &&
+		    waiter->sched->state == HOTPLUG_EVENT_STATE_QUEUED)
+			hotplug_event_make_ready (waiter);
+	}
+	g_slist_free (sched->dependents);
+
+	g_slice_free (HotplugEventSched, sched);
+	hotplug_event->sched = NULL;
+}
+
+static gboolean
+hotplug_event_process_queue_idle (gpointer data)
+{
+	hotplug_process_source = 0;
+	hotplug_event_process_queue ();
+	return FALSE;
+}
 
 void
 hotplug_event_end (void *end_token)
 {
 	HotplugEvent *hotplug_event = (HotplugEvent *) end_token;
 
-	hotplug_events_in_progress = g_list_remove (hotplug_events_in_progress, hotplug_event);
+	hotplug_event_unschedule (hotplug_event);
 
-	g_slice_free (HotplugEvent, hotplug_event);
+	hotplug_event_free (hotplug_event);
 
-	/* An event is removed. So we need to restart from the beginning of the queue
-	 * as some events are ready to run now */
-	hotplug_event_queue_restart = TRUE;
+	/* an event held back by the limit may start now; the caller doesn't
+	 * necessarily process the queue after ending an event */
+	if (hotplug_max_running > 0 && hotplug_process_source == 0 &&
+	    hotplug_events_ready != NULL && !g_queue_is_empty (hotplug_events_ready))
+		hotplug_process_source = g_idle_add (hotplug_event_process_queue_idle, NULL);
 }
 
 void 
@@ -78,7 +549,12 @@ hotplug_event_reposted (void *end_token)
 	HotplugEvent *hotplug_event = (HotplugEvent *) end_token;
 
 	hotplug_event->reposted = TRUE;
-	hotplug_events_in_progress = g_list_remove (hotplug_events_in_progress, hotplug_event);
+
+	/* normally the event has already been put back in the queue; if not,
+	 * it's no longer in progress either */
+	if (hotplug_event->sched != NULL &&
+	    hotplug_event->sched->state == HOTPLUG_EVENT_STATE_RUNNING)
+		hotplug_event_unschedule (hotplug_event);
 }
 
 static void
@@ -161,6 +637,9 @@ hotplug_event_begin_sysfs (HotplugEvent *hotplug_event)
 			hotplug_event->type = HOTPLUG_EVENT_SYSFS_DEVICE;
 	}
 
+	/* now that we know it's a block device, hold back device mapper events */
+	hotplug_event_hold_dm_gate (hotplug_event);
+
 	if (hotplug_event->type == HOTPLUG_EVENT_SYSFS_DEVICE) {
 		if (hotplug_event->action == HOTPLUG_ACTION_ADD ||
 		    (d == NULL && hotplug_event->action == HOTPLUG_ACTION_CHANGE)) {
@@ -314,153 +793,109 @@ hotplug_event_begin (HotplugEvent *hotplug_event)
 	}
 }
 
-void 
-hotplug_event_enqueue (HotplugEvent *hotplug_event)
-{
-	if (G_UNLIKELY (hotplug_event_queue == NULL))
-		hotplug_event_queue = g_queue_new ();
-
-	g_queue_push_tail (hotplug_event_queue, hotplug_event);
-}
-
-void 
-hotplug_event_enqueue_at_front (HotplugEvent *hotplug_event)
-{
-	if (G_UNLIKELY (hotplug_event_queue == NULL))
-		hotplug_event_queue = g_queue_new ();
-
-	g_queue_push_head (hotplug_event_queue, hotplug_event);
-
-	/* New event added at the start, restart processing of the queue from the
-	 * start */
-	hotplug_event_queue_restart = TRUE;
-}
-
-static gboolean
-compare_sysfspath(const char *running, const char *waiting)
+static void
+hotplug_event_enqueue_at (HotplugEvent *hotplug_event, gboolean at_front)
 {
-	int i;
+	HotplugEventSched *sched;
+	gboolean requeued;
 
-	for (i = 0; i < HAL_PATH_MAX; i++) {
-		/* identical device event found */
-		if (running[i] == '\0' && waiting[i] == '\0')
-			return TRUE;
+	if (G_UNLIKELY (hotplug_events_ready == NULL)) {
+		hotplug_events_ready = g_queue_new ();
+		hotplug_events_dm_gated = g_queue_new ();
+	}
 
-		/* parent device event found */
-		if (running[i] == '\0' && waiting[i] == '/')
-			return TRUE;
+	sched = hotplug_event->sched;
+	requeued = (sched != NULL);
+	if (requeued) {
+		/* a running event is put back in the queue */
+		g_assert (sched->state == HOTPLUG_EVENT_STATE_RUNNING);
+		hotplug_num_running--;
+	} else {
+		sched = g_slice_new0 (HotplugEventSched);
+		hotplug_event->sched = sched;
+	}
 
-		/* child device event found */
-		if (running[i] == '/' && waiting[i] == '\0')
-			return TRUE;
+	sched->state = HOTPLUG_EVENT_STATE_QUEUED;
+	sched->position = at_front ? hotplug_head_position-- : hotplug_tail_position++;
+	hotplug_num_queued++;
 
-		/* no matching event */
-		if (running[i] != waiting[i])
-			break;
+	if (hotplug_event_is_sysfs (hotplug_event)) {
+		if (!requeued)
+			hotplug_event_attach (hotplug_event);
+		hotplug_event_find_dependencies (hotplug_event, requeued);
+		hotplug_event_hold_dm_gate (hotplug_event);
 	}
 
-	return FALSE;
+	if (sched->num_blockers == 0)
+		hotplug_event_make_ready (hotplug_event);
+	else
+		HAL_DEBUG (("event held back: %s", hotplug_event->sysfs.sysfs_path));
 }
 
-/*
- * Returns TRUE if @eventl depends on @eventr
- */
-static gboolean
-compare_event (HotplugEvent *eventl, HotplugEvent *eventr)
+void 
+hotplug_event_enqueue (HotplugEvent *hotplug_event)
 {
-	if (*eventl->sysfs.sysfs_path_old != '\0')
-		if (strcmp (eventr->sysfs.sysfs_path_old, eventl->sysfs.sysfs_path_old) == 0)
-			return TRUE;
-	return compare_sysfspath (eventr->sysfs.sysfs_path, eventl->sysfs.sysfs_path);
+	hotplug_event_enqueue_at (hotplug_event, FALSE);
 }
 
-/*
- * Returns TRUE if @hotplug_event depends on any event in @events
- */
-static gboolean
-compare_events (HotplugEvent *hotplug_event, GList *events)
+void 
+hotplug_event_enqueue_at_front (HotplugEvent *hotplug_event)
 {
-	GList *lp;
-	HotplugEvent *loop_event;
-
-	switch (hotplug_event->type) {
-
-	/* explicit fallthrough */
-	case HOTPLUG_EVENT_SYSFS:
-	case HOTPLUG_EVENT_SYSFS_DEVICE:
-	case HOTPLUG_EVENT_SYSFS_BLOCK:
-
-		for (lp = events; lp; lp = g_list_next (lp)) {
-			loop_event = (HotplugEvent*) lp->data;
-			/* skip ourselves and all later events*/
-			if (loop_event->sysfs.seqnum >= hotplug_event->sysfs.seqnum) {
-				HAL_DEBUG (("event %s: skip ourselves and all later events", hotplug_event->sysfs.sysfs_path));
-				break;
-			}
-			if (compare_event (hotplug_event, loop_event)) {
-				HAL_DEBUG (("event %s dependant on %s", hotplug_event->sysfs.sysfs_path, loop_event->sysfs.sysfs_path));
-				return TRUE;
-			} else if (hotplug_event->sysfs.is_dm_device) {
-				if ((loop_event->type == HOTPLUG_EVENT_SYSFS_BLOCK) && !loop_event->sysfs.is_dm_device) {
-					HAL_DEBUG (("event %s is dm-device, have at least one (%s) non-dm block device in queue -> held event.",
-						    hotplug_event->sysfs.sysfs_path, loop_event->sysfs.sysfs_path ));
-					return TRUE;
-				}
-			}
-		}
-		return FALSE;
-
-	default:
-		return FALSE;
-	}
+	hotplug_event_enqueue_at (hotplug_event, TRUE);
 }
 
-/*
- * Returns TRUE if @hotplug_event depends on any running event in @events
- * This function checks if there is a running remove/add event for the same 
- * sysfs_path/device. (for more see fd.o#23060)
- */
-static gboolean
-compare_events_running (HotplugEvent *hotplug_event, GList *events)
+static void
+hotplug_event_start (HotplugEvent *hotplug_event)
 {
+	HotplugEventSched *sched = hotplug_event->sched;
 	GList *lp;
-	HotplugEvent *loop_event;
 
-	switch (hotplug_event->type) {
+	sched->state = HOTPLUG_EVENT_STATE_RUNNING;
+	hotplug_num_queued--;
+	hotplug_num_running++;
 
-	/* explicit fallthrough */
-	case HOTPLUG_EVENT_SYSFS:
-	case HOTPLUG_EVENT_SYSFS_DEVICE:
-	case HOTPLUG_EVENT_SYSFS_BLOCK:
+	if (sched->node == NULL)
+		return;
 
-		for (lp = events; lp; lp = g_list_next (lp)) {
-			loop_event = (HotplugEvent*) lp->data;
-			/* skip ourselves and all later events*/
-			if (!strcmp (hotplug_event->sysfs.sysfs_path, loop_event->sysfs.sysfs_path)) {
-				if (loop_event->action != hotplug_event->action) {
-					HAL_DEBUG (("there is still a event running for this device, wait!"));
-					return TRUE;
-				}
+	/* hold back queued events with a different action for the same device */
+	for (lp = sched->node->events; lp != NULL; lp = lp->next) {
+		HotplugEvent *other = (HotplugEvent *) lp->data;
 
-			}
+		if (other != hotplug_event &&
+		    other->sched->state == HOTPLUG_EVENT_STATE_QUEUED &&
+		    other->action != hotplug_event->action) {
+			HAL_DEBUG (("there is still a event running for this device, wait!"));
+			hotplug_event_add_dependency (hotplug_event, other);
 		}
-		return FALSE;
-
-	default:
-		return FALSE;
 	}
 }
 
+/** Limit the number of hotplug events in progress at once
+ *
+ *  @param  max_running         Maximum number of running events, 0 for
+ *                              no limit
+ *
+ *  Events for independent devices are started without waiting for each
+ *  other; during coldplug that can mean hundreds of probers at once.
+ */
+void
+hotplug_event_set_max_running (guint max_running)
+{
+	hotplug_max_running = max_running;
 
+	/* start what the old limit held back, but not from under our caller */
+	if (hotplug_process_source == 0 &&
+	    hotplug_events_ready != NULL && !g_queue_is_empty (hotplug_events_ready))
+		hotplug_process_source = g_idle_add (hotplug_event_process_queue_idle, NULL);
+}
 
 void 
 hotplug_event_process_queue (void)
 {
 	HotplugEvent *hotplug_event;
-	GList *lp, *lp2;
 	static gboolean processing = FALSE;
 
-	if (G_UNLIKELY (hotplug_event_queue == NULL))
+	if (G_UNLIKELY (hotplug_events_ready == NULL))
 		return;
 
 	if (processing)
@@ -468,40 +903,26 @@ hotplug_event_process_queue (void)
 	
 	processing = TRUE;
 
-	lp = hotplug_event_queue->head;
-	while (lp != NULL) {
-		hotplug_event = lp->data;
+	/* events ending synchronously may make more events ready while we loop */
+	while ((hotplug_max_running == 0 || hotplug_num_running < hotplug_max_running) &&
+	       (hotplug_event = g_queue_pop_head (hotplug_events_ready)) != NULL) {
+		hotplug_event->sched->ready_link = NULL;
 
 		if (hotplug_event->action == HOTPLUG_ACTION_ADD)
-			HAL_DEBUG (("checking ADD event %s", hotplug_event->sysfs.sysfs_path));
+			HAL_DEBUG (("starting ADD event %s", hotplug_event->sysfs.sysfs_path));
 		else if (hotplug_event->action == HOTPLUG_ACTION_REMOVE)
-			HAL_DEBUG (("checking REMOVE event %s", hotplug_event->sysfs.sysfs_path));
+			HAL_DEBUG (("starting REMOVE event %s", hotplug_event->sysfs.sysfs_path));
 		else 
-			HAL_DEBUG (("checking event %s, action: %d", hotplug_event->sysfs.sysfs_path, hotplug_event->action));
-
-		if (!compare_events (hotplug_event, hotplug_event_queue->head) && 
-		    !compare_events (hotplug_event, hotplug_events_in_progress) &&
-		    !compare_events_running (hotplug_event, hotplug_events_in_progress)) {
-			lp2 = lp->prev;
-			g_queue_unlink(hotplug_event_queue, lp);
-			hotplug_events_in_progress = g_list_concat (hotplug_events_in_progress, lp);
-			hotplug_event_begin (hotplug_event);
-			if (lp2 == NULL || hotplug_event_queue_restart) {
-				lp = hotplug_event_queue->head;
-				hotplug_event_queue_restart = FALSE;
-			} else {
-				lp = g_list_next(lp2);
-			}
-		} else {
-			HAL_DEBUG (("event held back: %s", hotplug_event->sysfs.sysfs_path));
-			lp = g_list_next (lp);
-		}
+			HAL_DEBUG (("starting event %s, action: %d", hotplug_event->sysfs.sysfs_path, hotplug_event->action));
+
+		hotplug_event_start (hotplug_event);
+		hotplug_event_begin (hotplug_event);
 	}
-	HAL_DEBUG (("events queued = %d, events in progress = %d", hotplug_event_queue->length, g_list_length (hotplug_events_in_progress)));
+	HAL_DEBUG (("events queued = %d, events in progress = %d", hotplug_num_queued, hotplug_num_running));
 
 	processing = FALSE;
 
-	if (hotplug_event_queue->length == 0 && g_list_length (hotplug_events_in_progress) == 0) {
+	if (hotplug_num_queued == 0 && hotplug_num_running == 0) {
 		HAL_DEBUG(("Hotplug-queue empty now ... no hotplug events in progress"));
 		hotplug_queue_now_empty ();
 	}
@@ -550,7 +971,7 @@ hotplug_reprobe_generate_remove_events (HalDevice *d)
 	HotplugEvent *e;
 
 	/* first remove childs */
-	childs = hal_device_store_match_multiple_key_value_string (hald_get_gdl (), "info.parent", hal_device_get_udi (d));
+	childs = hal_device_store_get_children (hald_get_gdl (), d);
 	for (i = childs; i != NULL; i = g_slist_next (i)) {
 		HalDevice *child;
 
@@ -634,7 +1055,7 @@ hotplug_reprobe_generate_add_events (HalDevice *d)
 	}
 
 	/* then add childs */
-	childs = hal_device_store_match_multiple_key_value_string (hald_get_gdl (), "info.parent", hal_device_get_udi (d));
+	childs = hal_device_store_get_children (hald_get_gdl (), d);
 	for (i = childs; i != NULL; i = g_slist_next (i)) {
 		HalDevice *child;
 
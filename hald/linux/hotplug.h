@@ -49,20 +49,28 @@ typedef enum {
 	HOTPLUG_EVENT_PMU          = 6
 } HotplugEventType;
 
+typedef struct _HotplugEventSched HotplugEventSched;
+typedef struct _HotplugEventStrings HotplugEventStrings;
+
 /** Data structure representing a hotplug event; also used for
  *  coldplugging.
+ *
+ *  The string members are never NULL; they point either to "" or into
+ *  the string arena of the event, see hotplug_event_strdup().
  */
 typedef struct
 {
 	HotplugActionType action;				/* Whether the event is add or remove */
 	HotplugEventType type;					/* Type of event */
 	gboolean reposted;					/* Avoid loops */
+	HotplugEventSched *sched;				/* Scheduler bookkeeping, private to hotplug.c */
+	HotplugEventStrings *strings;				/* Storage for the strings below */
 	union {
 		struct {
-			char subsystem[HAL_NAME_MAX];		/* Kernel subsystem the device belongs to */
-			char sysfs_path[HAL_PATH_MAX];		/* Kernel device devpath */
-			char sysfs_path_old[HAL_PATH_MAX];	/* Old kernel device devpath (for 'move') */
-			char device_file[HAL_PATH_MAX];	        /* Device node for the device */
+			const char *subsystem;			/* Kernel subsystem the device belongs to */
+			const char *sysfs_path;			/* Kernel device devpath */
+			const char *sysfs_path_old;		/* Old kernel device devpath (for 'move') */
+			const char *device_file;		/* Device node for the device */
 			unsigned long long seqnum;		/* kernel uevent sequence number */
 			int net_ifindex;			/* Kernel ifindex for network devices */
 
@@ -70,41 +78,51 @@ typedef struct
 			gboolean is_dm_device;
 
 			/* stuff udev may tell us about the device and we don't want to query */
-			char vendor[HAL_NAME_MAX];
-			char model[HAL_NAME_MAX];
-			char revision[HAL_NAME_MAX];
-			char serial[HAL_NAME_MAX];
-			char fsusage[HAL_NAME_MAX];
-			char fstype[HAL_NAME_MAX];
-			char fsversion[HAL_NAME_MAX];
-			char fslabel[HAL_NAME_MAX];
-			char fsuuid[HAL_NAME_MAX];
+			const char *vendor;
+			const char *model;
+			const char *revision;
+			const char *serial;
+			const char *fsusage;
+			const char *fstype;
+			const char *fsversion;
+			const char *fslabel;
+			const char *fsuuid;
 		} sysfs;
 
 		struct {
 			int  acpi_type;				/* Type of ACPI object; see acpi.c */
-			char acpi_path[HAL_PATH_MAX];		/* Path into procfs, e.g. /proc/acpi/battery/BAT0/ */
+			const char *acpi_path;			/* Path into procfs, e.g. /proc/acpi/battery/BAT0/ */
 		} acpi;
 
 		struct {
 			int  apm_type;				/* Type of APM object; see apm.c */
-			char apm_path[HAL_PATH_MAX];		/* Path into procfs, e.g. /proc/apm */
+			const char *apm_path;			/* Path into procfs, e.g. /proc/apm */
 		} apm;
 
 		struct {
 			int  pmu_type;				/* Type of PMU object; see pmu.c */
-			char pmu_path[HAL_PATH_MAX];		/* Path into procfs, e.g. /proc/pmu/battery_0 */
+			const char *pmu_path;			/* Path into procfs, e.g. /proc/pmu/battery_0 */
 		} pmu;
 	};
 
 } HotplugEvent;
 
+HotplugEvent *hotplug_event_new (void);
+
+void hotplug_event_free (HotplugEvent *hotplug_event);
+
+const char *hotplug_event_strdup (HotplugEvent *hotplug_event, const char *str);
+
+const char *hotplug_event_strdup_printf (HotplugEvent *hotplug_event, const char *format, ...) __attribute__((format (printf, 2, 3)));
+
 void hotplug_event_enqueue (HotplugEvent *event);
 
 void hotplug_event_enqueue_at_front (HotplugEvent *hotplug_event);
 
 void hotplug_event_process_queue (void);
 
+void hotplug_event_set_max_running (guint max_running);
+
 void hotplug_event_end (void *end_token);
 
 void hotplug_event_reposted (void *end_token);
@@ -122,7 +122,7 @@ hald_udev_data (GIOChannel *source, GIOCondition condition, gpointer user_data)
 		goto out;
 	}
 
-	hotplug_event = g_slice_new0 (HotplugEvent);
+	hotplug_event = hotplug_event_new ();
 	hotplug_event->type = HOTPLUG_EVENT_SYSFS;
 
 	while (bufpos < sizeof (buf)) {
@@ -146,8 +146,7 @@ hald_udev_data (GIOChannel *source, GIOCondition condition, gpointer user_data)
                                 goto invalid;
                         }
 
-			g_snprintf (hotplug_event->sysfs.sysfs_path, sizeof (hotplug_event->sysfs.sysfs_path),
-				    "/sys%s", &key[8]);
+			hotplug_event->sysfs.sysfs_path = hotplug_event_strdup_printf (hotplug_event, "/sys%s", &key[8]);
 		} else if (strncmp(key, "DEVPATH_OLD=", 12) == 0) {
 
                         /* md devices are handled via looking at /proc/mdstat */
@@ -156,62 +155,61 @@ hald_udev_data (GIOChannel *source, GIOCondition condition, gpointer user_data)
                                 goto invalid;
                         }
 
-			g_snprintf (hotplug_event->sysfs.sysfs_path_old, sizeof (hotplug_event->sysfs.sysfs_path_old),
-				    "/sys%s", &key[12]);
+			hotplug_event->sysfs.sysfs_path_old = hotplug_event_strdup_printf (hotplug_event, "/sys%s", &key[12]);
 		} else if (strncmp(key, "SUBSYSTEM=", 10) == 0)
-			g_strlcpy (hotplug_event->sysfs.subsystem, &key[10], sizeof (hotplug_event->sysfs.subsystem));
+			hotplug_event->sysfs.subsystem = hotplug_event_strdup (hotplug_event, &key[10]);
 		else if (strncmp(key, "DEVNAME=", 8) == 0)
-			g_strlcpy (hotplug_event->sysfs.device_file, &key[8], sizeof (hotplug_event->sysfs.device_file));
+			hotplug_event->sysfs.device_file = hotplug_event_strdup (hotplug_event, &key[8]);
 		else if (strncmp(key, "SEQNUM=", 7) == 0)
 			hotplug_event->sysfs.seqnum = strtoull(&key[7], NULL, 10);
 		else if (strncmp(key, "IFINDEX=", 8) == 0)
 			hotplug_event->sysfs.net_ifindex = strtoul(&key[8], NULL, 10);
 		else if (strncmp(key, "ID_VENDOR=", 10) == 0) {
 			if ((str = hal_util_strdup_valid_utf8(&key[10])) != NULL ) {
-				g_strlcpy (hotplug_event->sysfs.vendor, str, sizeof(hotplug_event->sysfs.vendor));
+				hotplug_event->sysfs.vendor = hotplug_event_strdup (hotplug_event, str);
 				g_free (str);
 			}
 		} else if (strncmp(key, "ID_MODEL=", 9) == 0) {
 			if ((str = hal_util_strdup_valid_utf8(&key[9])) != NULL ) {
-				g_strlcpy (hotplug_event->sysfs.model, str, sizeof(hotplug_event->sysfs.model));
+				hotplug_event->sysfs.model = hotplug_event_strdup (hotplug_event, str);
 				g_free (str);
 			}
 		} else if (strncmp(key, "ID_REVISION=", 12) == 0) {
 			if ((str = hal_util_strdup_valid_utf8(&key[12])) != NULL ) {
-				g_strlcpy (hotplug_event->sysfs.revision, str, sizeof(hotplug_event->sysfs.revision));
+				hotplug_event->sysfs.revision = hotplug_event_strdup (hotplug_event, str);
 				g_free (str);
 			}
 		} else if (strncmp(key, "ID_SERIAL=", 10) == 0) {
 			if ((str = hal_util_strdup_valid_utf8(&key[10])) != NULL ) {
-				g_strlcpy (hotplug_event->sysfs.serial, str, sizeof(hotplug_event->sysfs.serial));
+				hotplug_event->sysfs.serial = hotplug_event_strdup (hotplug_event, str);
 				g_free (str);
 			}
 		} else if (strncmp(key, "ID_FS_USAGE=", 12) == 0) {
 			if ((str = hal_util_strdup_valid_utf8(&key[12])) != NULL ) {
-				g_strlcpy (hotplug_event->sysfs.fsusage, str, sizeof(hotplug_event->sysfs.fsusage));
+				hotplug_event->sysfs.fsusage = hotplug_event_strdup (hotplug_event, str);
 				g_free (str);
 			}
 		} else if (strncmp(key, "ID_FS_TYPE=", 11) == 0) {
 			if ((str = hal_util_strdup_valid_utf8(&key[11])) != NULL ) {
-				g_strlcpy (hotplug_event->sysfs.fstype, str, sizeof(hotplug_event->sysfs.fstype));
+				hotplug_event->sysfs.fstype = hotplug_event_strdup (hotplug_event, str);
 				g_free (str);
 			}
 		} else if (strncmp(key, "ID_FS_VERSION=", 14) == 0) {
 			if ((str = hal_util_strdup_valid_utf8(&key[14])) != NULL ) {
-				g_strlcpy (hotplug_event->sysfs.fsversion, str, sizeof(hotplug_event->sysfs.fsversion));
+				hotplug_event->sysfs.fsversion = hotplug_event_strdup (hotplug_event, str);
 				g_free (str);
 			}
 		} else if (strncmp(key, "ID_FS_UUID=", 11) == 0) {
 			if ((str = hal_util_strdup_valid_utf8(&key[11])) != NULL ) {
-				g_strlcpy (hotplug_event->sysfs.fsuuid, str, sizeof(hotplug_event->sysfs.fsuuid));
+				hotplug_event->sysfs.fsuuid = hotplug_event_strdup (hotplug_event, str);
 				g_free (str);
 			}
 		} else if (strncmp(key, "ID_FS_LABEL_ENC=", 16) == 0) {
 			dstr = g_malloc0 (keylen - 15);
-			hal_util_decode_escape (&key[16], dstr, sizeof(hotplug_event->sysfs.fslabel));
+			hal_util_decode_escape (&key[16], dstr, keylen - 15);
 
 			if ((str = hal_util_strdup_valid_utf8(dstr)) != NULL ) {
-				g_strlcpy (hotplug_event->sysfs.fslabel, str, sizeof(hotplug_event->sysfs.fslabel));
+				hotplug_event->sysfs.fslabel = hotplug_event_strdup (hotplug_event, str);
 				g_free (str);
 			}
 			g_free (dstr);
@@ -288,7 +286,7 @@ hald_udev_data (GIOChannel *source, GIOCondition condition, gpointer user_data)
 	}
 
 invalid:
-	g_slice_free (HotplugEvent, hotplug_event);
+	hotplug_event_free (hotplug_event);
 
 out:
 	return TRUE;
@@ -401,6 +399,8 @@ osspec_privileged_init (void)
 		g_error_free (err);
 
 	osspec_privileged_init_preparse_set_dmi(FALSE, NULL);
+
+	blockdev_privileged_init ();
 }
 
 void
@@ -418,6 +418,9 @@ osspec_init (void)
 	 */
 
 	hal_device_store_index_property (hald_get_gdl (), "linux.sysfs_path");
+	/* used to map /proc/mounts entries to volumes */
+	hal_device_store_index_property (hald_get_gdl (), "block.minor");
+	hal_device_store_index_property (hald_get_gdl (), "block.device");
 
 	memset(&saddr, 0x00, sizeof(saddr));
 	saddr.sun_family = AF_LOCAL;
@@ -474,6 +477,8 @@ void
 hotplug_queue_now_empty (void)
 {
 	if (hald_is_initialising && hald_done_synthesizing_coldplug) {
+		/* coldplug limits the events running at once */
+		hotplug_event_set_max_running (0);
 		osspec_probe_done ();
         }
 }
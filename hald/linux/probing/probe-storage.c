@@ -111,6 +111,12 @@ main (int argc, char *argv[])
 
 	dbus_error_init (&error);
 
+	/* hald can't remove cache entries itself, see partutil.c */
+	if (argc == 3 && strcmp (argv[1], "--drop-partition-table-cache") == 0) {
+		setup_logger ();
+		return part_table_cache_drop (g_ascii_strtoull (argv[2], NULL, 10)) ? 0 : 1;
+	}
+
 	if ((udi = getenv ("UDI")) == NULL)
 		goto out;
 	if ((device_file = getenv ("HAL_PROP_BLOCK_DEVICE")) == NULL)
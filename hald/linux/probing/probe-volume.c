@@ -658,7 +658,7 @@ main (int argc, char *argv[])
 			 */
 			if (bid_ret != 0 && is_disc) {
 				PartitionTable *p;
-				p = part_table_load_from_disk (stordev_dev_file);
+				p = part_table_load_from_disk_cached (stordev_dev_file);
 				if (p != NULL) {
 					int i;
 
@@ -701,7 +701,7 @@ main (int argc, char *argv[])
 			PartitionTable *p;
 
 			HAL_INFO (("Loading part table"));
-			p = part_table_load_from_disk (stordev_dev_file);
+			p = part_table_load_from_disk_cached (stordev_dev_file);
 			if (p != NULL) {
 				PartitionTable *p2;
 				int entry;
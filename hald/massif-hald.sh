@@ -31,6 +31,7 @@ export HAL_FDI_SOURCE_PREPROBE=$HALD_TMPDIR/share/hal/fdi/preprobe
 export HAL_FDI_SOURCE_INFORMATION=$HALD_TMPDIR/share/hal/fdi/information
 export HAL_FDI_SOURCE_POLICY=$HALD_TMPDIR/share/hal/fdi/policy
 export HAL_FDI_CACHE_NAME=$HALD_TMPDIR/hald-local-fdi-cache
+export HAL_IDS_CACHE_NAME=$HALD_TMPDIR/hald-local-ids-cache
 export POLKIT_POLICY_DIR=$HALD_TMPDIR/share/PolicyKit/policy
 
 #delete all old memory outputs, else we get hundreds
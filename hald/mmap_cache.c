@@ -79,6 +79,9 @@ int di_rules_init (void)
 		DIE (("Couldn't mmap file '%s', errno=%d: %s", cachename, errno, strerror (errno)));
 
 	header = (struct cache_header*) rules_ptr;
+	if (rules_size < sizeof (struct cache_header) || header->version != RULES_CACHE_VERSION)
+		DIE (("Cache file '%s' has an unknown format", cachename));
+
 	HAL_INFO(("preprobe: offset=%08lx, size=%d", header->fdi_rules_preprobe,
 		header->fdi_rules_information - header->fdi_rules_preprobe));
 	HAL_INFO(("information: offset=%08lx, size=%d", header->fdi_rules_information,
@@ -158,6 +161,24 @@ regen_cache (void)
 
 static gboolean cache_valid = FALSE;
 
+/* check whether the cache was written by this version of hald-generate-fdi-cache */
+static gboolean
+cache_version_matches (const char *cachename)
+{
+	struct cache_header header;
+	gboolean ret;
+	int fd;
+
+	ret = FALSE;
+	if ((fd = open (cachename, O_RDONLY)) < 0)
+		goto out;
+	if (read (fd, &header, sizeof (struct cache_header)) == sizeof (struct cache_header))
+		ret = (header.version == RULES_CACHE_VERSION);
+	close (fd);
+out:
+	return ret;
+}
+
 static void
 cache_invalidated (HalFileMonitor      *monitor,
                    HalFileMonitorEvent  event,
@@ -269,6 +290,10 @@ di_cache_coherency_check (gboolean setup_watches)
 			HAL_INFO(("Cache zero size, so regenerating"));
 			regen_cache();
 			did_regen = TRUE;
+		} else if (!cache_version_matches (cachename)) {
+			HAL_INFO(("Cache has an old format, so regenerating"));
+			regen_cache();
+			did_regen = TRUE;
 		}
 	} else {
 		regen_cache();
@@ -99,19 +99,117 @@ struct rule {
 
 	u_int32_t	value_offset;	/* offset to keys value (aligned to 4 bytes) */
 	size_t		value_len;	/* length of keys value */
+	u_int32_t	match_offset;	/* offset of the struct rule_match of a match rule */
 
 	size_t		key_len;
 	char		key[0];
 };
 
+/* One step of a key path like '@block.storage_device:storage.bus' that
+ * leads from the device being matched to the device to look at */
+struct rule_hop {
+	u_int32_t	name;		/* offset of the udi, or of the property holding it */
+	u_int32_t	indirect;	/* name is a property ('@foo') rather than a udi */
+};
+
+/* the value was "false" for exists, empty, is_ascii and is_absolute_path */
+#define RULE_MATCH_NEGATE	(1 << 0)
+/* a bool match on something else than "true" or "false" */
+#define RULE_MATCH_NEVER	(1 << 1)
+
+/* The operands of a match rule, decoded by hald-generate-fdi-cache so that
+ * matching a device doesn't need to parse the rule's value again. Which
+ * fields are used depends on the match type.
+ */
+struct rule_match {
+	int64_t		number;		/* int, uint64 and compare_*: the value as an integer */
+	double		real;		/* double and compare_*: the value as a double */
+	u_int32_t	flags;
+	u_int32_t	prop;		/* offset of the property name to check */
+	u_int32_t	num_hops;	/* 0 if the property is on the device itself */
+	u_int32_t	hops;		/* struct rule_hop[num_hops] */
+	u_int32_t	ncase_value;	/* *_ncase: offset of the lowercased value */
+	u_int32_t	num_values;	/* *_outof: the ';' separated values */
+	u_int32_t	values;		/* u_int32_t[num_values]: string offsets, or int32 for int_outof */
+	u_int32_t	hash_size;	/* string_outof: a power of two */
+	u_int32_t	hash_seed;
+	u_int32_t	hash;		/* u_int32_t[hash_size]: index into values plus one, or 0 */
+};
+
+/* FNV-1a; the cache generator picks a seed for each string_outof set
+ * that gives every value a slot of its own */
+static inline u_int32_t
+rule_hash (const char *s, u_int32_t seed)
+{
+	u_int32_t h = 2166136261U ^ seed;
+
+	for (; *s != '\0'; s++) {
+		h ^= (unsigned char) *s;
+		h *= 16777619U;
+	}
+	return h;
+}
+
 struct cache_header {
+	u_int32_t	version;		/* RULES_CACHE_VERSION */
 	u_int32_t	fdi_rules_preprobe;
 	u_int32_t	fdi_rules_information;
 	u_int32_t	fdi_rules_policy;
 	u_int32_t	all_rules_size;
+	u_int32_t	fdi_index_preprobe;	/* offsets of the struct cache_index */
+	u_int32_t	fdi_index_information;	/* for each section, or 0 */
+	u_int32_t	fdi_index_policy;
+	u_int32_t	fdi_files;		/* offset of the struct cache_fdi_file[] */
+	u_int32_t	num_fdi_files;
 	char		empty_string[4];
 };
 
+/* Where the rules of each fdi file are, in rule order. When the cache is
+ * generated again, the rules of files that didn't change are copied from
+ * here instead of parsing the file. */
+struct cache_fdi_file {
+	u_int64_t	mtime;
+	u_int64_t	size;
+	u_int32_t	name;		/* offset of the path of the file */
+	u_int32_t	start;		/* offset of the first rule */
+	u_int32_t	end;		/* offset just after the last rule */
+	u_int32_t	pad;
+};
+
+/* Index over the top-level blocks of a rule section, stored after the
+ * rules. A block is an outermost <match> including everything nested in
+ * it, or a single rule outside of any match. Blocks whose outermost match
+ * is on a property of the device itself are filed under the key of that
+ * match, and for string matches also under its value, so only blocks that
+ * can possibly match a device need to be evaluated.
+ *
+ * All lists of block numbers are sorted in rule order.
+ */
+struct cache_index {
+	u_int32_t	num_blocks;
+	u_int32_t	blocks;		/* u_int32_t[num_blocks + 1]: offset of each block and the section end */
+	u_int32_t	num_unindexed;
+	u_int32_t	unindexed;	/* u_int32_t[]: blocks that are always evaluated */
+	u_int32_t	num_keys;
+	u_int32_t	keys;		/* struct cache_index_key[], sorted by key */
+};
+
+struct cache_index_key {
+	u_int32_t	key;		/* offset of the key string */
+	u_int32_t	num_any;
+	u_int32_t	any;		/* u_int32_t[]: blocks that only need the key to exist */
+	u_int32_t	num_values;
+	u_int32_t	values;		/* struct cache_index_value[], sorted by value */
+};
+
+struct cache_index_value {
+	u_int32_t	value;		/* offset of the value string */
+	u_int32_t	num_blocks;
+	u_int32_t	blocks;		/* u_int32_t[]: blocks that need key == value */
+};
+
+#define RULES_CACHE_VERSION		0x46444904
+
 #define HAL_MAX_INDENT_DEPTH		64
 
 #define HALD_CACHE_FILE PACKAGE_LOCALSTATEDIR "/cache/hald/fdi-cache"
@@ -0,0 +1,422 @@
+/***************************************************************************
+ * CVSID: $Id$
+ *
+ * rule_match.c : run fdi match rules on devices.
+ *
+ * Copyright (C) 2003 David Zeuthen, <david@fubar.dk>
+ * Copyright (C) 2006 Kay Sievers, <kay.sievers@vrfy.org>
+ * Copyright (C) 2006 Richard Hughes <richard@hughsie.com>
+ * Copyright (C) 2007 Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ * Copyright (C) 2007 Sergey Lapin <slapinid@gmail.com>
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ **************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <string.h>
+#include <math.h>
+#include <dbus/dbus.h>
+
+#include "hald.h"
+#include "logger.h"
+#include "mmap_cache.h"
+#include "device_store.h"
+#include "rule.h"
+#include "rule_match.h"
+
+/* the fdi cache, see device_info.c */
+extern void *rules_ptr;
+
+/* Compare the value of a property on a hal device object against the value of
+ * a match rule and return the result. Note that this works for several types,
+ * e.g. both strings and integers - in the latter case the rule's value as decoded
+ * by the cache generator is used.
+ *
+ * The comparison might not make sense if you are comparing a property which is an integer
+ * against a string in which case this function returns FALSE. Also, if the property doesn't
+ * exist this function will also return FALSE.
+ *
+ * @param  d                    hal device object
+ * @param  key                  Key of the property to compare
+ * @param  m                    Decoded operands of the match rule
+ * @param  right_side           Value to compare against
+ * @param  result               Pointer to where to store result
+ * @return                      TRUE if, and only if, the comparison could take place
+ */
+static gboolean
+match_compare_property (HalDevice *d, const char *key, const struct rule_match *m,
+			const char *right_side, dbus_int64_t *result)
+{
+	switch (hal_device_property_get_type (d, key)) {
+	case HAL_PROPERTY_TYPE_STRING:
+		*result = (dbus_int64_t) strcmp (hal_device_property_get_string (d, key), right_side);
+		return TRUE;
+
+	case HAL_PROPERTY_TYPE_INT32:
+		*result = ((dbus_int64_t) hal_device_property_get_int (d, key)) - m->number;
+		return TRUE;
+
+	case HAL_PROPERTY_TYPE_UINT64:
+		*result = ((dbus_int64_t) hal_device_property_get_uint64 (d, key)) - m->number;
+		return TRUE;
+
+	case HAL_PROPERTY_TYPE_DOUBLE:
+		*result = (dbus_int64_t) ceil (hal_device_property_get_double (d, key) - m->real);
+		return TRUE;
+
+	default:
+		/* a missing property, or a boolean where this doesn't make sense */
+		return FALSE;
+	}
+}
+
+/* follow the key path of a match rule from the device being matched */
+static HalDevice *
+match_find_device (const struct rule_match *m, HalDevice *d)
+{
+	const struct rule_hop *hops = (const struct rule_hop *) RULES_PTR(m->hops);
+	const char *udi;
+	u_int32_t i;
+
+	for (i = 0; i < m->num_hops; i++) {
+		const char *name = (const char *) RULES_PTR(hops[i].name);
+
+		if (hops[i].indirect) {
+			udi = hal_device_property_get_string (d, name);
+			if (udi == NULL)
+				return NULL;
+		} else {
+			udi = name;
+		}
+
+		d = hal_device_store_find (hald_get_gdl (), udi);
+		if (d == NULL)
+			d = hal_device_store_find (hald_get_tdl (), udi);
+		if (d == NULL)
+			return NULL;
+	}
+
+	return d;
+}
+
+/* whether a string is one of the values of a string_outof match */
+static gboolean
+match_string_outof (const struct rule_match *m, const char *haystack)
+{
+	const u_int32_t *values = (const u_int32_t *) RULES_PTR(m->values);
+	const u_int32_t *hash = (const u_int32_t *) RULES_PTR(m->hash);
+	u_int32_t n;
+
+	if (m->num_values == 0)
+		return FALSE;
+
+	n = hash[rule_hash (haystack, m->hash_seed) & (m->hash_size - 1)];
+	return n != 0 && strcmp ((const char *) RULES_PTR(values[n - 1]), haystack) == 0;
+}
+
+/* whether a string has one of the values of a contains_outof or
+ * prefix_outof match in it */
+static gboolean
+match_substring_outof (const struct rule_match *m, match_type type, const char *haystack)
+{
+	const u_int32_t *values = (const u_int32_t *) RULES_PTR(m->values);
+	u_int32_t i;
+
+	for (i = 0; i < m->num_values; i++) {
+		const char *value = (const char *) RULES_PTR(values[i]);
+
+		if (type == MATCH_CONTAINS_OUTOF) {
+			if (strstr (haystack, value) != NULL)
+				return TRUE;
+		} else {
+			if (g_str_has_prefix (haystack, value))
+				return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/* whether a string list has an element equal to value */
+static gboolean
+match_strlist_contains (HalDevice *d, const char *key, const char *value, gboolean ncase)
+{
+	HalDeviceStrListIter iter;
+
+	for (hal_device_property_strlist_iter_init (d, key, &iter);
+	     hal_device_property_strlist_iter_is_valid (&iter);
+	     hal_device_property_strlist_iter_next (&iter)) {
+		const char *str = hal_device_property_strlist_iter_get_value (&iter);
+
+		if (ncase ? g_ascii_strcasecmp (str, value) == 0 : strcmp (str, value) == 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/**
+ * rule_match_device:
+ * @rule:	a RULE_MATCH rule from the fdi cache
+ * @d:		the device to run it on
+ *
+ * Run a match rule on a device. Everything that only depends on the rule
+ * was decoded by hald-generate-fdi-cache into a struct rule_match, so all
+ * that is left is looking up the property once and comparing.
+ *
+ * Returns:	TRUE if the rule matches
+ */
+gboolean
+rule_match_device (const struct rule *rule, HalDevice *d)
+{
+	const struct rule_match *m = (const struct rule_match *) RULES_PTR(rule->match_offset);
+	const char *value = (char *)RULES_PTR(rule->value_offset);
+	const char *prop_to_check = (const char *) RULES_PTR(m->prop);
+	int type;
+
+	/* Resolve key paths like 'someudi/foo/bar/baz:prop.name' '@prop.here.is.an.udi:with.prop.name' */
+	if (m->num_hops > 0) {
+		d = match_find_device (m, d);
+		if (d == NULL)
+			return FALSE;
+	}
+
+	type = hal_device_property_get_type (d, prop_to_check);
+
+	switch (rule->type_match) {
+	case MATCH_STRING:
+		return type == HAL_PROPERTY_TYPE_STRING &&
+			strcmp (hal_device_property_get_string (d, prop_to_check), value) == 0;
+
+	case MATCH_INT:
+		return type == HAL_PROPERTY_TYPE_INT32 &&
+			hal_device_property_get_int (d, prop_to_check) == m->number;
+
+	case MATCH_UINT64:
+		return type == HAL_PROPERTY_TYPE_UINT64 &&
+			hal_device_property_get_uint64 (d, prop_to_check) == (dbus_uint64_t) m->number;
+
+	case MATCH_BOOL:
+		if (m->flags & RULE_MATCH_NEVER)
+			return FALSE;
+		return type == HAL_PROPERTY_TYPE_BOOLEAN &&
+			hal_device_property_get_bool (d, prop_to_check) == m->number;
+
+	case MATCH_DOUBLE:
+		return type == HAL_PROPERTY_TYPE_DOUBLE &&
+			hal_device_property_get_double (d, prop_to_check) == m->real;
+
+	case MATCH_EXISTS:
+	{
+		gboolean exists = type != HAL_PROPERTY_TYPE_INVALID;
+
+		return (m->flags & RULE_MATCH_NEGATE) ? !exists : exists;
+	}
+
+	case MATCH_EMPTY:
+	{
+		gboolean is_empty;
+
+		if (type != HAL_PROPERTY_TYPE_STRING)
+			return FALSE;
+		is_empty = hal_device_property_get_string (d, prop_to_check)[0] == '\0';
+
+		return (m->flags & RULE_MATCH_NEGATE) ? !is_empty : is_empty;
+	}
+
+	case MATCH_ISASCII:
+	{
+		gboolean is_ascii = TRUE;
+		const char *str;
+
+		if (type != HAL_PROPERTY_TYPE_STRING)
+			return FALSE;
+
+		for (str = hal_device_property_get_string (d, prop_to_check); *str != '\0'; str++) {
+			if (((unsigned char) *str) > 0x7f) {
+				is_ascii = FALSE;
+				break;
+			}
+		}
+
+		return (m->flags & RULE_MATCH_NEGATE) ? !is_ascii : is_ascii;
+	}
+
+	case MATCH_IS_ABS_PATH:
+	{
+		gboolean is_absolute_path;
+
+		if (type != HAL_PROPERTY_TYPE_STRING)
+			return FALSE;
+		is_absolute_path = g_path_is_absolute (hal_device_property_get_string (d, prop_to_check));
+
+		return (m->flags & RULE_MATCH_NEGATE) ? !is_absolute_path : is_absolute_path;
+	}
+
+	case MATCH_CONTAINS:
+	case MATCH_CONTAINS_NOT:
+	{
+		gboolean contains = FALSE;
+
+		if (type == HAL_PROPERTY_TYPE_STRING)
+			contains = strstr (hal_device_property_get_string (d, prop_to_check), value) != NULL;
+		else if (type == HAL_PROPERTY_TYPE_STRLIST)
+			contains = match_strlist_contains (d, prop_to_check, value, FALSE);
+		else if (type != HAL_PROPERTY_TYPE_INVALID)
+			return FALSE;
+
+		if (rule->type_match == MATCH_CONTAINS)
+			return contains;
+		else
+			return !contains; /* rule->type_match == MATCH_CONTAINS_NOT  */
+	}
+
+	case MATCH_CONTAINS_OUTOF:
+	case MATCH_PREFIX_OUTOF:
+		return type == HAL_PROPERTY_TYPE_STRING &&
+			match_substring_outof (m, rule->type_match, hal_device_property_get_string (d, prop_to_check));
+
+	case MATCH_STRING_OUTOF:
+		return type == HAL_PROPERTY_TYPE_STRING &&
+			match_string_outof (m, hal_device_property_get_string (d, prop_to_check));
+
+	case MATCH_INT_OUTOF:
+	{
+		const int32_t *values = (const int32_t *) RULES_PTR(m->values);
+		int to_check;
+		u_int32_t i;
+
+		if (type != HAL_PROPERTY_TYPE_INT32)
+			return FALSE;
+
+		to_check = hal_device_property_get_int (d, prop_to_check);
+		for (i = 0; i < m->num_values; i++) {
+			if (values[i] == to_check)
+				return TRUE;
+		}
+		return FALSE;
+	}
+
+	case MATCH_SIBLING_CONTAINS:
+	{
+		dbus_bool_t contains = FALSE;
+		const char *parent_udi;
+
+		parent_udi = hal_device_property_get_string (d, "info.parent");
+		if (parent_udi != NULL) {
+			GSList *i;
+			GSList *siblings;
+
+			siblings = hal_device_store_match_multiple_key_value_string (hald_get_gdl (),
+										     "info.parent",
+										     parent_udi);
+			for (i = siblings; i != NULL; i = g_slist_next (i)) {
+				HalDevice *sib = HAL_DEVICE (i->data);
+
+				if (sib == d)
+					continue;
+
+				HAL_INFO (("Checking sibling '%s' of '%s' whether '%s' contains '%s'",
+					   hal_device_get_udi (sib), hal_device_get_udi (d), prop_to_check, value));
+
+				if (hal_device_property_get_type (sib, prop_to_check) == HAL_PROPERTY_TYPE_STRING) {
+					if (hal_device_has_property (sib, prop_to_check)) {
+						const char *haystack;
+						
+						haystack = hal_device_property_get_string (sib, prop_to_check);
+						if (value != NULL && haystack != NULL && strstr (haystack, value))
+							contains = TRUE;
+					}
+				} else if (hal_device_property_get_type (sib, prop_to_check) == HAL_PROPERTY_TYPE_STRLIST && value != NULL) {
+					contains = match_strlist_contains (sib, prop_to_check, value, FALSE);
+				}
+
+				if (contains)
+					break;
+
+			} /* for all siblings */
+			g_slist_free (siblings);			
+		}
+
+		return contains;
+	}
+
+	case MATCH_CONTAINS_NCASE:
+	case MATCH_PREFIX_NCASE:
+	case MATCH_SUFFIX_NCASE:
+	{
+		const char *value_lowercase = (const char *) RULES_PTR(m->ncase_value);
+		char *haystack_lowercase;
+		gboolean found;
+
+		if (type == HAL_PROPERTY_TYPE_STRLIST && rule->type_match == MATCH_CONTAINS_NCASE)
+			return match_strlist_contains (d, prop_to_check, value, TRUE);
+		if (type != HAL_PROPERTY_TYPE_STRING)
+			return FALSE;
+
+		haystack_lowercase = g_utf8_strdown (hal_device_property_get_string (d, prop_to_check), -1);
+		if (rule->type_match == MATCH_CONTAINS_NCASE)
+			found = strstr (haystack_lowercase, value_lowercase) != NULL;
+		else if (rule->type_match == MATCH_PREFIX_NCASE)
+			found = g_str_has_prefix (haystack_lowercase, value_lowercase);
+		else
+			found = g_str_has_suffix (haystack_lowercase, value_lowercase);
+		g_free (haystack_lowercase);
+
+		return found;
+	}
+
+	case MATCH_PREFIX:
+		return type == HAL_PROPERTY_TYPE_STRING &&
+			g_str_has_prefix (hal_device_property_get_string (d, prop_to_check), value);
+
+	case MATCH_SUFFIX:
+		return type == HAL_PROPERTY_TYPE_STRING &&
+			g_str_has_suffix (hal_device_property_get_string (d, prop_to_check), value);
+
+	case MATCH_COMPARE_LT:
+	case MATCH_COMPARE_LE:
+	case MATCH_COMPARE_GT:
+	case MATCH_COMPARE_GE:
+	case MATCH_COMPARE_NE:
+	{
+		dbus_int64_t result;
+
+		if (!match_compare_property (d, prop_to_check, m, value, &result))
+			return FALSE;
+
+		switch (rule->type_match) {
+		case MATCH_COMPARE_LT:
+			return result < 0;
+		case MATCH_COMPARE_LE:
+			return result <= 0;
+		case MATCH_COMPARE_GT:
+			return result > 0;
+		case MATCH_COMPARE_GE:
+			return result >= 0;
+		default:
+			return result != 0;
+		}
+	}
+
+	default:
+		HAL_INFO(("match ERROR"));
+		return FALSE;
+	}
+}
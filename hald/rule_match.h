@@ -0,0 +1,41 @@
+/***************************************************************************
+ * CVSID: $Id$
+ *
+ * rule_match.h : run fdi match rules on devices.
+ *
+ * Copyright (C) 2003 David Zeuthen, <david@fubar.dk>
+ * Copyright (C) 2006 Kay Sievers, <kay.sievers@vrfy.org>
+ * Copyright (C) 2006 Richard Hughes <richard@hughsie.com>
+ * Copyright (C) 2007 Mikhail Kshevetskiy <mikhail.kshevetskiy@gmail.com>
+ * Copyright (C) 2007 Sergey Lapin <slapinid@gmail.com>
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ **************************************************************************/
+
+#ifndef RULE_MATCH_H
+#define RULE_MATCH_H
+
+#include <glib.h>
+
+#include "device.h"
+
+struct rule;
+
+gboolean rule_match_device (const struct rule *rule, HalDevice *d);
+
+#endif /* RULE_MATCH_H */
@@ -392,16 +392,20 @@ hal_util_set_double_from_file (HalDevice *d, const gchar *key, const gchar *dire
 void
 hal_util_make_udi_unique (HalDeviceStore *store, gchar *udi, gsize udisize, const char *original_udi)
 {
-	int i;
+	guint i;
 
 	if (hal_device_store_find (store, original_udi) == NULL) {
 		g_strlcpy (udi, original_udi, udisize);
 		goto out;
 	}
 
-	for (i = 0; ; i++) {
-		g_snprintf (udi, udisize, "%s_%d", original_udi, i);
+	/* Hand out the lowest free suffix like we always did, but start
+	 * where the last search ended instead of at 0. The suffix found is
+	 * remembered as is, the device may never be added. */
+	for (i = hal_device_store_get_udi_suffix (store, original_udi); ; i++) {
+		g_snprintf (udi, udisize, "%s_%u", original_udi, i);
 		if (hal_device_store_find (store, udi) == NULL) {
+			hal_device_store_set_udi_suffix (store, original_udi, i);
 			goto out;
 		}
 	}
@@ -1334,6 +1334,21 @@ libhal_volume_get_msdos_part_table_size (LibHalVolume *volume)
 
 /***********************************************************************/
 
+/* Whether a property set lists the given capability in info.capabilities */
+static dbus_bool_t
+property_set_has_capability (LibHalPropertySet *props, const char *capability)
+{
+	const char * const *caps;
+	unsigned int i;
+
+	caps = libhal_ps_get_strlist (props, "info.capabilities");
+	for (i = 0; caps != NULL && caps[i] != NULL; i++) {
+		if (strcmp (caps[i], capability) == 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
 /** 
  *  libhal_drive_from_device_file:
  *  @hal_ctx:             libhal context to use
@@ -1350,6 +1365,8 @@ libhal_drive_from_device_file (LibHalContext *hal_ctx, const char *device_file)
 	int i;
 	char **hal_udis;
 	int num_hal_udis;
+	LibHalPropertySet **props;
+	const char *keys[] = {"info.capabilities", "block.storage_device", NULL};
 	LibHalDrive *result;
 	char *found_udi;
 	DBusError error;
@@ -1366,30 +1383,35 @@ libhal_drive_from_device_file (LibHalContext *hal_ctx, const char *device_file)
 		goto out;
 	}
 
+	/* one request for all candidates instead of a few per candidate */
+	if (!libhal_devices_get_properties (hal_ctx, (const char **) hal_udis, keys, &props, &error)) {
+		LIBHAL_FREE_DBUS_ERROR(&error);
+		libhal_free_string_array (hal_udis);
+		goto out;
+	}
+
 	for (i = 0; i < num_hal_udis; i++) {
-		char *udi;
-		char *storage_udi;
-		DBusError err1;
-		DBusError err2;
-		udi = hal_udis[i];
+		const char *storage_udi;
 
-		dbus_error_init (&err1);
-		dbus_error_init (&err2);
-		if (libhal_device_query_capability (hal_ctx, udi, "volume", &err1)) {
+		if (props[i] == NULL)
+			continue;
 
-			storage_udi = libhal_device_get_property_string (hal_ctx, udi, "block.storage_device", &err1);
+		if (property_set_has_capability (props[i], "volume")) {
+			storage_udi = libhal_ps_get_string (props[i], "block.storage_device");
 			if (storage_udi == NULL)
 				continue;
+			free (found_udi);
 			found_udi = strdup (storage_udi);
-			libhal_free_string (storage_udi);
 			break;
-		} else if (libhal_device_query_capability (hal_ctx, udi, "storage", &err2)) {
-			found_udi = strdup (udi);
+		} else if (property_set_has_capability (props[i], "storage")) {
+			free (found_udi);
+			found_udi = strdup (hal_udis[i]);
 		}
-		LIBHAL_FREE_DBUS_ERROR(&err1);
-		LIBHAL_FREE_DBUS_ERROR(&err2);
 	}
 
+	for (i = 0; i < num_hal_udis; i++)
+		libhal_free_property_set (props[i]);
+	free (props);
 	libhal_free_string_array (hal_udis);
 
 	if (found_udi != NULL)
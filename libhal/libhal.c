@@ -241,6 +241,26 @@ struct LibHalProperty_s {
 	UT_hash_handle hh;		/*makes this hashable*/
 };
 
+/**
+ * LibHalCachedDevice:
+ *
+ * A device in the client side property cache of a #LibHalContext.
+ */
+typedef struct LibHalCachedDevice_s LibHalCachedDevice;
+struct LibHalCachedDevice_s {
+	char *udi;			/**< Unique Device Id, also the hash key */
+
+	/** Cached properties or NULL if they have not been fetched yet */
+	LibHalPropertySet *properties;
+
+	/** Whether properties have been dropped from the set because they
+	 *  were modified; a key missing from the set is then unknown
+	 *  rather than non-existent */
+	dbus_bool_t is_partial;
+
+	UT_hash_handle hh;		/*makes this hashable*/
+};
+
 /**
  * LibHalContext:
  *
@@ -253,6 +273,9 @@ struct LibHalContext_s {
 	dbus_bool_t is_shutdown;              /**< Have we been shutdown */
 	dbus_bool_t cache_enabled;            /**< Is the cache enabled */
 	dbus_bool_t is_direct;                /**< Whether the connection to hald is direct */
+	dbus_bool_t cache_is_watching;        /**< Are we subscribed to PropertyModified for the cache */
+	dbus_bool_t cache_is_complete;        /**< Does the cache hold every device in the GDL */
+	LibHalCachedDevice *cache;            /**< Cached devices, keyed by UDI */
 
 	/** Device added */
 	LibHalDeviceAdded device_added;
@@ -293,6 +316,14 @@ struct LibHalContext_s {
 	void *user_data;                      /**< User data */
 };
 
+static LibHalPropertySet *property_set_copy (const LibHalPropertySet *set);
+
+static LibHalPropertySet *get_all_properties_from_hald (LibHalContext *ctx, const char *udi, DBusError *error);
+
+static dbus_bool_t get_all_devices_with_properties_from_hald (LibHalContext *ctx, int *out_num_devices, char ***out_udi, LibHalPropertySet ***out_properties, DBusError *error);
+
+static LibHalCachedDevice *cache_get_device (LibHalContext *ctx, const char *udi, const char *key);
+
 /**
  * libhal_ctx_set_user_data:
  * @ctx: the context for the connection to hald
@@ -405,11 +436,11 @@ libhal_property_fill_value_from_variant (LibHalProperty *p, DBusMessageIter *var
 	}
 	case DBUS_TYPE_BOOLEAN:
 	{
-		double v;
+		dbus_bool_t v;
 
 		dbus_message_iter_get_basic (var_iter, &v);
 
-		p->v.double_value = v;
+		p->v.bool_value = v;
 		p->type = LIBHAL_PROPERTY_TYPE_BOOLEAN; 
 
 		break;
@@ -514,6 +545,21 @@ oom:
  */
 LibHalPropertySet *
 libhal_device_get_all_properties (LibHalContext *ctx, const char *udi, DBusError *error)
+{
+	LibHalCachedDevice *cached;
+
+	LIBHAL_CHECK_LIBHALCONTEXT(ctx, NULL);
+	LIBHAL_CHECK_UDI_VALID(udi, NULL);
+
+	cached = cache_get_device (ctx, udi, NULL);
+	if (cached != NULL)
+		return property_set_copy (cached->properties);
+
+	return get_all_properties_from_hald (ctx, udi, error);
+}
+
+static LibHalPropertySet *
+get_all_properties_from_hald (LibHalContext *ctx, const char *udi, DBusError *error)
 {
 	DBusMessage *message;
 	DBusMessage *reply;
@@ -521,9 +567,6 @@ libhal_device_get_all_properties (LibHalContext *ctx, const char *udi, DBusError
 	LibHalPropertySet *result;
 	DBusError _error;
 
-	LIBHAL_CHECK_LIBHALCONTEXT(ctx, NULL);
-	LIBHAL_CHECK_UDI_VALID(udi, NULL);
-
 	message = dbus_message_new_method_call ("org.freedesktop.Hal", udi,
 						"org.freedesktop.Hal.Device",
 						"GetAllProperties");
@@ -584,6 +627,17 @@ libhal_property_set_sort (LibHalPropertySet *set)
 	HASH_SORT (set->properties, key_sort);
 }
 
+static void
+property_free (LibHalProperty *p)
+{
+	free (p->key);
+	if (p->type == DBUS_TYPE_STRING)
+		free (p->v.str_value);
+	if (p->type == LIBHAL_PROPERTY_TYPE_STRLIST)
+		libhal_free_string_array (p->v.strlist_value);
+	free (p);
+}
+
 /**
  * libhal_free_property_set:
  * @set: property-set to free
@@ -600,14 +654,9 @@ libhal_free_property_set (LibHalPropertySet * set)
 
 	for (p = set->properties; p != NULL;) {
 		HASH_DELETE (hh, set->properties, p);
-		free (p->key);
-		if (p->type == DBUS_TYPE_STRING)
-			free (p->v.str_value);
-		if (p->type == LIBHAL_PROPERTY_TYPE_STRLIST)
-			libhal_free_string_array (p->v.strlist_value);
 		p_old = p;
 		p = p->hh.next;
-		free (p_old);
+		property_free (p_old);
 	}
 	free (set);
 }
@@ -973,6 +1022,368 @@ libhal_psi_get_strlist (LibHalPropertySetIterator * iter)
 	return iter->cur_prop->v.strlist_value;
 }
 
+static char **
+string_array_copy (char **strings)
+{
+	char **copy;
+	unsigned int n;
+	unsigned int i;
+
+	for (n = 0; strings[n] != NULL; n++)
+		;
+
+	copy = malloc (sizeof (char *) * (n + 1));
+	if (copy == NULL)
+		return NULL;
+
+	for (i = 0; i < n; i++) {
+		copy[i] = strdup (strings[i]);
+		if (copy[i] == NULL) {
+			libhal_free_string_array (copy);
+			return NULL;
+		}
+	}
+	copy[n] = NULL;
+
+	return copy;
+}
+
+static LibHalPropertySet *
+property_set_copy (const LibHalPropertySet *set)
+{
+	LibHalPropertySet *result;
+	LibHalProperty *p;
+	LibHalProperty *copy;
+
+	result = malloc (sizeof (LibHalPropertySet));
+	if (result == NULL)
+		goto oom;
+	result->properties = NULL;
+
+	for (p = set->properties; p != NULL; p = p->hh.next) {
+		copy = malloc (sizeof (LibHalProperty));
+		if (copy == NULL)
+			goto oom;
+
+		copy->type = p->type;
+		copy->v = p->v;
+		copy->key = strdup (p->key);
+		if (copy->key == NULL) {
+			free (copy);
+			goto oom;
+		}
+
+		if (p->type == LIBHAL_PROPERTY_TYPE_STRING) {
+			copy->v.str_value = strdup (p->v.str_value);
+			if (copy->v.str_value == NULL) {
+				free (copy->key);
+				free (copy);
+				goto oom;
+			}
+		} else if (p->type == LIBHAL_PROPERTY_TYPE_STRLIST &&
+			   p->v.strlist_value != NULL) {
+			copy->v.strlist_value = string_array_copy (p->v.strlist_value);
+			if (copy->v.strlist_value == NULL) {
+				free (copy->key);
+				free (copy);
+				goto oom;
+			}
+		}
+
+		HASH_ADD_KEYPTR (hh, result->properties, copy->key, strlen (copy->key), copy);
+	}
+
+	return result;
+
+oom:
+	if (result != NULL)
+		libhal_free_property_set (result);
+
+	fprintf (stderr,
+		"%s %d : error allocating memory\n",
+		 __FILE__, __LINE__);
+
+	return NULL;
+}
+
+/*
+ * The client side property cache.
+ *
+ * When enabled with libhal_ctx_set_cache() every device we have been
+ * asked about is kept in ctx->cache together with all its properties,
+ * fetched in one go with GetAllProperties (or, for the whole GDL, with
+ * GetAllDevicesWithProperties). The cache is kept coherent with the
+ * DeviceAdded, DeviceRemoved and PropertyModified signals in
+ * filter_func(); a modified property is dropped from the set and the
+ * whole set is fetched again the next time that property is asked for.
+ *
+ * The cache is only used on bus connections (not on direct ones) and
+ * only after we subscribed to the PropertyModified signals. Like the
+ * callbacks, it relies on the application dispatching the connection.
+ */
+
+#define LIBHAL_CACHE_MATCH_RULE				\
+	"type='signal',"				\
+	"interface='org.freedesktop.Hal.Device',"	\
+	"member='PropertyModified',"			\
+	"sender='org.freedesktop.Hal'"
+
+static dbus_bool_t
+cache_is_active (LibHalContext *ctx)
+{
+	return ctx->cache_enabled && ctx->cache_is_watching;
+}
+
+static void
+cache_free_device (LibHalContext *ctx, LibHalCachedDevice *cached)
+{
+	HASH_DELETE (hh, ctx->cache, cached);
+	free (cached->udi);
+	if (cached->properties != NULL)
+		libhal_free_property_set (cached->properties);
+	free (cached);
+}
+
+static void
+cache_flush (LibHalContext *ctx)
+{
+	while (ctx->cache != NULL)
+		cache_free_device (ctx, ctx->cache);
+	ctx->cache_is_complete = FALSE;
+}
+
+static LibHalCachedDevice *
+cache_add_device (LibHalContext *ctx, const char *udi)
+{
+	LibHalCachedDevice *cached;
+
+	HASH_FIND_STR (ctx->cache, udi, cached);
+	if (cached != NULL)
+		return cached;
+
+	cached = malloc (sizeof (LibHalCachedDevice));
+	if (cached == NULL)
+		return NULL;
+
+	cached->udi = strdup (udi);
+	if (cached->udi == NULL) {
+		free (cached);
+		return NULL;
+	}
+	cached->properties = NULL;
+	cached->is_partial = FALSE;
+
+	HASH_ADD_KEYPTR (hh, ctx->cache, cached->udi, strlen (cached->udi), cached);
+
+	return cached;
+}
+
+static void
+cache_remove_device (LibHalContext *ctx, const char *udi)
+{
+	LibHalCachedDevice *cached;
+
+	HASH_FIND_STR (ctx->cache, udi, cached);
+	if (cached != NULL)
+		cache_free_device (ctx, cached);
+}
+
+/* Forget the value of a property; the device is fetched again the next
+ * time the property is asked for. If @removed is TRUE we know the property
+ * no longer exists and the set stays authoritative. */
+static void
+cache_invalidate_property (LibHalContext *ctx, const char *udi, const char *key, dbus_bool_t removed)
+{
+	LibHalCachedDevice *cached;
+	LibHalProperty *p;
+
+	HASH_FIND_STR (ctx->cache, udi, cached);
+	if (cached == NULL || cached->properties == NULL)
+		return;
+
+	HASH_FIND_STR (cached->properties->properties, key, p);
+	if (p != NULL) {
+		HASH_DELETE (hh, cached->properties->properties, p);
+		property_free (p);
+	}
+
+	if (!removed)
+		cached->is_partial = TRUE;
+}
+
+/* Forget all properties of a device, e.g. after it was merged into */
+static void
+cache_invalidate_device (LibHalContext *ctx, const char *udi)
+{
+	LibHalCachedDevice *cached;
+
+	HASH_FIND_STR (ctx->cache, udi, cached);
+	if (cached == NULL || cached->properties == NULL)
+		return;
+
+	libhal_free_property_set (cached->properties);
+	cached->properties = NULL;
+	cached->is_partial = FALSE;
+}
+
+/*
+ * Get a device from the cache, fetching its properties from hald if we
+ * don't have them or if @key (all properties if @key is NULL) may be out
+ * of date. Returns NULL if the cache is not in use or the device could
+ * not be fetched; the caller should then ask hald directly so errors are
+ * reported as usual.
+ */
+static LibHalCachedDevice *
+cache_get_device (LibHalContext *ctx, const char *udi, const char *key)
+{
+	LibHalCachedDevice *cached;
+	LibHalPropertySet *properties;
+
+	if (!cache_is_active (ctx))
+		return NULL;
+
+	HASH_FIND_STR (ctx->cache, udi, cached);
+	if (cached == NULL && ctx->cache_is_complete)
+		return NULL;
+
+	if (cached != NULL && cached->properties != NULL) {
+		if (!cached->is_partial)
+			return cached;
+		if (key != NULL && property_set_lookup (cached->properties, key) != NULL)
+			return cached;
+	}
+
+	properties = get_all_properties_from_hald (ctx, udi, NULL);
+	if (properties == NULL)
+		return NULL;
+
+	if (cached == NULL) {
+		cached = cache_add_device (ctx, udi);
+		if (cached == NULL) {
+			libhal_free_property_set (properties);
+			return NULL;
+		}
+	}
+
+	if (cached->properties != NULL)
+		libhal_free_property_set (cached->properties);
+	cached->properties = properties;
+	cached->is_partial = FALSE;
+
+	return cached;
+}
+
+/* Get a property from the cache; NULL if the caller should ask hald */
+static LibHalProperty *
+cache_get_property (LibHalContext *ctx, const char *udi, const char *key)
+{
+	LibHalCachedDevice *cached;
+	LibHalProperty *p;
+
+	cached = cache_get_device (ctx, udi, key);
+	if (cached == NULL)
+		return NULL;
+
+	HASH_FIND_STR (cached->properties->properties, key, p);
+	return p;
+}
+
+/* Replace the cache with every device in the GDL */
+static dbus_bool_t
+cache_fill (LibHalContext *ctx)
+{
+	int num_devices;
+	char **udis;
+	LibHalPropertySet **properties;
+	LibHalCachedDevice *cached;
+	int i;
+
+	if (!get_all_devices_with_properties_from_hald (ctx, &num_devices, &udis, &properties, NULL))
+		return FALSE;
+
+	cache_flush (ctx);
+
+	for (i = 0; i < num_devices; i++) {
+		cached = cache_add_device (ctx, udis[i]);
+		if (cached == NULL) {
+			for (; i < num_devices; i++)
+				libhal_free_property_set (properties[i]);
+			libhal_free_string_array (udis);
+			free (properties);
+			cache_flush (ctx);
+			return FALSE;
+		}
+		cached->properties = properties[i];
+	}
+
+	libhal_free_string_array (udis);
+	free (properties);
+
+	ctx->cache_is_complete = TRUE;
+	return TRUE;
+}
+
+static char **
+cache_get_udis (LibHalContext *ctx, int *num_devices)
+{
+	LibHalCachedDevice *cached;
+	char **udis;
+	int n;
+
+	udis = malloc (sizeof (char *) * (HASH_COUNT (ctx->cache) + 1));
+	if (udis == NULL)
+		goto oom;
+
+	n = 0;
+	for (cached = ctx->cache; cached != NULL; cached = cached->hh.next) {
+		udis[n] = strdup (cached->udi);
+		if (udis[n] == NULL) {
+			libhal_free_string_array (udis);
+			goto oom;
+		}
+		n++;
+	}
+	udis[n] = NULL;
+
+	*num_devices = n;
+	return udis;
+
+oom:
+	fprintf (stderr, "%s %d : error allocating memory\n", __FILE__, __LINE__);
+	return NULL;
+}
+
+static dbus_bool_t
+cache_subscribe (LibHalContext *ctx, DBusError *error)
+{
+	DBusError _error;
+
+	if (ctx->cache_is_watching)
+		return TRUE;
+
+	dbus_error_init (&_error);
+	dbus_bus_add_match (ctx->connection, LIBHAL_CACHE_MATCH_RULE, &_error);
+	if (dbus_error_is_set (&_error)) {
+		dbus_move_error (&_error, error);
+		return FALSE;
+	}
+
+	ctx->cache_is_watching = TRUE;
+	return TRUE;
+}
+
+static void
+cache_unsubscribe (LibHalContext *ctx)
+{
+	if (ctx->cache_is_watching) {
+		/* the reply is not interesting; don't block on it */
+		dbus_bus_remove_match (ctx->connection, LIBHAL_CACHE_MATCH_RULE, NULL);
+		ctx->cache_is_watching = FALSE;
+	}
+
+	cache_flush (ctx);
+}
+
 static DBusHandlerResult
 singleton_device_changed (LibHalContext *ctx, DBusConnection *connection, DBusMessage *msg, dbus_bool_t added)
 {
@@ -1054,6 +1465,8 @@ filter_func (DBusConnection * connection,
 		if (dbus_message_get_args (message, &error,
 					   DBUS_TYPE_STRING, &udi,
 					   DBUS_TYPE_INVALID)) {
+			if (ctx->cache_is_complete)
+				cache_add_device (ctx, udi);
 			if (ctx->device_added != NULL) {
 				ctx->device_added (ctx, udi);
 			}
@@ -1066,6 +1479,7 @@ filter_func (DBusConnection * connection,
 		if (dbus_message_get_args (message, &error,
 					   DBUS_TYPE_STRING, &udi,
 					   DBUS_TYPE_INVALID)) {
+			cache_remove_device (ctx, udi);
 			if (ctx->device_removed != NULL) {
 				ctx->device_removed (ctx, udi);
 			}
@@ -1166,7 +1580,7 @@ filter_func (DBusConnection * connection,
 		}
 		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 	} else if (dbus_message_is_signal (message, "org.freedesktop.Hal.Device", "PropertyModified")) {
-		if (ctx->device_property_modified != NULL) {
+		if (ctx->device_property_modified != NULL || ctx->cache != NULL) {
 			int i;
 			char *key;
 			dbus_bool_t removed;
@@ -1191,11 +1605,14 @@ filter_func (DBusConnection * connection,
 				dbus_message_iter_get_basic (&iter_struct, &removed);
 				dbus_message_iter_next (&iter_struct);
 				dbus_message_iter_get_basic (&iter_struct, &added);
-				
-				ctx->device_property_modified (ctx, 
-							       object_path,
-							       key, removed,
-							       added);
+
+				cache_invalidate_property (ctx, object_path, key, removed);
+
+				if (ctx->device_property_modified != NULL)
+					ctx->device_property_modified (ctx, 
+								       object_path,
+								       key, removed,
+								       added);
 				
 				dbus_message_iter_next (&iter_array);
 			}
@@ -1244,6 +1661,11 @@ libhal_get_all_devices (LibHalContext *ctx, int *num_devices, DBusError *error)
 
 	*num_devices = 0;
 
+	/* enumerating the GDL is usually followed by looking at the
+	 * devices so fill the whole cache in a single round trip */
+	if (cache_is_active (ctx) && (ctx->cache_is_complete || cache_fill (ctx)))
+		return cache_get_udis (ctx, num_devices);
+
 	message = dbus_message_new_method_call ("org.freedesktop.Hal",
 						"/org/freedesktop/Hal/Manager",
 						"org.freedesktop.Hal.Manager",
@@ -1303,11 +1725,16 @@ libhal_device_get_property_type (LibHalContext *ctx, const char *udi, const char
 	DBusMessageIter iter, reply_iter;
 	LibHalPropertyType type;
 	DBusError _error;
+	LibHalProperty *p;
 
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, LIBHAL_PROPERTY_TYPE_INVALID); /* or return NULL? */
 	LIBHAL_CHECK_UDI_VALID(udi, LIBHAL_PROPERTY_TYPE_INVALID);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", LIBHAL_PROPERTY_TYPE_INVALID);
 
+	p = cache_get_property (ctx, udi, key);
+	if (p != NULL)
+		return p->type;
+
 	message = dbus_message_new_method_call ("org.freedesktop.Hal", udi,
 						"org.freedesktop.Hal.Device",
 						"GetPropertyType");
@@ -1363,11 +1790,23 @@ libhal_device_get_property_strlist (LibHalContext *ctx, const char *udi, const c
 	DBusMessageIter iter, iter_array, reply_iter;
 	char **our_strings;
 	DBusError _error;
+	LibHalProperty *p;
 	
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, NULL);
 	LIBHAL_CHECK_UDI_VALID(udi, NULL);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", NULL);
 
+	p = cache_get_property (ctx, udi, key);
+	if (p != NULL && p->type == LIBHAL_PROPERTY_TYPE_STRLIST &&
+	    p->v.strlist_value != NULL) {
+		our_strings = string_array_copy (p->v.strlist_value);
+		if (our_strings == NULL) {
+			fprintf (stderr, "%s %d : error allocating memory\n",
+				 __FILE__, __LINE__);
+		}
+		return our_strings;
+	}
+
 	message = dbus_message_new_method_call ("org.freedesktop.Hal", udi,
 						"org.freedesktop.Hal.Device",
 						"GetPropertyStringList");
@@ -1435,11 +1874,22 @@ libhal_device_get_property_string (LibHalContext *ctx,
 	char *value;
 	char *dbus_str;
 	DBusError _error;
+	LibHalProperty *p;
 
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, NULL);
 	LIBHAL_CHECK_UDI_VALID(udi, NULL);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", NULL);
 
+	p = cache_get_property (ctx, udi, key);
+	if (p != NULL && p->type == LIBHAL_PROPERTY_TYPE_STRING) {
+		value = strdup (p->v.str_value);
+		if (value == NULL) {
+			fprintf (stderr, "%s %d : error allocating memory\n",
+				 __FILE__, __LINE__);
+		}
+		return value;
+	}
+
 	message = dbus_message_new_method_call ("org.freedesktop.Hal", udi,
 						"org.freedesktop.Hal.Device",
 						"GetPropertyString");
@@ -1509,11 +1959,16 @@ libhal_device_get_property_int (LibHalContext *ctx,
 	DBusMessageIter iter, reply_iter;
 	dbus_int32_t value;
 	DBusError _error;
+	LibHalProperty *p;
 
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, -1);
 	LIBHAL_CHECK_UDI_VALID(udi, -1);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", -1);
 
+	p = cache_get_property (ctx, udi, key);
+	if (p != NULL && p->type == LIBHAL_PROPERTY_TYPE_INT32)
+		return p->v.int_value;
+
 	message = dbus_message_new_method_call ("org.freedesktop.Hal", udi,
 						"org.freedesktop.Hal.Device",
 						"GetPropertyInteger");
@@ -1580,11 +2035,16 @@ libhal_device_get_property_uint64 (LibHalContext *ctx,
 	DBusMessageIter iter, reply_iter;
 	dbus_uint64_t value;
 	DBusError _error;
+	LibHalProperty *p;
 
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, -1);
 	LIBHAL_CHECK_UDI_VALID(udi, -1);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", -1);
 
+	p = cache_get_property (ctx, udi, key);
+	if (p != NULL && p->type == LIBHAL_PROPERTY_TYPE_UINT64)
+		return p->v.uint64_value;
+
 	message = dbus_message_new_method_call ("org.freedesktop.Hal", udi,
 						"org.freedesktop.Hal.Device",
 						"GetPropertyInteger");
@@ -1650,11 +2110,16 @@ libhal_device_get_property_double (LibHalContext *ctx,
 	DBusMessageIter iter, reply_iter;
 	double value;
 	DBusError _error;
+	LibHalProperty *p;
 
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, -1.0);
 	LIBHAL_CHECK_UDI_VALID(udi, -1.0);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", -1.0);
 
+	p = cache_get_property (ctx, udi, key);
+	if (p != NULL && p->type == LIBHAL_PROPERTY_TYPE_DOUBLE)
+		return p->v.double_value;
+
 	message = dbus_message_new_method_call ("org.freedesktop.Hal", udi,
 						"org.freedesktop.Hal.Device",
 						"GetPropertyDouble");
@@ -1720,11 +2185,16 @@ libhal_device_get_property_bool (LibHalContext *ctx,
 	DBusMessageIter iter, reply_iter;
 	dbus_bool_t value;
 	DBusError _error;
+	LibHalProperty *p;
 
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(udi, FALSE);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", FALSE);
 
+	p = cache_get_property (ctx, udi, key);
+	if (p != NULL && p->type == LIBHAL_PROPERTY_TYPE_BOOLEAN)
+		return p->v.bool_value;
+
 	message = dbus_message_new_method_call ("org.freedesktop.Hal", udi,
 						"org.freedesktop.Hal.Device",
 						"GetPropertyBoolean");
@@ -1854,6 +2324,8 @@ libhal_device_set_property_helper (LibHalContext *ctx,
 
 	dbus_message_unref (message);
 
+	cache_invalidate_property (ctx, udi, key, FALSE);
+
 	if (error != NULL && dbus_error_is_set (error)) {
 		return FALSE;
 	}
@@ -2074,6 +2546,8 @@ libhal_device_property_strlist_append (LibHalContext *ctx,
 
 	dbus_message_unref (message);
 
+	cache_invalidate_property (ctx, udi, key, FALSE);
+
 	if (error != NULL && dbus_error_is_set (error)) {
 		return FALSE;
 	}
@@ -2133,6 +2607,8 @@ libhal_device_property_strlist_prepend (LibHalContext *ctx,
 
 	dbus_message_unref (message);
 
+	cache_invalidate_property (ctx, udi, key, FALSE);
+
 	if (error != NULL && dbus_error_is_set (error)) {
 		return FALSE;
 	}
@@ -2191,6 +2667,8 @@ libhal_device_property_strlist_remove_index (LibHalContext *ctx,
 
 	dbus_message_unref (message);
 
+	cache_invalidate_property (ctx, udi, key, FALSE);
+
 	if (error != NULL && dbus_error_is_set (error)) {
 		return FALSE;
 	}
@@ -2249,6 +2727,8 @@ libhal_device_property_strlist_remove (LibHalContext *ctx,
 
 	dbus_message_unref (message);
 
+	cache_invalidate_property (ctx, udi, key, FALSE);
+
 	if (error != NULL && dbus_error_is_set (error)) {
 		return FALSE;
 	}
@@ -2597,10 +3077,19 @@ libhal_device_exists (LibHalContext *ctx, const char *udi, DBusError *error)
 	DBusMessageIter iter, reply_iter;
 	dbus_bool_t value;
 	DBusError _error;
+	LibHalCachedDevice *cached;
 
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(udi, FALSE);
 
+	if (cache_is_active (ctx)) {
+		HASH_FIND_STR (ctx->cache, udi, cached);
+		if (cached != NULL)
+			return TRUE;
+		if (ctx->cache_is_complete)
+			return FALSE;
+	}
+
 	message = dbus_message_new_method_call ("org.freedesktop.Hal",
 						"/org/freedesktop/Hal/Manager",
 						"org.freedesktop.Hal.Manager",
@@ -2667,11 +3156,16 @@ libhal_device_property_exists (LibHalContext *ctx,
 	DBusMessageIter iter, reply_iter;
 	dbus_bool_t value;
 	DBusError _error;
+	LibHalCachedDevice *cached;
 
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 	LIBHAL_CHECK_UDI_VALID(udi, FALSE);
 	LIBHAL_CHECK_PARAM_VALID(key, "*key", FALSE);
 
+	cached = cache_get_device (ctx, udi, key);
+	if (cached != NULL)
+		return property_set_lookup (cached->properties, key) != NULL;
+
 	message = dbus_message_new_method_call ("org.freedesktop.Hal", udi,
 						"org.freedesktop.Hal.Device",
 						"PropertyExists");
@@ -2761,6 +3255,8 @@ libhal_merge_properties (LibHalContext *ctx,
 
 	dbus_message_unref (message);
 
+	cache_invalidate_device (ctx, target_udi);
+
 	if (error != NULL && dbus_error_is_set (error)) {
 		return FALSE;
 	}
@@ -3012,6 +3508,107 @@ libhal_manager_find_device_string_match (LibHalContext *ctx,
 }
 
 
+static char **
+libhal_manager_get_related_devices (LibHalContext *ctx, const char *method,
+				    const char *udi, int *num_devices, DBusError *error)
+{
+	DBusMessage *message;
+	DBusMessage *reply;
+	DBusMessageIter iter, iter_array, reply_iter;
+	char **hal_device_names;
+	DBusError _error;
+
+	message = dbus_message_new_method_call ("org.freedesktop.Hal",
+						"/org/freedesktop/Hal/Manager",
+						"org.freedesktop.Hal.Manager",
+						method);
+	if (message == NULL) {
+		fprintf (stderr,
+			 "%s %d : Couldn't allocate D-BUS message\n",
+			 __FILE__, __LINE__);
+		return NULL;
+	}
+
+	dbus_message_iter_init_append (message, &iter);
+	dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &udi);
+
+	dbus_error_init (&_error);
+	reply = dbus_connection_send_with_reply_and_block (ctx->connection,
+							   message, -1,
+							   &_error);
+
+	dbus_message_unref (message);
+
+	dbus_move_error (&_error, error);
+	if (error != NULL && dbus_error_is_set (error)) {
+		return NULL;
+	}
+	if (reply == NULL) {
+		return NULL;
+	}
+	/* now analyse reply */
+	dbus_message_iter_init (reply, &reply_iter);
+
+	if (dbus_message_iter_get_arg_type (&reply_iter) != DBUS_TYPE_ARRAY) {
+		fprintf (stderr, "%s %d : wrong reply from hald.  Expecting an array.\n", __FILE__, __LINE__);
+		dbus_message_unref (reply);
+		return NULL;
+	}
+
+	dbus_message_iter_recurse (&reply_iter, &iter_array);
+
+	hal_device_names = libhal_get_string_array_from_iter (&iter_array, num_devices);
+
+	dbus_message_unref (reply);
+	return hal_device_names;
+}
+
+/**
+ * libhal_manager_get_children:
+ * @ctx: the context for the connection to hald
+ * @udi: the Unique Device Id of the parent
+ * @num_devices: pointer to store number of devices
+ * @error: pointer to an initialized dbus error object for returning errors or NULL
+ *
+ * Get the devices whose info.parent is the given device. This is
+ * answered from an index in hald and is much cheaper than matching
+ * on info.parent.
+ *
+ * Returns: UDI of devices; free with libhal_free_string_array()
+ */
+char **
+libhal_manager_get_children (LibHalContext *ctx, const char *udi,
+			     int *num_devices, DBusError *error)
+{
+	LIBHAL_CHECK_LIBHALCONTEXT(ctx, NULL);
+	LIBHAL_CHECK_UDI_VALID(udi, NULL);
+
+	return libhal_manager_get_related_devices (ctx, "GetChildren", udi, num_devices, error);
+}
+
+/**
+ * libhal_manager_get_subtree:
+ * @ctx: the context for the connection to hald
+ * @udi: the Unique Device Id of the root of the subtree
+ * @num_devices: pointer to store number of devices
+ * @error: pointer to an initialized dbus error object for returning errors or NULL
+ *
+ * Get the given device and all its descendants, parents before their
+ * children.
+ *
+ * Returns: UDI of devices; free with libhal_free_string_array()
+ */
+char **
+libhal_manager_get_subtree (LibHalContext *ctx, const char *udi,
+			    int *num_devices, DBusError *error)
+{
+	LIBHAL_CHECK_LIBHALCONTEXT(ctx, NULL);
+	LIBHAL_CHECK_UDI_VALID(udi, NULL);
+
+	return libhal_manager_get_related_devices (ctx, "GetSubtree", udi, num_devices, error);
+}
+
+
 /**
  * libhal_device_add_capability:
  * @ctx: the context for the connection to hald
@@ -3055,6 +3652,8 @@ libhal_device_add_capability (LibHalContext *ctx,
 
 	dbus_message_unref (message);
 
+	cache_invalidate_device (ctx, udi);
+
 	if (error != NULL && dbus_error_is_set (error)) {
 		return FALSE;
 	}
@@ -3314,8 +3913,13 @@ libhal_ctx_new (void)
  * @ctx: context to enable/disable cache for
  * @use_cache: whether or not to use cache
  *
- * Enable or disable caching. Note: Caching is not actually
- * implemented yet.
+ * Enable or disable caching. With the cache enabled, device properties
+ * are fetched from hald in bulk the first time they are needed and
+ * subsequent queries are answered locally. The cache is kept up to date
+ * using the DeviceAdded, DeviceRemoved and PropertyModified signals so the
+ * application must dispatch messages on the connection, just as it must
+ * for callbacks to be invoked. Caching is not available for direct
+ * connections to hald.
  *
  * Returns: TRUE if cache was successfully enabled/disabled, FALSE otherwise
  */
@@ -3324,6 +3928,13 @@ libhal_ctx_set_cache (LibHalContext *ctx, dbus_bool_t use_cache)
 {
 	LIBHAL_CHECK_LIBHALCONTEXT(ctx, FALSE);
 
+	if (!use_cache) {
+		cache_unsubscribe (ctx);
+	} else if (ctx->is_initialized && !ctx->is_direct) {
+		if (!cache_subscribe (ctx, NULL))
+			return FALSE;
+	}
+
 	ctx->cache_enabled = use_cache;
 	return TRUE;
 }
@@ -3411,6 +4022,11 @@ libhal_ctx_init (LibHalContext *ctx, DBusError *error)
 	if (error != NULL && dbus_error_is_set (error)) {
 		return FALSE;
 	}
+
+	/* without the signals the cache would go stale; just don't use it */
+	if (ctx->cache_enabled)
+		cache_subscribe (ctx, NULL);
+
 	ctx->is_initialized = TRUE;
 	ctx->is_direct = FALSE;
 
@@ -3500,6 +4116,8 @@ libhal_ctx_shutdown (LibHalContext *ctx, DBusError *error)
 
 		/* TODO: remove other matches */
 
+		cache_unsubscribe (ctx);
+
 		dbus_connection_remove_filter (ctx->connection, filter_func, ctx);
 	}
 
@@ -3519,6 +4137,8 @@ libhal_ctx_shutdown (LibHalContext *ctx, DBusError *error)
 dbus_bool_t    
 libhal_ctx_free (LibHalContext *ctx)
 {
+	if (ctx != NULL)
+		cache_flush (ctx);
 	free (ctx);
 	return TRUE;
 }
@@ -4041,6 +4661,8 @@ libhal_device_claim_interface (LibHalContext *ctx,
 
 	dbus_message_unref (message);
 
+	cache_invalidate_device (ctx, udi);
+
 	if (error != NULL && dbus_error_is_set (error)) {
 		return FALSE;
 	}
@@ -4506,6 +5128,9 @@ libhal_device_commit_changeset (LibHalContext *ctx, LibHalChangeSet *changeset,
 
 	dbus_message_unref (message);
 
+	for (elem = changeset->head; elem != NULL; elem = elem->next)
+		cache_invalidate_property (ctx, changeset->udi, elem->key, FALSE);
+
 	dbus_move_error (&_error, error);
 	if (error != NULL && dbus_error_is_set (error)) {
 		fprintf (stderr,
@@ -5092,6 +5717,59 @@ dbus_bool_t libhal_get_all_devices_with_properties (LibHalContext       *ctx,
                                                     LibHalPropertySet ***out_properties, 
                                                     DBusError           *error)
 {
+	LibHalCachedDevice *cached;
+	char **udi_array;
+	LibHalPropertySet **prop_array;
+	int count;
+
+	LIBHAL_CHECK_LIBHALCONTEXT (ctx, FALSE);
+	LIBHAL_CHECK_PARAM_VALID (out_num_devices, "*out_num_devices",FALSE);
+	LIBHAL_CHECK_PARAM_VALID (out_udi, "***out_udi", FALSE);
+	LIBHAL_CHECK_PARAM_VALID (out_properties, "***out_properties", FALSE);
+
+	if (!cache_is_active (ctx) || !(ctx->cache_is_complete || cache_fill (ctx)))
+		return get_all_devices_with_properties_from_hald (ctx, out_num_devices, out_udi,
+								  out_properties, error);
+
+	udi_array = cache_get_udis (ctx, &count);
+	if (udi_array == NULL)
+		return FALSE;
+
+	prop_array = (LibHalPropertySet **) calloc (count + 1, sizeof (LibHalPropertySet *));
+	if (prop_array == NULL) {
+		libhal_free_string_array (udi_array);
+		return FALSE;
+	}
+
+	for (count = 0; udi_array[count] != NULL; count++) {
+		cached = cache_get_device (ctx, udi_array[count], NULL);
+		if (cached != NULL)
+			prop_array[count] = property_set_copy (cached->properties);
+		if (prop_array[count] == NULL) {
+			/* device went away under us; let hald sort it out */
+			for (count = 0; prop_array[count] != NULL; count++)
+				libhal_free_property_set (prop_array[count]);
+			free (prop_array);
+			libhal_free_string_array (udi_array);
+			return get_all_devices_with_properties_from_hald (ctx, out_num_devices, out_udi,
+									  out_properties, error);
+		}
+	}
+
+	*out_num_devices = count;
+	*out_udi = udi_array;
+	*out_properties = prop_array;
+
+	return TRUE;
+}
+
+static dbus_bool_t
+get_all_devices_with_properties_from_hald (LibHalContext       *ctx,
+                                           int                 *out_num_devices,
+                                           char              ***out_udi,
+                                           LibHalPropertySet ***out_properties,
+                                           DBusError           *error)
+{
 
 	DBusMessage *message;
 	DBusMessage *reply;
@@ -5229,3 +5907,338 @@ fail:
 
         return FALSE;
 }
+
+/* Number of devices we ask hald for per GetDevicesWithPropertiesFiltered call */
+#define LIBHAL_FILTERED_CHUNK_SIZE 64
+
+/**
+ * libhal_get_devices_with_properties_filtered:
+ * @ctx: the context for the connection to hald
+ * @capability: only return devices with this capability, or NULL for any
+ * @key: only return devices where this string property ...
+ * @value: ... has this value; NULL for any device
+ * @wanted_keys: NULL terminated array of the properties to return, or NULL for all
+ * @out_num_devices: Return location for number of devices
+ * @out_udi: Return location for array of of udi's. Caller should free this with libhal_free_string_array() when done with it.
+ * @out_properties: Return location for array of #LibHalPropertySet objects. Caller should free each one of them with libhal_free_property_set() when done with it
+ * @error: Return location for error
+ *
+ * Like libhal_get_all_devices_with_properties() but hald only sends the
+ * devices and properties asked for. The devices are fetched in chunks,
+ * ordered by UDI, so hald is not blocked while a huge reply is built.
+ *
+ * Returns: %TRUE if success; %FALSE and @error will be set.
+ **/
+dbus_bool_t
+libhal_get_devices_with_properties_filtered (LibHalContext       *ctx,
+                                             const char          *capability,
+                                             const char          *key,
+                                             const char          *value,
+                                             const char         **wanted_keys,
+                                             int                 *out_num_devices,
+                                             char              ***out_udi,
+                                             LibHalPropertySet ***out_properties,
+                                             DBusError           *error)
+{
+	DBusMessage *message;
+	DBusMessage *reply;
+	DBusMessageIter iter, iter_keys, iter_array, reply_iter;
+	DBusError _error;
+	char **udi_array;
+	char **_udi_array;
+	LibHalPropertySet **prop_array;
+	LibHalPropertySet **_prop_array;
+	char *cursor;
+	const char *str;
+	dbus_uint32_t chunk_size;
+	int count;
+	int size;
+	int n;
+
+	LIBHAL_CHECK_LIBHALCONTEXT (ctx, FALSE);
+	LIBHAL_CHECK_PARAM_VALID (out_num_devices, "*out_num_devices",FALSE);
+	LIBHAL_CHECK_PARAM_VALID (out_udi, "***out_udi", FALSE);
+	LIBHAL_CHECK_PARAM_VALID (out_properties, "***out_properties", FALSE);
+
+	*out_num_devices = 0;
+	*out_udi = NULL;
+	*out_properties = NULL;
+
+	if (capability == NULL)
+		capability = "";
+	if (key == NULL || value == NULL) {
+		key = "";
+		value = "";
+	}
+
+	count = 0;
+	size = 0;
+	udi_array = NULL;
+	prop_array = NULL;
+	cursor = NULL;
+	chunk_size = LIBHAL_FILTERED_CHUNK_SIZE;
+
+	do {
+		message = dbus_message_new_method_call ("org.freedesktop.Hal",
+							"/org/freedesktop/Hal/Manager",
+							"org.freedesktop.Hal.Manager",
+							"GetDevicesWithPropertiesFiltered");
+		if (message == NULL) {
+			fprintf (stderr, "%s %d : Could not allocate D-BUS message\n", __FILE__, __LINE__);
+			goto fail;
+		}
+
+		str = cursor != NULL ? cursor : "";
+		dbus_message_iter_init_append (message, &iter);
+		dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &capability);
+		dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &key);
+		dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &value);
+		dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, DBUS_TYPE_STRING_AS_STRING, &iter_keys);
+		for (n = 0; wanted_keys != NULL && wanted_keys[n] != NULL; n++)
+			dbus_message_iter_append_basic (&iter_keys, DBUS_TYPE_STRING, &wanted_keys[n]);
+		dbus_message_iter_close_container (&iter, &iter_keys);
+		dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &str);
+		dbus_message_iter_append_basic (&iter, DBUS_TYPE_UINT32, &chunk_size);
+
+		dbus_error_init (&_error);
+		reply = dbus_connection_send_with_reply_and_block (ctx->connection, message, -1, &_error);
+		dbus_message_unref (message);
+
+		dbus_move_error (&_error, error);
+		if (error != NULL && dbus_error_is_set (error)) {
+			if (reply != NULL)
+				dbus_message_unref (reply);
+			goto fail;
+		}
+		if (reply == NULL)
+			goto fail;
+
+		/* now analyze reply */
+		dbus_message_iter_init (reply, &reply_iter);
+		if (dbus_message_iter_get_arg_type (&reply_iter) != DBUS_TYPE_ARRAY) {
+			fprintf (stderr, "%s %d : wrong reply from hald.  Expecting an array.\n", __FILE__, __LINE__);
+			dbus_message_unref (reply);
+			goto fail;
+		}
+
+		dbus_message_iter_recurse (&reply_iter, &iter_array);
+		while (dbus_message_iter_get_arg_type (&iter_array) == DBUS_TYPE_STRUCT) {
+			DBusMessageIter iter_struct;
+
+			/* room for this one and the terminating NULL */
+			if (count + 1 >= size) {
+				size = size == 0 ? LIBHAL_FILTERED_CHUNK_SIZE : size * 2;
+				_udi_array = (char **) realloc (udi_array, sizeof (char *) * size);
+				if (_udi_array != NULL)
+					udi_array = _udi_array;
+				_prop_array = (LibHalPropertySet **) realloc (prop_array, sizeof (void *) * size);
+				if (_prop_array != NULL)
+					prop_array = _prop_array;
+				if (_udi_array == NULL || _prop_array == NULL) {
+					dbus_message_unref (reply);
+					goto fail;
+				}
+			}
+
+			dbus_message_iter_recurse (&iter_array, &iter_struct);
+			dbus_message_iter_get_basic (&iter_struct, &str);
+			dbus_message_iter_next (&iter_struct);
+
+			udi_array[count] = strdup (str);
+			if (udi_array[count] == NULL) {
+				dbus_message_unref (reply);
+				goto fail;
+			}
+			prop_array[count] = get_property_set (&iter_struct);
+			if (prop_array[count] == NULL) {
+				free (udi_array[count]);
+				dbus_message_unref (reply);
+				goto fail;
+			}
+			count++;
+
+			dbus_message_iter_next (&iter_array);
+		}
+
+		/* where to continue; empty when we got everything */
+		free (cursor);
+		cursor = NULL;
+		dbus_message_iter_next (&reply_iter);
+		if (dbus_message_iter_get_arg_type (&reply_iter) == DBUS_TYPE_STRING) {
+			dbus_message_iter_get_basic (&reply_iter, &str);
+			if (str[0] != '\0')
+				cursor = strdup (str);
+		}
+		dbus_message_unref (reply);
+	} while (cursor != NULL);
+
+	if (udi_array == NULL) {
+		udi_array = (char **) malloc (sizeof (char *));
+		prop_array = (LibHalPropertySet **) malloc (sizeof (void *));
+		if (udi_array == NULL || prop_array == NULL)
+			goto fail;
+	}
+	udi_array[count] = NULL;
+	prop_array[count] = NULL;
+
+	*out_num_devices = count;
+	*out_udi = udi_array;
+	*out_properties = prop_array;
+
+	return TRUE;
+
+fail:
+	free (cursor);
+	for (n = 0; n < count; n++) {
+		free (udi_array[n]);
+		libhal_free_property_set (prop_array[n]);
+	}
+	free (udi_array);
+	free (prop_array);
+
+	return FALSE;
+}
+
+/**
+ * libhal_devices_get_properties:
+ * @ctx: the context for the connection to hald
+ * @udis: NULL terminated array of device UDIs
+ * @keys: NULL terminated array of the properties wanted, or NULL for all of them
+ * @out_properties: Return location for an array with a #LibHalPropertySet for
+ * each UDI in @udis, in the same order; the set is NULL if the device does not
+ * exist. Caller should free each set with libhal_free_property_set() and the
+ * array with free() when done with it
+ * @error: pointer to an initialized dbus error object for returning errors or NULL
+ *
+ * Get properties of many devices with a single request to hald rather
+ * than one per device and property. A set may lack some of @keys if the
+ * device doesn't have them, or hold more than @keys if they were at hand.
+ *
+ * Returns: %TRUE if success; %FALSE and @error will be set.
+ **/
+dbus_bool_t
+libhal_devices_get_properties (LibHalContext       *ctx,
+                               const char         **udis,
+                               const char         **keys,
+                               LibHalPropertySet ***out_properties,
+                               DBusError           *error)
+{
+	DBusMessage *message;
+	DBusMessage *reply;
+	DBusMessageIter iter, iter_strings, iter_array, reply_iter;
+	DBusError _error;
+	LibHalCachedDevice *cached;
+	LibHalPropertySet **prop_array;
+	const char *udi;
+	int num_udis;
+	int n;
+
+	LIBHAL_CHECK_LIBHALCONTEXT (ctx, FALSE);
+	LIBHAL_CHECK_PARAM_VALID (udis, "*udis", FALSE);
+	LIBHAL_CHECK_PARAM_VALID (out_properties, "***out_properties", FALSE);
+
+	*out_properties = NULL;
+
+	for (num_udis = 0; udis[num_udis] != NULL; num_udis++)
+		;
+
+	prop_array = (LibHalPropertySet **) calloc (num_udis + 1, sizeof (LibHalPropertySet *));
+	if (prop_array == NULL)
+		return FALSE;
+
+	/* no need to ask hald if we have all of them */
+	if (cache_is_active (ctx)) {
+		for (n = 0; n < num_udis; n++) {
+			HASH_FIND_STR (ctx->cache, udis[n], cached);
+			if (cached == NULL || cached->properties == NULL || cached->is_partial)
+				break;
+		}
+		if (n == num_udis) {
+			for (n = 0; n < num_udis; n++) {
+				HASH_FIND_STR (ctx->cache, udis[n], cached);
+				prop_array[n] = property_set_copy (cached->properties);
+				if (prop_array[n] == NULL)
+					goto fail;
+			}
+			*out_properties = prop_array;
+			return TRUE;
+		}
+	}
+
+	message = dbus_message_new_method_call ("org.freedesktop.Hal",
+						"/org/freedesktop/Hal/Manager",
+						"org.freedesktop.Hal.Manager",
+						"GetDevicesProperties");
+	if (message == NULL) {
+		fprintf (stderr, "%s %d : Could not allocate D-BUS message\n", __FILE__, __LINE__);
+		goto fail;
+	}
+
+	dbus_message_iter_init_append (message, &iter);
+	dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, DBUS_TYPE_STRING_AS_STRING, &iter_strings);
+	for (n = 0; n < num_udis; n++)
+		dbus_message_iter_append_basic (&iter_strings, DBUS_TYPE_STRING, &udis[n]);
+	dbus_message_iter_close_container (&iter, &iter_strings);
+	dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, DBUS_TYPE_STRING_AS_STRING, &iter_strings);
+	for (n = 0; keys != NULL && keys[n] != NULL; n++)
+		dbus_message_iter_append_basic (&iter_strings, DBUS_TYPE_STRING, &keys[n]);
+	dbus_message_iter_close_container (&iter, &iter_strings);
+
+	dbus_error_init (&_error);
+	reply = dbus_connection_send_with_reply_and_block (ctx->connection, message, -1, &_error);
+	dbus_message_unref (message);
+
+	dbus_move_error (&_error, error);
+	if (error != NULL && dbus_error_is_set (error)) {
+		if (reply != NULL)
+			dbus_message_unref (reply);
+		goto fail;
+	}
+	if (reply == NULL)
+		goto fail;
+
+	/* now analyze reply */
+	dbus_message_iter_init (reply, &reply_iter);
+	if (dbus_message_iter_get_arg_type (&reply_iter) != DBUS_TYPE_ARRAY) {
+		fprintf (stderr, "%s %d : wrong reply from hald.  Expecting an array.\n", __FILE__, __LINE__);
+		dbus_message_unref (reply);
+		goto fail;
+	}
+
+	/* the reply is in the order we asked, minus devices that are gone */
+	n = 0;
+	dbus_message_iter_recurse (&reply_iter, &iter_array);
+	while (dbus_message_iter_get_arg_type (&iter_array) == DBUS_TYPE_STRUCT) {
+		DBusMessageIter iter_struct;
+
+		dbus_message_iter_recurse (&iter_array, &iter_struct);
+		dbus_message_iter_get_basic (&iter_struct, &udi);
+		dbus_message_iter_next (&iter_struct);
+
+		while (n < num_udis && strcmp (udis[n], udi) != 0)
+			n++;
+		if (n == num_udis)
+			break;
+
+		prop_array[n] = get_property_set (&iter_struct);
+		if (prop_array[n] == NULL) {
+			dbus_message_unref (reply);
+			goto fail;
+		}
+		n++;
+
+		dbus_message_iter_next (&iter_array);
+	}
+	dbus_message_unref (reply);
+
+	*out_properties = prop_array;
+
+	return TRUE;
+
+fail:
+	for (n = 0; n < num_udis; n++)
+		libhal_free_property_set (prop_array[n]);
+	free (prop_array);
+
+	return FALSE;
+}
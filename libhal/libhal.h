@@ -525,6 +525,24 @@ dbus_bool_t libhal_get_all_devices_with_properties (LibHalContext       *ctx,
                                                     LibHalPropertySet ***out_properties, 
                                                     DBusError           *error);
 
+/* Get the devices matching a capability and/or property, with only the wanted properties */
+dbus_bool_t libhal_get_devices_with_properties_filtered (LibHalContext       *ctx,
+                                                         const char          *capability,
+                                                         const char          *key,
+                                                         const char          *value,
+                                                         const char         **wanted_keys,
+                                                         int                 *out_num_devices,
+                                                         char              ***out_udi,
+                                                         LibHalPropertySet ***out_properties,
+                                                         DBusError           *error);
+
+/* Get properties of many devices in one go */
+dbus_bool_t libhal_devices_get_properties (LibHalContext       *ctx,
+                                           const char         **udis,
+                                           const char         **keys,
+                                           LibHalPropertySet ***out_properties,
+                                           DBusError           *error);
+
 /* sort all properties according to property name */
 void libhal_property_set_sort (LibHalPropertySet *set);
 
@@ -659,6 +677,18 @@ char **libhal_manager_find_device_string_match (LibHalContext *ctx,
 						int *num_devices,
 						DBusError *error);
 
+/* Get the devices whose info.parent is the given device. */
+char **libhal_manager_get_children (LibHalContext *ctx,
+				    const char *udi,
+				    int *num_devices,
+				    DBusError *error);
+
+/* Get a device and all its descendants, parents first. */
+char **libhal_manager_get_subtree (LibHalContext *ctx,
+				   const char *udi,
+				   int *num_devices,
+				   DBusError *error);
+
 /* Assign a capability to a device. */
 dbus_bool_t libhal_device_add_capability (LibHalContext *ctx,
 					  const char *udi,
@@ -363,6 +363,128 @@ part_table_parse_bsd (int fd, guint64 offset, guint64 size)
 #endif
 
 
+/*
+ * All partition table parsers read through a small cache so they can ask
+ * for the few bytes they need without a round trip to the device for
+ * each. The device is read in aligned chunks, each at most once; the MBR,
+ * a GPT header with its entries and an Apple partition map all fit in
+ * the first chunk. EBRs are far apart, so the extended partition walk
+ * reads single sectors instead.
+ */
+#define DISK_CHUNK_SIZE (64 * 1024)
+#define DISK_SECTOR_SIZE 512
+
+typedef struct {
+	guint64 offset;
+	guint len;
+	guint8 *data;
+} DiskChunk;
+
+typedef struct {
+	int fd;
+	guint64 size;
+	guint chunk_size;	/* DISK_CHUNK_SIZE or DISK_SECTOR_SIZE */
+	GSList *chunks;
+	int num_reads;		/* for statistics */
+	guint64 bytes_read;
+} DiskReader;
+
+static DiskChunk *
+disk_read_chunk (DiskReader *disk, guint64 offset, guint size)
+{
+	DiskChunk *chunk;
+	ssize_t n;
+
+	chunk = g_malloc (sizeof (DiskChunk) + size);
+	chunk->offset = offset;
+	chunk->len = MIN (size, disk->size - offset);
+	chunk->data = (guint8 *) (chunk + 1);
+
+	/* short reads are fine, we just need what the parsers ask for */
+	do {
+		n = pread (disk->fd, chunk->data, chunk->len, offset);
+	} while (n < 0 && errno == EINTR);
+	disk->num_reads++;
+	if (n <= 0) {
+		HAL_INFO (("read of %u bytes at %" G_GUINT64_FORMAT " failed (%s)",
+			   chunk->len, offset, n < 0 ? strerror (errno) : "end of file"));
+		g_free (chunk);
+		return NULL;
+	}
+	chunk->len = n;
+	disk->bytes_read += n;
+
+	return chunk;
+}
+
+static DiskChunk *
+disk_get_chunk (DiskReader *disk, guint64 offset)
+{
+	GSList *l;
+	DiskChunk *chunk;
+
+	for (l = disk->chunks; l != NULL; l = l->next) {
+		chunk = l->data;
+		if (offset >= chunk->offset && offset - chunk->offset < chunk->len)
+			return chunk;
+	}
+
+	chunk = disk_read_chunk (disk, offset - offset % disk->chunk_size, disk->chunk_size);
+
+	/* An I/O error anywhere in the chunk, typically near the end of
+	 * failing or odd-sized media, must not fail reads of sectors that
+	 * are fine; retry just the sector we need. */
+	if (chunk == NULL || offset - chunk->offset >= chunk->len) {
+		g_free (chunk);
+		chunk = NULL;
+		if (disk->chunk_size > DISK_SECTOR_SIZE)
+			chunk = disk_read_chunk (disk, offset - offset % DISK_SECTOR_SIZE, DISK_SECTOR_SIZE);
+		if (chunk == NULL)
+			return NULL;
+	}
+
+	disk->chunks = g_slist_prepend (disk->chunks, chunk);
+	return chunk;
+}
+
+/* Like lseek()+read(), but served from the cache */
+static gboolean
+disk_read (DiskReader *disk, guint64 offset, void *buf, size_t len)
+{
+	guint8 *dest = buf;
+	DiskChunk *chunk;
+	guint64 pos;
+	size_t n;
+
+	if (offset >= disk->size || len > disk->size - offset) {
+		HAL_INFO (("read failed (beyond end of device)"));
+		return FALSE;
+	}
+
+	while (len > 0) {
+		chunk = disk_get_chunk (disk, offset);
+		if (chunk == NULL)
+			return FALSE;
+
+		pos = offset - chunk->offset;
+		n = MIN (len, chunk->len - pos);
+		memcpy (dest, chunk->data + pos, n);
+		dest += n;
+		offset += n;
+		len -= n;
+	}
+
+	return TRUE;
+}
+
+static void
+disk_free_chunks (DiskReader *disk)
+{
+	g_slist_foreach (disk->chunks, (GFunc) g_free, NULL);
+	g_slist_free (disk->chunks);
+	disk->chunks = NULL;
+}
+
 #define MSDOS_MAGIC			"\x55\xaa"
 #define MSDOS_PARTTABLE_OFFSET		0x1be
 #define MSDOS_SIG_OFF			0x1fe
@@ -412,7 +534,7 @@ hexdump (const guint8 *mem, int size)
 #endif
 
 static PartitionTable *
-part_table_parse_msdos_extended (int fd, guint64 offset, guint64 size)
+part_table_parse_msdos_extended (DiskReader *disk, guint64 offset, guint64 size)
 {
 	int n;
 	PartitionTable *p;
@@ -424,23 +546,20 @@ part_table_parse_msdos_extended (int fd, guint64 offset, guint64 size)
 
 	next = offset;
 
+	/* one sector per EBR; reading ahead would mostly fetch data */
+	disk->chunk_size = DISK_SECTOR_SIZE;
+
 	while (next != 0) {
 		guint64 readfrom;
-		const guint8 embr[512];
+		guint8 embr[512];
 
 		readfrom = next;
 		next = 0;
 
 		//HAL_INFO (("readfrom = %lld", readfrom));
 
-		if (lseek (fd, readfrom, SEEK_SET) < 0) {
-			HAL_INFO (("lseek failed (%s)", strerror (errno)));
-			goto out;
-		}
-		if (read (fd, &embr, sizeof (embr)) != sizeof (embr)) {
-			HAL_INFO (("read failed (%s)", strerror (errno)));
+		if (!disk_read (disk, readfrom, &embr, sizeof (embr)))
 			goto out;
-		}
 		
 		if (memcmp (&embr[MSDOS_SIG_OFF], MSDOS_MAGIC, 2) != 0) {
 			HAL_INFO (("No MSDOS_MAGIC found"));
@@ -498,15 +617,16 @@ part_table_parse_msdos_extended (int fd, guint64 offset, guint64 size)
 	}
 
 out:
+	disk->chunk_size = DISK_CHUNK_SIZE;
 	//HAL_INFO (("Exiting MS-DOS extended parser"));
 	return p;
 }
 
 static PartitionTable *
-part_table_parse_msdos (int fd, guint64 offset, guint64 size, gboolean *found_gpt)
+part_table_parse_msdos (DiskReader *disk, guint64 offset, guint64 size, gboolean *found_gpt)
 {
 	int n;
-	const guint8 mbr[512] __attribute__ ((aligned));
+	guint8 mbr[512] __attribute__ ((aligned));
 	PartitionTable *p;
 
 	//HAL_INFO (("Entering MS-DOS parser"));
@@ -515,14 +635,8 @@ part_table_parse_msdos (int fd, guint64 offset, guint64 size, gboolean *found_gp
 
 	p = NULL;
 
-	if (lseek (fd, offset, SEEK_SET) < 0) {
-		HAL_INFO (("lseek failed (%s)", strerror (errno)));
-		goto out;
-	}
-	if (read (fd, &mbr, sizeof (mbr)) != sizeof (mbr)) {
-		HAL_INFO (("read failed (%s)", strerror (errno)));
+	if (!disk_read (disk, offset, &mbr, sizeof (mbr)))
 		goto out;
-	}
 
 	if (memcmp (&mbr[MSDOS_SIG_OFF], MSDOS_MAGIC, 2) != 0) {
 		HAL_INFO (("No MSDOS_MAGIC found"));
@@ -574,7 +688,7 @@ part_table_parse_msdos (int fd, guint64 offset, guint64 size, gboolean *found_gp
 		case 0x05: /* MS-DOS */
 		case 0x0f: /* Win95 */
 		case 0x85: /* Linux */
-			e_part_table = part_table_parse_msdos_extended (fd, pstart, psize);
+			e_part_table = part_table_parse_msdos_extended (disk, pstart, psize);
 			if (e_part_table != NULL) {
 				pe = part_entry_new (e_part_table,
 						     &(mbr[MSDOS_PARTTABLE_OFFSET + n * 16]),
@@ -586,7 +700,7 @@ part_table_parse_msdos (int fd, guint64 offset, guint64 size, gboolean *found_gp
 		case 0xa5: /* FreeBSD */
 		case 0xa6: /* OpenBSD */
 		case 0xa9: /* NetBSD */
-			//e_part_table = part_table_parse_bsd (fd, pstart, psize);
+			//e_part_table = part_table_parse_bsd (disk, pstart, psize);
 			//break;
 
 		default:
@@ -615,7 +729,7 @@ out:
 #define GPT_PART_TYPE_GUID_EMPTY "00000000-0000-0000-0000-000000000000"
 
 static PartitionTable *
-part_table_parse_gpt (int fd, guint64 offset, guint64 size)
+part_table_parse_gpt (DiskReader *disk, guint64 offset, guint64 size)
 {
 	int n;
 	PartitionTable *p;
@@ -631,14 +745,8 @@ part_table_parse_gpt (int fd, guint64 offset, guint64 size)
 	p = NULL;
 
 	/* Check GPT signature */
-	if (lseek (fd, offset + 512 + 0, SEEK_SET) < 0) {
-		HAL_INFO (("lseek failed (%s)", strerror (errno)));
+	if (!disk_read (disk, offset + 512 + 0, buf, 8))
 		goto out;
-	}
-	if (read (fd, buf, 8) != 8) {
-		HAL_INFO (("read failed (%s)", strerror (errno)));
-		goto out;
-	}
 	if (memcmp (buf, GPT_MAGIC, 8) != 0) {
 		HAL_INFO (("No GPT_MAGIC found"));
 		goto out;
@@ -647,44 +755,20 @@ part_table_parse_gpt (int fd, guint64 offset, guint64 size)
 	HAL_INFO (("GPT magic found"));
 
 	/* Disk UUID */
-	if (lseek (fd, offset + 512 + 56, SEEK_SET) < 0) {
-		HAL_INFO (("lseek failed (%s)", strerror (errno)));
+	if (!disk_read (disk, offset + 512 + 56, buf, 16))
 		goto out;
-	}
-	if (read (fd, buf, 16) != 16) {
-		HAL_INFO (("read failed (%s)", strerror (errno)));
-		goto out;
-	}
 	//hexdump ((guint8*) buf, 16);
 
-	if (lseek (fd, offset + 512 + 72, SEEK_SET) < 0) {
-		HAL_INFO (("lseek failed (%s)", strerror (errno)));
+	if (!disk_read (disk, offset + 512 + 72, buf, 8))
 		goto out;
-	}
-	if (read (fd, buf, 8) != 8) {
-		HAL_INFO (("read failed (%s)", strerror (errno)));
-		goto out;
-	}
 	partition_entry_lba = get_le64 (buf);
 
-	if (lseek (fd, offset + 512 + 80, SEEK_SET) < 0) {
-		HAL_INFO (("lseek failed (%s)", strerror (errno)));
+	if (!disk_read (disk, offset + 512 + 80, buf, 4))
 		goto out;
-	}
-	if (read (fd, buf, 4) != 4) {
-		HAL_INFO (("read failed (%s)", strerror (errno)));
-		goto out;
-	}
 	num_entries = get_le32 (buf);
 
-	if (lseek (fd, offset + 512 + 84, SEEK_SET) < 0) {
-		HAL_INFO (("lseek failed (%s)", strerror (errno)));
+	if (!disk_read (disk, offset + 512 + 84, buf, 4))
 		goto out;
-	}
-	if (read (fd, buf, 4) != 4) {
-		HAL_INFO (("read failed (%s)", strerror (errno)));
-		goto out;
-	}
 	size_of_entry = get_le32(buf);
 
 
@@ -708,14 +792,8 @@ part_table_parse_gpt (int fd, guint64 offset, guint64 size)
 		} gpt_part_entry;
 		char *partition_type_guid;
 
-		if (lseek (fd, offset + partition_entry_lba * 512 + n * size_of_entry, SEEK_SET) < 0) {
-			HAL_INFO (("lseek failed (%s)", strerror (errno)));
+		if (!disk_read (disk, offset + partition_entry_lba * 512 + n * size_of_entry, &gpt_part_entry, 128))
 			goto out;
-		}
-		if (read (fd, &gpt_part_entry, 128) != 128) {
-			HAL_INFO (("read failed (%s)", strerror (errno)));
-			goto out;
-		}
 
 		partition_type_guid = get_le_guid (gpt_part_entry.partition_type_guid);
 
@@ -746,7 +824,7 @@ out:
 #define MAC_PART_MAGIC "PM"
 
 static PartitionTable *
-part_table_parse_apple (int fd, guint64 offset, guint64 size)
+part_table_parse_apple (DiskReader *disk, guint64 offset, guint64 size)
 {
 	int n;
 	PartitionTable *p;
@@ -785,14 +863,8 @@ part_table_parse_apple (int fd, guint64 offset, guint64 size)
 	p = NULL;
 
 	/* Check Mac start of disk signature */
-	if (lseek (fd, offset + 0, SEEK_SET) < 0) {
-		HAL_INFO (("lseek failed (%s)", strerror (errno)));
-		goto out;
-	}
-	if (read (fd, &mac_header, sizeof (mac_header)) != sizeof (mac_header)) {
-		HAL_INFO (("read failed (%s)", strerror (errno)));
+	if (!disk_read (disk, offset + 0, &mac_header, sizeof (mac_header)))
 		goto out;
-	}
 	if (memcmp (&(mac_header.signature), MAC_MAGIC, 2) != 0) {
 		HAL_INFO (("No MAC_MAGIC found"));
 		goto out;
@@ -807,14 +879,8 @@ part_table_parse_apple (int fd, guint64 offset, guint64 size)
 	p->size = size;
 
 	/* get number of entries from first entry   */
-	if (lseek (fd, offset + block_size, SEEK_SET) < 0) {
-		HAL_INFO (("lseek failed (%s)", strerror (errno)));
-		goto out;
-	}
-	if (read (fd, &mac_part, sizeof (mac_part)) != sizeof (mac_part)) {
-		HAL_INFO (("read failed (%s)", strerror (errno)));
+	if (!disk_read (disk, offset + block_size, &mac_part, sizeof (mac_part)))
 		goto out;
-	}
 	map_count = GUINT32_FROM_BE (mac_part.map_count); /* num blocks in part map */
 
 	HAL_INFO (("map_count = %d", map_count));
@@ -827,14 +893,8 @@ part_table_parse_apple (int fd, guint64 offset, guint64 size)
 			break;
 		}
 
-		if (lseek (fd, offset + (n + 1) * block_size, SEEK_SET) < 0) {
-			HAL_INFO (("lseek failed (%s)", strerror (errno)));
-			goto out;
-		}
-		if (read (fd, &mac_part, sizeof (mac_part)) != sizeof (mac_part)) {
-			HAL_INFO (("read failed (%s)", strerror (errno)));
+		if (!disk_read (disk, offset + (n + 1) * block_size, &mac_part, sizeof (mac_part)))
 			goto out;
-		}
 
 		pe = part_entry_new (NULL,
 				     (guint8*) &mac_part,
@@ -849,57 +909,400 @@ out:
 	return p;
 }
 
-PartitionTable *
-part_table_load_from_disk (char *device)
+/*
+ * hald-probe-storage reads the partition table of a disk and then
+ * hald-probe-volume is run for every partition, each of which needs its
+ * own entry of the very same table. So every time we read a table from
+ * disk we also save it to a small cache file named after the dev_t of the
+ * disk, and part_table_load_from_disk_cached() uses that if it was made
+ * for the same disk (dev_t, size and, if the kernel provides one, the disk
+ * sequence number that changes with the media).
+ *
+ * hald has the cache file of a disk removed when it sees a change uevent
+ * for it or the disk goes away, see hald/linux/blockdev.c. The probers
+ * trust what they read back, so only root may write to the directory;
+ * hald runs "hald-probe-storage --drop-partition-table-cache" for that.
+ */
+#define PART_TABLE_CACHE_MAGIC   0x43545048	/* "HPTC" */
+#define PART_TABLE_CACHE_VERSION 1
+
+typedef struct {
+	guint32 magic;
+	guint32 version;
+	guint64 devt;
+	guint64 size;
+	guint64 diskseq;
+} PartTableCacheHeader;
+
+typedef struct {
+	const guint8 *data;
+	gsize len;
+	gsize pos;
+} PartTableCacheReader;
+
+static void
+part_table_cache_get_key (int fd, guint64 size, PartTableCacheHeader *key)
+{
+	struct stat statbuf;
+	char path[256];
+	char *contents;
+
+	memset (key, 0, sizeof (PartTableCacheHeader));
+	key->magic = PART_TABLE_CACHE_MAGIC;
+	key->version = PART_TABLE_CACHE_VERSION;
+	key->size = size;
+
+	if (fstat (fd, &statbuf) != 0 || !S_ISBLK (statbuf.st_mode))
+		return;
+	key->devt = statbuf.st_rdev;
+
+	/* not available before Linux 5.15; dev_t and size have to do then */
+	snprintf (path, sizeof (path), "/sys/dev/block/%u:%u/diskseq",
+		  major (statbuf.st_rdev), minor (statbuf.st_rdev));
+	if (g_file_get_contents (path, &contents, NULL, NULL)) {
+		key->diskseq = g_ascii_strtoull (contents, NULL, 10);
+		g_free (contents);
+	}
+}
+
+static void
+part_table_cache_write_table (GByteArray *buf, PartitionTable *p)
+{
+	guint32 scheme;
+	guint32 num_entries;
+	GSList *i;
+
+	scheme = p->scheme;
+	num_entries = g_slist_length (p->entries);
+	g_byte_array_append (buf, (guint8 *) &scheme, sizeof (scheme));
+	g_byte_array_append (buf, (guint8 *) &p->offset, sizeof (p->offset));
+	g_byte_array_append (buf, (guint8 *) &p->size, sizeof (p->size));
+	g_byte_array_append (buf, (guint8 *) &num_entries, sizeof (num_entries));
+
+	for (i = p->entries; i != NULL; i = i->next) {
+		PartitionEntry *pe = i->data;
+		guint32 is_part_table;
+		guint32 length;
+
+		is_part_table = pe->is_part_table;
+		length = pe->length;
+		g_byte_array_append (buf, (guint8 *) &is_part_table, sizeof (is_part_table));
+		g_byte_array_append (buf, (guint8 *) &pe->offset, sizeof (pe->offset));
+		g_byte_array_append (buf, (guint8 *) &length, sizeof (length));
+		g_byte_array_append (buf, pe->data, length);
+		if (pe->is_part_table)
+			part_table_cache_write_table (buf, pe->part_table);
+	}
+}
+
+static gboolean
+part_table_cache_read (PartTableCacheReader *r, void *dest, gsize len)
 {
+	if (len > r->len - r->pos)
+		return FALSE;
+	memcpy (dest, r->data + r->pos, len);
+	r->pos += len;
+	return TRUE;
+}
+
+static PartitionTable *
+part_table_cache_read_table (PartTableCacheReader *r)
+{
+	PartitionTable *p;
+	guint32 scheme;
+	guint32 num_entries;
+	guint32 n;
+
+	if (!part_table_cache_read (r, &scheme, sizeof (scheme)))
+		return NULL;
+
+	p = part_table_new_empty ((PartitionScheme) scheme);
+	if (!part_table_cache_read (r, &p->offset, sizeof (p->offset)) ||
+	    !part_table_cache_read (r, &p->size, sizeof (p->size)) ||
+	    !part_table_cache_read (r, &num_entries, sizeof (num_entries)))
+		goto error;
+
+	for (n = 0; n < num_entries; n++) {
+		PartitionTable *e_part_table;
+		PartitionEntry *pe;
+		guint32 is_part_table;
+		guint32 length;
+		guint64 offset;
+
+		if (!part_table_cache_read (r, &is_part_table, sizeof (is_part_table)) ||
+		    !part_table_cache_read (r, &offset, sizeof (offset)) ||
+		    !part_table_cache_read (r, &length, sizeof (length)) ||
+		    length > r->len - r->pos)
+			goto error;
+
+		pe = part_entry_new (NULL, r->data + r->pos, length, offset);
+		r->pos += length;
+		p->entries = g_slist_prepend (p->entries, pe);
+
+		if (is_part_table) {
+			e_part_table = part_table_cache_read_table (r);
+			if (e_part_table == NULL)
+				goto error;
+			pe->is_part_table = TRUE;
+			pe->part_table = e_part_table;
+		}
+	}
+	p->entries = g_slist_reverse (p->entries);
+
+	return p;
+
+error:
+	p->entries = g_slist_reverse (p->entries);
+	part_table_free (p);
+	return NULL;
+}
+
+/* Open the cache directory; -1 if it's missing or anyone but root could
+ * have put things in it */
+static int
+part_table_cache_open_dir (void)
+{
+	struct stat statbuf;
+	int dirfd;
+
+	dirfd = open (PART_TABLE_CACHE_DIR, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (dirfd < 0)
+		return -1;
+
+	if (fstat (dirfd, &statbuf) != 0 || statbuf.st_uid != 0 ||
+	    (statbuf.st_mode & (S_IWGRP | S_IWOTH)) != 0) {
+		HAL_INFO (("Not using partition table cache, %s is not owned by root", PART_TABLE_CACHE_DIR));
+		close (dirfd);
+		return -1;
+	}
+
+	return dirfd;
+}
+
+static void
+part_table_cache_save (PartTableCacheHeader *key, PartitionTable *p)
+{
+	GByteArray *buf;
+	char *name;
+	char *tmp_name;
+	int dirfd;
 	int fd;
-	guint64 size;
+	gboolean written;
+
+	dirfd = part_table_cache_open_dir ();
+	if (dirfd < 0)
+		return;
+
+	name = g_strdup_printf ("%" G_GUINT64_FORMAT, key->devt);
+
+	/* nothing to reuse next time; don't leave an old table behind */
+	if (p == NULL) {
+		unlinkat (dirfd, name, 0);
+		g_free (name);
+		close (dirfd);
+		return;
+	}
+
+	buf = g_byte_array_new ();
+	g_byte_array_append (buf, (guint8 *) key, sizeof (PartTableCacheHeader));
+	part_table_cache_write_table (buf, p);
+
+	/* write to a temporary file and rename so readers never see half a
+	 * table; one left behind by a prober that died can only be ours */
+	tmp_name = g_strdup_printf ("%s.%d", name, getpid ());
+	unlinkat (dirfd, tmp_name, 0);
+	fd = openat (dirfd, tmp_name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0644);
+	if (fd < 0) {
+		HAL_INFO (("Cannot write partition table cache %s: %s", tmp_name, strerror (errno)));
+		goto out;
+	}
+	written = (write (fd, buf->data, buf->len) == (ssize_t) buf->len);
+	close (fd);
+
+	if (!written || renameat (dirfd, tmp_name, dirfd, name) != 0) {
+		HAL_INFO (("Cannot write partition table cache %s", name));
+		unlinkat (dirfd, tmp_name, 0);
+	}
+
+out:
+	g_free (tmp_name);
+	g_free (name);
+	g_byte_array_free (buf, TRUE);
+	close (dirfd);
+}
+
+/* cache files are a few KiB; anything much larger isn't one of ours */
+#define PART_TABLE_CACHE_MAX_SIZE (1024 * 1024)
+
+static PartitionTable *
+part_table_cache_load (PartTableCacheHeader *key)
+{
+	PartTableCacheReader r;
+	PartitionTable *p;
+	struct stat statbuf;
+	char *name;
+	guint8 *contents;
+	gsize len;
+	ssize_t n;
+	int dirfd;
+	int fd;
+
+	p = NULL;
+	contents = NULL;
+	fd = -1;
+
+	dirfd = part_table_cache_open_dir ();
+	if (dirfd < 0)
+		return NULL;
+
+	name = g_strdup_printf ("%" G_GUINT64_FORMAT, key->devt);
+	fd = openat (dirfd, name, O_RDONLY | O_NOFOLLOW);
+	if (fd < 0)
+		goto out;
+
+	if (fstat (fd, &statbuf) != 0 || !S_ISREG (statbuf.st_mode) || statbuf.st_uid != 0 ||
+	    statbuf.st_size > PART_TABLE_CACHE_MAX_SIZE) {
+		HAL_INFO (("Ignoring partition table cache %s", name));
+		goto out;
+	}
+
+	contents = g_malloc (statbuf.st_size + 1);
+	for (len = 0; len < (gsize) statbuf.st_size; len += n) {
+		n = read (fd, contents + len, statbuf.st_size - len);
+		if (n <= 0)
+			break;
+	}
+
+	if (len < sizeof (PartTableCacheHeader) ||
+	    memcmp (contents, key, sizeof (PartTableCacheHeader)) != 0) {
+		HAL_INFO (("Partition table cache %s is stale", name));
+		goto out;
+	}
+
+	r.data = contents;
+	r.len = len;
+	r.pos = sizeof (PartTableCacheHeader);
+	p = part_table_cache_read_table (&r);
+	if (p == NULL || r.pos != r.len) {
+		HAL_INFO (("Partition table cache %s is corrupt", name));
+		part_table_free (p);
+		p = NULL;
+	}
+
+out:
+	if (fd >= 0)
+		close (fd);
+	close (dirfd);
+	g_free (contents);
+	g_free (name);
+	return p;
+}
+
+gboolean
+part_table_cache_drop (guint64 devt)
+{
+	char *name;
+	int dirfd;
+	gboolean ret;
+
+	dirfd = part_table_cache_open_dir ();
+	if (dirfd < 0)
+		return FALSE;
+
+	name = g_strdup_printf ("%" G_GUINT64_FORMAT, devt);
+	ret = unlinkat (dirfd, name, 0) == 0 || errno == ENOENT;
+	if (!ret)
+		HAL_INFO (("Cannot remove partition table cache %s: %s", name, strerror (errno)));
+
+	g_free (name);
+	close (dirfd);
+	return ret;
+}
+
+static PartitionTable *
+part_table_load (char *device, gboolean use_cache)
+{
+	DiskReader disk;
+	PartTableCacheHeader key;
 	PartitionTable *p;
 	gboolean found_gpt;
 
 	p = NULL;
+	memset (&disk, 0, sizeof (disk));
+	disk.chunk_size = DISK_CHUNK_SIZE;
 
-	fd = open (device, O_RDONLY);
-	if (fd < 0) {
+	disk.fd = open (device, O_RDONLY);
+	if (disk.fd < 0) {
 		HAL_INFO (("Cannot open device %s", device));
 		goto out;
 	}
 
-	if (ioctl (fd, BLKGETSIZE64, &size) != 0) {
+	if (ioctl (disk.fd, BLKGETSIZE64, &disk.size) != 0) {
 		HAL_INFO (("Cannot determine size of device"));
 		goto out;
 	}
 
-	p = part_table_parse_msdos (fd, 0, size, &found_gpt);
+	part_table_cache_get_key (disk.fd, disk.size, &key);
+	if (key.devt == 0)
+		use_cache = FALSE;
+
+	if (use_cache) {
+		p = part_table_cache_load (&key);
+		if (p != NULL) {
+			HAL_INFO (("Using cached %s partition table",
+				   part_get_scheme_name (p->scheme)));
+			goto out;
+		}
+	}
+
+	p = part_table_parse_msdos (&disk, 0, disk.size, &found_gpt);
 	if (p != NULL) {
 		HAL_INFO (("MSDOS partition table detected"));
-		goto out;
+		goto save;
 	}
 
 	if (found_gpt) {
-		p = part_table_parse_gpt (fd, 0, size);
+		p = part_table_parse_gpt (&disk, 0, disk.size);
 		if (p != NULL) {
 			HAL_INFO (("EFI GPT partition table detected"));
-			goto out;
+			goto save;
 		}
 	}
 
-	p = part_table_parse_apple (fd, 0, size);
+	p = part_table_parse_apple (&disk, 0, disk.size);
 	if (p != NULL) {
 		HAL_INFO (("Apple partition table detected"));
-		goto out;
+		goto save;
 	}
 
 	HAL_INFO (("No known partition table found"));
 
+save:
+	if (key.devt != 0)
+		part_table_cache_save (&key, p);
 
 out:
-	if (fd >= 0)
-		close (fd);
+	HAL_INFO (("Read %d chunks (%" G_GUINT64_FORMAT " bytes) from %s",
+		   disk.num_reads, disk.bytes_read, device));
+	disk_free_chunks (&disk);
+	if (disk.fd >= 0)
+		close (disk.fd);
 
 	return p;
 }
 
+PartitionTable *
+part_table_load_from_disk (char *device)
+{
+	return part_table_load (device, FALSE);
+}
+
+PartitionTable *
+part_table_load_from_disk_cached (char *device)
+{
+	return part_table_load (device, TRUE);
+}
+
 
 
 PartitionScheme
@@ -53,6 +53,10 @@ const char           *part_get_scheme_name (PartitionScheme scheme);
 struct PartitionTable_s;
 typedef struct PartitionTable_s PartitionTable;
 
+/* Tables read by part_table_load_from_disk() are saved here, one file per
+ * disk named after its dev_t in decimal */
+#define PART_TABLE_CACHE_DIR HALD_SOCKET_DIR "/probe-cache"
+
 
 /**
  * part_table_load_from_disk:
@@ -64,6 +68,30 @@ typedef struct PartitionTable_s PartitionTable;
  */
 PartitionTable       *part_table_load_from_disk   (char *device);
 
+/**
+ * part_table_load_from_disk_cached:
+ * @device: name of device file for entire disk, e.g. /dev/sda
+ *
+ * Like part_table_load_from_disk() but returns the table saved by the
+ * last call to either function for the same disk, if any, instead of
+ * reading it again. Only use this when the table was just read by
+ * someone else, e.g. when probing the partitions of a disk.
+ *
+ * Returns: A partition table object. Use part_table_free() to free this object.
+ */
+PartitionTable       *part_table_load_from_disk_cached (char *device);
+
+/**
+ * part_table_cache_drop:
+ * @devt: dev_t of the disk
+ *
+ * Removes the partition table saved for a disk, if any. Needs root, as
+ * the cache directory is only writable by root.
+ *
+ * Returns: TRUE if no table is saved for the disk anymore
+ */
+gboolean              part_table_cache_drop       (guint64 devt);
+
 /**
  * part_table_free:
  * @part_table: the partition table
@@ -59,7 +59,10 @@ static char *show_device = NULL;
 
 struct Device {
 	char *name;
-	char *parent;
+	const char *parent;
+	LibHalPropertySet *props;
+	struct Device *first_child;
+	struct Device *next_sibling;
 };
 
 /** 
@@ -96,34 +99,17 @@ get_time (void)
 }
 
 /** 
- *  print_props:
- *  @udi:                Universal Device Id
+ *  print_property_set:
+ *  @props:              Properties of a device
  *
- *  Print all properties of a device 
+ *  Print a set of properties, sorted by name
  */
 static void
-print_props (const char *udi)
+print_property_set (LibHalPropertySet *props)
 {
-	DBusError error;
-	LibHalPropertySet *props;
 	LibHalPropertySetIterator it;
 	int type;
 
-	dbus_error_init (&error);
-
-	props = libhal_device_get_all_properties (hal_ctx, udi, &error);
-
-	/* NOTE : This may be NULL if the device was removed
-	 *        in the daemon; this is because
-	 *        hal_device_get_all_properties() is a in
-	 *        essence an IPC call and other stuff may
-	 *        be happening..
-	 */
-	if (props == NULL) {
-		LIBHAL_FREE_DBUS_ERROR (&error);
-		return;
-	}
-
 	libhal_property_set_sort (props);
 
 	for (libhal_psi_init (&it, props); libhal_psi_has_more (&it); libhal_psi_next (&it)) {
@@ -185,7 +171,36 @@ print_props (const char *udi)
 			break;
 		}
 	}
+}
+
+/** 
+ *  print_props:
+ *  @udi:                Universal Device Id
+ *
+ *  Print all properties of a device 
+ */
+static void
+print_props (const char *udi)
+{
+	DBusError error;
+	LibHalPropertySet *props;
+
+	dbus_error_init (&error);
+
+	props = libhal_device_get_all_properties (hal_ctx, udi, &error);
+
+	/* NOTE : This may be NULL if the device was removed
+	 *        in the daemon; this is because
+	 *        hal_device_get_all_properties() is a in
+	 *        essence an IPC call and other stuff may
+	 *        be happening..
+	 */
+	if (props == NULL) {
+		LIBHAL_FREE_DBUS_ERROR (&error);
+		return;
+	}
 
+	print_property_set (props);
 	libhal_free_property_set (props);
 }
 
@@ -219,47 +234,34 @@ dump_device (const char *udi)
 
 /** 
  *  dump_children:
- *  @udi:                 Universal Device Id of parent
- *  @num_devices:         Total number of devices in device list
- *  @devices:             List of devices
+ *  @first:               First device of a list of siblings
  *  @depth:               Current recursion depth
  *
- *  Dump all children of device 
+ *  Dump the siblings and all their children
  */
 static void
-dump_children (char *udi, int num_devices, struct Device *devices, int depth)
+dump_children (struct Device *first, int depth)
 {
-	int i;
-
-	for (i = 0; i < num_devices; i++) {
-		if (!udi) {
-			if (devices[i].parent)
-				continue;
-		}
-		else {
-			if (!devices[i].parent)
-				continue;
-			if (strcmp (devices[i].parent, udi))
-				continue;
-		}
+	struct Device *d;
 
+	for (d = first; d != NULL; d = d->next_sibling) {
 		if (long_list)
-			printf ("udi = '%s'\n", devices[i].name);
+			printf ("udi = '%s'\n", d->name);
 		else {
 			int j;
 			if (tree_view) {
 				for (j = 0;j < depth;j++)
 					printf("  ");
 			}
-			printf ("%s\n", short_name (devices[i].name));
+			printf ("%s\n", short_name (d->name));
 		}
 
 		if (long_list) {
-			print_props (devices[i].name);
+			print_property_set (d->props);
 			printf ("\n");
 		}
 
-		dump_children(devices[i].name, num_devices, devices, depth + 1);
+		dump_children (d->first_child, depth + 1);
 	}
 }
 
@@ -273,8 +275,13 @@ dump_devices (void)
 {
 	int i;
 	int num_devices;
+	int num_present;
 	char **device_names;
 	struct Device *devices;
+	struct Device *roots;
+	GHashTable *by_name;
+	LibHalPropertySet **props;
+	const char *parent_key[] = {"info.parent", NULL};
 	DBusError error;
 
 	dbus_error_init (&error);
@@ -285,38 +292,75 @@ dump_devices (void)
 		DIE (("Couldn't obtain list of devices\n"));
 	}
 
+	/* one request for all devices: everything if we print it, else just the parents */
+	if (!libhal_devices_get_properties (hal_ctx, (const char **) device_names,
+					    long_list ? NULL : parent_key, &props, &error)) {
+		LIBHAL_FREE_DBUS_ERROR (&error);
+		libhal_free_string_array (device_names);
+		DIE (("Couldn't obtain properties of devices\n"));
+	}
+
 	devices = malloc (sizeof(struct Device) * num_devices);
 	if (!devices) {
+		for (i = 0;i < num_devices;i++)
+			libhal_free_property_set (props[i]);
+		free (props);
 		libhal_free_string_array (device_names);
 		return;
 	}
 
+	/* skip devices that went away in the meantime */
+	num_present = 0;
 	for (i = 0;i < num_devices;i++) {
-		devices[i].name = device_names[i];
-		devices[i].parent = libhal_device_get_property_string (hal_ctx,
-				device_names[i], "info.parent", &error);
+		if (props[i] == NULL)
+			continue;
+		devices[num_present].name = device_names[i];
+		devices[num_present].props = props[i];
+		devices[num_present].parent = libhal_ps_get_string (props[i], "info.parent");
+		devices[num_present].first_child = NULL;
+		devices[num_present].next_sibling = NULL;
+		num_present++;
+	}
 
-		if (dbus_error_is_set (&error)) {
-			/* Free the error (which include a dbus_error_init())
-			   This should prevent errors if a call above fails */
-			dbus_error_free (&error);
+	/* link every device to its parent once instead of scanning the whole
+	 * list for the children of each device; going backwards and prepending
+	 * keeps siblings in the order hald gave them to us */
+	by_name = g_hash_table_new (g_str_hash, g_str_equal);
+	for (i = 0;i < num_present;i++)
+		g_hash_table_insert (by_name, devices[i].name, &devices[i]);
+
+	roots = NULL;
+	for (i = num_present - 1;i >= 0;i--) {
+		struct Device *parent;
+
+		if (devices[i].parent == NULL) {
+			devices[i].next_sibling = roots;
+			roots = &devices[i];
+			continue;
 		}
+
+		/* devices whose parent is gone are not shown, as before */
+		parent = g_hash_table_lookup (by_name, devices[i].parent);
+		if (parent == NULL)
+			continue;
+		devices[i].next_sibling = parent->first_child;
+		parent->first_child = &devices[i];
 	}
+	g_hash_table_destroy (by_name);
 
 	if (long_list) {
 		printf ("\n"
 			"Dumping %d device(s) from the Global Device List:\n"
 			"-------------------------------------------------\n",
-			num_devices);
+			num_present);
 	}
 
-	dump_children(NULL, num_devices, devices, 0);
+	dump_children (roots, 0);
 
-	for (i = 0;i < num_devices;i++) {
-		if (devices[i].parent)
-			libhal_free_string (devices[i].parent);
-	}
+	for (i = 0;i < num_present;i++)
+		libhal_free_property_set (devices[i].props);
 
+	free (props);
 	free (devices);
 	libhal_free_string_array (device_names);
 
@@ -324,7 +368,7 @@ dump_devices (void)
 		printf ("\n"
 			"Dumped %d device(s) from the Global Device List.\n"
 			"------------------------------------------------\n",
-			num_devices);
+			num_present);
 
 		printf ("\n");
 	}